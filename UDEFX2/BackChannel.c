@@ -32,6 +32,9 @@ Kernel-mode Driver Framework
 #include <ntstrsafe.h>
 #include "BackChannel.tmh"
 
+// a stripe chunk must go to one read, whole
+C_ASSERT((UDEFX2_BULK_PAIRS == 1) || (BACKCHANNEL_COMPLETION_MODE == WRQueueModeMessage));
+
 
 
 NTSTATUS
@@ -41,18 +44,20 @@ BackChannelInit(
 {
     PUDECX_USBCONTROLLER_CONTEXT pControllerContext = GetUsbControllerContext(ctrdevice);
 
-    NTSTATUS status = WRQueueInit(ctrdevice, &(pControllerContext->missionRequest), FALSE);
+    NTSTATUS status = WRQueueInit(ctrdevice, &(pControllerContext->missionRequest), FALSE, WRQueueModeMessage, NULL);
     if (!NT_SUCCESS(status)) {
         LogError(TRACE_DEVICE, "Unable to initialize mission completion, err= %!STATUS!", status);
         goto exit;
     }
 
-    status = WRQueueInit(ctrdevice, &(pControllerContext->missionCompletion), TRUE);
+    status = WRQueueInit(ctrdevice, &(pControllerContext->missionCompletion), TRUE, BACKCHANNEL_COMPLETION_MODE, NULL);
     if (!NT_SUCCESS(status)) {
         LogError(TRACE_DEVICE, "Unable to initialize mission request, err= %!STATUS!", status);
         goto exit;
     }
 
+    NT_VERIFY(NT_SUCCESS(StripeSplitterInit(&(pControllerContext->completionStripes), BACKCHANNEL_STRIPE_CHUNK_SIZE)));
+
 exit:
     return status;
 }
@@ -69,6 +74,113 @@ BackChannelDestroy(
     WRQueueDestroy(&(pControllerContext->missionRequest));
 }
 
+//
+// Queues a mission completion for BULK IN. With one bulk pair it is queued
+// as is; with several, as stripe chunks, one write each, so the pipes can
+// share them out. Urgent completions go as one unsequenced chunk, which the
+// host hands on without waiting for the sequence to catch up.
+// A message cut short would leave a gap the host cannot get past, so room
+// for all of its chunks is reserved before it takes a sequence number.
+//
+static NTSTATUS
+BackChannelPushCompletion(
+    _In_ PUDECX_BACKCHANNEL_CONTEXT pBackChannelContext,
+    _In_ ULONG Lane,
+    _In_reads_bytes_(Length) PUCHAR Data,
+    _In_ SIZE_T Length,
+    _Out_ PULONG readsCompleted
+)
+{
+    PSTRIPE_SPLITTER pSplitter = &(pBackChannelContext->completionStripes);
+    WRQUEUE_RESERVATION reservation = { 0, 0 };
+    NTSTATUS status = STATUS_SUCCESS;
+    PUCHAR chunk = NULL;
+    ULONG message = 0;
+    ULONG flags = 0;
+    ULONG chunks;
+
+    if (UDEFX2_BULK_PAIRS == 1)
+    {
+        return WRQueuePushWrite(&(pBackChannelContext->missionCompletion), Lane, Data, Length, readsCompleted);
+    }
+
+    *readsCompleted = 0;
+    chunks = StripeChunkCount(pSplitter, Length);
+
+    if (Lane == WRQUEUE_LANE_URGENT)
+    {
+        if (chunks != 1)
+        {
+            LogError(TRACE_DEVICE, "BCHAN Urgent completion of %d bytes does not fit in a chunk", (ULONG)Length);
+            status = STATUS_INVALID_BUFFER_SIZE;
+            goto exit;
+        }
+        flags = STRIPE_FLAG_UNSEQUENCED;
+    }
+
+    chunk = (PUCHAR)ExAllocatePool2(POOL_FLAG_NON_PAGED, pSplitter->ChunkSize, UDEFX_POOL_TAG);
+    if (chunk == NULL)
+    {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto exit;
+    }
+
+    status = WRQueueReserve(&(pBackChannelContext->missionCompletion),
+        Length + ((SIZE_T)chunks * STRIPE_HEADER_SIZE), (LONG)chunks, &reservation);
+    if (!NT_SUCCESS(status))
+    {
+        LogError(TRACE_DEVICE, "BCHAN No room for the %d chunks of a completion %!STATUS!", chunks, status);
+        goto exit;
+    }
+
+    if (Lane != WRQUEUE_LANE_URGENT)
+    {
+        message = StripeBegin(pSplitter);
+    }
+
+    for (ULONG i = 0; i < chunks; ++i)
+    {
+        ULONG chunkLength = StripeChunk(pSplitter, message, flags, Data, Length, i, chunk);
+        ULONG reads;
+
+        // with the room reserved, only running out of memory gets here
+        status = WRQueuePushWriteReserved(&(pBackChannelContext->missionCompletion), Lane, &reservation, chunk, chunkLength, &reads);
+        if (!NT_SUCCESS(status))
+        {
+            LogError(TRACE_DEVICE, "BCHAN Chunk %d of %d of completion %d refused %!STATUS!", i, chunks, message, status);
+            goto exit;
+        }
+        *readsCompleted += reads;
+    }
+
+exit:
+    WRQueueReleaseReservation(&(pBackChannelContext->missionCompletion), &reservation);
+    if (chunk != NULL)
+    {
+        ExFreePoolWithTag(chunk, UDEFX_POOL_TAG);
+    }
+    return status;
+}
+
+
+NTSTATUS
+BackChannelCompleteMission(
+    _In_ WDFDEVICE ctrdevice,
+    _In_reads_bytes_(Length) const UCHAR *Data,
+    _In_ SIZE_T Length
+)
+{
+    ULONG readsCompleted;
+
+    return BackChannelPushCompletion(
+        GetBackChannelContext(ctrdevice),
+        WRQUEUE_LANE_NORMAL,
+        (PUCHAR)Data,
+        Length,
+        &readsCompleted);
+}
+
+
 VOID
 BackChannelEvtRead(
     WDFQUEUE   Queue,
@@ -125,10 +237,9 @@ BackChannelEvtWrite(
     size_t Length
 )
 {
-    WDFREQUEST matchingRead;
+    ULONG readsCompleted;
     PVOID transferBuffer;
     SIZE_T transferBufferLength;
-    SIZE_T completeBytes = 0;
 
     UNREFERENCED_PARAMETER(Length);
 
@@ -143,35 +254,17 @@ BackChannelEvtWrite(
         goto exit;
     }
 
-    // try to get us information about a request that may be waiting for this info
-    status = WRQueuePushWrite(
-        &(pControllerContext->missionCompletion),
+    // hand the completion to USB reads that may be waiting for it; what they cannot take is queued
+    status = BackChannelPushCompletion(
+        pControllerContext,
+        WRQUEUE_LANE_NORMAL,
         transferBuffer,
         transferBufferLength,
-        &matchingRead);
+        &readsCompleted);
 
-    if (matchingRead != NULL)
+    if (readsCompleted != 0)
     {
-        PUCHAR rbuffer;
-        ULONG rlen;
-
-        // this is a USB read!
-        status = UdecxUrbRetrieveBuffer(matchingRead, &rbuffer, &rlen);
-
-        if (!NT_SUCCESS(status)) {
-
-            LogError(TRACE_DEVICE, "BCHAN WdfRequest %p cannot retrieve mission completion buffer %!STATUS!",
-                matchingRead, status);
-        }
-        else {
-            completeBytes = MINLEN(rlen, transferBufferLength);
-            memcpy(rbuffer, transferBuffer, completeBytes);
-        }
-
-        UdecxUrbSetBytesCompleted(matchingRead, (ULONG)completeBytes);
-        UdecxUrbCompleteWithNtStatus(matchingRead, status);
-
-        LogInfo(TRACE_DEVICE, "BCHAN Mission completion %p delivered with matching USB read %p", Request, matchingRead);
+        LogInfo(TRACE_DEVICE, "BCHAN Mission completion %p delivered to %d matching USB reads", Request, readsCompleted);
     }
     else {
         LogInfo(TRACE_DEVICE, "BCHAN Mission completion %p enqueued", Request);
@@ -233,6 +326,351 @@ BackChannelIoctl(
         WdfRequestComplete(Request, status);
         handled = TRUE;
         break;
+
+    case IOCTL_UDEFX2_GET_QUEUE_STATS:
+    {
+        PUDEFX2_QUEUE_STATS pStats = NULL;
+
+        status = WdfRequestRetrieveOutputBuffer(Request,
+            sizeof(UDEFX2_QUEUE_STATS),
+            (PVOID *)&pStats,
+            &pblen);
+
+        if (!NT_SUCCESS(status))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR,
+                TRACE_QUEUE,
+                "%!FUNC! Unable to retrieve output buffer");
+            pblen = 0;
+        }
+        else {
+            WRQueueGetStats(&(pControllerContext->missionRequest), &(pStats->MissionRequest));
+            WRQueueGetStats(&(pControllerContext->missionCompletion), &(pStats->MissionCompletion));
+            pblen = sizeof(UDEFX2_QUEUE_STATS);
+        }
+        WdfRequestCompleteWithInformation(Request, status, pblen);
+        handled = TRUE;
+        break;
+    }
+
+    case IOCTL_UDEFX2_GET_QUEUE_PROFILE:
+    {
+        PUDEFX2_QUEUE_PROFILE pProfile = NULL;
+
+        status = WdfRequestRetrieveOutputBuffer(Request,
+            sizeof(UDEFX2_QUEUE_PROFILE),
+            (PVOID *)&pProfile,
+            &pblen);
+
+        if (!NT_SUCCESS(status))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR,
+                TRACE_QUEUE,
+                "%!FUNC! Unable to retrieve output buffer");
+            pblen = 0;
+        }
+        else {
+            pProfile->TimestampFrequency = OsTimestampFrequency();
+            WRQueueGetProfile(&(pControllerContext->missionRequest), &(pProfile->MissionRequest));
+            WRQueueGetProfile(&(pControllerContext->missionCompletion), &(pProfile->MissionCompletion));
+            pblen = sizeof(UDEFX2_QUEUE_PROFILE);
+        }
+        WdfRequestCompleteWithInformation(Request, status, pblen);
+        handled = TRUE;
+        break;
+    }
+
+    case IOCTL_UDEFX2_SET_BULK_IN_PATTERN:
+    {
+        PUDEFX2_PATTERN_CONFIG pConfig = NULL;
+
+        status = WdfRequestRetrieveInputBuffer(Request,
+            sizeof(UDEFX2_PATTERN_CONFIG),
+            (PVOID *)&pConfig,
+            &pblen);
+
+        if (!NT_SUCCESS(status))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR,
+                TRACE_QUEUE,
+                "%!FUNC! Unable to retrieve input buffer");
+        }
+        else {
+            status = Io_SetBulkInPattern(pControllerContext->ChildDevice, pConfig);
+        }
+        WdfRequestComplete(Request, status);
+        handled = TRUE;
+        break;
+    }
+
+    case IOCTL_UDEFX2_SET_BULK_OUT_SINK:
+    {
+        PUDEFX2_SINK_CONFIG pConfig = NULL;
+
+        status = WdfRequestRetrieveInputBuffer(Request,
+            sizeof(UDEFX2_SINK_CONFIG),
+            (PVOID *)&pConfig,
+            &pblen);
+
+        if (!NT_SUCCESS(status))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR,
+                TRACE_QUEUE,
+                "%!FUNC! Unable to retrieve input buffer");
+        }
+        else {
+            status = Io_SetBulkOutSink(pControllerContext->ChildDevice, pConfig);
+        }
+        WdfRequestComplete(Request, status);
+        handled = TRUE;
+        break;
+    }
+
+    case IOCTL_UDEFX2_GET_SINK_STATS:
+    {
+        PUDEFX2_SINK_STATS pStats = NULL;
+
+        status = WdfRequestRetrieveOutputBuffer(Request,
+            sizeof(UDEFX2_SINK_STATS),
+            (PVOID *)&pStats,
+            &pblen);
+
+        if (!NT_SUCCESS(status))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR,
+                TRACE_QUEUE,
+                "%!FUNC! Unable to retrieve output buffer");
+            pblen = 0;
+        }
+        else {
+            Io_GetSinkStats(pControllerContext->ChildDevice, pStats);
+            pblen = sizeof(UDEFX2_SINK_STATS);
+        }
+        WdfRequestCompleteWithInformation(Request, status, pblen);
+        handled = TRUE;
+        break;
+    }
+
+    case IOCTL_UDEFX2_SET_LOOPBACK:
+    {
+        PUDEFX2_LOOPBACK_CONFIG pConfig = NULL;
+
+        status = WdfRequestRetrieveInputBuffer(Request,
+            sizeof(UDEFX2_LOOPBACK_CONFIG),
+            (PVOID *)&pConfig,
+            &pblen);
+
+        if (!NT_SUCCESS(status))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR,
+                TRACE_QUEUE,
+                "%!FUNC! Unable to retrieve input buffer");
+        }
+        else {
+            status = Io_SetLoopback(pControllerContext->ChildDevice, pConfig);
+        }
+        WdfRequestComplete(Request, status);
+        handled = TRUE;
+        break;
+    }
+
+    case IOCTL_UDEFX2_GET_LOOPBACK_STATS:
+    {
+        PUDEFX2_LOOPBACK_STATS pStats = NULL;
+
+        status = WdfRequestRetrieveOutputBuffer(Request,
+            sizeof(UDEFX2_LOOPBACK_STATS),
+            (PVOID *)&pStats,
+            &pblen);
+
+        if (!NT_SUCCESS(status))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR,
+                TRACE_QUEUE,
+                "%!FUNC! Unable to retrieve output buffer");
+            pblen = 0;
+        }
+        else {
+            Io_GetLoopbackStats(pControllerContext->ChildDevice, pStats);
+            pblen = sizeof(UDEFX2_LOOPBACK_STATS);
+        }
+        WdfRequestCompleteWithInformation(Request, status, pblen);
+        handled = TRUE;
+        break;
+    }
+
+    case IOCTL_UDEFX2_GET_ISOCH_STATS:
+    {
+        PUDEFX2_ISOCH_STATS pStats = NULL;
+
+        status = WdfRequestRetrieveOutputBuffer(Request,
+            sizeof(UDEFX2_ISOCH_STATS),
+            (PVOID *)&pStats,
+            &pblen);
+
+        if (!NT_SUCCESS(status))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR,
+                TRACE_QUEUE,
+                "%!FUNC! Unable to retrieve output buffer");
+            pblen = 0;
+        }
+        else {
+            Io_GetIsochStats(pControllerContext->ChildDevice, pStats);
+            pblen = sizeof(UDEFX2_ISOCH_STATS);
+        }
+        WdfRequestCompleteWithInformation(Request, status, pblen);
+        handled = TRUE;
+        break;
+    }
+
+    case IOCTL_UDEFX2_GET_MISSION_STATS:
+    {
+        PUDEFX2_MISSION_STATS pStats = NULL;
+
+        status = WdfRequestRetrieveOutputBuffer(Request,
+            sizeof(UDEFX2_MISSION_STATS),
+            (PVOID *)&pStats,
+            &pblen);
+
+        if (!NT_SUCCESS(status))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR,
+                TRACE_QUEUE,
+                "%!FUNC! Unable to retrieve output buffer");
+            pblen = 0;
+        }
+        else {
+            Io_GetMissionStats(pControllerContext->ChildDevice, pStats);
+            pblen = sizeof(UDEFX2_MISSION_STATS);
+        }
+        WdfRequestCompleteWithInformation(Request, status, pblen);
+        handled = TRUE;
+        break;
+    }
+
+    case IOCTL_UDEFX2_GET_ENDPOINT_STATS:
+    {
+        PUDEFX2_ENDPOINT_STATS pStats = NULL;
+
+        status = WdfRequestRetrieveOutputBuffer(Request,
+            sizeof(UDEFX2_ENDPOINT_STATS),
+            (PVOID *)&pStats,
+            &pblen);
+
+        if (!NT_SUCCESS(status))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR,
+                TRACE_QUEUE,
+                "%!FUNC! Unable to retrieve output buffer");
+            pblen = 0;
+        }
+        else {
+            Io_GetEndpointStats(pControllerContext->ChildDevice, pStats);
+            pblen = sizeof(UDEFX2_ENDPOINT_STATS);
+        }
+        WdfRequestCompleteWithInformation(Request, status, pblen);
+        handled = TRUE;
+        break;
+    }
+
+    case IOCTL_UDEFX2_SET_INTERRUPT_MODERATION:
+    {
+        PUDEFX2_INTERRUPT_MODERATION pSetting = NULL;
+
+        status = WdfRequestRetrieveInputBuffer(Request,
+            sizeof(UDEFX2_INTERRUPT_MODERATION),
+            (PVOID *)&pSetting,
+            &pblen);
+
+        if (!NT_SUCCESS(status))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR,
+                TRACE_QUEUE,
+                "%!FUNC! Unable to retrieve input buffer");
+        }
+        else {
+            status = Io_SetInterruptModeration(pControllerContext->ChildDevice, pSetting);
+        }
+        WdfRequestComplete(Request, status);
+        handled = TRUE;
+        break;
+    }
+
+    case IOCTL_UDEFX2_GET_INTERRUPT_STATS:
+    {
+        PUDEFX2_INTERRUPT_STATS pStats = NULL;
+
+        status = WdfRequestRetrieveOutputBuffer(Request,
+            sizeof(UDEFX2_INTERRUPT_STATS),
+            (PVOID *)&pStats,
+            &pblen);
+
+        if (!NT_SUCCESS(status))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR,
+                TRACE_QUEUE,
+                "%!FUNC! Unable to retrieve output buffer");
+            pblen = 0;
+        }
+        else {
+            Io_GetInterruptStats(pControllerContext->ChildDevice, pStats);
+            pblen = sizeof(UDEFX2_INTERRUPT_STATS);
+        }
+        WdfRequestCompleteWithInformation(Request, status, pblen);
+        handled = TRUE;
+        break;
+    }
+
+    case IOCTL_UDEFX2_DUMP_FLIGHT_RECORDER:
+    {
+        PUDEFX2_FLIGHT_DUMP pDump = NULL;
+
+        status = WdfRequestRetrieveOutputBuffer(Request,
+            FIELD_OFFSET(UDEFX2_FLIGHT_DUMP, Records),
+            (PVOID *)&pDump,
+            &pblen);
+
+        if (!NT_SUCCESS(status))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR,
+                TRACE_QUEUE,
+                "%!FUNC! Unable to retrieve output buffer");
+            pblen = 0;
+        }
+        else {
+            Io_DumpFlightRecorder(pControllerContext->ChildDevice, pDump, pblen, &pblen);
+        }
+        WdfRequestCompleteWithInformation(Request, status, pblen);
+        handled = TRUE;
+        break;
+    }
+
+    case IOCTL_UDEFX2_SEND_URGENT_COMPLETION:
+    {
+        PVOID payload = NULL;
+        ULONG readsCompleted;
+
+        status = WdfRequestRetrieveInputBuffer(Request, 1, &payload, &pblen);
+        if (!NT_SUCCESS(status))
+        {
+            TraceEvents(TRACE_LEVEL_ERROR,
+                TRACE_QUEUE,
+                "%!FUNC! Unable to retrieve input buffer");
+            pblen = 0;
+        }
+        else {
+            // same as a back-channel write, but ahead of anything queued in lower lanes
+            status = BackChannelPushCompletion(pControllerContext,
+                WRQUEUE_LANE_URGENT,
+                payload,
+                pblen,
+                &readsCompleted);
+        }
+        WdfRequestCompleteWithInformation(Request, status, pblen);
+        handled = TRUE;
+        break;
+    }
     }
 
     return handled;
@@ -26,6 +26,31 @@ Kernel-mode Driver Framework
 
 EXTERN_C_START
 
+//
+// How mission completions written through the back-channel are packed into
+// BULK IN transfers. WRQueueModeStream packs as many as fit into one URB,
+// at the cost of message boundaries the host then has to recover itself;
+// BULK IN is EpModeOrdered, so its reads come one at a time, as it needs.
+//
+#define BACKCHANNEL_COMPLETION_MODE WRQueueModeMessage
+
+//
+// With several bulk pairs (UDEFX2_BULK_PAIRS), mission completions are cut
+// into stripe chunks of up to this many bytes, header included, queued one
+// by one so any BULK IN pipe can take the next one. Host reads must be at
+// least this big. Urgent completions must fit in one chunk.
+//
+#define BACKCHANNEL_STRIPE_CHUNK_SIZE 4096
+
+//
+// When no back-channel read is waiting, a BULK OUT URB is parked as is, and
+// completed once reads have copied its payload straight out of it, instead
+// of being copied into the queue and completed right away. This saves a copy
+// and an allocation per mission request, but the host sees its OUT transfers
+// complete only as the back-channel consumes them.
+//
+#define BACKCHANNEL_DEFERRED_MISSION_REQUESTS TRUE
+
 // magic to re-use the controller context without creating
 // explict dependencies on the controller where we only want to use
 // the back-channel
@@ -42,6 +67,16 @@ BackChannelDestroy(
     _In_ WDFDEVICE ctrdevice
 );
 
+//
+// Queues a mission completion for BULK IN, as a back-channel write would.
+//
+NTSTATUS
+BackChannelCompleteMission(
+    _In_ WDFDEVICE ctrdevice,
+    _In_reads_bytes_(Length) const UCHAR *Data,
+    _In_ SIZE_T Length
+);
+
 BOOLEAN
 BackChannelIoctl(
     _In_ ULONG IoControlCode,
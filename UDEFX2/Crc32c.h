@@ -0,0 +1,79 @@
+/*++
+
+Module Name:
+
+Crc32c.h
+
+Abstract:
+
+    CRC-32C (Castagnoli), as used by iSCSI and ext4: reflected polynomial
+    0x82F63B78, initial value and final XOR of 0xFFFFFFFF, so that
+    Crc32c("123456789", 9) == 0xE3069283.
+
+    Runs on the CPU's CRC32 instructions where there are some (SSE4.2 on
+    x64, the ARMv8 CRC extension on ARM64), checked at run time, and on a
+    slicing-by-8 table otherwise.
+
+    This module is OS-neutral; see OsShim.h.
+
+--*/
+
+#pragma once
+
+#include "OsShim.h"
+
+EXTERN_C_START
+
+
+//
+// Detects the CRC instructions and builds the fallback tables. Call once,
+// before any other Crc32c routine; calling it again is harmless.
+//
+VOID
+Crc32cInit(
+    VOID
+);
+
+//
+// Carries on a CRC over more data: start from Crc32cStart(), feed every
+// piece through Crc32cUpdate, and finish with Crc32cFinish().
+//
+#define Crc32cStart()           0xFFFFFFFFUL
+#define Crc32cFinish(__crc)     ((ULONG)~(__crc))
+
+ULONG
+Crc32cUpdate(
+    _In_ ULONG Crc,
+    _In_reads_bytes_(Length) const UCHAR *Buffer,
+    _In_ SIZE_T Length
+);
+
+FORCEINLINE
+ULONG
+Crc32c(
+    _In_reads_bytes_(Length) const UCHAR *Buffer,
+    _In_ SIZE_T Length
+)
+{
+    return Crc32cFinish(Crc32cUpdate(Crc32cStart(), Buffer, Length));
+}
+
+//
+// TRUE if Crc32cUpdate runs on CRC instructions.
+//
+BOOLEAN
+Crc32cIsAccelerated(
+    VOID
+);
+
+//
+// Turns the CRC instructions off, to compare against the table, or back on
+// where the CPU has them. Not to be called while Crc32cUpdate may run.
+//
+VOID
+Crc32cUseHardware(
+    _In_ BOOLEAN bUse
+);
+
+
+EXTERN_C_END
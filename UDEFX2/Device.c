@@ -162,6 +162,8 @@ Return Value:
     }
 
 	UDECX_WDF_DEVICE_CONFIG_INIT(&controllerConfig, ControllerEvtUdecxWdfDeviceQueryUsbCapability);
+	controllerConfig.NumberOfUsb20Ports = UDEFX2_USB20_PORTS;
+	controllerConfig.NumberOfUsb30Ports = UDEFX2_USB30_PORTS;
 
 	status = UdecxWdfDeviceAddUsbDeviceEmulation(wdfDevice,
 		&controllerConfig);
@@ -190,7 +192,11 @@ Return Value:
 	// Create default queue. It only supports USB controller IOCTLs. (USB I/O will come through
 	// in separate USB device queues.)
 	//
-	WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(&defaultQueueConfig, WdfIoQueueDispatchSequential);
+	// Parallel, because back-channel reads stay pended inside the driver (they are
+	// parked in a lock-free queue, not forwarded) and must not block the writes
+	// that complete them.
+	//
+	WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(&defaultQueueConfig, WdfIoQueueDispatchParallel);
 	defaultQueueConfig.EvtIoDeviceControl = ControllerEvtIoDeviceControl;
     defaultQueueConfig.EvtIoRead = BackChannelEvtRead;
     defaultQueueConfig.EvtIoWrite = BackChannelEvtWrite;
@@ -582,5 +588,13 @@ ControllerEvtUdecxWdfDeviceQueryUsbCapability(
 	{
 		return STATUS_SUCCESS;
 	}
+	if (UDEFX2_SUPERSPEED && (RtlCompareMemory(
+		CapabilityType,
+		&GUID_USB_CAPABILITY_DEVICE_CONNECTION_SUPER_SPEED_COMPATIBLE,
+		sizeof(GUID)
+	) == sizeof(GUID)))
+	{
+		return STATUS_SUCCESS;
+	}
 	return STATUS_UNSUCCESSFUL;
 }
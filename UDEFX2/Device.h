@@ -18,6 +18,7 @@ Environment:
 
 #include "public.h"
 #include "Misc.h"
+#include "Stripe.h"
 
 EXTERN_C_START
 
@@ -44,6 +45,7 @@ typedef struct _UDECX_USBCONTROLLER_CONTEXT {
     WDFQUEUE DefaultQueue;
     WRITE_BUFFER_TO_READ_REQUEST_QUEUE missionRequest;
     WRITE_BUFFER_TO_READ_REQUEST_QUEUE missionCompletion;
+    STRIPE_SPLITTER completionStripes; // several bulk pairs only
 
     PUDECXUSBDEVICE_INIT  ChildDeviceInit;
     UDECXUSBDEVICE        ChildDevice;
@@ -53,7 +55,7 @@ WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(UDECX_USBCONTROLLER_CONTEXT, GetUsbController
 
 
 typedef struct _REQUEST_CONTEXT {
-	UINT32 unused;
+	PVOID ParkedRead; // valid while the request is parked in a WRITE_BUFFER_TO_READ_REQUEST_QUEUE
 } REQUEST_CONTEXT, *PREQUEST_CONTEXT;
 
 WDF_DECLARE_CONTEXT_TYPE(REQUEST_CONTEXT);
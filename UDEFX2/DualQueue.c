@@ -0,0 +1,655 @@
+/*++
+
+Module Name:
+
+DualQueue.c
+
+Abstract:
+
+    Implementation of the lock-free dual queue declared in DualQueue.h.
+
+    The rings are the classic bounded MPMC array queue, where every cell
+    carries a sequence number telling producers and consumers whose turn it
+    is. The balance counter guarantees that a ring operation following a
+    successful reservation always has a slot/item to work with; at worst it
+    spins until the peer that reserved that slot finishes publishing it.
+
+    Canceled waiters are the exception: one that gave its place in the
+    balance back (RETIRED) no longer stands for any reservation, so whoever
+    pops it just pops again. Its canceler marks its cell, so DqRequest can
+    pop it from the head without looking at a waiter it does not own.
+
+--*/
+
+#include "DualQueue.h"
+
+
+
+NTSTATUS
+DqRingInit(
+    _Out_ PDQ_RING Ring,
+    _In_  LONG     Capacity
+)
+{
+    LONG64 i;
+
+    Ring->Cells = (PDQ_CELL)OsAllocate(sizeof(DQ_CELL) * (SIZE_T)Capacity);
+    if (Ring->Cells == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    Ring->Mask = Capacity - 1;
+    for (i = 0; i < Capacity; ++i) {
+        Ring->Cells[i].Sequence = i;
+        Ring->Cells[i].Item = NULL;
+    }
+    Ring->EnqueuePos = 0;
+    Ring->DequeuePos = 0;
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+DqRingDestroy(
+    _Inout_ PDQ_RING Ring
+)
+{
+    if (Ring->Cells != NULL) {
+        OsFree(Ring->Cells);
+        Ring->Cells = NULL;
+    }
+}
+
+
+static BOOLEAN
+_DqRingTryPushAt(
+    _Inout_ PDQ_RING Ring,
+    _In_    PVOID    Item,
+    _Out_   PLONG64  Position
+)
+{
+    LONG64 pos = ReadNoFence64(&(Ring->EnqueuePos));
+    PDQ_CELL cell;
+
+    for (;;) {
+        cell = &(Ring->Cells[pos & Ring->Mask]);
+        LONG64 seq = ReadAcquire64(&(cell->Sequence));
+        LONG64 diff = seq - pos;
+
+        if (diff == 0) {
+            LONG64 seen = InterlockedCompareExchange64(&(Ring->EnqueuePos), pos + 1, pos);
+            if (seen == pos) {
+                break;
+            }
+            pos = seen;
+        } else if (diff < 0) {
+            return FALSE; // full, or the previous lap has not been consumed yet
+        } else {
+            pos = ReadNoFence64(&(Ring->EnqueuePos));
+        }
+    }
+
+    cell->Item = Item;
+    WriteRelease64(&(cell->Sequence), pos + 1);
+    (*Position) = pos;
+    return TRUE;
+}
+
+
+BOOLEAN
+DqRingTryPush(
+    _Inout_ PDQ_RING Ring,
+    _In_    PVOID    Item
+)
+{
+    LONG64 pos;
+    return _DqRingTryPushAt(Ring, Item, &pos);
+}
+
+
+PVOID
+DqRingTryPop(
+    _Inout_ PDQ_RING Ring
+)
+{
+    LONG64 pos = ReadNoFence64(&(Ring->DequeuePos));
+    PDQ_CELL cell;
+    PVOID item;
+
+    for (;;) {
+        cell = &(Ring->Cells[pos & Ring->Mask]);
+        LONG64 seq = ReadAcquire64(&(cell->Sequence));
+        LONG64 diff = seq - (pos + 1);
+
+        if (diff == 0) {
+            LONG64 seen = InterlockedCompareExchange64(&(Ring->DequeuePos), pos + 1, pos);
+            if (seen == pos) {
+                break;
+            }
+            pos = seen;
+        } else if (diff < 0) {
+            return NULL; // empty, or the producer has not published yet
+        } else {
+            pos = ReadNoFence64(&(Ring->DequeuePos));
+        }
+    }
+
+    item = cell->Item;
+    WriteRelease64(&(cell->Sequence), pos + Ring->Mask + 1);
+    return item;
+}
+
+
+//
+// Reserved operations: the balance already promised a slot / an item,
+// so these only spin while a peer is mid-publish.
+//
+static VOID
+_DqRingPush(
+    _Inout_ PDQ_RING Ring,
+    _In_    PVOID    Item
+)
+{
+    while (!DqRingTryPush(Ring, Item)) {
+        OsCpuRelax();
+    }
+}
+
+//
+// A retired waiter's canceler sets the low bit of its cell's item.
+//
+#define DQ_RETIRED_MARK             ((ULONG_PTR)1)
+#define DQ_UNMARK(__item)           ((PDQ_WAITER)((ULONG_PTR)(__item) & ~DQ_RETIRED_MARK))
+#define DQ_IS_MARKED(__item)        (((ULONG_PTR)(__item) & DQ_RETIRED_MARK) != 0)
+
+static VOID
+_DqReleaseWaiter(
+    _In_ PDUAL_QUEUE Q,
+    _In_ PDQ_WAITER  Waiter
+)
+{
+    if (Q->ReleaseWaiter != NULL) {
+        Q->ReleaseWaiter(Waiter);
+    }
+}
+
+//
+// Waits out a canceler that has not decided yet whether Waiter keeps its
+// place in the balance, and returns the state it settled in.
+//
+static LONG
+_DqSettledState(
+    _In_ PDQ_WAITER Waiter
+)
+{
+    LONG state;
+    while ((state = ReadAcquire(&(Waiter->State))) == DQ_WAITER_CANCELING) {
+        OsCpuRelax();
+    }
+    return state;
+}
+
+static PDQ_WAITER
+_DqPopWaiter(
+    _Inout_ PDUAL_QUEUE Q
+)
+{
+    PVOID item;
+    while ((item = DqRingTryPop(&(Q->Waiters))) == NULL) {
+        OsCpuRelax();
+    }
+    InterlockedDecrement(&(Q->WaiterSlots));
+    return DQ_UNMARK(item);
+}
+
+//
+// Pops the waiter a balance reservation stands for, and claims it.
+// Retired waiters on the way stand for no reservation, so they are released
+// and skipped. Returns NULL if that waiter was canceled, after releasing it:
+// the reservation went with it.
+//
+static PDQ_WAITER
+_DqTakeWaiter(
+    _Inout_ PDUAL_QUEUE Q
+)
+{
+    for (;;) {
+        PDQ_WAITER w = _DqPopWaiter(Q);
+
+        if (DqClaimWaiter(w)) {
+            return w;
+        }
+
+        // DqClaimWaiter waited out CANCELING, so this is final
+        LONG state = ReadAcquire(&(w->State));
+        _DqReleaseWaiter(Q, w);
+        if (state != DQ_WAITER_RETIRED) {
+            return NULL;
+        }
+    }
+}
+
+//
+// Pops the waiter at the head of the ring if its canceler marked it retired.
+// Returns FALSE if the head is anything else (or the ring is empty).
+//
+static BOOLEAN
+_DqReapWaiter(
+    _Inout_ PDUAL_QUEUE Q
+)
+{
+    PDQ_RING ring = &(Q->Waiters);
+    LONG64 pos = ReadAcquire64(&(ring->DequeuePos));
+    PDQ_CELL cell = &(ring->Cells[pos & ring->Mask]);
+    PDQ_WAITER w;
+
+    if ((ReadAcquire64(&(cell->Sequence)) != pos + 1) ||
+        !DQ_IS_MARKED(ReadPointerAcquire(&(cell->Item)))) {
+        return FALSE;
+    }
+    if (InterlockedCompareExchange64(&(ring->DequeuePos), pos + 1, pos) != pos) {
+        return TRUE; // somebody else popped it; look again
+    }
+
+    // only marks are ever written to a published cell, so it still is the one we saw
+    w = DQ_UNMARK(cell->Item);
+    WriteRelease64(&(cell->Sequence), pos + ring->Mask + 1);
+    InterlockedDecrement(&(Q->WaiterSlots));
+
+    (VOID)_DqSettledState(w); // marked before it settles
+    _DqReleaseWaiter(Q, w);
+    return TRUE;
+}
+
+//
+// Takes a slot in the Waiters ring for a waiter about to be parked, popping
+// retired waiters from the head to make room if needed.
+//
+static BOOLEAN
+_DqReserveWaiterSlot(
+    _Inout_ PDUAL_QUEUE Q
+)
+{
+    for (;;) {
+        LONG n = ReadAcquire(&(Q->WaiterSlots));
+
+        if (n >= (LONG)(Q->Waiters.Mask + 1)) {
+            if (!_DqReapWaiter(Q)) {
+                return FALSE;
+            }
+            continue;
+        }
+        if (InterlockedCompareExchange(&(Q->WaiterSlots), n + 1, n) == n) {
+            return TRUE;
+        }
+    }
+}
+
+static PVOID
+_DqPopData(
+    _Inout_ PDUAL_QUEUE Q
+)
+{
+    PVOID item;
+
+    for (;;) {
+        if ((ReadPointerAcquire(&(Q->Front)) != NULL) &&
+            ((item = InterlockedExchangePointer(&(Q->Front), NULL)) != NULL)) {
+            return item;
+        }
+        if ((item = DqRingTryPop(&(Q->Data))) != NULL) {
+            return item;
+        }
+        OsCpuRelax(); // the item we reserved is still being published
+    }
+}
+
+
+NTSTATUS
+DqInit(
+    _Out_ PDUAL_QUEUE Q,
+    _In_  LONG        Capacity,
+    _In_  PFN_DQ_RELEASE_WAITER ReleaseWaiter
+)
+{
+    NTSTATUS status;
+
+    memset(Q, 0, sizeof(*Q));
+
+    if ((Capacity <= 0) || ((Capacity & (Capacity - 1)) != 0)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    Q->Capacity = Capacity;
+    Q->ReleaseWaiter = ReleaseWaiter;
+
+    status = DqRingInit(&(Q->Data), Capacity * 2);
+    if (!NT_SUCCESS(status)) {
+        goto Error;
+    }
+
+    status = DqRingInit(&(Q->Waiters), Capacity * 2);
+    if (!NT_SUCCESS(status)) {
+        goto Error;
+    }
+
+    return STATUS_SUCCESS;
+
+Error:
+    DqDestroy(Q);
+    return status;
+}
+
+
+VOID
+DqDestroy(
+    _Inout_ PDUAL_QUEUE Q
+)
+{
+    // caller is expected to have drained both rings
+    DqRingDestroy(&(Q->Data));
+    DqRingDestroy(&(Q->Waiters));
+}
+
+
+BOOLEAN
+DqCancelWaiter(
+    _Inout_ PDUAL_QUEUE Q,
+    _Inout_ PDQ_WAITER  Waiter
+)
+{
+    OS_NO_PREEMPT_STATE np;
+    LONG final = DQ_WAITER_CANCELED;
+
+    for (;;) {
+        LONG state = ReadAcquire(&(Waiter->State));
+
+        if ((state != DQ_WAITER_ARMING) && (state != DQ_WAITER_PARKED)) {
+            return FALSE; // claimed, or canceled already
+        }
+        if (InterlockedCompareExchange(&(Waiter->State), DQ_WAITER_CANCELING, state) == state) {
+            break;
+        }
+    }
+
+    // poppers wait while we are CANCELING, so do not get preempted in between
+    OsEnterNoPreempt(&np);
+
+    //
+    // Give the waiter's place in the balance back, unless every waiter is
+    // reserved by a matcher already: then one of them will pop this one
+    // with its reservation, and retire it.
+    //
+    for (;;) {
+        LONG b = ReadAcquire(&(Q->Balance));
+
+        if (b >= 0) {
+            break;
+        }
+        if (InterlockedCompareExchange(&(Q->Balance), b + 1, b) == b) {
+            PDQ_CELL cell = &(Q->Waiters.Cells[Waiter->Ticket & Q->Waiters.Mask]);
+
+            // if it got popped already this fails, or marks a cell about to be overwritten
+            (VOID)InterlockedCompareExchangePointer(&(cell->Item),
+                (PVOID)((ULONG_PTR)Waiter | DQ_RETIRED_MARK), Waiter);
+            final = DQ_WAITER_RETIRED;
+            break;
+        }
+    }
+
+    // last touch: whoever popped it may release it as soon as it settles
+    WriteRelease(&(Waiter->State), final);
+
+    OsLeaveNoPreempt(&np);
+    return TRUE;
+}
+
+
+BOOLEAN
+DqClaimWaiter(
+    _Inout_ PDQ_WAITER Waiter
+)
+{
+    for (;;) {
+        LONG state = InterlockedCompareExchange(&(Waiter->State), DQ_WAITER_CLAIMED, DQ_WAITER_PARKED);
+
+        if (state == DQ_WAITER_PARKED) {
+            return TRUE;
+        }
+        if ((state != DQ_WAITER_ARMING) && (state != DQ_WAITER_CANCELING)) {
+            return FALSE;
+        }
+        OsCpuRelax(); // owner is still arming it, or canceler settling it
+    }
+}
+
+
+static DQ_RESULT
+_DqOffer(
+    _Inout_  PDUAL_QUEUE Q,
+    _In_opt_ PVOID       Item,
+    _In_     BOOLEAN     bFront,
+    _Out_    PDQ_WAITER *Matched
+)
+{
+    DQ_RESULT result;
+    OS_NO_PREEMPT_STATE np;
+
+    *Matched = NULL;
+
+    OsEnterNoPreempt(&np);
+    for (;;) {
+        LONG b = ReadAcquire(&(Q->Balance));
+
+        if (b < 0) {
+            if (InterlockedCompareExchange(&(Q->Balance), b + 1, b) != b) {
+                continue;
+            }
+
+            PDQ_WAITER w = _DqTakeWaiter(Q);
+            if (w != NULL) {
+                *Matched = w;
+                result = DqMatched;
+                break;
+            }
+
+            // canceled while parked, and our reservation went with it; retry
+            continue;
+        }
+
+        if (Item == NULL) {
+            result = DqEmpty;
+            break;
+        }
+
+        if (!bFront && (b >= Q->Capacity)) {
+            result = DqFull;
+            break;
+        }
+
+        if (InterlockedCompareExchange(&(Q->Balance), b + 1, b) != b) {
+            continue;
+        }
+
+        if (!bFront ||
+            (InterlockedCompareExchangePointer(&(Q->Front), Item, NULL) != NULL)) {
+            // (when pushing back: someone else's item is at the head already, queue behind)
+            _DqRingPush(&(Q->Data), Item);
+        }
+        result = DqQueued;
+        break;
+    }
+    OsLeaveNoPreempt(&np);
+
+    return result;
+}
+
+
+DQ_RESULT
+DqOffer(
+    _Inout_  PDUAL_QUEUE Q,
+    _In_opt_ PVOID       Item,
+    _Out_    PDQ_WAITER *Matched
+)
+{
+    return _DqOffer(Q, Item, FALSE, Matched);
+}
+
+
+ULONG
+DqClaimWaiters(
+    _Inout_ PDUAL_QUEUE Q,
+    _In_    ULONG       Max,
+    _Out_writes_to_(Max, return) PDQ_WAITER *Matched
+)
+{
+    ULONG claimed = 0;
+    OS_NO_PREEMPT_STATE np;
+
+    OsEnterNoPreempt(&np);
+    while (Max > 0) {
+        LONG b = ReadAcquire(&(Q->Balance));
+        LONG n;
+
+        if (b >= 0) {
+            break;
+        }
+
+        n = ((ULONG)-b < Max) ? -b : (LONG)Max;
+        if (InterlockedCompareExchange(&(Q->Balance), b + n, b) != b) {
+            continue;
+        }
+
+        while (n-- > 0) {
+            PDQ_WAITER w = _DqTakeWaiter(Q);
+            if (w != NULL) {
+                Matched[claimed++] = w;
+            }
+        }
+        break;
+    }
+    OsLeaveNoPreempt(&np);
+
+    return claimed;
+}
+
+
+DQ_RESULT
+DqOfferFront(
+    _Inout_  PDUAL_QUEUE Q,
+    _In_     PVOID       Item,
+    _Out_    PDQ_WAITER *Matched
+)
+{
+    return _DqOffer(Q, Item, TRUE, Matched);
+}
+
+
+DQ_RESULT
+DqRequest(
+    _Inout_  PDUAL_QUEUE Q,
+    _In_opt_ PDQ_WAITER  Waiter,
+    _Out_    PVOID      *Matched
+)
+{
+    DQ_RESULT result;
+    OS_NO_PREEMPT_STATE np;
+    BOOLEAN bHaveSlot = FALSE;
+
+    *Matched = NULL;
+
+    OsEnterNoPreempt(&np);
+    for (;;) {
+        LONG b = ReadAcquire(&(Q->Balance));
+
+        if (b > 0) {
+            if (InterlockedCompareExchange(&(Q->Balance), b - 1, b) != b) {
+                continue;
+            }
+            *Matched = _DqPopData(Q);
+            result = DqMatched;
+            break;
+        }
+
+        if (Waiter == NULL) {
+            result = DqEmpty;
+            break;
+        }
+
+        if (-b >= Q->Capacity) {
+            result = DqFull;
+            break;
+        }
+
+        if (!bHaveSlot) {
+            if (!_DqReserveWaiterSlot(Q)) {
+                result = DqFull;
+                break;
+            }
+            bHaveSlot = TRUE;
+            continue; // the balance may have moved meanwhile
+        }
+
+        if (InterlockedCompareExchange(&(Q->Balance), b - 1, b) != b) {
+            continue;
+        }
+
+        Waiter->State = DQ_WAITER_ARMING;
+        while (!_DqRingTryPushAt(&(Q->Waiters), Waiter, &(Waiter->Ticket))) {
+            OsCpuRelax(); // the slot we reserved is still being vacated
+        }
+        bHaveSlot = FALSE;
+        result = DqQueued;
+        break;
+    }
+
+    if (bHaveSlot) {
+        InterlockedDecrement(&(Q->WaiterSlots));
+    }
+    OsLeaveNoPreempt(&np);
+
+    return result;
+}
+
+
+PVOID
+DqDrainItem(
+    _Inout_ PDUAL_QUEUE Q
+)
+{
+    for (;;) {
+        LONG b = ReadAcquire(&(Q->Balance));
+        if (b <= 0) {
+            return NULL;
+        }
+        if (InterlockedCompareExchange(&(Q->Balance), b - 1, b) == b) {
+            return _DqPopData(Q);
+        }
+    }
+}
+
+
+PDQ_WAITER
+DqDrainWaiter(
+    _Inout_ PDUAL_QUEUE Q
+)
+{
+    for (;;) {
+        PVOID item = DqRingTryPop(&(Q->Waiters));
+        PDQ_WAITER w;
+
+        if (item == NULL) {
+            return NULL;
+        }
+        InterlockedDecrement(&(Q->WaiterSlots));
+
+        w = DQ_UNMARK(item);
+        if (_DqSettledState(w) == DQ_WAITER_RETIRED) {
+            _DqReleaseWaiter(Q, w); // stands for nothing in the balance
+            continue;
+        }
+
+        InterlockedIncrement(&(Q->Balance));
+        return w;
+    }
+}
@@ -0,0 +1,237 @@
+/*++
+
+Module Name:
+
+DualQueue.h
+
+Abstract:
+
+    Lock-free dual queue. At any instant it holds either queued data items
+    or parked waiters, never both. Offering data to a queue that has parked
+    waiters hands the data to the oldest waiter instead of queuing it, and
+    requesting data from a queue with no data parks the waiter.
+
+    Internally it is a signed balance counter plus two bounded MPMC rings:
+        Balance > 0   that many data items are (being) queued
+        Balance < 0   that many waiters are (being) parked
+    plus a single Front slot, holding a data item that was pushed back to
+    the head of the queue (e.g. a partially consumed one).
+    A single CAS on the balance decides, atomically, whether an operation
+    matches or queues. The ring operation that follows can only spin for the
+    short window in which a peer publishes a slot it already reserved.
+
+    This module is OS-neutral; see OsShim.h.
+
+--*/
+
+#pragma once
+
+#include "OsShim.h"
+
+EXTERN_C_START
+
+
+typedef struct _DQ_CELL
+{
+    volatile LONG64 Sequence;
+    PVOID           Item;
+} DQ_CELL, *PDQ_CELL;
+
+
+typedef struct _DQ_RING
+{
+    PDQ_CELL        Cells;
+    LONG64          Mask;
+    volatile LONG64 EnqueuePos;
+    volatile LONG64 DequeuePos;
+} DQ_RING, *PDQ_RING;
+
+
+//
+// The bounded MPMC ring on its own, for users that just need a lock-free
+// FIFO (e.g. free lists). TryPush fails when full, TryPop returns NULL when empty.
+//
+NTSTATUS
+DqRingInit(
+    _Out_ PDQ_RING Ring,
+    _In_  LONG     Capacity     // power of two
+);
+
+VOID
+DqRingDestroy(
+    _Inout_ PDQ_RING Ring
+);
+
+BOOLEAN
+DqRingTryPush(
+    _Inout_ PDQ_RING Ring,
+    _In_    PVOID    Item
+);
+
+PVOID
+DqRingTryPop(
+    _Inout_ PDQ_RING Ring
+);
+
+
+//
+// Waiter states. A waiter is parked ARMING, so a matcher cannot claim it
+// before the owner had a chance to make it cancelable; the owner then moves
+// it to PARKED. Exactly one of DqClaimWaiter/DqCancelWaiter wins.
+//
+// A canceled waiter gives its place in the balance back (RETIRED) unless a
+// matcher already reserved it, in which case it keeps it (CANCELED) and that
+// matcher retires it. Either way it stays in the ring until popped, and
+// whoever pops it releases it; RETIRED ones at the head are also popped by
+// DqRequest, so they do not take room from live waiters.
+//
+#define DQ_WAITER_ARMING    0
+#define DQ_WAITER_PARKED    1
+#define DQ_WAITER_CLAIMED   2
+#define DQ_WAITER_CANCELED  3
+#define DQ_WAITER_CANCELING 4   // transient, between the two above and below
+#define DQ_WAITER_RETIRED   5
+
+typedef struct _DQ_WAITER
+{
+    volatile LONG State;
+    LONG64        Ticket;   // its position in the Waiters ring
+} DQ_WAITER, *PDQ_WAITER;
+
+
+//
+// Called for a waiter that was canceled while parked, once it has been
+// popped out of the ring and nobody references it any more.
+//
+typedef VOID (*PFN_DQ_RELEASE_WAITER)(
+    _In_ PDQ_WAITER Waiter
+);
+
+
+typedef struct _DUAL_QUEUE
+{
+    volatile LONG         Balance;
+    LONG                  Capacity;
+    PVOID volatile        Front;    // served before anything in Data
+    DQ_RING               Data;     // 2x Capacity: room for items pushed back while Front is taken
+    DQ_RING               Waiters;  // 2x Capacity: room for retired waiters behind a live one
+    volatile LONG         WaiterSlots; // taken in Waiters, retired waiters included
+    PFN_DQ_RELEASE_WAITER ReleaseWaiter;
+} DUAL_QUEUE, *PDUAL_QUEUE;
+
+
+typedef enum _DQ_RESULT
+{
+    DqMatched,  // the peer item/waiter was returned to the caller
+    DqQueued,   // the caller's item/waiter is now held by the queue
+    DqEmpty,    // nothing to match, and nothing was offered to queue
+    DqFull      // nothing to match, and the queue is at capacity
+} DQ_RESULT;
+
+
+NTSTATUS
+DqInit(
+    _Out_ PDUAL_QUEUE Q,
+    _In_  LONG        Capacity,     // power of two
+    _In_  PFN_DQ_RELEASE_WAITER ReleaseWaiter
+);
+
+VOID
+DqDestroy(
+    _Inout_ PDUAL_QUEUE Q
+);
+
+
+//
+// Producer side. Claims the oldest parked waiter if there is one,
+// otherwise queues Item (when non-NULL).
+//
+DQ_RESULT
+DqOffer(
+    _Inout_  PDUAL_QUEUE Q,
+    _In_opt_ PVOID       Item,
+    _Out_    PDQ_WAITER *Matched
+);
+
+//
+// Batched producer side: claims up to Max of the oldest parked waiters with
+// a single balance reservation, without queuing anything. Waiters found
+// canceled are released and skipped, so fewer than reserved may come back.
+// Returns how many were stored in Matched.
+//
+ULONG
+DqClaimWaiters(
+    _Inout_ PDUAL_QUEUE Q,
+    _In_    ULONG       Max,
+    _Out_writes_to_(Max, return) PDQ_WAITER *Matched
+);
+
+//
+// Same as DqOffer, but the item goes to the head of the queue, and is not
+// subject to Capacity since it is only going back where it came from.
+// Meant for consumers that took an item and could not finish it.
+//
+DQ_RESULT
+DqOfferFront(
+    _Inout_  PDUAL_QUEUE Q,
+    _In_     PVOID       Item,
+    _Out_    PDQ_WAITER *Matched
+);
+
+//
+// Consumer side. Takes the oldest queued item if there is one,
+// otherwise parks Waiter (when non-NULL) in DQ_WAITER_ARMING state.
+// Full means Capacity live waiters, or a ring full of retired ones stuck
+// behind a live one.
+//
+DQ_RESULT
+DqRequest(
+    _Inout_  PDUAL_QUEUE Q,
+    _In_opt_ PDQ_WAITER  Waiter,
+    _Out_    PVOID      *Matched
+);
+
+
+//
+// Drain helpers for teardown; never block, never match.
+//
+PVOID
+DqDrainItem(
+    _Inout_ PDUAL_QUEUE Q
+);
+
+PDQ_WAITER
+DqDrainWaiter(
+    _Inout_ PDUAL_QUEUE Q
+);
+
+
+//
+// Owner side: ARMING -> PARKED. Fails if the waiter got canceled meanwhile.
+//
+FORCEINLINE
+BOOLEAN
+DqArmWaiter(
+    _Inout_ PDQ_WAITER Waiter
+)
+{
+    return (InterlockedCompareExchange(&(Waiter->State), DQ_WAITER_PARKED, DQ_WAITER_ARMING) == DQ_WAITER_ARMING);
+}
+
+//
+// Cancels a parked waiter of Q. On success the caller must no longer touch
+// it; it is released once popped.
+//
+BOOLEAN
+DqCancelWaiter(
+    _Inout_ PDUAL_QUEUE Q,
+    _Inout_ PDQ_WAITER  Waiter
+);
+
+BOOLEAN
+DqClaimWaiter(
+    _Inout_ PDQ_WAITER Waiter
+);
+
+
+EXTERN_C_END
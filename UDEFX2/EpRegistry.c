@@ -0,0 +1,143 @@
+/*++
+
+Module Name:
+
+EpRegistry.c
+
+Abstract:
+
+    Implementation of the endpoint registry declared in EpRegistry.h.
+
+--*/
+
+#include "EpRegistry.h"
+
+#define EP_DT_ENDPOINT      0x05
+
+
+VOID
+EpRegistryInit(
+    _Out_ PEP_REGISTRY Registry
+)
+{
+    memset(Registry, 0, sizeof(*Registry));
+}
+
+
+NTSTATUS
+EpRegister(
+    _Inout_ PEP_REGISTRY Registry,
+    _In_ UCHAR Address,
+    _In_ UCHAR Type,
+    _In_ USHORT MaxPacketSize,
+    _In_ UCHAR Interval
+)
+{
+    ULONG index = EpSlotOf(Address);
+    PEP_SLOT slot = &(Registry->Slot[index]);
+
+    if (((Address & ~(EP_DIRECTION_IN | 0x0F)) != 0) || (Type > UD_ENDPOINT_INTERRUPT) ||
+        ((Registry->Present & (1u << index)) != 0)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    memset(slot, 0, sizeof(*slot));
+    slot->Address = Address;
+    slot->Type = Type;
+    slot->MaxPacketSize = MaxPacketSize;
+    slot->Interval = Interval;
+    Registry->Present |= (1u << index);
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+EpRegisterConfiguration(
+    _Inout_ PEP_REGISTRY Registry,
+    _In_reads_bytes_(Length) const UCHAR *Configuration,
+    _In_ ULONG Length
+)
+{
+    ULONG offset = 0;
+
+    while (offset < Length) {
+        const UCHAR *desc = Configuration + offset;
+        NTSTATUS status;
+
+        if ((Length - offset < 2) || (desc[0] < 2) || (desc[0] > Length - offset)) {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        if (desc[1] == EP_DT_ENDPOINT) {
+            if (desc[0] < UD_ENDPOINT_LENGTH) {
+                return STATUS_INVALID_PARAMETER;
+            }
+            UCHAR type = (UCHAR)(desc[3] & 0x03);
+            // wMaxPacketSize: the size in bits 0-10, extra transactions above
+            USHORT maxPacketSize = (USHORT)((desc[4] | (desc[5] << 8)) & 0x07FF);
+            PEP_SLOT slot = EpLookup(Registry, desc[2]);
+
+            // the same endpoint again, in another alternate setting
+            if ((slot != NULL) && (slot->Type == type) &&
+                (slot->MaxPacketSize == maxPacketSize) && (slot->Interval == desc[6])) {
+                offset += desc[0];
+                continue;
+            }
+            status = EpRegister(Registry, desc[2], type, maxPacketSize, desc[6]);
+            if (!NT_SUCCESS(status)) {
+                return status;
+            }
+        }
+        offset += desc[0];
+    }
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+EpBind(
+    _Inout_ PEP_REGISTRY Registry,
+    _In_reads_(Count) const EP_BINDING *Bindings,
+    _In_ ULONG Count,
+    _Out_opt_ PUCHAR Unbound
+)
+{
+    // next ordinal of each type, OUT then IN
+    USHORT next[2][UD_ENDPOINT_INTERRUPT + 1] = { { 0 } };
+
+    // slots are in number order within a direction, so ordinals come out by number
+    for (ULONG index = 0; index < EP_SLOTS; ++index) {
+        PEP_SLOT slot = EpAt(Registry, index);
+        UCHAR direction;
+        ULONG i;
+
+        if (slot == NULL) {
+            continue;
+        }
+
+        direction = (UCHAR)(slot->Address & EP_DIRECTION_IN);
+        slot->Ordinal = next[(direction != 0) ? 1 : 0][slot->Type]++;
+
+        for (i = 0; i < Count; ++i) {
+            const EP_BINDING *binding = &(Bindings[i]);
+
+            if ((binding->Type == slot->Type) && (binding->Direction == direction) &&
+                ((binding->Ordinal == EP_ANY) || (binding->Ordinal == slot->Ordinal))) {
+                break;
+            }
+        }
+
+        if (i == Count) {
+            if (Unbound != NULL) {
+                *Unbound = slot->Address;
+            }
+            return STATUS_NOT_SUPPORTED;
+        }
+
+        slot->Mode = Bindings[i].Mode;
+        slot->WindowDepth = Bindings[i].WindowDepth;
+        slot->Flags = Bindings[i].Flags;
+        slot->Handler = Bindings[i].Handler;
+    }
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,195 @@
+/*++
+
+Module Name:
+
+EpRegistry.h
+
+Abstract:
+
+    The device's endpoints, in a table of EP_SLOTS slots indexed by number
+    and direction: OUT endpoints 0-15 in slots 0-15, IN endpoints 0-15 in
+    slots 16-31, so finding an endpoint's slot from its address is a mask
+    and a shift.
+
+    The table is filled in at plug-in from the configuration descriptor
+    (and the default endpoint), then bound to the driver through a table
+    of bindings, matched on transfer type, direction and ordinal: the
+    endpoint's rank among those of the same type and direction, by number
+    (the bulk pair, for bulk endpoints). A binding gives the slot its
+    handler, dispatch mode and flags; the driver then hangs the endpoint's
+    queues off the slot, and every I/O path finds them there.
+
+    Handlers and queues are opaque here. Slots are set up before any I/O,
+    and only their counters change after that.
+
+    This module is OS-neutral; see OsShim.h.
+
+--*/
+
+#pragma once
+
+#include "OsShim.h"
+#include "UsbDescriptor.h"
+
+EXTERN_C_START
+
+
+#define EP_SLOTS            32
+#define EP_DIRECTION_IN     0x80
+#define EP_ANY              0xFFFF      // binding ordinal matching any
+
+
+typedef enum _EP_MODE
+{
+    EpModeSequential,       // one URB at a time
+    EpModeOrdered           // up to WindowDepth at a time, handled in order
+} EP_MODE;
+
+//
+// Slot flags
+//   PARKED          URBs can be held back on a queue of their own
+//   FLOW_CONTROLLED the queue is stopped under back-pressure
+//
+#define EP_FLAG_PARKED          0x01
+#define EP_FLAG_FLOW_CONTROLLED 0x02
+
+
+typedef struct _EP_STATS
+{
+    volatile LONG64 Urbs;       // transfers dispatched
+    volatile LONG64 Other;      // any other request
+} EP_STATS, *PEP_STATS;
+
+typedef struct _EP_SLOT
+{
+    UCHAR       Address;        // direction bit included
+    UCHAR       Type;           // UD_ENDPOINT_xxx
+    UCHAR       Flags;          // EP_FLAG_xxx
+    UCHAR       Interval;
+    USHORT      MaxPacketSize;
+    USHORT      Ordinal;
+    EP_MODE     Mode;
+    ULONG       WindowDepth;    // EpModeOrdered
+    PVOID       Handler;
+    PVOID       Queue;
+    PVOID       Parked;         // EP_FLAG_PARKED
+    EP_STATS    Stats;
+} EP_SLOT, *PEP_SLOT;
+
+typedef struct _EP_REGISTRY
+{
+    ULONG       Present;        // one bit a slot
+    EP_SLOT     Slot[EP_SLOTS];
+} EP_REGISTRY, *PEP_REGISTRY;
+
+
+//
+// What the driver does with the endpoints of a type and direction; with
+// an Ordinal other than EP_ANY, only with that one. The first match wins.
+//
+typedef struct _EP_BINDING
+{
+    UCHAR       Type;
+    UCHAR       Direction;      // 0 or EP_DIRECTION_IN
+    USHORT      Ordinal;
+    EP_MODE     Mode;
+    ULONG       WindowDepth;
+    UCHAR       Flags;
+    PVOID       Handler;
+} EP_BINDING, *PEP_BINDING;
+
+
+FORCEINLINE
+ULONG
+EpSlotOf(
+    _In_ UCHAR Address
+)
+{
+    return (ULONG)((Address & 0x0F) | ((Address & EP_DIRECTION_IN) >> 3));
+}
+
+//
+// The slot of endpoint Address, or NULL if there is no such endpoint.
+//
+FORCEINLINE
+PEP_SLOT
+EpLookup(
+    _In_ PEP_REGISTRY Registry,
+    _In_ UCHAR Address
+)
+{
+    ULONG index = EpSlotOf(Address);
+
+    return ((Registry->Present & (1u << index)) != 0) ? &(Registry->Slot[index]) : NULL;
+}
+
+//
+// The slot at Index, or NULL if it is not in use.
+//
+FORCEINLINE
+PEP_SLOT
+EpAt(
+    _In_ PEP_REGISTRY Registry,
+    _In_ ULONG Index
+)
+{
+    return ((Registry->Present & (1u << Index)) != 0) ? &(Registry->Slot[Index]) : NULL;
+}
+
+FORCEINLINE
+VOID
+EpCount(
+    _Inout_ PEP_SLOT Slot,
+    _In_ BOOLEAN bUrb
+)
+{
+    InterlockedIncrement64(bUrb ? &(Slot->Stats.Urbs) : &(Slot->Stats.Other));
+}
+
+
+VOID
+EpRegistryInit(
+    _Out_ PEP_REGISTRY Registry
+);
+
+//
+// Adds one endpoint. Fails if its slot is taken, or the type is not one
+// of UD_ENDPOINT_xxx.
+//
+NTSTATUS
+EpRegister(
+    _Inout_ PEP_REGISTRY Registry,
+    _In_ UCHAR Address,
+    _In_ UCHAR Type,
+    _In_ USHORT MaxPacketSize,
+    _In_ UCHAR Interval
+);
+
+//
+// Adds every endpoint of a configuration descriptor set, as returned by
+// GET_DESCRIPTOR. An endpoint repeated in another alternate setting is
+// added once, and must be described the same way each time. Fails on a
+// descriptor running past Length, and as EpRegister does.
+//
+NTSTATUS
+EpRegisterConfiguration(
+    _Inout_ PEP_REGISTRY Registry,
+    _In_reads_bytes_(Length) const UCHAR *Configuration,
+    _In_ ULONG Length
+);
+
+//
+// Numbers the endpoints of each type and direction, and binds each one.
+// Fails with STATUS_NOT_SUPPORTED, and the endpoint's address in
+// Unbound, if one matches no binding.
+//
+NTSTATUS
+EpBind(
+    _Inout_ PEP_REGISTRY Registry,
+    _In_reads_(Count) const EP_BINDING *Bindings,
+    _In_ ULONG Count,
+    _Out_opt_ PUCHAR Unbound
+);
+
+
+EXTERN_C_END
@@ -0,0 +1,96 @@
+/*++
+
+Module Name:
+
+EventRing.c
+
+Abstract:
+
+    Implementation of the event ring declared in EventRing.h.
+
+    Head and Tail run free and wrap around at 2^32; slots are indexed with
+    the low bits. The producer publishes a slot by releasing Tail after
+    filling it, and the consumer frees it by releasing Head after reading it.
+
+--*/
+
+#include "EventRing.h"
+
+C_ASSERT((EVENT_RING_CAPACITY & (EVENT_RING_CAPACITY - 1)) == 0);
+
+#define EV_SLOT(__i)    ((ULONG)(__i) & (EVENT_RING_CAPACITY - 1))
+
+
+
+VOID
+EvRingInit(
+    _Out_ PEVENT_RING Ring
+)
+{
+    memset(Ring, 0, sizeof(*Ring));
+}
+
+
+BOOLEAN
+EvRingPush(
+    _Inout_ PEVENT_RING Ring,
+    _In_    ULONG Flags
+)
+{
+    LONG tail = Ring->Tail;
+    ULONG sequence = Ring->NextSequence++;
+
+    InterlockedIncrement64(&(Ring->Raised));
+
+    if (((ULONG)tail - (ULONG)ReadAcquire(&(Ring->Head))) >= EVENT_RING_CAPACITY) {
+        InterlockedIncrement64(&(Ring->Overflows));
+        return FALSE;
+    }
+
+    PRING_EVENT ev = &(Ring->Events[EV_SLOT(tail)]);
+    ev->Flags = Flags;
+    ev->Sequence = sequence;
+    ev->RaiseTime = OsTimestamp();
+
+    WriteRelease(&(Ring->Tail), (LONG)((ULONG)tail + 1));
+    return TRUE;
+}
+
+
+ULONG
+EvRingPop(
+    _Inout_ PEVENT_RING Ring,
+    _Out_writes_to_(MaxEvents, return) PRING_EVENT Events,
+    _In_    ULONG MaxEvents
+)
+{
+    LONG head = Ring->Head;
+    ULONG available = (ULONG)ReadAcquire(&(Ring->Tail)) - (ULONG)head;
+    ULONG count = (available < MaxEvents) ? available : MaxEvents;
+
+    for (ULONG i = 0; i < count; ++i) {
+        Events[i] = Ring->Events[EV_SLOT((ULONG)head + i)];
+    }
+
+    if (count > 0) {
+        WriteRelease(&(Ring->Head), (LONG)((ULONG)head + count));
+        InterlockedAdd64(&(Ring->Delivered), (LONG64)count);
+    }
+    return count;
+}
+
+
+BOOLEAN
+EvRingPeek(
+    _In_  PEVENT_RING Ring,
+    _Out_ PRING_EVENT Event
+)
+{
+    LONG head = Ring->Head;
+
+    if ((ULONG)ReadAcquire(&(Ring->Tail)) == (ULONG)head) {
+        return FALSE;
+    }
+    *Event = Ring->Events[EV_SLOT(head)];
+    return TRUE;
+}
@@ -0,0 +1,137 @@
+/*++
+
+Module Name:
+
+EventRing.h
+
+Abstract:
+
+    Fixed-capacity ring of device events (interrupt flags), for one producer
+    and one consumer, which need no lock between them. Several producers, or
+    several consumers, must be serialized by the owner.
+
+    Every event raised gets the next sequence number, including the ones
+    dropped because the ring was full, so the receiving side can tell a gap
+    from a quiet period; drops are counted as overflows.
+
+    This module is OS-neutral; see OsShim.h.
+
+--*/
+
+#pragma once
+
+#include "OsShim.h"
+
+EXTERN_C_START
+
+
+#define EVENT_RING_CAPACITY 64      // power of two
+
+
+typedef struct _RING_EVENT
+{
+    ULONG   Flags;
+    ULONG   Sequence;
+    ULONG64 RaiseTime;              // OsTimestamp()
+} RING_EVENT, *PRING_EVENT;
+
+
+typedef struct _EVENT_RING
+{
+    // producer side
+    volatile LONG   Tail;           // next slot to write
+    ULONG           NextSequence;
+    volatile LONG64 Raised;
+    volatile LONG64 Overflows;
+
+    // consumer side
+    volatile LONG   Head;           // next slot to read
+    volatile LONG64 Delivered;
+
+    RING_EVENT      Events[EVENT_RING_CAPACITY];
+} EVENT_RING, *PEVENT_RING;
+
+
+VOID
+EvRingInit(
+    _Out_ PEVENT_RING Ring
+);
+
+//
+// Producer. Returns FALSE if the ring was full and the event dropped.
+//
+BOOLEAN
+EvRingPush(
+    _Inout_ PEVENT_RING Ring,
+    _In_    ULONG Flags
+);
+
+//
+// Consumer. Takes up to MaxEvents, oldest first; returns how many it took.
+//
+ULONG
+EvRingPop(
+    _Inout_ PEVENT_RING Ring,
+    _Out_writes_to_(MaxEvents, return) PRING_EVENT Events,
+    _In_    ULONG MaxEvents
+);
+
+//
+// Events waiting. Exact for the consumer; a snapshot for anyone else.
+//
+FORCEINLINE
+ULONG
+EvRingCount(
+    _In_ PEVENT_RING Ring
+)
+{
+    return (ULONG)ReadAcquire(&(Ring->Tail)) - (ULONG)ReadAcquire(&(Ring->Head));
+}
+
+//
+// Consumer. The oldest event waiting, without taking it; FALSE if none.
+//
+BOOLEAN
+EvRingPeek(
+    _In_  PEVENT_RING Ring,
+    _Out_ PRING_EVENT Event
+);
+
+
+//
+// Interrupt moderation: events are held back until MaxBatch of them are
+// waiting, or the oldest has waited MaxDelay, whichever comes first; then
+// all of them are due. MaxBatch 1 (or MaxDelay 0) means no moderation.
+//
+typedef struct _EVENT_MODERATION
+{
+    ULONG64 MaxDelay;               // OsTimestamp() ticks
+    ULONG   MaxBatch;
+} EVENT_MODERATION, *PEVENT_MODERATION;
+
+//
+// Whether Pending events, the oldest raised at OldestRaise, are due at Now.
+// If not, *Wait is how long until they are, in OsTimestamp() ticks.
+//
+FORCEINLINE
+BOOLEAN
+EvModerationDue(
+    _In_  PEVENT_MODERATION Moderation,
+    _In_  ULONG   Pending,
+    _In_  ULONG64 OldestRaise,
+    _In_  ULONG64 Now,
+    _Out_ PULONG64 Wait
+)
+{
+    ULONG64 age = (Now > OldestRaise) ? (Now - OldestRaise) : 0;
+
+    *Wait = 0;
+    if ((Pending >= Moderation->MaxBatch) || (age >= Moderation->MaxDelay)) {
+        return TRUE;
+    }
+    *Wait = Moderation->MaxDelay - age;
+    return FALSE;
+}
+
+
+EXTERN_C_END
@@ -0,0 +1,75 @@
+/*++
+
+Module Name:
+
+FlightRecorder.c
+
+Abstract:
+
+    Implementation of the flight recorder declared in FlightRecorder.h.
+    Recording is inline, in the header; only setup and the reader live here.
+
+--*/
+
+#include "FlightRecorder.h"
+
+C_ASSERT((FR_RING_RECORDS & (FR_RING_RECORDS - 1)) == 0);
+C_ASSERT((FR_MAX_RINGS & (FR_MAX_RINGS - 1)) == 0);
+
+
+
+NTSTATUS
+FrInit(
+    _Out_ PFLIGHT_RECORDER Recorder,
+    _In_  ULONG RingCount
+)
+{
+    if ((RingCount == 0) || (RingCount > FR_MAX_RINGS) || ((RingCount & (RingCount - 1)) != 0)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    memset(Recorder, 0, FR_RECORDER_SIZE(RingCount));
+    Recorder->RingMask = RingCount - 1;
+    return STATUS_SUCCESS;
+}
+
+
+ULONG
+FrDump(
+    _In_  PFLIGHT_RECORDER Recorder,
+    _Out_writes_to_(MaxRecords, return) PFR_RECORD Records,
+    _In_  ULONG MaxRecords,
+    _Out_ PULONG64 Recorded
+)
+{
+    ULONG count = 0;
+    ULONG64 recorded = 0;
+
+    for (ULONG r = 0; r <= Recorder->RingMask; ++r) {
+        PFR_RING ring = &(Recorder->Rings[r]);
+        ULONG head = (ULONG)ReadAcquire(&(ring->Head));
+        ULONG n = (head < FR_RING_RECORDS) ? head : FR_RING_RECORDS;
+
+        recorded += head;
+
+        for (ULONG i = head - n; (i != head) && (count < MaxRecords); ++i) {
+            PFR_RECORD record = &(ring->Records[i & (FR_RING_RECORDS - 1)]);
+            LONG sequence = ReadAcquire(&(record->Sequence));
+
+            // being written, or already overwritten by a newer one
+            if (sequence != (LONG)(i + 1)) {
+                continue;
+            }
+
+            Records[count] = *record;
+            OsAcquireFence();
+
+            if (ReadNoFence(&(record->Sequence)) == sequence) {
+                ++count;
+            }
+        }
+    }
+
+    *Recorded = recorded;
+    return count;
+}
@@ -0,0 +1,159 @@
+/*++
+
+Module Name:
+
+FlightRecorder.h
+
+Abstract:
+
+    Always-on binary trace of URB traffic: fixed-size records (timestamp,
+    endpoint, length, status, request) in per-processor rings, recorded
+    without locks or formatting, and copied out on demand. Each ring keeps
+    the last FR_RING_RECORDS records of its processor, overwriting older ones.
+
+    Recording claims a slot with one interlocked increment on the
+    processor's own ring and fills it with plain stores; the record's
+    Sequence is cleared first and set last, so a reader can tell a whole
+    record from one being written or overwritten, and skip it.
+
+    With more processors than rings, processors share rings; records stay
+    whole, unless a ring wraps all the way around while one is written.
+
+    This module is OS-neutral; see OsShim.h.
+
+--*/
+
+#pragma once
+
+#include "OsShim.h"
+
+EXTERN_C_START
+
+
+#define FR_RING_RECORDS     256     // per ring, power of two
+#define FR_MAX_RINGS        64      // power of two
+
+
+typedef enum _FR_EVENT
+{
+    FrEventComplete = 1,    // URB completed; Length is what was transferred
+    FrEventPend,            // URB may be kept pending; Length is its buffer size.
+                            // Recorded before it is handed over, so it is
+                            // always ahead of its FrEventComplete
+    FrEventMax
+} FR_EVENT;
+
+
+typedef struct _FR_RECORD
+{
+    ULONG64       Timestamp;    // OsTimestamp()
+    ULONG64       RequestId;
+    ULONG         Length;
+    LONG          Status;
+    UCHAR         Endpoint;     // address, direction bit included
+    UCHAR         Event;        // FR_EVENT
+    USHORT        Ring;
+    volatile LONG Sequence;     // per ring, from 1; 0 while being written
+} FR_RECORD, *PFR_RECORD;
+
+C_ASSERT(sizeof(FR_RECORD) == 32);
+
+
+typedef struct _FR_RING
+{
+    volatile LONG Head;         // records claimed so far
+    UCHAR         Pad[60];      // keeps Head off the line of its neighbour's records
+    FR_RECORD     Records[FR_RING_RECORDS];
+} FR_RING, *PFR_RING;
+
+
+typedef struct _FLIGHT_RECORDER
+{
+    ULONG   RingMask;           // ring count - 1
+    UCHAR   Pad[60];
+    FR_RING Rings[1];           // RingMask + 1 of them
+} FLIGHT_RECORDER, *PFLIGHT_RECORDER;
+
+#define FR_RECORDER_SIZE(__rings) \
+    (sizeof(FLIGHT_RECORDER) + (((__rings) - 1) * sizeof(FR_RING)))
+
+
+//
+// Rings to give a recorder for CpuCount processors: one each, rounded up
+// to a power of two, up to FR_MAX_RINGS.
+//
+FORCEINLINE
+ULONG
+FrRingCount(
+    _In_ ULONG CpuCount
+)
+{
+    ULONG rings = 1;
+
+    while ((rings < CpuCount) && (rings < FR_MAX_RINGS)) {
+        rings <<= 1;
+    }
+    return rings;
+}
+
+//
+// Recorder is FR_RECORDER_SIZE(RingCount) bytes, owned by the caller.
+//
+NTSTATUS
+FrInit(
+    _Out_ PFLIGHT_RECORDER Recorder,
+    _In_  ULONG RingCount       // power of two, up to FR_MAX_RINGS
+);
+
+
+FORCEINLINE
+VOID
+FrRecord(
+    _Inout_ PFLIGHT_RECORDER Recorder,
+    _In_    FR_EVENT Event,
+    _In_    UCHAR   Endpoint,
+    _In_    ULONG64 RequestId,
+    _In_    ULONG   Length,
+    _In_    LONG    Status
+)
+{
+    OS_NO_PREEMPT_STATE np;
+
+    OsEnterNoPreempt(&np);
+
+    ULONG r = OsCurrentCpu() & Recorder->RingMask;
+    PFR_RING ring = &(Recorder->Rings[r]);
+    LONG sequence = InterlockedIncrement(&(ring->Head));
+    PFR_RECORD record = &(ring->Records[(ULONG)(sequence - 1) & (FR_RING_RECORDS - 1)]);
+
+    WriteNoFence(&(record->Sequence), 0);
+    OsReleaseFence();
+
+    record->Timestamp = OsTimestamp();
+    record->RequestId = RequestId;
+    record->Length = Length;
+    record->Status = Status;
+    record->Endpoint = Endpoint;
+    record->Event = (UCHAR)Event;
+    record->Ring = (USHORT)r;
+    WriteRelease(&(record->Sequence), sequence);
+
+    OsLeaveNoPreempt(&np);
+}
+
+//
+// Copies out up to MaxRecords whole records, ring by ring, oldest first
+// within a ring; returns how many. *Recorded is how many were ever
+// recorded, so the caller can tell how many it missed. May run alongside
+// FrRecord.
+//
+ULONG
+FrDump(
+    _In_  PFLIGHT_RECORDER Recorder,
+    _Out_writes_to_(MaxRecords, return) PFR_RECORD Records,
+    _In_  ULONG MaxRecords,
+    _Out_ PULONG64 Recorded
+);
+
+
+EXTERN_C_END
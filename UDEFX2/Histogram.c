@@ -0,0 +1,49 @@
+/*++
+
+Module Name:
+
+Histogram.c
+
+Abstract:
+
+    Implementation of the histogram helpers declared in Histogram.h.
+    Recording is inline, in the header; only the reader side (and reset)
+    lives here.
+
+--*/
+
+#include "Histogram.h"
+
+
+
+VOID
+HistRead(
+    _In_ PHISTOGRAM Hist,
+    _Out_writes_(HISTOGRAM_WORDS) PULONG64 Counters
+)
+{
+    ULONG i;
+
+    Counters[0] = (ULONG64)ReadNoFence64(&(Hist->Count));
+    Counters[1] = (ULONG64)ReadNoFence64(&(Hist->Sum));
+    Counters[2] = (ULONG64)ReadNoFence64(&(Hist->Max));
+    for (i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        Counters[3 + i] = (ULONG64)ReadNoFence64(&(Hist->Buckets[i]));
+    }
+}
+
+
+VOID
+HistReset(
+    _Inout_ PHISTOGRAM Hist
+)
+{
+    ULONG i;
+
+    InterlockedExchange64(&(Hist->Count), 0);
+    InterlockedExchange64(&(Hist->Sum), 0);
+    InterlockedExchange64(&(Hist->Max), 0);
+    for (i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        InterlockedExchange64(&(Hist->Buckets[i]), 0);
+    }
+}
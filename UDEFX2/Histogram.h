@@ -0,0 +1,126 @@
+/*++
+
+Module Name:
+
+Histogram.h
+
+Abstract:
+
+    Lock-free log-linear histogram, cheap enough to record into on every
+    queue operation: one bit scan and a few interlocked adds, no locks,
+    no allocation.
+
+    Values below 2^HISTOGRAM_SUB_BITS get a bucket each; above that, every
+    power of two is split into 2^HISTOGRAM_SUB_BITS equal buckets, so the
+    relative error stays under 25% over the whole range. Values past the
+    last bucket are counted in it (Max still has them exactly).
+
+    This module is OS-neutral; see OsShim.h.
+
+--*/
+
+#pragma once
+
+#include "OsShim.h"
+
+EXTERN_C_START
+
+
+#define HISTOGRAM_SUB_BITS  2
+#define HISTOGRAM_BUCKETS   128     // exact up to 2^33 - 1
+
+
+typedef struct _HISTOGRAM
+{
+    volatile LONG64 Count;
+    volatile LONG64 Sum;
+    volatile LONG64 Max;
+    volatile LONG64 Buckets[HISTOGRAM_BUCKETS];
+} HISTOGRAM, *PHISTOGRAM;
+
+
+FORCEINLINE
+ULONG
+HistBucketOf(
+    _In_ ULONG64 Value
+)
+{
+    ULONG msb;
+    ULONG bucket;
+
+    if (Value < (1ull << HISTOGRAM_SUB_BITS)) {
+        return (ULONG)Value;
+    }
+
+    msb = OsHighestBit64(Value);
+    bucket = ((msb - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) |
+             (ULONG)((Value >> (msb - HISTOGRAM_SUB_BITS)) & ((1ull << HISTOGRAM_SUB_BITS) - 1));
+
+    return (bucket < HISTOGRAM_BUCKETS) ? bucket : (HISTOGRAM_BUCKETS - 1);
+}
+
+
+//
+// Smallest value counted in Bucket.
+//
+FORCEINLINE
+ULONG64
+HistBucketLow(
+    _In_ ULONG Bucket
+)
+{
+    ULONG shift = Bucket >> HISTOGRAM_SUB_BITS;
+
+    if (shift == 0) {
+        return Bucket;
+    }
+    return ((1ull << HISTOGRAM_SUB_BITS) | (Bucket & ((1ull << HISTOGRAM_SUB_BITS) - 1))) << (shift - 1);
+}
+
+
+FORCEINLINE
+VOID
+HistRecord(
+    _Inout_ PHISTOGRAM Hist,
+    _In_    ULONG64    Value
+)
+{
+    LONG64 seen;
+
+    InterlockedIncrement64(&(Hist->Buckets[HistBucketOf(Value)]));
+    InterlockedIncrement64(&(Hist->Count));
+    InterlockedExchangeAdd64(&(Hist->Sum), (LONG64)Value);
+
+    seen = ReadNoFence64(&(Hist->Max));
+    while (((LONG64)Value > seen) &&
+           (InterlockedCompareExchange64(&(Hist->Max), (LONG64)Value, seen) != seen)) {
+        seen = ReadNoFence64(&(Hist->Max));
+    }
+}
+
+
+//
+// Copies a histogram that may still be recorded into, as plain counters:
+// Count, Sum, Max, then the buckets. Each one is read atomically, but the
+// copy as a whole is not a snapshot: Count may be a few records off the
+// bucket total.
+//
+#define HISTOGRAM_WORDS     (3 + HISTOGRAM_BUCKETS)
+
+VOID
+HistRead(
+    _In_ PHISTOGRAM Hist,
+    _Out_writes_(HISTOGRAM_WORDS) PULONG64 Counters
+);
+
+//
+// Empties a histogram that may still be recorded into; a record racing
+// with it may be left half counted.
+//
+VOID
+HistReset(
+    _Inout_ PHISTOGRAM Hist
+);
+
+
+EXTERN_C_END
@@ -0,0 +1,176 @@
+/*++
+
+Module Name:
+
+IntrPacket.h
+
+Abstract:
+
+    Wire format of INTERRUPT IN transfers, shared by the device (UDEFX2) and
+    the host-side driver, which includes this header as is.
+
+    A transfer of exactly sizeof(DEVICE_INTR_FLAGS) bytes is the original
+    format: the flags of one event, nothing else. Any larger transfer is a
+    packet: a header, then up to INTR_PACKET_MAX_EVENTS event records,
+    oldest first, as many as the transfer has room for. Everything is
+    little-endian.
+
+    Records are RecordSize bytes apart, so fields can be appended to a
+    record without a new version; a reader takes the fields it knows and
+    skips the rest.
+
+    A full packet (128 bytes) spans two 64-byte interrupt packets; a 64-byte
+    transfer carries up to 7 events.
+
+    This module is OS-neutral; see OsShim.h.
+
+--*/
+
+#pragma once
+
+#include "OsShim.h"
+
+EXTERN_C_START
+
+
+#define INTR_PACKET_VERSION     1
+#define INTR_PACKET_MAX_EVENTS  15
+
+typedef struct _INTR_PACKET_HEADER
+{
+    UCHAR   Version;        // INTR_PACKET_VERSION
+    UCHAR   Count;          // records that follow
+    UCHAR   RecordSize;     // at least sizeof(INTR_PACKET_RECORD)
+    UCHAR   Reserved;
+    ULONG   Overflows;      // events the device dropped so far, low 32 bits
+} INTR_PACKET_HEADER, *PINTR_PACKET_HEADER;
+
+typedef struct _INTR_PACKET_RECORD
+{
+    ULONG   Flags;          // DEVICE_INTR_FLAGS
+    ULONG   Sequence;       // one per event raised, dropped ones included
+} INTR_PACKET_RECORD, *PINTR_PACKET_RECORD;
+
+C_ASSERT(sizeof(INTR_PACKET_HEADER) == 8);
+C_ASSERT(sizeof(INTR_PACKET_RECORD) == 8);
+
+#define INTR_PACKET_SIZE(__count) \
+    (sizeof(INTR_PACKET_HEADER) + ((__count) * sizeof(INTR_PACKET_RECORD)))
+
+#define INTR_PACKET_MAX_SIZE    INTR_PACKET_SIZE(INTR_PACKET_MAX_EVENTS)
+
+
+FORCEINLINE
+VOID
+_IntrPacketPut32(
+    _Out_writes_bytes_(4) PUCHAR p,
+    _In_ ULONG Value
+)
+{
+    p[0] = (UCHAR)Value;
+    p[1] = (UCHAR)(Value >> 8);
+    p[2] = (UCHAR)(Value >> 16);
+    p[3] = (UCHAR)(Value >> 24);
+}
+
+FORCEINLINE
+ULONG
+_IntrPacketGet32(
+    _In_reads_bytes_(4) const UCHAR *p
+)
+{
+    return (ULONG)p[0] | ((ULONG)p[1] << 8) | ((ULONG)p[2] << 16) | ((ULONG)p[3] << 24);
+}
+
+
+//
+// How many records a packet of Length bytes has room for; 0 if it cannot
+// hold even one.
+//
+FORCEINLINE
+ULONG
+IntrPacketCapacity(
+    _In_ SIZE_T Length
+)
+{
+    if (Length < INTR_PACKET_SIZE(1)) {
+        return 0;
+    }
+    Length = (Length - sizeof(INTR_PACKET_HEADER)) / sizeof(INTR_PACKET_RECORD);
+    return (Length < INTR_PACKET_MAX_EVENTS) ? (ULONG)Length : INTR_PACKET_MAX_EVENTS;
+}
+
+//
+// Writes a packet of Count records; Count must be within
+// IntrPacketCapacity(Length). Returns the packet size.
+//
+FORCEINLINE
+SIZE_T
+IntrPacketEncode(
+    _Out_writes_bytes_to_(Length, return) PUCHAR Buffer,
+    _In_ SIZE_T Length,
+    _In_reads_(Count) const INTR_PACKET_RECORD *Records,
+    _In_ ULONG Count,
+    _In_ ULONG Overflows
+)
+{
+    PUCHAR p = Buffer + sizeof(INTR_PACKET_HEADER);
+
+    UNREFERENCED_PARAMETER(Length);
+    NT_ASSERT(Count <= IntrPacketCapacity(Length));
+
+    Buffer[0] = INTR_PACKET_VERSION;
+    Buffer[1] = (UCHAR)Count;
+    Buffer[2] = (UCHAR)sizeof(INTR_PACKET_RECORD);
+    Buffer[3] = 0;
+    _IntrPacketPut32(Buffer + 4, Overflows);
+
+    for (ULONG i = 0; i < Count; ++i, p += sizeof(INTR_PACKET_RECORD)) {
+        _IntrPacketPut32(p, Records[i].Flags);
+        _IntrPacketPut32(p + 4, Records[i].Sequence);
+    }
+
+    return INTR_PACKET_SIZE(Count);
+}
+
+//
+// Reads a packet back. Fails on a version it does not know, or a packet
+// shorter than its header says.
+//
+FORCEINLINE
+NTSTATUS
+IntrPacketDecode(
+    _In_reads_bytes_(Length) const UCHAR *Buffer,
+    _In_ SIZE_T Length,
+    _Out_ PINTR_PACKET_HEADER Header,
+    _Out_writes_(INTR_PACKET_MAX_EVENTS) PINTR_PACKET_RECORD Records
+)
+{
+    if (Length < sizeof(INTR_PACKET_HEADER)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    Header->Version = Buffer[0];
+    Header->Count = Buffer[1];
+    Header->RecordSize = Buffer[2];
+    Header->Reserved = Buffer[3];
+    Header->Overflows = _IntrPacketGet32(Buffer + 4);
+
+    if ((Header->Version != INTR_PACKET_VERSION) ||
+        (Header->Count > INTR_PACKET_MAX_EVENTS) ||
+        (Header->RecordSize < sizeof(INTR_PACKET_RECORD)) ||
+        (Length < sizeof(INTR_PACKET_HEADER) + ((SIZE_T)Header->Count * Header->RecordSize))) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    const UCHAR *p = Buffer + sizeof(INTR_PACKET_HEADER);
+    for (ULONG i = 0; i < Header->Count; ++i, p += Header->RecordSize) {
+        Records[i].Flags = _IntrPacketGet32(p);
+        Records[i].Sequence = _IntrPacketGet32(p + 4);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+
+EXTERN_C_END
@@ -0,0 +1,234 @@
+/*++
+
+Module Name:
+
+IsoSched.c
+
+Abstract:
+
+    Implementation of the isochronous scheduler declared in IsoSched.h.
+
+--*/
+
+#include "IsoSched.h"
+
+
+NTSTATUS
+IsoInit(
+    _Out_ PISO_SCHEDULER Sched,
+    _In_  ISO_DIRECTION Direction,
+    _In_  ULONG PacketSize,
+    _In_  ULONG Slots,
+    _In_  ULONG Prefill,
+    _In_  ULONG Rate,
+    _In_  ULONG64 Frequency,
+    _In_opt_ PFN_ISO_FILL Fill,
+    _In_opt_ PFN_ISO_DRAIN Drain,
+    _In_opt_ PVOID Context
+)
+{
+    memset(Sched, 0, sizeof(*Sched));
+
+    if ((PacketSize == 0) || (Slots == 0) || (Prefill > Slots) || (Rate == 0) || (Frequency == 0)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    Sched->Data = (PUCHAR)OsAllocate((SIZE_T)PacketSize * Slots);
+    Sched->Lengths = (PULONG)OsAllocate(sizeof(ULONG) * Slots);
+    if ((Sched->Data == NULL) || (Sched->Lengths == NULL)) {
+        IsoCleanup(Sched);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    Sched->Direction = Direction;
+    Sched->PacketSize = PacketSize;
+    Sched->Slots = Slots;
+    Sched->Prefill = Prefill;
+    Sched->Rate = Rate;
+    Sched->Frequency = Frequency;
+    Sched->Fill = Fill;
+    Sched->Drain = Drain;
+    Sched->Context = Context;
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+IsoCleanup(
+    _Inout_ PISO_SCHEDULER Sched
+)
+{
+    if (Sched->Data != NULL) {
+        OsFree(Sched->Data);
+        Sched->Data = NULL;
+    }
+    if (Sched->Lengths != NULL) {
+        OsFree(Sched->Lengths);
+        Sched->Lengths = NULL;
+    }
+}
+
+
+static PUCHAR
+_IsoSlot(
+    _In_ PISO_SCHEDULER Sched,
+    _In_ ULONG Index                // from Head
+)
+{
+    return Sched->Data + ((SIZE_T)((Sched->Head + Index) % Sched->Slots) * Sched->PacketSize);
+}
+
+
+//
+// Device side of an IN endpoint: one more packet, if there is room.
+//
+static VOID
+_IsoProduce(
+    _Inout_ PISO_SCHEDULER Sched
+)
+{
+    PUCHAR slot;
+    ULONG length = Sched->PacketSize;
+
+    if (Sched->Count == Sched->Slots) {
+        Sched->Stats.Overruns++;
+        return;
+    }
+
+    slot = _IsoSlot(Sched, Sched->Count);
+    if (Sched->Fill != NULL) {
+        length = Sched->Fill(Sched->Context, slot, Sched->PacketSize);
+        if (length == 0) {
+            return;
+        }
+    } else {
+        memset(slot, 0, Sched->PacketSize);
+    }
+    Sched->Lengths[(Sched->Head + Sched->Count) % Sched->Slots] = length;
+    Sched->Count++;
+}
+
+
+static VOID
+_IsoPop(
+    _Inout_ PISO_SCHEDULER Sched
+)
+{
+    Sched->Head = (Sched->Head + 1) % Sched->Slots;
+    Sched->Count--;
+}
+
+
+VOID
+IsoStart(
+    _Inout_ PISO_SCHEDULER Sched,
+    _In_ ULONG64 Now
+)
+{
+    Sched->Base = Now;
+    Sched->NextFrame = 0;
+    Sched->Head = 0;
+    Sched->Count = 0;
+
+    for (ULONG i = 0; i < Sched->Prefill; ++i) {
+        if (Sched->Direction == IsoDirectionIn) {
+            _IsoProduce(Sched);
+        } else {
+            memset(_IsoSlot(Sched, i), 0, Sched->PacketSize);
+            Sched->Lengths[i] = Sched->PacketSize;
+            Sched->Count++;
+        }
+    }
+}
+
+
+ULONG
+IsoFramesDue(
+    _Inout_ PISO_SCHEDULER Sched,
+    _In_ ULONG64 Now,
+    _In_ ULONG MaxLag
+)
+{
+    ULONG64 due;
+
+    if (Now < Sched->Base) {
+        return 0;
+    }
+
+    // frames 0 .. due - 1 are due by Now
+    due = (((Now - Sched->Base) * Sched->Rate) / Sched->Frequency) + 1;
+    if (due <= Sched->NextFrame) {
+        return 0;
+    }
+
+    if (due - Sched->NextFrame > MaxLag) {
+        Sched->Stats.Skipped += (due - Sched->NextFrame) - MaxLag;
+        Sched->NextFrame = due - MaxLag;
+    }
+    return (ULONG)(due - Sched->NextFrame);
+}
+
+
+ULONG
+IsoRunFrame(
+    _Inout_ PISO_SCHEDULER Sched,
+    _In_ ULONG64 Now,
+    _Inout_updates_bytes_opt_(HostLength) PUCHAR HostPacket,
+    _In_ ULONG HostLength
+)
+{
+    ULONG64 due = IsoFrameTime(Sched, Sched->NextFrame);
+    ULONG moved = 0;
+
+    HistRecord(&(Sched->Lateness), (Now > due) ? (Now - due) : 0);
+    Sched->NextFrame++;
+    Sched->Stats.Frames++;
+
+    if (Sched->Direction == IsoDirectionIn)
+    {
+        // this frame's packet, then the oldest one to the host
+        _IsoProduce(Sched);
+
+        if (HostPacket != NULL) {
+            if (Sched->Count == 0) {
+                Sched->Stats.Underruns++;
+            } else {
+                moved = Sched->Lengths[Sched->Head];
+                if (moved > HostLength) {
+                    moved = HostLength;
+                }
+                memcpy(HostPacket, _IsoSlot(Sched, 0), moved);
+                _IsoPop(Sched);
+            }
+        }
+    }
+    else
+    {
+        // the host's packet in, then the oldest one to the device
+        if (HostPacket != NULL) {
+            if (Sched->Count == Sched->Slots) {
+                Sched->Stats.Overruns++;
+            } else {
+                moved = (HostLength < Sched->PacketSize) ? HostLength : Sched->PacketSize;
+                memcpy(_IsoSlot(Sched, Sched->Count), HostPacket, moved);
+                Sched->Lengths[(Sched->Head + Sched->Count) % Sched->Slots] = moved;
+                Sched->Count++;
+            }
+        }
+
+        if (Sched->Count == 0) {
+            Sched->Stats.Underruns++;
+        } else {
+            if (Sched->Drain != NULL) {
+                Sched->Drain(Sched->Context, _IsoSlot(Sched, 0), Sched->Lengths[Sched->Head]);
+            }
+            _IsoPop(Sched);
+        }
+    }
+
+    if (HostPacket != NULL) {
+        Sched->Stats.Packets++;
+        Sched->Stats.Bytes += moved;
+    }
+    return moved;
+}
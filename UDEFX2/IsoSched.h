@@ -0,0 +1,164 @@
+/*++
+
+Module Name:
+
+IsoSched.h
+
+Abstract:
+
+    Per-interval scheduler of an isochronous endpoint. The device side runs
+    on the bus clock: every (micro)frame, an IN endpoint produces one
+    packet into a ring, and an OUT endpoint consumes one from it. The host
+    side moves at most one packet per frame too, from the URB in flight:
+    an IN URB takes a packet out of the ring, an OUT URB puts one in.
+
+    The ring starts pre-filled, so the host can be a few frames late
+    without the stream breaking. When it is later than that, IN packets go
+    out empty and OUT ones run dry (underruns); when it does not keep up at
+    all, the ring fills up and packets are dropped (overruns).
+
+    Frames are run by whoever gets to them, on a timer, and each one is
+    timed against when it was due; the lateness histogram is the jitter of
+    the schedule.
+
+    This module is OS-neutral; see OsShim.h. It does no locking.
+
+--*/
+
+#pragma once
+
+#include "OsShim.h"
+#include "Histogram.h"
+
+EXTERN_C_START
+
+
+typedef enum _ISO_DIRECTION
+{
+    IsoDirectionIn,         // device to host
+    IsoDirectionOut         // host to device
+} ISO_DIRECTION;
+
+
+//
+// Device side of the stream: an IN endpoint's source, an OUT endpoint's
+// sink. Either may be NULL: zeros are sent, and data is dropped. A source
+// returns the bytes it produced, up to Length; with none, the frame has
+// no packet, and the host will eventually see an underrun.
+//
+typedef ULONG (*PFN_ISO_FILL)(
+    _In_ PVOID Context,
+    _Out_writes_bytes_(Length) PUCHAR Packet,
+    _In_ ULONG Length
+);
+
+typedef VOID (*PFN_ISO_DRAIN)(
+    _In_ PVOID Context,
+    _In_reads_bytes_(Length) const UCHAR *Packet,
+    _In_ ULONG Length
+);
+
+
+typedef struct _ISO_STATS
+{
+    ULONG64 Frames;         // run
+    ULONG64 Packets;        // host packets handled
+    ULONG64 Bytes;          // in those
+    ULONG64 Underruns;      // IN: host packet with nothing to send; OUT: frame with nothing to consume
+    ULONG64 Overruns;       // IN: packet produced into a full ring; OUT: host packet into a full ring
+    ULONG64 Skipped;        // frames given up on, too far behind
+} ISO_STATS, *PISO_STATS;
+
+
+typedef struct _ISO_SCHEDULER
+{
+    ISO_DIRECTION Direction;
+    ULONG         PacketSize;
+    ULONG         Slots;            // ring depth
+    ULONG         Prefill;          // packets in the ring at start
+    ULONG         Rate;             // frames per second
+    ULONG64       Frequency;        // timestamp ticks per second
+    PFN_ISO_FILL  Fill;
+    PFN_ISO_DRAIN Drain;
+    PVOID         Context;
+
+    ULONG64       Base;             // timestamp frame 0 was due
+    ULONG64       NextFrame;        // the next one to run
+    ULONG         Head;             // oldest packet
+    ULONG         Count;            // packets in the ring
+    PUCHAR        Data;             // Slots packets
+    PULONG        Lengths;          // of each
+
+    ISO_STATS     Stats;
+    HISTOGRAM     Lateness;         // of each frame run, in ticks
+} ISO_SCHEDULER, *PISO_SCHEDULER;
+
+
+NTSTATUS
+IsoInit(
+    _Out_ PISO_SCHEDULER Sched,
+    _In_  ISO_DIRECTION Direction,
+    _In_  ULONG PacketSize,
+    _In_  ULONG Slots,
+    _In_  ULONG Prefill,            // at most Slots
+    _In_  ULONG Rate,
+    _In_  ULONG64 Frequency,
+    _In_opt_ PFN_ISO_FILL Fill,
+    _In_opt_ PFN_ISO_DRAIN Drain,
+    _In_opt_ PVOID Context
+);
+
+VOID
+IsoCleanup(
+    _Inout_ PISO_SCHEDULER Sched
+);
+
+//
+// (Re)starts the stream at Now, frame 0: the ring is refilled with Prefill
+// packets, from Fill for IN, of zeros for OUT. Counters carry on.
+//
+VOID
+IsoStart(
+    _Inout_ PISO_SCHEDULER Sched,
+    _In_ ULONG64 Now
+);
+
+//
+// Frames due by Now and not run yet. Beyond MaxLag of them, the oldest are
+// given up on (Skipped), the ring left as it was.
+//
+ULONG
+IsoFramesDue(
+    _Inout_ PISO_SCHEDULER Sched,
+    _In_ ULONG64 Now,
+    _In_ ULONG MaxLag
+);
+
+//
+// When frame Frame is due.
+//
+FORCEINLINE
+ULONG64
+IsoFrameTime(
+    _In_ const ISO_SCHEDULER *Sched,
+    _In_ ULONG64 Frame
+)
+{
+    return Sched->Base + ((Frame * Sched->Frequency) / Sched->Rate);
+}
+
+//
+// Runs the next frame, at Now, with the host's packet for it if there is
+// one (HostPacket NULL otherwise). Returns the bytes moved to or from the
+// host packet: 0 on an underrun (IN) or an overrun (OUT).
+//
+ULONG
+IsoRunFrame(
+    _Inout_ PISO_SCHEDULER Sched,
+    _In_ ULONG64 Now,
+    _Inout_updates_bytes_opt_(HostLength) PUCHAR HostPacket,
+    _In_ ULONG HostLength
+);
+
+
+EXTERN_C_END
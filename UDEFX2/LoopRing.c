@@ -0,0 +1,189 @@
+/*++
+
+Module Name:
+
+LoopRing.c
+
+Abstract:
+
+    Implementation of the message ring declared in LoopRing.h.
+
+--*/
+
+#include "LoopRing.h"
+
+#define LR_HEADER       LOOP_RING_ALIGN         // length word, padded
+#define LR_WRAP         0xFFFFFFFF              // length word of the wrap marker
+
+#define LR_ROUND_UP(__n)    (((__n) + (LOOP_RING_ALIGN - 1)) & ~(ULONG64)(LOOP_RING_ALIGN - 1))
+
+
+
+NTSTATUS
+LrInit(
+    _Out_ PLOOP_RING Ring,
+    _In_  ULONG Capacity
+)
+{
+    memset(Ring, 0, sizeof(*Ring));
+
+    if ((Capacity < 64) || ((Capacity & (Capacity - 1)) != 0)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    Ring->Data = (PUCHAR)OsAllocate(Capacity);
+    if (Ring->Data == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    Ring->Capacity = Capacity;
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+LrCleanup(
+    _Inout_ PLOOP_RING Ring
+)
+{
+    if (Ring->Data != NULL) {
+        OsFree(Ring->Data);
+        Ring->Data = NULL;
+    }
+}
+
+
+//
+// Bytes a message of Length takes from the producer's index: its record,
+// after *Skip bytes left unused before the end of the buffer if it does
+// not fit there (the message then starts over at the beginning).
+//
+static ULONG64
+LrSpace(
+    _In_  const LOOP_RING *Ring,
+    _In_  ULONG64 Head,
+    _In_  ULONG Length,
+    _Out_ PULONG64 Skip
+)
+{
+    ULONG64 record = LR_HEADER + LR_ROUND_UP((ULONG64)Length);
+    ULONG offset = (ULONG)(Head & (Ring->Capacity - 1));
+
+    *Skip = (offset + record > Ring->Capacity) ? (Ring->Capacity - offset) : 0;
+    return *Skip + record;
+}
+
+
+BOOLEAN
+LrHasRoom(
+    _In_ PLOOP_RING Ring,
+    _In_ ULONG Length
+)
+{
+    ULONG64 head = (ULONG64)Ring->Head;
+    ULONG64 tail = (ULONG64)ReadAcquire64(&(Ring->Tail));
+    ULONG64 skip;
+
+    return (Length <= LrMaxMessage(Ring)) &&
+        ((head - tail) + LrSpace(Ring, head, Length, &skip) <= Ring->Capacity);
+}
+
+
+BOOLEAN
+LrPush(
+    _Inout_ PLOOP_RING Ring,
+    _In_reads_bytes_(Length) const UCHAR *Message,
+    _In_ ULONG Length
+)
+{
+    ULONG64 head = (ULONG64)Ring->Head;
+    ULONG64 tail = (ULONG64)ReadAcquire64(&(Ring->Tail));
+    ULONG offset = (ULONG)(head & (Ring->Capacity - 1));
+    ULONG64 skip;
+    ULONG64 space;
+
+    if (Length > LrMaxMessage(Ring)) {
+        return FALSE;
+    }
+
+    space = LrSpace(Ring, head, Length, &skip);
+    if ((head - tail) + space > Ring->Capacity) {
+        return FALSE;
+    }
+
+    // no room before the end: a marker there, and the message at the start
+    if (skip != 0) {
+        *(ULONG *)(Ring->Data + offset) = LR_WRAP;
+        offset = 0;
+    }
+
+    *(ULONG *)(Ring->Data + offset) = Length;
+    if (Length != 0) {
+        memcpy(Ring->Data + offset + LR_HEADER, Message, Length);
+    }
+
+    WriteRelease64(&(Ring->Head), (LONG64)(head + space));
+    return TRUE;
+}
+
+
+BOOLEAN
+LrPeek(
+    _In_  PLOOP_RING Ring,
+    _Out_ PUCHAR *Data,
+    _Out_ PULONG Length
+)
+{
+    ULONG64 tail = (ULONG64)Ring->Tail;
+    ULONG64 head = (ULONG64)ReadAcquire64(&(Ring->Head));
+    ULONG offset = (ULONG)(tail & (Ring->Capacity - 1));
+    ULONG length;
+
+    if (head == tail) {
+        return FALSE;
+    }
+
+    length = *(ULONG *)(Ring->Data + offset);
+    if (length == LR_WRAP) {
+        // the producer only wraps with a message behind the marker
+        tail += Ring->Capacity - offset;
+        WriteRelease64(&(Ring->Tail), (LONG64)tail);
+        offset = 0;
+        length = *(ULONG *)(Ring->Data);
+    }
+
+    *Data = Ring->Data + offset + LR_HEADER + Ring->Cursor;
+    *Length = length - Ring->Cursor;
+    return TRUE;
+}
+
+
+BOOLEAN
+LrConsume(
+    _Inout_ PLOOP_RING Ring,
+    _In_ ULONG Bytes
+)
+{
+    ULONG64 tail = (ULONG64)Ring->Tail;
+    ULONG offset = (ULONG)(tail & (Ring->Capacity - 1));
+    ULONG length = *(ULONG *)(Ring->Data + offset);
+
+    Ring->Cursor += Bytes;
+    if (Ring->Cursor < length) {
+        return FALSE;
+    }
+
+    Ring->Cursor = 0;
+    WriteRelease64(&(Ring->Tail), (LONG64)(tail + LR_HEADER + LR_ROUND_UP((ULONG64)length)));
+    return TRUE;
+}
+
+
+VOID
+LrReset(
+    _Inout_ PLOOP_RING Ring
+)
+{
+    Ring->Head = 0;
+    Ring->Tail = 0;
+    Ring->Cursor = 0;
+}
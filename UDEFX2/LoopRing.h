@@ -0,0 +1,131 @@
+/*++
+
+Module Name:
+
+LoopRing.h
+
+Abstract:
+
+    Message ring between one producer and one consumer, e.g. BULK OUT
+    transfers on their way back out through BULK IN in loopback mode.
+    Messages are copied in whole, and copied out in as many pieces as the
+    consumer likes; their boundaries are kept.
+
+    One producer and one consumer can use the ring at the same time without
+    a lock: each only writes its own index, published with release and read
+    with acquire semantics.
+
+    Messages are laid out one after the other, each one after a length
+    word, aligned on LOOP_RING_ALIGN; one that does not fit before the end
+    of the buffer starts over at the beginning, behind a wrap marker.
+
+    This module is OS-neutral; see OsShim.h.
+
+--*/
+
+#pragma once
+
+#include "OsShim.h"
+
+EXTERN_C_START
+
+
+#define LOOP_RING_ALIGN     8
+
+
+typedef struct _LOOP_RING
+{
+    volatile LONG64 Head;       // bytes produced, ever; producer only
+    UCHAR           Pad1[56];
+    volatile LONG64 Tail;       // bytes consumed, ever; consumer only
+    ULONG           Cursor;     // consumer only: bytes taken from the oldest message
+    UCHAR           Pad2[52];
+    ULONG           Capacity;   // power of two
+    PUCHAR          Data;
+} LOOP_RING, *PLOOP_RING;
+
+
+NTSTATUS
+LrInit(
+    _Out_ PLOOP_RING Ring,
+    _In_  ULONG Capacity        // power of two, at least 64
+);
+
+VOID
+LrCleanup(
+    _Inout_ PLOOP_RING Ring
+);
+
+//
+// Largest message the ring takes, whatever its state.
+//
+FORCEINLINE
+ULONG
+LrMaxMessage(
+    _In_ const LOOP_RING *Ring
+)
+{
+    return (Ring->Capacity / 2) - LOOP_RING_ALIGN;
+}
+
+//
+// Producer: copies a message in; FALSE, with nothing copied, if the ring
+// has no room for it now (or ever, if Length > LrMaxMessage).
+//
+BOOLEAN
+LrPush(
+    _Inout_ PLOOP_RING Ring,
+    _In_reads_bytes_(Length) const UCHAR *Message,
+    _In_ ULONG Length
+);
+
+//
+// Producer: whether LrPush would take a message of Length bytes now. It
+// still will later, as only the producer makes the room smaller.
+//
+BOOLEAN
+LrHasRoom(
+    _In_ PLOOP_RING Ring,
+    _In_ ULONG Length
+);
+
+//
+// Consumer: the part of the oldest message not taken yet. FALSE if the
+// ring is empty. A message of 0 bytes is there, with *Length 0.
+//
+BOOLEAN
+LrPeek(
+    _In_  PLOOP_RING Ring,
+    _Out_ PUCHAR *Data,
+    _Out_ PULONG Length
+);
+
+//
+// Consumer: takes Bytes of what LrPeek returned; the message is released
+// once all of it is taken. Returns TRUE if it was.
+//
+BOOLEAN
+LrConsume(
+    _Inout_ PLOOP_RING Ring,
+    _In_ ULONG Bytes
+);
+
+FORCEINLINE
+BOOLEAN
+LrIsEmpty(
+    _In_ PLOOP_RING Ring
+)
+{
+    return ReadAcquire64(&(Ring->Head)) == ReadNoFence64(&(Ring->Tail));
+}
+
+//
+// Drops everything; neither side may be using the ring.
+//
+VOID
+LrReset(
+    _Inout_ PLOOP_RING Ring
+);
+
+
+EXTERN_C_END
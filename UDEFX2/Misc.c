@@ -3,10 +3,13 @@ Copyright (c) Microsoft Corporation
 
 Module Name:
 
-misc.cpp
+Misc.c
 
 Abstract:
 
+    WDF/UdeCx glue for the write-to-read queues: what WRQueueCore.c needs
+    done with a request (fill it, complete it, make it cancelable, park
+    it), done the WDF way, or the UDE way for URBs.
 
 --*/
 
@@ -18,72 +21,291 @@ Abstract:
 #include "Misc.tmh"
 
 
+// the profile IOCTL hands histograms out in HistRead layout
+C_ASSERT(WRQUEUE_HISTOGRAM_BUCKETS == HISTOGRAM_BUCKETS);
+C_ASSERT(sizeof(WRQUEUE_HISTOGRAM) == HISTOGRAM_WORDS * sizeof(ULONG64));
+C_ASSERT(FIELD_OFFSET(WRQUEUE_HISTOGRAM, Buckets) == 3 * sizeof(ULONG64));
+
+
+typedef struct _WRQUEUE_PARK_CONTEXT
+{
+    PWRITE_BUFFER_TO_READ_REQUEST_QUEUE pQ;
+} WRQUEUE_PARK_CONTEXT, *PWRQUEUE_PARK_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(WRQUEUE_PARK_CONTEXT, _WQQGetParkContext);
+
+
 static VOID
-_WQQCancelRequest(
-    IN WDFQUEUE Queue,
-    IN WDFREQUEST  Request
+_WQQCompleteRead(
+    _In_ PWRITE_BUFFER_TO_READ_REQUEST_QUEUE pQ,
+    _In_ WDFREQUEST rqRead,
+    _In_ NTSTATUS   status,
+    _In_ SIZE_T     bytes
+)
+{
+    if (pQ->bUSBReqQueue) {
+        if (status == STATUS_CANCELLED) {
+            LogInfo(TRACE_DEVICE, "Canceling request %p", rqRead);
+        }
+        UdecxUrbSetBytesCompleted(rqRead, (ULONG)bytes);
+        UdecxUrbCompleteWithNtStatus(rqRead, status);
+    } else {
+        WdfRequestCompleteWithInformation(rqRead, status, bytes);
+    }
+}
+
+
+static VOID
+_WQQCompleteWrite(
+    _In_ PWRITE_BUFFER_TO_READ_REQUEST_QUEUE pQ,
+    _In_ WDFREQUEST  Request,
+    _In_ NTSTATUS    status,
+    _In_ SIZE_T      bytes
+)
+{
+    if (pQ->bUSBWriteQueue) {
+        UdecxUrbSetBytesCompleted(Request, (ULONG)bytes);
+        UdecxUrbCompleteWithNtStatus(Request, status);
+    } else {
+        WdfRequestCompleteWithInformation(Request, status, bytes);
+    }
+}
+
+
+static VOID
+_WQQEvtDeferredWriteCanceled(
+    _In_ WDFQUEUE    Queue,
+    _In_ WDFREQUEST  Request
+)
+{
+    // its entry stays queued; whoever pops it will not find the request any more
+    LogInfo(TRACE_DEVICE, "Canceling deferred write %p", Request);
+    _WQQCompleteWrite(_WQQGetParkContext(Queue)->pQ, Request, STATUS_CANCELLED, 0);
+}
+
+
+static PREQUEST_CONTEXT
+_WQQGetRequestContext(
+    _In_ WDFREQUEST Request
 )
 {
-    UNREFERENCED_PARAMETER(Queue);
-    WdfRequestComplete(Request, STATUS_CANCELLED);
+    PREQUEST_CONTEXT pContext = WdfObjectGetTypedContext(Request, REQUEST_CONTEXT);
+
+    if (pContext == NULL) {
+        // URBs are created by UdeCx, so they may not carry our request context
+        WDF_OBJECT_ATTRIBUTES attributes;
+        WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, REQUEST_CONTEXT);
+
+        NTSTATUS status = WdfObjectAllocateContext(Request, &attributes, (PVOID *)&pContext);
+        if (!NT_SUCCESS(status)) {
+            TraceEvents(TRACE_LEVEL_ERROR,
+                TRACE_QUEUE,
+                "Unable to allocate request context, err= %!STATUS!", status);
+            pContext = NULL;
+        }
+    }
+
+    return pContext;
 }
 
 
 static VOID
-_WQQCancelUSBRequest(
-    IN WDFQUEUE Queue,
+_WQQEvtRequestCancel(
     IN WDFREQUEST  Request
 )
 {
-    UNREFERENCED_PARAMETER(Queue);
-    LogInfo(TRACE_DEVICE, "Canceling request %p", Request);
-    UdecxUrbCompleteWithNtStatus(Request, STATUS_CANCELLED);
+    PREQUEST_CONTEXT pContext = WdfObjectGetTypedContext(Request, REQUEST_CONTEXT);
+
+    WrqCancelRead(pContext->ParkedRead);
+}
+
+
+//
+// WRQUEUE_OPS; Context is the PWRITE_BUFFER_TO_READ_REQUEST_QUEUE.
+//
+static NTSTATUS
+_WQQOpArmRead(
+    _In_ PVOID      Context,
+    _In_ OS_REQUEST Read,
+    _In_ PVOID      ParkedRead
+)
+{
+    // allocated by WRQueuePullRead: this runs with preemption disabled
+    PREQUEST_CONTEXT pContext = WdfObjectGetTypedContext((WDFREQUEST)Read, REQUEST_CONTEXT);
+
+    UNREFERENCED_PARAMETER(Context);
+
+    NT_ASSERT(pContext != NULL);
+    pContext->ParkedRead = ParkedRead;
+    return WdfRequestMarkCancelableEx((WDFREQUEST)Read, _WQQEvtRequestCancel);
+}
+
+
+static BOOLEAN
+_WQQOpDisarmRead(
+    _In_ PVOID      Context,
+    _In_ OS_REQUEST Read
+)
+{
+    UNREFERENCED_PARAMETER(Context);
+
+    return (WdfRequestUnmarkCancelable((WDFREQUEST)Read) != STATUS_CANCELLED);
 }
 
 
+static NTSTATUS
+_WQQOpGetReadBuffer(
+    _In_  PVOID      Context,
+    _In_  OS_REQUEST Read,
+    _Out_ PUCHAR    *Buffer,
+    _Out_ PSIZE_T    Length
+)
+{
+    PWRITE_BUFFER_TO_READ_REQUEST_QUEUE pQ = (PWRITE_BUFFER_TO_READ_REQUEST_QUEUE)Context;
+    WDFREQUEST rqRead = (WDFREQUEST)Read;
+    NTSTATUS status;
+
+    if (pQ->bUSBReqQueue) {
+        ULONG rlen = 0;
+
+        // this is a USB read!
+        status = UdecxUrbRetrieveBuffer(rqRead, Buffer, &rlen);
+        if (!NT_SUCCESS(status)) {
+            LogError(TRACE_DEVICE, "WdfRequest %p cannot retrieve USB read buffer %!STATUS!",
+                rqRead, status);
+        }
+        (*Length) = rlen;
+    } else {
+        // this is a back-channel read, not a USB read!
+        status = WdfRequestRetrieveOutputBuffer(rqRead, 1, (PVOID *)Buffer, Length);
+        if (!NT_SUCCESS(status)) {
+            LogError(TRACE_DEVICE, "WdfRequest %p cannot retrieve back-channel read buffer %!STATUS!",
+                rqRead, status);
+        }
+    }
+
+    return status;
+}
+
+
+static VOID
+_WQQOpCompleteRead(
+    _In_ PVOID      Context,
+    _In_ OS_REQUEST Read,
+    _In_ NTSTATUS   Status,
+    _In_ SIZE_T     Bytes
+)
+{
+    _WQQCompleteRead((PWRITE_BUFFER_TO_READ_REQUEST_QUEUE)Context, (WDFREQUEST)Read, Status, Bytes);
+}
+
+
+//
+// Moves a deferred write where it can be canceled, keeping its handle
+// valid for the reader even if it is.
+//
+static NTSTATUS
+_WQQOpParkWrite(
+    _In_ PVOID      Context,
+    _In_ OS_REQUEST Write
+)
+{
+    PWRITE_BUFFER_TO_READ_REQUEST_QUEUE pQ = (PWRITE_BUFFER_TO_READ_REQUEST_QUEUE)Context;
+    WDFREQUEST rqWrite = (WDFREQUEST)Write;
+
+    WdfObjectReference(rqWrite);
+
+    NTSTATUS status = WdfRequestForwardToIoQueue(rqWrite, pQ->DeferredWrites);
+    if (!NT_SUCCESS(status)) {
+        LogError(TRACE_DEVICE, "Unable to park deferred write %p %!STATUS!", rqWrite, status);
+        WdfObjectDereference(rqWrite);
+    }
+    return status;
+}
+
+
+static BOOLEAN
+_WQQOpTakeWrite(
+    _In_ PVOID      Context,
+    _In_ OS_REQUEST Write
+)
+{
+    PWRITE_BUFFER_TO_READ_REQUEST_QUEUE pQ = (PWRITE_BUFFER_TO_READ_REQUEST_QUEUE)Context;
+    WDFREQUEST rqWrite = (WDFREQUEST)Write;
+    WDFREQUEST rqFound;
+
+    NTSTATUS status = WdfIoQueueRetrieveFoundRequest(pQ->DeferredWrites, rqWrite, &rqFound);
+    WdfObjectDereference(rqWrite);
+
+    return NT_SUCCESS(status);
+}
+
+
+static VOID
+_WQQOpCompleteWrite(
+    _In_ PVOID      Context,
+    _In_ OS_REQUEST Write,
+    _In_ NTSTATUS   Status,
+    _In_ SIZE_T     Bytes
+)
+{
+    _WQQCompleteWrite((PWRITE_BUFFER_TO_READ_REQUEST_QUEUE)Context, (WDFREQUEST)Write, Status, Bytes);
+}
+
+
+static const WRQUEUE_OPS _WQQOps = {
+    _WQQOpArmRead,
+    _WQQOpDisarmRead,
+    _WQQOpGetReadBuffer,
+    _WQQOpCompleteRead,
+    _WQQOpParkWrite,
+    _WQQOpTakeWrite,
+    _WQQOpCompleteWrite
+};
+
+
 NTSTATUS
 WRQueueInit(
     _In_    WDFDEVICE parent,
     _Inout_ PWRITE_BUFFER_TO_READ_REQUEST_QUEUE pQ,
-    _In_    BOOLEAN bUSBReqQueue
+    _In_    BOOLEAN bUSBReqQueue,
+    _In_    WRQUEUE_MODE Mode,
+    _In_opt_ PWRQUEUE_LIMITS Limits
 )
 {
+    NTSTATUS status;
+
     memset(pQ, 0, sizeof(*pQ));
 
+    // when a request gets canceled, this is how we want to do the completion
+    pQ->bUSBReqQueue = bUSBReqQueue;
+    // one end is always USB, the other the back-channel
+    pQ->bUSBWriteQueue = !bUSBReqQueue;
+
     WDF_IO_QUEUE_CONFIG queueConfig;
     WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+    queueConfig.EvtIoCanceledOnQueue = _WQQEvtDeferredWriteCanceled;
+    queueConfig.PowerManaged = WdfFalse;
 
-    // when a request gets canceled, this is where we want to do the completion
-    queueConfig.EvtIoCanceledOnQueue = (bUSBReqQueue ? _WQQCancelUSBRequest : _WQQCancelRequest );
-
-
-    NTSTATUS status = WdfSpinLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &(pQ->qsync));
-    if (!NT_SUCCESS(status) )  {
-        pQ->qsync = NULL;
+    WDF_OBJECT_ATTRIBUTES attributes;
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, WRQUEUE_PARK_CONTEXT);
+    status = WdfIoQueueCreate(parent, &queueConfig, &attributes, &(pQ->DeferredWrites));
+    if (!NT_SUCCESS(status))  {
         TraceEvents(TRACE_LEVEL_ERROR,
             TRACE_QUEUE,
-            "Unable to create spinlock, err= %!STATUS!", status);
-        goto Error;
+            "Unable to create deferred write queue, err= %!STATUS!", status );
+        goto Exit;
     }
+    _WQQGetParkContext(pQ->DeferredWrites)->pQ = pQ;
 
-    InitializeListHead( &(pQ->WriteBufferQueue) );
-
-    status = WdfIoQueueCreate(parent, 
-        &queueConfig, WDF_NO_OBJECT_ATTRIBUTES, &(pQ->ReadBufferQueue) );
-
+    status = WrqInit(&(pQ->Core), Mode, Limits, &_WQQOps, pQ);
     if (!NT_SUCCESS(status))  {
-        pQ->ReadBufferQueue = NULL;
         TraceEvents(TRACE_LEVEL_ERROR,
             TRACE_QUEUE,
-            "Unable to create rd queue, err= %!STATUS!", status );
-        goto Error;
+            "Unable to create write-to-read queue, err= %!STATUS!", status );
+        goto Exit;
     }
 
-    goto Exit;
-
-Error: // free anything done half-way
-    WRQueueDestroy(pQ);
-
 Exit:
     return status;
 }
@@ -93,80 +315,224 @@ WRQueueDestroy(
     _Inout_ PWRITE_BUFFER_TO_READ_REQUEST_QUEUE pQ
 )
 {
-    PLIST_ENTRY e;
-    if (pQ->qsync == NULL)  {
-        return; // init has not even started
+    WrqDestroy(&(pQ->Core));
+}
+
+
+static VOID
+_WQQLogPushFailure(
+    _In_ PWRITE_BUFFER_TO_READ_REQUEST_QUEUE pQ,
+    _In_ SIZE_T   wlen,
+    _In_ NTSTATUS status
+)
+{
+    if (!NT_SUCCESS(status)) {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_QUEUE,
+            "Write of %Iu bytes refused, queue at %I64d bytes / %d entries, err= %!STATUS!",
+            wlen,
+            ReadNoFence64(&(pQ->Core.QueuedBytes)),
+            ReadNoFence(&(pQ->Core.QueuedEntries)),
+            status);
     }
+}
 
-    // clean up the entire list
-    WdfSpinLockAcquire( pQ->qsync );
-    while ((e = RemoveHeadList(&(pQ->WriteBufferQueue))) != (&(pQ->WriteBufferQueue)) ) {
 
-        PBUFFER_CONTENT pWriteEntry = CONTAINING_RECORD(e, BUFFER_CONTENT, BufferLink);
-        ExFreePool(pWriteEntry);
+NTSTATUS
+WRQueuePushWrite(
+    _In_ PWRITE_BUFFER_TO_READ_REQUEST_QUEUE pQ,
+    _In_ ULONG Lane,
+    _In_ PVOID wbuffer,
+    _In_ SIZE_T wlen,
+    _Out_ PULONG readsCompleted
+)
+{
+    BOOLEAN bTaken;
+    NTSTATUS status = WrqPushWrite(&(pQ->Core), Lane, NULL, wbuffer, wlen, readsCompleted, &bTaken);
 
-    }
-    WdfSpinLockRelease(pQ->qsync);
+    _WQQLogPushFailure(pQ, wlen, status);
+    return status;
+}
+
+
+NTSTATUS
+WRQueuePushWriteDeferred(
+    _In_ PWRITE_BUFFER_TO_READ_REQUEST_QUEUE pQ,
+    _In_ ULONG Lane,
+    _In_ WDFREQUEST rqWrite,
+    _In_ PVOID wbuffer,
+    _In_ SIZE_T wlen,
+    _Out_ PULONG readsCompleted,
+    _Out_ PBOOLEAN pbTaken
+)
+{
+    NTSTATUS status = WrqPushWrite(&(pQ->Core), Lane, (OS_REQUEST)rqWrite, wbuffer, wlen, readsCompleted, pbTaken);
 
-    WdfObjectDelete(pQ->ReadBufferQueue);
-    pQ->ReadBufferQueue = NULL;
- 
-    WdfObjectDelete(pQ->qsync);
-    pQ->qsync = NULL;
+    _WQQLogPushFailure(pQ, wlen, status);
+    return status;
 }
 
 
 NTSTATUS
-WRQueuePushWrite(
+WRQueueReserve(
     _In_ PWRITE_BUFFER_TO_READ_REQUEST_QUEUE pQ,
+    _In_ SIZE_T Bytes,
+    _In_ LONG Entries,
+    _Out_ PWRQUEUE_RESERVATION Reservation
+)
+{
+    NTSTATUS status = WrqReserve(&(pQ->Core), Bytes, Entries, Reservation);
+
+    _WQQLogPushFailure(pQ, Bytes, status);
+    return status;
+}
+
+
+NTSTATUS
+WRQueuePushWriteReserved(
+    _In_ PWRITE_BUFFER_TO_READ_REQUEST_QUEUE pQ,
+    _In_ ULONG Lane,
+    _Inout_ PWRQUEUE_RESERVATION Reservation,
     _In_ PVOID wbuffer,
     _In_ SIZE_T wlen,
-    _Out_ WDFREQUEST *rqReadToComplete
+    _Out_ PULONG readsCompleted
 )
 {
-    NTSTATUS status;
+    NTSTATUS status = WrqPushWriteReserved(&(pQ->Core), Lane, Reservation, wbuffer, wlen, readsCompleted);
 
-    if (rqReadToComplete == NULL) {
-        status = STATUS_INVALID_PARAMETER;
-        goto Exit;
+    _WQQLogPushFailure(pQ, wlen, status);
+    return status;
+}
+
+
+VOID
+WRQueueReleaseReservation(
+    _In_ PWRITE_BUFFER_TO_READ_REQUEST_QUEUE pQ,
+    _Inout_ PWRQUEUE_RESERVATION Reservation
+)
+{
+    WrqReleaseReservation(&(pQ->Core), Reservation);
+}
+
+
+NTSTATUS
+WRQueuePushWriteBatch(
+    _In_ PWRITE_BUFFER_TO_READ_REQUEST_QUEUE pQ,
+    _In_reads_(Count) PWRQUEUE_BUFFER Writes,
+    _In_ ULONG Count,
+    _Out_writes_to_(MaxCompletions, *CompletionCount) PWRQUEUE_COMPLETION Completions,
+    _In_ ULONG MaxCompletions,
+    _Out_ PULONG CompletionCount
+)
+{
+    return WrqPushWriteBatch(&(pQ->Core), Writes, Count, Completions, MaxCompletions, CompletionCount);
+}
+
+
+VOID
+WRQueueCompleteBatch(
+    _In_ PWRITE_BUFFER_TO_READ_REQUEST_QUEUE pQ,
+    _In_reads_(Count) PWRQUEUE_COMPLETION Completions,
+    _In_ ULONG Count
+)
+{
+    ULONG i;
+
+    for (i = 0; i < Count; ++i) {
+        _WQQCompleteRead(pQ, (WDFREQUEST)Completions[i].Request, Completions[i].Status, Completions[i].Information);
+    }
+}
+
+
+VOID
+WRQueuePurgeDeferredWrites(
+    _In_ PWRITE_BUFFER_TO_READ_REQUEST_QUEUE pQ
+)
+{
+    // their entries stay queued, and get dropped by whichever read pops them
+    WdfIoQueuePurgeSynchronously(pQ->DeferredWrites);
+    WdfIoQueueStart(pQ->DeferredWrites);
+}
+
+
+VOID
+WRQueueSetFlowControl(
+    _Inout_  PWRITE_BUFFER_TO_READ_REQUEST_QUEUE pQ,
+    _In_opt_ PFN_WRQUEUE_FLOW_CONTROL FlowControl,
+    _In_opt_ PVOID Context
+)
+{
+    WrqSetFlowControl(&(pQ->Core), FlowControl, Context);
+}
+
+
+static ULONG64
+_WQQTicksTo100ns(
+    _In_ ULONG64 Ticks
+)
+{
+    ULONG64 frequency = OsTimestampFrequency();
+
+    return ((Ticks / frequency) * 10000000) + (((Ticks % frequency) * 10000000) / frequency);
+}
+
+
+VOID
+WRQueueGetStats(
+    _In_  PWRITE_BUFFER_TO_READ_REQUEST_QUEUE pQ,
+    _Out_ PWRQUEUE_STATS Stats
+)
+{
+    PWRQUEUE Q = &(pQ->Core);
+    OS_LOCK_STATE lockState;
+    ULONG64 throttledTime;
+
+    memset(Stats, 0, sizeof(*Stats));
+
+    if (!Q->bInitialized) {
+        return;
     }
 
-    (*rqReadToComplete) = NULL;
+    Stats->QueuedBytes = (ULONG64)ReadNoFence64(&(Q->QueuedBytes));
+    Stats->PeakBytes = (ULONG64)ReadNoFence64(&(Q->PeakBytes));
+    Stats->QueuedEntries = (ULONG)ReadNoFence(&(Q->QueuedEntries));
+    Stats->PeakEntries = (ULONG)ReadNoFence(&(Q->PeakEntries));
+    Stats->Refused = (ULONG64)ReadNoFence64(&(Q->Refused));
+
+    OsLockAcquire(&(Q->FlowLock), &lockState);
+    Stats->Throttles = (ULONG64)Q->Throttles;
+    throttledTime = Q->ThrottledTime;
+    if (Q->bThrottled) {
+        throttledTime += OsTimestamp() - Q->ThrottleStart; // still going
+    }
+    OsLockRelease(&(Q->FlowLock), &lockState);
 
+    Stats->ThrottledTime = _WQQTicksTo100ns(throttledTime);
+}
 
-    WDFREQUEST firstPendingRead;
-    status = WdfIoQueueRetrieveNextRequest(pQ->ReadBufferQueue, &firstPendingRead);
-    if ( NT_SUCCESS(status) )  {
-        (*rqReadToComplete) = firstPendingRead;
-        goto Exit;
-    } else {
-        PBUFFER_CONTENT pNewEntry;
-        status = STATUS_SUCCESS; // til proven otherwise
 
-        // allocate
-        pNewEntry = ExAllocatePool2(POOL_FLAG_PAGED, sizeof(BUFFER_CONTENT) + wlen, UDEFX_POOL_TAG);
-        if (pNewEntry == NULL) {
-            TraceEvents(TRACE_LEVEL_ERROR,
-                TRACE_QUEUE,
-                "Not enough memory to queue write, err= %!STATUS!", status);
-            status = STATUS_INSUFFICIENT_RESOURCES;
-            goto Exit;
-        }
+VOID
+WRQueueGetProfile(
+    _In_  PWRITE_BUFFER_TO_READ_REQUEST_QUEUE pQ,
+    _Out_ PWRQUEUE_PROFILE Profile
+)
+{
+    PWRQUEUE Q = &(pQ->Core);
 
-        // copy
-        memcpy(&(pNewEntry->BufferStart), wbuffer, wlen);
-        pNewEntry->BufferLength = wlen;
+    memset(Profile, 0, sizeof(*Profile));
 
-        // enqueue
-        WdfSpinLockAcquire(pQ->qsync);
-        InsertTailList(
-            &(pQ->WriteBufferQueue),
-            &(pNewEntry->BufferLink) );
-        WdfSpinLockRelease(pQ->qsync);
+    if (!Q->bInitialized) {
+        return;
     }
 
-Exit:
-    return status;
+    HistRead(&(Q->WriteResidency), (PULONG64)&(Profile->WriteResidency));
+    HistRead(&(Q->ReadResidency), (PULONG64)&(Profile->ReadResidency));
+    HistRead(&(Q->Depth), (PULONG64)&(Profile->Depth));
+    Profile->WritesQueued = (ULONG64)ReadNoFence64(&(Q->WritesQueued));
+    Profile->ReadsParked = (ULONG64)ReadNoFence64(&(Q->ReadsParked));
+    Profile->MatchedOnWrite = (ULONG64)ReadNoFence64(&(Q->MatchedOnWrite));
+    Profile->MatchedOnRead = (ULONG64)ReadNoFence64(&(Q->MatchedOnRead));
+    Profile->PeakParkedReads = (ULONG)ReadNoFence(&(Q->PeakParkedReads));
 }
 
 
@@ -182,50 +548,19 @@ WRQueuePullRead(
 {
     NTSTATUS status;
 
-    if (pbReadyToComplete == NULL) {
-        status = STATUS_INVALID_PARAMETER;
-        goto Exit;
-    }
-    if (completedBytes == NULL) {
-        status = STATUS_INVALID_PARAMETER;
-        goto Exit;
-    }
-    if (rbuffer == NULL) {
-        status = STATUS_INVALID_PARAMETER;
-        goto Exit;
+    // the read may park, and is armed with preemption disabled; give it its context here
+    if (_WQQGetRequestContext(rqRead) == NULL) {
+        (*pbReadyToComplete) = TRUE;
+        (*completedBytes) = 0;
+        return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    // defaults
-    (*pbReadyToComplete) = FALSE;
-    (*completedBytes) = 0;
-
-    WdfSpinLockAcquire(pQ->qsync);
-    PLIST_ENTRY firstPendingWrite = RemoveHeadList( &(pQ->WriteBufferQueue) );
-    WdfSpinLockRelease(pQ->qsync);
+    status = WrqPullRead(&(pQ->Core), (OS_REQUEST)rqRead, rbuffer, rlen, pbReadyToComplete, completedBytes);
 
-    if (firstPendingWrite == &(pQ->WriteBufferQueue) ) {
-
-        // no dangling writes found, must pend this read
-        status = WdfRequestForwardToIoQueue(rqRead, pQ->ReadBufferQueue);
-        if (!NT_SUCCESS(status)) {
-            TraceEvents(TRACE_LEVEL_ERROR,
-                TRACE_QUEUE,
-                "Unable to foward pending read, err= %!STATUS!", status);
-        }
-
-    } else {
-        size_t minlen;
-        PBUFFER_CONTENT pWriteEntry = CONTAINING_RECORD(firstPendingWrite, BUFFER_CONTENT, BufferLink);
-
-        minlen = MINLEN(pWriteEntry->BufferLength, rlen);
-        memcpy(rbuffer, &(pWriteEntry->BufferStart), minlen);
-
-        (*pbReadyToComplete) = TRUE;
-        (*completedBytes) = minlen;
-        ExFreePool(pWriteEntry);
-        status = STATUS_SUCCESS;
+    if (!NT_SUCCESS(status) && (status != STATUS_CANCELLED)) {
+        TraceEvents(TRACE_LEVEL_ERROR,
+            TRACE_QUEUE,
+            "Unable to pend read %p, err= %!STATUS!", rqRead, status);
     }
-
-Exit:
     return status;
 }
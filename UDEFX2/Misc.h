@@ -15,6 +15,8 @@ Abstract:
 #include <ntddk.h>
 #include <wdf.h>
 #include "trace.h"
+#include "Public.h"
+#include "WRQueueCore.h"
 
 
 
@@ -24,26 +26,30 @@ Abstract:
 EXTERN_C_START
 
 
-typedef struct _BUFFER_CONTENT
-{
-    LIST_ENTRY  BufferLink;
-    SIZE_T      BufferLength;
-    UCHAR       BufferStart; // variable-size structure, first byte of last field
-} BUFFER_CONTENT, *PBUFFER_CONTENT;
-
-
+//
+// The WDF face of a WRQUEUE: requests are WDFREQUESTs, URBs on the USB end
+// (see WRQueueCore.h for the queue semantics).
+//
 typedef struct _WRITE_BUFFER_TO_READ_REQUEST_QUEUE
 {
-    LIST_ENTRY WriteBufferQueue; // write data comes in, keep it here to complete a read request
-    WDFQUEUE   ReadBufferQueue; // read request comes in, stays here til a matching write buffer arrives
-    WDFSPINLOCK qsync;
+    WRQUEUE    Core;
+    WDFQUEUE   DeferredWrites; // writes queued by reference sit here, where they can be canceled
+    BOOLEAN    bUSBReqQueue;   // parked reads are URBs, fill and complete them the UDE way
+    BOOLEAN    bUSBWriteQueue; // deferred writes are URBs
 } WRITE_BUFFER_TO_READ_REQUEST_QUEUE, *PWRITE_BUFFER_TO_READ_REQUEST_QUEUE;
 
+//
+// A WRQueueModeStream queue must have one reader at a time: its reads must
+// come from a sequential queue, or one handled in order (EpModeOrdered),
+// or the bytes packed into concurrent reads end up interleaved.
+//
 NTSTATUS
 WRQueueInit(
     _In_    WDFDEVICE parent,
     _Inout_ PWRITE_BUFFER_TO_READ_REQUEST_QUEUE pQ,
-    _In_    BOOLEAN bUSBReqQueue
+    _In_    BOOLEAN bUSBReqQueue,
+    _In_    WRQUEUE_MODE Mode,
+    _In_opt_ PWRQUEUE_LIMITS Limits     // NULL for WRQUEUE_LIMITS_INIT defaults
 );
 
 VOID
@@ -53,12 +59,120 @@ WRQueueDestroy(
 
 
 
+//
+// Pending reads are filled and completed right here, as many as the write
+// spans; whatever they do not take gets queued in the given lane.
+//
 NTSTATUS
 WRQueuePushWrite(
     _In_ PWRITE_BUFFER_TO_READ_REQUEST_QUEUE pQ,
+    _In_ ULONG Lane,            // WRQUEUE_LANE_xxx
+    _In_ PVOID wbuffer,
+    _In_ SIZE_T wlen,
+    _Out_ PULONG readsCompleted
+);
+
+//
+// Same, but whatever pending reads do not take is queued by reference:
+// rqWrite itself is parked, later reads copy straight out of wbuffer, and
+// the last one completes rqWrite. No allocation of the payload, one copy less.
+// On return, *pbTaken tells whether the queue owns rqWrite now (it may even
+// have completed it already); if not, the caller completes it as usual.
+//
+NTSTATUS
+WRQueuePushWriteDeferred(
+    _In_ PWRITE_BUFFER_TO_READ_REQUEST_QUEUE pQ,
+    _In_ ULONG Lane,
+    _In_ WDFREQUEST rqWrite,
     _In_ PVOID wbuffer,
     _In_ SIZE_T wlen,
-    _Out_ WDFREQUEST *rqReadToComplete
+    _Out_ PULONG readsCompleted,
+    _Out_ PBOOLEAN pbTaken
+);
+
+//
+// Room held for a message sent as several writes, so that it goes whole or
+// not at all (see WrqReserve): writes pushed against the reservation can only
+// fail for want of memory. The reservation is released once they are pushed.
+//
+NTSTATUS
+WRQueueReserve(
+    _In_ PWRITE_BUFFER_TO_READ_REQUEST_QUEUE pQ,
+    _In_ SIZE_T Bytes,
+    _In_ LONG Entries,
+    _Out_ PWRQUEUE_RESERVATION Reservation
+);
+
+NTSTATUS
+WRQueuePushWriteReserved(
+    _In_ PWRITE_BUFFER_TO_READ_REQUEST_QUEUE pQ,
+    _In_ ULONG Lane,
+    _Inout_ PWRQUEUE_RESERVATION Reservation,
+    _In_ PVOID wbuffer,
+    _In_ SIZE_T wlen,
+    _Out_ PULONG readsCompleted
+);
+
+VOID
+WRQueueReleaseReservation(
+    _In_ PWRITE_BUFFER_TO_READ_REQUEST_QUEUE pQ,
+    _Inout_ PWRQUEUE_RESERVATION Reservation
+);
+
+//
+// Batched write side: pushes Writes[] in order, same as WRQueuePushWrite for
+// each, but pairs them with parked reads a batch per reservation, and leaves
+// those reads for the caller to complete (WRQueueCompleteBatch), e.g. after
+// it is done with its own bookkeeping. Reads that park while the batch is
+// being pushed, or beyond MaxCompletions, are completed right away instead.
+//
+NTSTATUS
+WRQueuePushWriteBatch(
+    _In_ PWRITE_BUFFER_TO_READ_REQUEST_QUEUE pQ,
+    _In_reads_(Count) PWRQUEUE_BUFFER Writes,
+    _In_ ULONG Count,
+    _Out_writes_to_(MaxCompletions, *CompletionCount) PWRQUEUE_COMPLETION Completions,
+    _In_ ULONG MaxCompletions,
+    _Out_ PULONG CompletionCount
+);
+
+VOID
+WRQueueCompleteBatch(
+    _In_ PWRITE_BUFFER_TO_READ_REQUEST_QUEUE pQ,
+    _In_reads_(Count) PWRQUEUE_COMPLETION Completions,
+    _In_ ULONG Count
+);
+
+//
+// Cancels all deferred writes still waiting for a read, e.g. when their
+// endpoint goes away. The queue keeps accepting new ones.
+//
+VOID
+WRQueuePurgeDeferredWrites(
+    _In_ PWRITE_BUFFER_TO_READ_REQUEST_QUEUE pQ
+);
+
+//
+// Installs (or, with NULL, removes) the producer throttle. If the queue is
+// throttled already, the new callback is told so right away.
+//
+VOID
+WRQueueSetFlowControl(
+    _Inout_  PWRITE_BUFFER_TO_READ_REQUEST_QUEUE pQ,
+    _In_opt_ PFN_WRQUEUE_FLOW_CONTROL FlowControl,
+    _In_opt_ PVOID Context
+);
+
+VOID
+WRQueueGetStats(
+    _In_  PWRITE_BUFFER_TO_READ_REQUEST_QUEUE pQ,
+    _Out_ PWRQUEUE_STATS Stats
+);
+
+VOID
+WRQueueGetProfile(
+    _In_  PWRITE_BUFFER_TO_READ_REQUEST_QUEUE pQ,
+    _Out_ PWRQUEUE_PROFILE Profile
 );
 
 NTSTATUS
@@ -0,0 +1,234 @@
+/*++
+
+Module Name:
+
+MissionExec.c
+
+Abstract:
+
+    Implementation of the mission executor declared in MissionExec.h.
+
+--*/
+
+#include "MissionExec.h"
+
+
+NTSTATUS
+MxInit(
+    _Out_ PMX_EXECUTOR Exec,
+    _In_reads_(HandlerCount) const MX_HANDLER *Handlers,
+    _In_  ULONG HandlerCount,
+    _In_  ULONG Workers,
+    _In_  ULONG Capacity,
+    _In_  PFN_MX_COMPLETE Complete,
+    _In_  PFN_MX_KICK Kick,
+    _In_opt_ PVOID Context
+)
+{
+    memset(Exec, 0, sizeof(*Exec));
+
+    if ((Workers == 0) || (Workers > MX_MAX_WORKERS) || (Capacity == 0)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    Exec->Worker = (PMX_WORKER)OsAllocate(sizeof(MX_WORKER) * Workers);
+    Exec->Jobs = (PMX_JOB)OsAllocate(sizeof(MX_JOB) * Capacity);
+    if ((Exec->Worker == NULL) || (Exec->Jobs == NULL)) {
+        MxCleanup(Exec);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    OsLockInit(&(Exec->Lock));
+    Exec->Handlers = Handlers;
+    Exec->HandlerCount = HandlerCount;
+    Exec->Complete = Complete;
+    Exec->Kick = Kick;
+    Exec->Context = Context;
+    Exec->Workers = Workers;
+    Exec->Idle = (Workers == MX_MAX_WORKERS) ? 0xFFFFFFFF : ((1u << Workers) - 1);
+    Exec->Capacity = Capacity;
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+MxCleanup(
+    _Inout_ PMX_EXECUTOR Exec
+)
+{
+    if (Exec->Worker != NULL) {
+        OsFree(Exec->Worker);
+        Exec->Worker = NULL;
+    }
+    if (Exec->Jobs != NULL) {
+        OsFree(Exec->Jobs);
+        Exec->Jobs = NULL;
+    }
+}
+
+
+const MX_HANDLER *
+MxLookup(
+    _In_ PMX_EXECUTOR Exec,
+    _In_reads_bytes_(Length) const UCHAR *Mission,
+    _In_ ULONG Length
+)
+{
+    ULONG typeLength = 0;
+
+    // the type ends at ':', or with the text; the host sends its NUL too
+    while ((typeLength < Length) && (Mission[typeLength] != ':') && (Mission[typeLength] != 0)) {
+        typeLength++;
+    }
+
+    for (ULONG i = 0; i < Exec->HandlerCount; ++i) {
+        const char *type = Exec->Handlers[i].Type;
+
+        if ((strlen(type) == typeLength) && (memcmp(type, Mission, typeLength) == 0)) {
+            return &(Exec->Handlers[i]);
+        }
+    }
+    return NULL;
+}
+
+
+NTSTATUS
+MxSubmit(
+    _Inout_ PMX_EXECUTOR Exec,
+    _In_reads_bytes_(Length) const UCHAR *Mission,
+    _In_ ULONG Length
+)
+{
+    const MX_HANDLER *handler = MxLookup(Exec, Mission, Length);
+    OS_LOCK_STATE lockState;
+    ULONG worker = MX_MAX_WORKERS;
+    PMX_JOB job;
+
+    OsLockAcquire(&(Exec->Lock), &lockState);
+
+    if (handler == NULL) {
+        Exec->Stats.Passed++;
+        OsLockRelease(&(Exec->Lock), &lockState);
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    if ((Exec->bStopped) || (Exec->Count == Exec->Capacity) || (Length > MX_MAX_MISSION)) {
+        Exec->Stats.Rejected++;
+        OsLockRelease(&(Exec->Lock), &lockState);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    job = &(Exec->Jobs[(Exec->Head + Exec->Count) % Exec->Capacity]);
+    job->Handler = handler;
+    job->Submitted = OsTimestamp();
+    job->Length = Length;
+    memcpy(job->Data, Mission, Length);
+    Exec->Count++;
+    Exec->Stats.Submitted++;
+    if (Exec->Count > Exec->Stats.PeakQueued) {
+        Exec->Stats.PeakQueued = Exec->Count;
+    }
+
+    // one idle worker more for each job queued, as long as there are some
+    if (Exec->Idle != 0) {
+        worker = OsHighestBit64(Exec->Idle);
+        Exec->Idle &= ~(1u << worker);
+        Exec->Busy++;
+        if (Exec->Busy > Exec->Stats.PeakBusy) {
+            Exec->Stats.PeakBusy = Exec->Busy;
+        }
+    }
+
+    OsLockRelease(&(Exec->Lock), &lockState);
+
+    if (worker != MX_MAX_WORKERS) {
+        Exec->Kick(Exec->Context, worker);
+    }
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+MxWork(
+    _Inout_ PMX_EXECUTOR Exec,
+    _In_ ULONG Worker
+)
+{
+    PMX_WORKER self = &(Exec->Worker[Worker]);
+    OS_LOCK_STATE lockState;
+
+    for (;;)
+    {
+        ULONG responseLength = 0;
+        NTSTATUS status;
+        ULONG64 started;
+
+        OsLockAcquire(&(Exec->Lock), &lockState);
+        if (Exec->Count == 0) {
+            // from here on, this worker can be kicked again
+            Exec->Idle |= (1u << Worker);
+            Exec->Busy--;
+            OsLockRelease(&(Exec->Lock), &lockState);
+            return;
+        }
+        self->Job = Exec->Jobs[Exec->Head];
+        Exec->Head = (Exec->Head + 1) % Exec->Capacity;
+        Exec->Count--;
+        OsLockRelease(&(Exec->Lock), &lockState);
+
+        started = OsTimestamp();
+        HistRecord(&(Exec->Wait), started - self->Job.Submitted);
+
+        status = self->Job.Handler->Handler(
+            Exec->Context,
+            self->Job.Data,
+            self->Job.Length,
+            self->Response,
+            sizeof(self->Response),
+            &responseLength);
+        if (responseLength > sizeof(self->Response)) {
+            responseLength = sizeof(self->Response);
+        }
+
+        Exec->Complete(Exec->Context, status, self->Response, responseLength);
+        HistRecord(&(Exec->Latency), OsTimestamp() - self->Job.Submitted);
+
+        OsLockAcquire(&(Exec->Lock), &lockState);
+        if (NT_SUCCESS(status)) {
+            Exec->Stats.Completed++;
+        } else {
+            Exec->Stats.Failed++;
+        }
+        OsLockRelease(&(Exec->Lock), &lockState);
+    }
+}
+
+
+VOID
+MxStop(
+    _Inout_ PMX_EXECUTOR Exec
+)
+{
+    OS_LOCK_STATE lockState;
+
+    OsLockAcquire(&(Exec->Lock), &lockState);
+    Exec->bStopped = TRUE;
+    Exec->Stats.Dropped += Exec->Count;
+    Exec->Head = 0;
+    Exec->Count = 0;
+    OsLockRelease(&(Exec->Lock), &lockState);
+}
+
+
+VOID
+MxGetStats(
+    _Inout_ PMX_EXECUTOR Exec,
+    _Out_ PMX_STATS Stats
+)
+{
+    OS_LOCK_STATE lockState;
+
+    OsLockAcquire(&(Exec->Lock), &lockState);
+    *Stats = Exec->Stats;
+    OsLockRelease(&(Exec->Lock), &lockState);
+}
@@ -0,0 +1,198 @@
+/*++
+
+Module Name:
+
+MissionExec.h
+
+Abstract:
+
+    Executes mission requests inside the driver, on a bounded pool of
+    workers, instead of sending them through the back-channel to an agent
+    in user mode and back.
+
+    A mission is looked up by its type, the text up to the first ':' (or
+    all of it); a type with a handler in the table is copied into a job
+    queue, and run there by one of the workers, which hands the handler's
+    response and status to the completion callback. Missions of any other
+    type are not taken: the caller sends them on as before.
+
+    Workers are the OS's. When a job is queued and a worker is idle, the
+    kick callback is called (outside the lock) to get worker n going;
+    worker n then calls MxWork(n) until it returns, which it does once the
+    queue is empty. A kicked worker always runs MxWork again, even if its
+    previous call has not returned yet.
+
+    Missions run in parallel and complete in any order.
+
+    This module is OS-neutral; see OsShim.h.
+
+--*/
+
+#pragma once
+
+#include "OsShim.h"
+#include "Histogram.h"
+
+EXTERN_C_START
+
+
+#define MX_MAX_MISSION      256     // bytes of a mission run here
+#define MX_MAX_RESPONSE     512     // bytes of a response
+#define MX_MAX_WORKERS      32
+
+
+//
+// Runs one mission: writes at most ResponseSize bytes of response, and
+// how many into ResponseLength. Its status goes to the completion as is.
+// Called at the workers' IRQL, which is PASSIVE_LEVEL in the driver.
+//
+typedef NTSTATUS (*PFN_MX_HANDLER)(
+    _In_opt_ PVOID Context,
+    _In_reads_bytes_(Length) const UCHAR *Mission,
+    _In_ ULONG Length,
+    _Out_writes_bytes_to_(ResponseSize, *ResponseLength) PUCHAR Response,
+    _In_ ULONG ResponseSize,
+    _Out_ PULONG ResponseLength
+);
+
+typedef struct _MX_HANDLER
+{
+    const char     *Type;
+    PFN_MX_HANDLER  Handler;
+} MX_HANDLER, *PMX_HANDLER;
+
+typedef VOID (*PFN_MX_COMPLETE)(
+    _In_opt_ PVOID Context,
+    _In_ NTSTATUS Status,
+    _In_reads_bytes_(Length) const UCHAR *Response,
+    _In_ ULONG Length
+);
+
+typedef VOID (*PFN_MX_KICK)(
+    _In_opt_ PVOID Context,
+    _In_ ULONG Worker
+);
+
+
+typedef struct _MX_JOB
+{
+    const MX_HANDLER *Handler;
+    ULONG64           Submitted;        // OsTimestamp()
+    ULONG             Length;
+    UCHAR             Data[MX_MAX_MISSION];
+} MX_JOB, *PMX_JOB;
+
+// what a worker runs a job with, so none of it is on its stack
+typedef struct _MX_WORKER
+{
+    MX_JOB  Job;
+    UCHAR   Response[MX_MAX_RESPONSE];
+} MX_WORKER, *PMX_WORKER;
+
+typedef struct _MX_STATS
+{
+    ULONG64 Submitted;      // queued
+    ULONG64 Completed;      // with a success status
+    ULONG64 Failed;         // with any other
+    ULONG64 Passed;         // of no known type, left to the caller
+    ULONG64 Rejected;       // queue full, or too long
+    ULONG64 Dropped;        // still queued when stopped
+    ULONG   PeakQueued;
+    ULONG   PeakBusy;       // workers
+} MX_STATS, *PMX_STATS;
+
+
+typedef struct _MX_EXECUTOR
+{
+    OS_LOCK           Lock;
+    const MX_HANDLER *Handlers;
+    ULONG             HandlerCount;
+    PFN_MX_COMPLETE   Complete;
+    PFN_MX_KICK       Kick;
+    PVOID             Context;
+
+    ULONG             Workers;
+    ULONG             Idle;             // one bit a worker, under Lock
+    ULONG             Busy;             // the others, under Lock
+    PMX_WORKER        Worker;           // Workers of them
+    ULONG             Capacity;         // jobs
+    ULONG             Head;             // under Lock
+    ULONG             Count;            // under Lock
+    PMX_JOB           Jobs;             // Capacity of them
+    BOOLEAN           bStopped;         // under Lock
+
+    MX_STATS          Stats;            // under Lock
+    HISTOGRAM         Latency;          // submitted to completed, in ticks
+    HISTOGRAM         Wait;             // submitted to started, in ticks
+} MX_EXECUTOR, *PMX_EXECUTOR;
+
+
+NTSTATUS
+MxInit(
+    _Out_ PMX_EXECUTOR Exec,
+    _In_reads_(HandlerCount) const MX_HANDLER *Handlers,
+    _In_  ULONG HandlerCount,
+    _In_  ULONG Workers,                // 1 to MX_MAX_WORKERS
+    _In_  ULONG Capacity,
+    _In_  PFN_MX_COMPLETE Complete,
+    _In_  PFN_MX_KICK Kick,
+    _In_opt_ PVOID Context
+);
+
+//
+// Workers must all be done: stopped, and out of MxWork.
+//
+VOID
+MxCleanup(
+    _Inout_ PMX_EXECUTOR Exec
+);
+
+//
+// The handler for a mission's type, or NULL.
+//
+const MX_HANDLER *
+MxLookup(
+    _In_ PMX_EXECUTOR Exec,
+    _In_reads_bytes_(Length) const UCHAR *Mission,
+    _In_ ULONG Length
+);
+
+//
+// Queues a mission for the workers. Returns STATUS_NOT_SUPPORTED for a
+// type with no handler, which the caller is to handle itself, and
+// STATUS_INSUFFICIENT_RESOURCES when the queue is full, the mission too
+// long or the executor stopped.
+//
+NTSTATUS
+MxSubmit(
+    _Inout_ PMX_EXECUTOR Exec,
+    _In_reads_bytes_(Length) const UCHAR *Mission,
+    _In_ ULONG Length
+);
+
+//
+// Body of worker Worker: runs jobs until there are none left.
+//
+VOID
+MxWork(
+    _Inout_ PMX_EXECUTOR Exec,
+    _In_ ULONG Worker
+);
+
+//
+// Refuses missions from now on, and drops the queued ones. Jobs already
+// running complete; the caller waits for its workers after this.
+//
+VOID
+MxStop(
+    _Inout_ PMX_EXECUTOR Exec
+);
+
+VOID
+MxGetStats(
+    _Inout_ PMX_EXECUTOR Exec,
+    _Out_ PMX_STATS Stats
+);
+
+
+EXTERN_C_END
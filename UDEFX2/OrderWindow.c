@@ -0,0 +1,109 @@
+/*++
+
+Module Name:
+
+OrderWindow.c
+
+Abstract:
+
+    Implementation of the in-flight window declared in OrderWindow.h.
+
+    Taking an item fetches it, gives it a ticket and publishes it in the
+    ticket's slot, all under FetchLock, and only while fewer than Depth
+    tickets are ahead of NextToRun. Whoever owns bRunning runs slots from
+    NextToRun on, refilling from Fetch whenever it finds the next slot
+    empty, until Fetch has nothing either. Having dropped bRunning, it looks
+    at that slot once more: an item published in between would otherwise be
+    stranded, as its taker may have tried for bRunning before it was dropped.
+
+--*/
+
+#include "OrderWindow.h"
+
+C_ASSERT((ORDER_WINDOW_SLOTS & (ORDER_WINDOW_SLOTS - 1)) == 0);
+
+#define OW_SLOT(__t)    ((ULONG)(__t) & (ORDER_WINDOW_SLOTS - 1))
+
+
+
+NTSTATUS
+OwInit(
+    _Out_ PORDER_WINDOW Window,
+    _In_  ULONG Depth,
+    _In_  PFN_ORDER_WINDOW_FETCH Fetch,
+    _In_  PFN_ORDER_WINDOW_RUN Run,
+    _In_  PVOID Context
+)
+{
+    if ((Depth == 0) || (Depth > ORDER_WINDOW_SLOTS) || (Fetch == NULL) || (Run == NULL)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    memset(Window, 0, sizeof(*Window));
+    OsLockInit(&(Window->FetchLock));
+    Window->Depth = Depth;
+    Window->Fetch = Fetch;
+    Window->Run = Run;
+    Window->Context = Context;
+    return STATUS_SUCCESS;
+}
+
+
+//
+// Takes items from Fetch while the window has room.
+//
+static VOID
+_OwFill(
+    _Inout_ PORDER_WINDOW Window
+)
+{
+    OS_LOCK_STATE lockState;
+
+    OsLockAcquire(&(Window->FetchLock), &lockState);
+    while ((ULONG64)(Window->NextTicket - ReadAcquire64(&(Window->NextToRun))) < Window->Depth) {
+        PVOID item = Window->Fetch(Window->Context);
+        if (item == NULL) {
+            break;
+        }
+        WritePointerRelease(&(Window->Slots[OW_SLOT(Window->NextTicket)]), item);
+        WriteNoFence64(&(Window->NextTicket), Window->NextTicket + 1);
+    }
+    OsLockRelease(&(Window->FetchLock), &lockState);
+}
+
+
+VOID
+OwPump(
+    _Inout_ PORDER_WINDOW Window
+)
+{
+    _OwFill(Window);
+
+    for (;;) {
+        if (InterlockedCompareExchange(&(Window->bRunning), 1, 0) != 0) {
+            return;     // the running thread will get to it
+        }
+
+        LONG64 next = Window->NextToRun;
+        for (;;) {
+            PVOID item = ReadPointerAcquire(&(Window->Slots[OW_SLOT(next)]));
+            if (item == NULL) {
+                // running freed up room; take what waits for it
+                _OwFill(Window);
+                item = ReadPointerAcquire(&(Window->Slots[OW_SLOT(next)]));
+                if (item == NULL) {
+                    break;
+                }
+            }
+            Window->Slots[OW_SLOT(next)] = NULL;
+            WriteRelease64(&(Window->NextToRun), ++next);
+            Window->Run(Window->Context, item);
+        }
+
+        InterlockedExchange(&(Window->bRunning), 0);
+
+        if (ReadPointerAcquire(&(Window->Slots[OW_SLOT(next)])) == NULL) {
+            return;
+        }
+    }
+}
@@ -0,0 +1,101 @@
+/*++
+
+Module Name:
+
+OrderWindow.h
+
+Abstract:
+
+    In-flight window for an endpoint whose items (URBs) are handled on
+    several threads: items are run strictly one at a time, in the order
+    they entered, so whatever they do to the endpoint's state (a data
+    stream, a sink, a FIFO they park in) happens in USB order. Transfers
+    completed while running, and transfers parked in a FIFO and completed
+    later, therefore complete in order too.
+
+    The window takes items itself, from a Fetch callback that hands them
+    out in arrival order (e.g. a manual queue), and gives each its ticket
+    under the same lock: nothing between arrival and ticket can reorder
+    them. It takes no more than Depth items that have not run yet; the
+    rest wait wherever Fetch gets them from.
+
+    Nobody waits on anybody: an item taken while another thread is running
+    the window is left in its slot, and that thread runs it on its way out,
+    taking more from Fetch as room frees up.
+
+    This module is OS-neutral; see OsShim.h.
+
+--*/
+
+#pragma once
+
+#include "OsShim.h"
+
+EXTERN_C_START
+
+
+#define ORDER_WINDOW_SLOTS  64      // power of two, upper bound of Depth
+
+
+//
+// Next item in arrival order, or NULL if there is none (for now).
+// Called under the window's lock.
+//
+typedef PVOID (*PFN_ORDER_WINDOW_FETCH)(
+    _In_ PVOID Context
+);
+
+typedef VOID (*PFN_ORDER_WINDOW_RUN)(
+    _In_ PVOID Context,
+    _In_ PVOID Item
+);
+
+
+typedef struct _ORDER_WINDOW
+{
+    OS_LOCK              FetchLock;     // fetching and ticketing
+    volatile LONG64      NextTicket;    // advanced under FetchLock
+    volatile LONG64      NextToRun;     // advanced by the running thread only
+    volatile LONG        bRunning;
+    ULONG                Depth;
+    PFN_ORDER_WINDOW_FETCH Fetch;
+    PFN_ORDER_WINDOW_RUN Run;
+    PVOID                Context;
+    PVOID volatile       Slots[ORDER_WINDOW_SLOTS];
+} ORDER_WINDOW, *PORDER_WINDOW;
+
+
+NTSTATUS
+OwInit(
+    _Out_ PORDER_WINDOW Window,
+    _In_  ULONG Depth,              // 1..ORDER_WINDOW_SLOTS
+    _In_  PFN_ORDER_WINDOW_FETCH Fetch,
+    _In_  PFN_ORDER_WINDOW_RUN Run,
+    _In_  PVOID Context
+);
+
+//
+// Takes whatever Fetch has, as far as the window has room, and runs
+// whatever is runnable, unless another thread is already doing so. Call it
+// whenever Fetch may have something new. Run may be called for items taken
+// by other threads.
+//
+VOID
+OwPump(
+    _Inout_ PORDER_WINDOW Window
+);
+
+//
+// Items taken and not run yet; a snapshot.
+//
+FORCEINLINE
+ULONG
+OwBacklog(
+    _In_ PORDER_WINDOW Window
+)
+{
+    return (ULONG)(ReadNoFence64(&(Window->NextTicket)) - ReadAcquire64(&(Window->NextToRun)));
+}
+
+
+EXTERN_C_END
@@ -0,0 +1,312 @@
+/*++
+
+Module Name:
+
+OsShim.h
+
+Abstract:
+
+    Minimal OS abstraction for the portable (WDF-free) parts of the driver.
+
+    Kernel builds map everything straight onto the NT primitives.
+    Any other build (e.g. a Linux user-space harness) gets the same names
+    implemented on top of the GCC/Clang __atomic builtins and libc, so
+    portable modules can be compiled and exercised outside the WDK.
+
+    Only what the portable modules actually use lives here. Keep it small.
+
+    I/O requests are opaque to portable modules (OS_REQUEST); whatever they
+    need to do with one goes through callbacks supplied by the driver.
+
+Environment:
+
+    Kernel-mode Driver Framework, or any C11 user-mode POSIX environment
+
+--*/
+
+#pragma once
+
+#if defined(_KERNEL_MODE)
+
+#include <ntddk.h>
+
+#define UDEFX_OS_POOL_TAG 'QEDU'
+
+//
+// Portable modules allocate from non-paged pool, since they are called
+// from URB completion paths that can run at DISPATCH_LEVEL.
+//
+FORCEINLINE
+PVOID
+OsAllocate(
+    _In_ SIZE_T Size
+)
+{
+    return ExAllocatePool2(POOL_FLAG_NON_PAGED, Size, UDEFX_OS_POOL_TAG);
+}
+
+FORCEINLINE
+VOID
+OsFree(
+    _In_ PVOID Ptr
+)
+{
+    ExFreePoolWithTag(Ptr, UDEFX_OS_POOL_TAG);
+}
+
+//
+// The lock-free structures spin briefly while a peer publishes a slot it has
+// already reserved. The publisher must not be preempted in that window, so
+// the window runs at DISPATCH_LEVEL.
+//
+typedef KIRQL OS_NO_PREEMPT_STATE;
+
+#define OsEnterNoPreempt(__pState)  KeRaiseIrql(DISPATCH_LEVEL, (__pState))
+#define OsLeaveNoPreempt(__pState)  KeLowerIrql(*(__pState))
+
+#define OsCpuRelax()                YieldProcessor()
+
+//
+// Short, non-nesting spin lock. Held at DISPATCH_LEVEL.
+//
+typedef KSPIN_LOCK OS_LOCK, *POS_LOCK;
+typedef KIRQL OS_LOCK_STATE;
+
+#define OsLockInit(__pLock)                 KeInitializeSpinLock(__pLock)
+#define OsLockAcquire(__pLock, __pState)    KeAcquireSpinLock((__pLock), (__pState))
+#define OsLockRelease(__pLock, __pState)    KeReleaseSpinLock((__pLock), *(__pState))
+
+//
+// An I/O request; a WDFREQUEST in the driver.
+//
+typedef PVOID OS_REQUEST;
+
+//
+// Timestamps for latency statistics, in OsTimestampFrequency() ticks per second.
+//
+#define OsTimestamp()               ((ULONG64)KeQueryPerformanceCounter(NULL).QuadPart)
+
+FORCEINLINE
+ULONG64
+OsTimestampFrequency(
+    VOID
+)
+{
+    LARGE_INTEGER frequency;
+    (VOID)KeQueryPerformanceCounter(&frequency);
+    return (ULONG64)frequency.QuadPart;
+}
+
+//
+// The processor the caller runs on; stable while preemption is disabled.
+//
+#define OsCurrentCpu()              KeGetCurrentProcessorNumberEx(NULL)
+
+//
+// Ordering for data published with plain stores: OsReleaseFence keeps what
+// comes before it ahead of any later store, OsAcquireFence keeps what comes
+// after it behind any earlier load. Free on x86/x64.
+//
+#if defined(_M_ARM64) || defined(_M_ARM)
+#define OsReleaseFence()            __dmb(_ARM64_BARRIER_ISH)
+#define OsAcquireFence()            __dmb(_ARM64_BARRIER_ISHLD)
+#else
+#define OsReleaseFence()            KeMemoryBarrierWithoutFence()
+#define OsAcquireFence()            KeMemoryBarrierWithoutFence()
+#endif
+
+//
+// Index of the most significant bit set; Value must not be 0.
+//
+FORCEINLINE
+ULONG
+OsHighestBit64(
+    _In_ ULONG64 Value
+)
+{
+    ULONG index;
+    (VOID)_BitScanReverse64(&index, Value);
+    return index;
+}
+
+#else  // user mode, non-Windows
+
+// clock_gettime and CLOCK_MONOTONIC are POSIX, not C11; this header must
+// come before any libc include for it to take effect
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 199309L
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef void                VOID, *PVOID;
+typedef unsigned char       UCHAR, *PUCHAR;
+typedef unsigned char       BOOLEAN, *PBOOLEAN;
+typedef unsigned short      USHORT, *PUSHORT;
+typedef int32_t             LONG, *PLONG;
+typedef uint32_t            ULONG, *PULONG;
+typedef int64_t             LONG64, *PLONG64;
+typedef uint64_t            ULONG64, *PULONG64;
+typedef uintptr_t           ULONG_PTR;
+typedef size_t              SIZE_T, *PSIZE_T;
+typedef LONG                NTSTATUS;
+
+#define TRUE  1
+#define FALSE 0
+
+#define STATUS_SUCCESS                  ((NTSTATUS)0x00000000L)
+#define STATUS_PENDING                  ((NTSTATUS)0x00000103L)
+#define STATUS_UNSUCCESSFUL             ((NTSTATUS)0xC0000001L)
+#define STATUS_INVALID_PARAMETER        ((NTSTATUS)0xC000000DL)
+#define STATUS_INSUFFICIENT_RESOURCES   ((NTSTATUS)0xC000009AL)
+#define STATUS_NOT_SUPPORTED            ((NTSTATUS)0xC00000BBL)
+#define STATUS_CANCELLED                ((NTSTATUS)0xC0000120L)
+#define NT_SUCCESS(__s)                 (((NTSTATUS)(__s)) >= 0)
+
+#define _In_
+#define _In_opt_
+#define _Out_
+#define _Out_opt_
+#define _Inout_
+#define _Inout_opt_
+#define _In_reads_(__n)
+#define _In_reads_bytes_(__n)
+#define _In_reads_bytes_opt_(__n)
+#define _Out_writes_(__n)
+#define _Out_writes_bytes_(__n)
+#define _Out_writes_bytes_to_opt_(__n, __c)
+#define _Out_writes_to_(__n, __c)
+#define _Out_writes_bytes_to_(__n, __c)
+#define _Inout_updates_bytes_(__n)
+#define _Inout_updates_bytes_opt_(__n)
+#define _Inout_updates_bytes_to_opt_(__n, __c)
+
+#define FORCEINLINE                 static inline __attribute__((always_inline))
+#define UNREFERENCED_PARAMETER(__p) ((void)(__p))
+#define C_ASSERT(__e)               _Static_assert((__e), #__e)
+#define NT_ASSERT(__e)              ((void)0)
+#define NT_VERIFY(__e)              ((void)(__e))
+#define CONTAINING_RECORD(__addr, __type, __field) \
+    ((__type *)((char *)(__addr) - offsetof(__type, __field)))
+
+#ifndef EXTERN_C_START
+#ifdef __cplusplus
+#define EXTERN_C_START extern "C" {
+#define EXTERN_C_END   }
+#else
+#define EXTERN_C_START
+#define EXTERN_C_END
+#endif
+#endif
+
+#define InterlockedIncrement(__p)                     __atomic_add_fetch((__p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedDecrement(__p)                     __atomic_sub_fetch((__p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd(__p, __v)              __atomic_fetch_add((__p), (__v), __ATOMIC_SEQ_CST)
+#define InterlockedIncrement64(__p)                   __atomic_add_fetch((__p), 1, __ATOMIC_SEQ_CST)
+#define InterlockedExchangeAdd64(__p, __v)            __atomic_fetch_add((__p), (__v), __ATOMIC_SEQ_CST)
+#define InterlockedAdd(__p, __v)                      __atomic_add_fetch((__p), (__v), __ATOMIC_SEQ_CST)
+#define InterlockedAdd64(__p, __v)                    __atomic_add_fetch((__p), (__v), __ATOMIC_SEQ_CST)
+#define InterlockedExchange(__p, __v)                 __atomic_exchange_n((__p), (__v), __ATOMIC_SEQ_CST)
+#define InterlockedExchange64(__p, __v)               __atomic_exchange_n((__p), (__v), __ATOMIC_SEQ_CST)
+#define InterlockedExchangePointer(__p, __v)          __atomic_exchange_n((__p), (__v), __ATOMIC_SEQ_CST)
+
+FORCEINLINE LONG
+InterlockedCompareExchange(volatile LONG *Dest, LONG Exchange, LONG Comparand)
+{
+    __atomic_compare_exchange_n(Dest, &Comparand, Exchange, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comparand;
+}
+
+FORCEINLINE LONG64
+InterlockedCompareExchange64(volatile LONG64 *Dest, LONG64 Exchange, LONG64 Comparand)
+{
+    __atomic_compare_exchange_n(Dest, &Comparand, Exchange, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comparand;
+}
+
+FORCEINLINE PVOID
+InterlockedCompareExchangePointer(PVOID volatile *Dest, PVOID Exchange, PVOID Comparand)
+{
+    __atomic_compare_exchange_n(Dest, &Comparand, Exchange, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return Comparand;
+}
+
+#define ReadNoFence(__p)              __atomic_load_n((__p), __ATOMIC_RELAXED)
+#define ReadAcquire(__p)              __atomic_load_n((__p), __ATOMIC_ACQUIRE)
+#define WriteRelease(__p, __v)        __atomic_store_n((__p), (__v), __ATOMIC_RELEASE)
+#define WriteNoFence(__p, __v)        __atomic_store_n((__p), (__v), __ATOMIC_RELAXED)
+#define ReadNoFence64(__p)            __atomic_load_n((__p), __ATOMIC_RELAXED)
+#define ReadAcquire64(__p)            __atomic_load_n((__p), __ATOMIC_ACQUIRE)
+#define WriteRelease64(__p, __v)      __atomic_store_n((__p), (__v), __ATOMIC_RELEASE)
+#define WriteNoFence64(__p, __v)      __atomic_store_n((__p), (__v), __ATOMIC_RELAXED)
+#define ReadPointerAcquire(__p)       __atomic_load_n((__p), __ATOMIC_ACQUIRE)
+#define WritePointerRelease(__p, __v) __atomic_store_n((__p), (__v), __ATOMIC_RELEASE)
+
+#define OsAllocate(__size)  calloc(1, (__size))
+#define OsFree(__ptr)       free(__ptr)
+
+typedef int OS_NO_PREEMPT_STATE;
+
+#define OsEnterNoPreempt(__pState)  ((void)(__pState))
+#define OsLeaveNoPreempt(__pState)  ((void)(__pState))
+
+#if defined(__x86_64__) || defined(__i386__)
+#define OsCpuRelax()  __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define OsCpuRelax()  __asm__ __volatile__("yield")
+#else
+#define OsCpuRelax()  ((void)0)
+#endif
+
+FORCEINLINE ULONG64
+OsTimestamp(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((ULONG64)ts.tv_sec * 1000000000ull) + (ULONG64)ts.tv_nsec;
+}
+
+#define OsTimestampFrequency()      1000000000ull
+
+#define OsHighestBit64(__v)         ((ULONG)(63 - __builtin_clzll(__v)))
+
+// threads are not pinned here, so each one gets a number of its own instead
+FORCEINLINE ULONG
+OsCurrentCpu(void)
+{
+    static volatile LONG next;
+    static __thread LONG self = -1;
+
+    if (self < 0) {
+        self = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED);
+    }
+    return (ULONG)self;
+}
+
+#define OsReleaseFence()            __atomic_thread_fence(__ATOMIC_RELEASE)
+#define OsAcquireFence()            __atomic_thread_fence(__ATOMIC_ACQUIRE)
+
+typedef volatile LONG OS_LOCK, *POS_LOCK;
+typedef int OS_LOCK_STATE;
+
+#define OsLockInit(__pLock)         __atomic_store_n((__pLock), 0, __ATOMIC_RELAXED)
+
+FORCEINLINE void
+OsLockAcquire(POS_LOCK Lock, OS_LOCK_STATE *State)
+{
+    (void)State;
+    while (__atomic_exchange_n(Lock, 1, __ATOMIC_ACQUIRE) != 0) {
+        OsCpuRelax();
+    }
+}
+
+#define OsLockRelease(__pLock, __pState) \
+    ((void)(__pState), __atomic_store_n((__pLock), 0, __ATOMIC_RELEASE))
+
+typedef void *OS_REQUEST;
+
+#endif // _KERNEL_MODE
@@ -0,0 +1,333 @@
+/*++
+
+Module Name:
+
+Pattern.c
+
+Abstract:
+
+    Implementation of the test pattern generator declared in Pattern.h.
+
+    Zeros and Mod63 are plain memset/memcpy, which are vectorized already.
+    Counter and Random have a 16-byte vector loop each; PRBS-31 is serial
+    by nature, and is produced 24 bits at a time instead.
+
+--*/
+
+#include "Pattern.h"
+
+#if defined(PATTERN_SIMD_SSE2)
+#include <emmintrin.h>
+#elif defined(PATTERN_SIMD_NEON)
+#include <arm_neon.h>
+#endif
+
+
+#define PRBS31_MASK 0x7FFFFFFFUL
+
+
+
+static ULONG64
+_PatternSplitMix(
+    _Inout_ PULONG64 State
+)
+{
+    ULONG64 z = (*State += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+
+static VOID
+_PatternStoreWord(
+    _Out_writes_bytes_(4) PUCHAR Buffer,
+    _In_ ULONG Word
+)
+{
+    Buffer[0] = (UCHAR)Word;
+    Buffer[1] = (UCHAR)(Word >> 8);
+    Buffer[2] = (UCHAR)(Word >> 16);
+    Buffer[3] = (UCHAR)(Word >> 24);
+}
+
+
+
+static VOID
+_PatternCounter(
+    _Inout_ PPATTERN_GENERATOR Gen,
+    _Out_writes_bytes_(Length) PUCHAR Buffer,
+    _In_    SIZE_T Length
+)
+{
+    ULONG64 offset = Gen->Offset;
+
+    // finish a word the previous fill stopped in the middle of
+    while ((Length > 0) && ((offset & 3) != 0)) {
+        *Buffer++ = (UCHAR)((ULONG)(offset >> 2) >> ((offset & 3) * 8));
+        ++offset;
+        --Length;
+    }
+
+    ULONG word = (ULONG)(offset >> 2);
+
+#if defined(PATTERN_SIMD_SSE2)
+    if (Gen->bUseSimd) {
+        __m128i v = _mm_setr_epi32((int)word, (int)(word + 1), (int)(word + 2), (int)(word + 3));
+        const __m128i step = _mm_set1_epi32(4);
+
+        for (; Length >= 16; Length -= 16, Buffer += 16) {
+            _mm_storeu_si128((__m128i *)Buffer, v);
+            v = _mm_add_epi32(v, step);
+        }
+        word = (ULONG)_mm_cvtsi128_si32(v);
+    }
+#elif defined(PATTERN_SIMD_NEON)
+    if (Gen->bUseSimd) {
+        const ULONG start[4] = { word, word + 1, word + 2, word + 3 };
+        uint32x4_t v = vld1q_u32(start);
+        const uint32x4_t step = vdupq_n_u32(4);
+
+        for (; Length >= 16; Length -= 16, Buffer += 16) {
+            vst1q_u8(Buffer, vreinterpretq_u8_u32(v));
+            v = vaddq_u32(v, step);
+        }
+        word = vgetq_lane_u32(v, 0);
+    }
+#endif
+
+    for (; Length >= 4; Length -= 4, Buffer += 4) {
+        _PatternStoreWord(Buffer, word++);
+    }
+
+    // the start of a word, the next fill finishes it
+    for (ULONG i = 0; i < Length; ++i) {
+        Buffer[i] = (UCHAR)(word >> (i * 8));
+    }
+}
+
+
+
+static VOID
+_PatternMod63(
+    _Inout_ PPATTERN_GENERATOR Gen,
+    _Out_writes_bytes_(Length) PUCHAR Buffer,
+    _In_    SIZE_T Length
+)
+{
+    SIZE_T pos = (SIZE_T)(Gen->Offset % Gen->PacketSize);
+
+    while (Length > 0) {
+        SIZE_T chunk = Gen->PacketSize - pos;
+        if (chunk > Length) {
+            chunk = Length;
+        }
+        memcpy(Buffer, &(Gen->Mod63[pos]), chunk);
+        Buffer += chunk;
+        Length -= chunk;
+        pos = 0;
+    }
+}
+
+
+
+static VOID
+_PatternPrbs31(
+    _Inout_ PPATTERN_GENERATOR Gen,
+    _Out_writes_bytes_(Length) PUCHAR Buffer,
+    _In_    SIZE_T Length
+)
+{
+    ULONG s = Gen->Prbs;
+
+    //
+    // Bit 0 of s is the latest bit out. The next bit is s[30] ^ s[27], and
+    // the 24 after it depend on s alone, so they come out in one go.
+    //
+    for (; Length >= 3; Length -= 3, Buffer += 3) {
+        ULONG t = ((s >> 7) ^ (s >> 4)) & 0xFFFFFF;
+        Buffer[0] = (UCHAR)(t >> 16);
+        Buffer[1] = (UCHAR)(t >> 8);
+        Buffer[2] = (UCHAR)t;
+        s = ((s << 24) | t) & PRBS31_MASK;
+    }
+
+    for (; Length > 0; --Length, ++Buffer) {
+        ULONG t = ((s >> 23) ^ (s >> 20)) & 0xFF;
+        *Buffer = (UCHAR)t;
+        s = ((s << 8) | t) & PRBS31_MASK;
+    }
+
+    Gen->Prbs = s;
+}
+
+
+
+//
+// Blocks of 16 bytes, one word of each xorshift32 lane.
+//
+static VOID
+_PatternRandomBlocks(
+    _Inout_ PPATTERN_GENERATOR Gen,
+    _Out_writes_bytes_(Blocks * 16) PUCHAR Buffer,
+    _In_    SIZE_T Blocks
+)
+{
+#if defined(PATTERN_SIMD_SSE2)
+    if (Gen->bUseSimd) {
+        __m128i s = _mm_loadu_si128((const __m128i *)Gen->Rng);
+
+        for (; Blocks > 0; --Blocks, Buffer += 16) {
+            s = _mm_xor_si128(s, _mm_slli_epi32(s, 13));
+            s = _mm_xor_si128(s, _mm_srli_epi32(s, 17));
+            s = _mm_xor_si128(s, _mm_slli_epi32(s, 5));
+            _mm_storeu_si128((__m128i *)Buffer, s);
+        }
+        _mm_storeu_si128((__m128i *)Gen->Rng, s);
+        return;
+    }
+#elif defined(PATTERN_SIMD_NEON)
+    if (Gen->bUseSimd) {
+        uint32x4_t s = vld1q_u32(Gen->Rng);
+
+        for (; Blocks > 0; --Blocks, Buffer += 16) {
+            s = veorq_u32(s, vshlq_n_u32(s, 13));
+            s = veorq_u32(s, vshrq_n_u32(s, 17));
+            s = veorq_u32(s, vshlq_n_u32(s, 5));
+            vst1q_u8(Buffer, vreinterpretq_u8_u32(s));
+        }
+        vst1q_u32(Gen->Rng, s);
+        return;
+    }
+#endif
+
+    for (; Blocks > 0; --Blocks, Buffer += 16) {
+        for (ULONG lane = 0; lane < 4; ++lane) {
+            ULONG x = Gen->Rng[lane];
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            Gen->Rng[lane] = x;
+            _PatternStoreWord(Buffer + (lane * 4), x);
+        }
+    }
+}
+
+
+static VOID
+_PatternRandom(
+    _Inout_ PPATTERN_GENERATOR Gen,
+    _Out_writes_bytes_(Length) PUCHAR Buffer,
+    _In_    SIZE_T Length
+)
+{
+    SIZE_T chunk;
+
+    // what is left of the block the previous fill cut short
+    chunk = (Gen->CarryLength < Length) ? Gen->CarryLength : Length;
+    memcpy(Buffer, &(Gen->Carry[sizeof(Gen->Carry) - Gen->CarryLength]), chunk);
+    Gen->CarryLength -= (ULONG)chunk;
+    Buffer += chunk;
+    Length -= chunk;
+
+    _PatternRandomBlocks(Gen, Buffer, Length / 16);
+    Buffer += Length & ~(SIZE_T)15;
+    Length &= 15;
+
+    if (Length > 0) {
+        _PatternRandomBlocks(Gen, Gen->Carry, 1);
+        memcpy(Buffer, Gen->Carry, Length);
+        Gen->CarryLength = (ULONG)(sizeof(Gen->Carry) - Length);
+    }
+}
+
+
+
+NTSTATUS
+PatternInit(
+    _Out_ PPATTERN_GENERATOR Gen,
+    _In_  PATTERN_KIND Kind,
+    _In_  ULONG PacketSize,
+    _In_  ULONG64 Seed
+)
+{
+    if ((Kind < PatternZeros) || (Kind >= PatternKindMax) ||
+        (PacketSize == 0) || (PacketSize > PATTERN_MAX_PACKET)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    Gen->Kind = Kind;
+    Gen->PacketSize = PacketSize;
+    Gen->Seed = Seed;
+    Gen->bUseSimd = PATTERN_HAVE_SIMD;
+
+    for (ULONG i = 0; i < PacketSize; ++i) {
+        Gen->Mod63[i] = (UCHAR)(i % 63);
+    }
+
+    PatternReset(Gen);
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+PatternReset(
+    _Inout_ PPATTERN_GENERATOR Gen
+)
+{
+    ULONG64 mix = Gen->Seed;
+
+    Gen->Offset = 0;
+    Gen->CarryLength = 0;
+
+    Gen->Prbs = (ULONG)Gen->Seed & PRBS31_MASK;
+    if (Gen->Prbs == 0) {
+        Gen->Prbs = PRBS31_MASK;
+    }
+
+    for (ULONG lane = 0; lane < 4; ++lane) {
+        ULONG x;
+        do {
+            x = (ULONG)_PatternSplitMix(&mix);
+        } while (x == 0);   // xorshift's one fixed point
+        Gen->Rng[lane] = x;
+    }
+}
+
+
+VOID
+PatternFill(
+    _Inout_ PPATTERN_GENERATOR Gen,
+    _Out_writes_bytes_(Length) PUCHAR Buffer,
+    _In_    SIZE_T Length
+)
+{
+    switch (Gen->Kind)
+    {
+    case PatternZeros:
+        memset(Buffer, 0, Length);
+        break;
+
+    case PatternCounter:
+        _PatternCounter(Gen, Buffer, Length);
+        break;
+
+    case PatternMod63:
+        _PatternMod63(Gen, Buffer, Length);
+        break;
+
+    case PatternPrbs31:
+        _PatternPrbs31(Gen, Buffer, Length);
+        break;
+
+    case PatternRandom:
+        _PatternRandom(Gen, Buffer, Length);
+        break;
+
+    default:
+        NT_ASSERT(FALSE);
+        break;
+    }
+
+    Gen->Offset += Length;
+}
@@ -0,0 +1,111 @@
+/*++
+
+Module Name:
+
+Pattern.h
+
+Abstract:
+
+    Test pattern generator, the data source of the BULK IN endpoint when it
+    is not serving mission completions.
+
+    A generator produces one endless byte stream; each PatternFill call
+    carries on where the previous one stopped, so the host sees the same
+    bytes whatever its transfer sizes are (mod-63 excepted, see below).
+    The bulk of the work runs on 128-bit vectors (SSE2 on x64, NEON on
+    ARM64), both baseline on those targets, with a scalar path that
+    produces exactly the same bytes.
+
+    This module is OS-neutral; see OsShim.h.
+
+--*/
+
+#pragma once
+
+#include "OsShim.h"
+
+EXTERN_C_START
+
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define PATTERN_SIMD_SSE2   1
+#elif defined(_M_ARM64) || defined(__aarch64__)
+#define PATTERN_SIMD_NEON   1
+#endif
+
+#if defined(PATTERN_SIMD_SSE2) || defined(PATTERN_SIMD_NEON)
+#define PATTERN_HAVE_SIMD   TRUE
+#else
+#define PATTERN_HAVE_SIMD   FALSE
+#endif
+
+
+//
+// The patterns. Values match UDEFX2_PATTERN_xxx in Public.h, 0 being
+// "no pattern" there.
+//   Zeros:   all bytes 0.
+//   Counter: 32-bit little-endian words 0, 1, 2, ...
+//   Mod63:   byte i of each packet is i % 63, as Linux f_sourcesink sends
+//            (pattern=1); it restarts on every packet boundary, so it lines
+//            up with usbtest only if transfers are whole packets.
+//   Prbs31:  x^31 + x^28 + 1 LFSR, most significant bit of each byte first.
+//   Random:  four interleaved xorshift32 generators seeded from Seed, one
+//            32-bit little-endian word each in turn.
+//
+typedef enum _PATTERN_KIND
+{
+    PatternZeros = 1,
+    PatternCounter,
+    PatternMod63,
+    PatternPrbs31,
+    PatternRandom,
+    PatternKindMax
+} PATTERN_KIND;
+
+#define PATTERN_MAX_PACKET  1024
+
+
+typedef struct _PATTERN_GENERATOR
+{
+    PATTERN_KIND Kind;
+    ULONG   PacketSize;             // Mod63 restarts every PacketSize bytes
+    ULONG64 Seed;
+    ULONG64 Offset;                 // bytes produced so far
+    ULONG   Prbs;                   // LFSR, 31 bits, never 0
+    ULONG   Rng[4];                 // xorshift32 lanes
+    UCHAR   Carry[16];              // Random: rest of a block cut short by the last fill
+    ULONG   CarryLength;
+    BOOLEAN bUseSimd;               // PATTERN_HAVE_SIMD, may be cleared to compare
+    UCHAR   Mod63[PATTERN_MAX_PACKET]; // one packet's worth, copied from
+} PATTERN_GENERATOR, *PPATTERN_GENERATOR;
+
+
+//
+// Fails on an unknown Kind, or a PacketSize of 0 or above PATTERN_MAX_PACKET.
+// Seed is used by Prbs31 (low 31 bits, 0 meaning all ones) and Random.
+//
+NTSTATUS
+PatternInit(
+    _Out_ PPATTERN_GENERATOR Gen,
+    _In_  PATTERN_KIND Kind,
+    _In_  ULONG PacketSize,
+    _In_  ULONG64 Seed
+);
+
+//
+// Back to the start of the stream, same pattern and seed.
+//
+VOID
+PatternReset(
+    _Inout_ PPATTERN_GENERATOR Gen
+);
+
+VOID
+PatternFill(
+    _Inout_ PPATTERN_GENERATOR Gen,
+    _Out_writes_bytes_(Length) PUCHAR Buffer,
+    _In_    SIZE_T Length
+);
+
+
+EXTERN_C_END
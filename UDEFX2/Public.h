@@ -37,3 +37,387 @@ typedef DEVICE_INTR_FLAGS* PDEVICE_INTR_FLAGS;
                                                   IOCTL_INDEX_UDEFX2C + 5,     \
                                                   METHOD_BUFFERED,         \
                                                   FILE_READ_ACCESS)
+
+
+//
+// Depth and back-pressure counters of one write-to-read queue.
+// "Throttled" is the time spent at or above the high watermark, i.e. with
+// BULK OUT held off (NAKed) for the mission request queue.
+//
+typedef struct _WRQUEUE_STATS {
+    ULONG64 QueuedBytes;
+    ULONG64 PeakBytes;
+    ULONG   QueuedEntries;
+    ULONG   PeakEntries;
+    ULONG64 Refused;            // writes rejected at the hard limits
+    ULONG64 Throttles;          // times the high watermark was crossed
+    ULONG64 ThrottledTime;      // total, in 100ns units
+} WRQUEUE_STATS, *PWRQUEUE_STATS;
+
+typedef struct _UDEFX2_QUEUE_STATS {
+    WRQUEUE_STATS MissionRequest;     // BULK OUT -> back-channel reads
+    WRQUEUE_STATS MissionCompletion;  // back-channel writes -> BULK IN
+} UDEFX2_QUEUE_STATS, *PUDEFX2_QUEUE_STATS;
+
+#define IOCTL_UDEFX2_GET_QUEUE_STATS     CTL_CODE(FILE_DEVICE_UDEFX2C,     \
+                                                  IOCTL_INDEX_UDEFX2C + 6,     \
+                                                  METHOD_BUFFERED,         \
+                                                  FILE_READ_ACCESS)
+
+//
+// Input: a mission completion, delivered like a back-channel write but
+// ahead of the ones already queued (urgent priority lane).
+//
+#define IOCTL_UDEFX2_SEND_URGENT_COMPLETION  CTL_CODE(FILE_DEVICE_UDEFX2C,     \
+                                                  IOCTL_INDEX_UDEFX2C + 7,     \
+                                                  METHOD_BUFFERED,         \
+                                                  FILE_WRITE_ACCESS)
+
+
+//
+// Log-linear histogram: values 0..3 get a bucket each, then every power of
+// two is split in 4 equal buckets. Bucket i (i >= 4) starts at
+// (4 + (i % 4)) << (i / 4 - 1); the last bucket also takes anything larger.
+//
+#define WRQUEUE_HISTOGRAM_BUCKETS  128
+
+typedef struct _WRQUEUE_HISTOGRAM {
+    ULONG64 Count;
+    ULONG64 Sum;
+    ULONG64 Max;
+    ULONG64 Buckets[WRQUEUE_HISTOGRAM_BUCKETS];
+} WRQUEUE_HISTOGRAM, *PWRQUEUE_HISTOGRAM;
+
+//
+// Where the time goes in one write-to-read queue.
+// Residency times are in UDEFX2_QUEUE_PROFILE.TimestampFrequency ticks.
+//
+typedef struct _WRQUEUE_PROFILE {
+    WRQUEUE_HISTOGRAM WriteResidency;   // queued write, until its last byte is read
+    WRQUEUE_HISTOGRAM ReadResidency;    // parked read, until a write fills it
+    WRQUEUE_HISTOGRAM Depth;            // queued writes, sampled as each one is queued
+    ULONG64 WritesQueued;
+    ULONG64 ReadsParked;
+    ULONG64 MatchedOnWrite;             // parked reads filled by an incoming write
+    ULONG64 MatchedOnRead;              // incoming reads filled from queued writes
+    ULONG   PeakParkedReads;
+    ULONG   Reserved;
+} WRQUEUE_PROFILE, *PWRQUEUE_PROFILE;
+
+typedef struct _UDEFX2_QUEUE_PROFILE {
+    ULONG64 TimestampFrequency;         // ticks per second
+    WRQUEUE_PROFILE MissionRequest;
+    WRQUEUE_PROFILE MissionCompletion;
+} UDEFX2_QUEUE_PROFILE, *PUDEFX2_QUEUE_PROFILE;
+
+#define IOCTL_UDEFX2_GET_QUEUE_PROFILE   CTL_CODE(FILE_DEVICE_UDEFX2C,     \
+                                                  IOCTL_INDEX_UDEFX2C + 8,     \
+                                                  METHOD_BUFFERED,         \
+                                                  FILE_READ_ACCESS)
+
+
+//
+// Data source of the BULK IN endpoint. UDEFX2_PATTERN_NONE (the default)
+// serves mission completions from the back-channel; any other value makes
+// BULK IN reads complete right away with that pattern, as an endless
+// stream that restarts from the beginning on every IOCTL. See Pattern.h
+// for the exact byte layout of each pattern.
+//
+#define UDEFX2_PATTERN_NONE     0
+#define UDEFX2_PATTERN_ZEROS    1
+#define UDEFX2_PATTERN_COUNTER  2   // 32-bit little-endian words 0, 1, 2...
+#define UDEFX2_PATTERN_MOD63    3   // Linux f_sourcesink pattern=1
+#define UDEFX2_PATTERN_PRBS31   4
+#define UDEFX2_PATTERN_RANDOM   5
+#define UDEFX2_PATTERN_MAX      6
+
+typedef struct _UDEFX2_PATTERN_CONFIG {
+    ULONG   Pattern;            // UDEFX2_PATTERN_xxx
+    ULONG   Reserved;
+    ULONG64 Seed;               // PRBS31 and RANDOM
+} UDEFX2_PATTERN_CONFIG, *PUDEFX2_PATTERN_CONFIG;
+
+#define IOCTL_UDEFX2_SET_BULK_IN_PATTERN CTL_CODE(FILE_DEVICE_UDEFX2C,     \
+                                                  IOCTL_INDEX_UDEFX2C + 9,     \
+                                                  METHOD_BUFFERED,         \
+                                                  FILE_WRITE_ACCESS)
+
+
+//
+// What the BULK OUT endpoint does with host writes. UDEFX2_SINK_NONE (the
+// default) queues them as mission requests for the back-channel; the other
+// modes drop them right away, after checking them:
+//   DISCARD  counts only
+//   PATTERN  expects the BULK IN stream of the given Pattern and Seed
+//            (see UDEFX2_PATTERN_xxx), continued across transfers
+//   CRC32C   expects every transfer to end with the little-endian CRC-32C
+//            of the bytes before it
+// Setting a mode restarts the stream and zeroes the counters.
+//
+#define UDEFX2_SINK_NONE        0
+#define UDEFX2_SINK_DISCARD     1
+#define UDEFX2_SINK_PATTERN     2
+#define UDEFX2_SINK_CRC32C      3
+#define UDEFX2_SINK_MAX         4
+
+typedef struct _UDEFX2_SINK_CONFIG {
+    ULONG   Mode;               // UDEFX2_SINK_xxx
+    ULONG   Pattern;            // UDEFX2_PATTERN_xxx, PATTERN mode
+    ULONG64 Seed;
+} UDEFX2_SINK_CONFIG, *PUDEFX2_SINK_CONFIG;
+
+#define IOCTL_UDEFX2_SET_BULK_OUT_SINK   CTL_CODE(FILE_DEVICE_UDEFX2C,     \
+                                                  IOCTL_INDEX_UDEFX2C + 10,    \
+                                                  METHOD_BUFFERED,         \
+                                                  FILE_WRITE_ACCESS)
+
+//
+// A transfer that does not check out is one error. FirstErrorOffset is
+// where the first one went wrong, counting from the start of the stream:
+// the first bad byte in PATTERN mode, the start of the transfer in CRC32C
+// mode; all ones while there is no error.
+//
+typedef struct _UDEFX2_SINK_STATS {
+    ULONG   Mode;
+    ULONG   Reserved;
+    ULONG64 Bytes;
+    ULONG64 Transfers;
+    ULONG64 Errors;
+    ULONG64 FirstErrorOffset;
+} UDEFX2_SINK_STATS, *PUDEFX2_SINK_STATS;
+
+#define IOCTL_UDEFX2_GET_SINK_STATS      CTL_CODE(FILE_DEVICE_UDEFX2C,     \
+                                                  IOCTL_INDEX_UDEFX2C + 11,    \
+                                                  METHOD_BUFFERED,         \
+                                                  FILE_READ_ACCESS)
+
+
+//
+// INTERRUPT IN event queue. Every event raised gets a sequence number;
+// those raised while Capacity events were already pending are dropped and
+// counted as overflows. Latency is from IOCTL_UDEFX2_GENERATE_INTERRUPT to
+// the completion of the URB carrying the event, in TimestampFrequency ticks.
+//
+typedef struct _UDEFX2_INTERRUPT_STATS {
+    ULONG64 TimestampFrequency;         // ticks per second
+    ULONG64 Raised;
+    ULONG64 Delivered;
+    ULONG64 Overflows;
+    ULONG64 Transfers;                  // INTERRUPT IN URBs completed with events
+    ULONG   Pending;
+    ULONG   Capacity;
+    ULONG   MaxDelayUs;                 // current UDEFX2_INTERRUPT_MODERATION
+    ULONG   MaxBatch;
+    WRQUEUE_HISTOGRAM Latency;
+} UDEFX2_INTERRUPT_STATS, *PUDEFX2_INTERRUPT_STATS;
+
+#define IOCTL_UDEFX2_GET_INTERRUPT_STATS CTL_CODE(FILE_DEVICE_UDEFX2C,     \
+                                                  IOCTL_INDEX_UDEFX2C + 12,    \
+                                                  METHOD_BUFFERED,         \
+                                                  FILE_READ_ACCESS)
+
+
+//
+// Interrupt moderation: raised events are held until MaxBatch of them are
+// pending, or the oldest has waited MaxDelayUs microseconds; then they are
+// all delivered together. MaxBatch 1 or MaxDelayUs 0 (the default) delivers
+// every event as soon as there is a URB for it.
+//
+#define UDEFX2_MODERATION_MAX_DELAY_US  1000000
+
+typedef struct _UDEFX2_INTERRUPT_MODERATION {
+    ULONG   MaxDelayUs;         // up to UDEFX2_MODERATION_MAX_DELAY_US
+    ULONG   MaxBatch;           // 1 up to the event queue capacity
+} UDEFX2_INTERRUPT_MODERATION, *PUDEFX2_INTERRUPT_MODERATION;
+
+#define IOCTL_UDEFX2_SET_INTERRUPT_MODERATION CTL_CODE(FILE_DEVICE_UDEFX2C, \
+                                                  IOCTL_INDEX_UDEFX2C + 13,    \
+                                                  METHOD_BUFFERED,         \
+                                                  FILE_WRITE_ACCESS)
+
+
+//
+// URB flight recorder: the last URBs each processor handled, one record
+// per completion, or per URB kept pending. Records come ring by ring, and
+// oldest first within a ring; sort on Timestamp for a single timeline.
+// Recorded - Count records were lost to wrap-around (or did not fit).
+//
+#define UDEFX2_FLIGHT_DUMP_VERSION      1
+
+#define UDEFX2_FLIGHT_EVENT_COMPLETE    1   // Length: bytes transferred
+#define UDEFX2_FLIGHT_EVENT_PEND        2   // Length: buffer size
+
+typedef struct _UDEFX2_FLIGHT_RECORD {
+    ULONG64 Timestamp;          // TimestampFrequency ticks
+    ULONG64 RequestId;          // the URB's request handle
+    ULONG   Length;
+    LONG    Status;             // NTSTATUS
+    UCHAR   Endpoint;           // address
+    UCHAR   Event;              // UDEFX2_FLIGHT_EVENT_xxx
+    USHORT  Ring;               // processor, modulo Rings
+    ULONG   Sequence;           // within the ring
+} UDEFX2_FLIGHT_RECORD, *PUDEFX2_FLIGHT_RECORD;
+
+typedef struct _UDEFX2_FLIGHT_DUMP {
+    ULONG   Version;            // UDEFX2_FLIGHT_DUMP_VERSION
+    ULONG   RecordSize;
+    ULONG   Rings;
+    ULONG   Count;              // records that follow
+    ULONG64 TimestampFrequency; // ticks per second
+    ULONG64 Recorded;           // ever, across all rings
+    UDEFX2_FLIGHT_RECORD Records[1];    // as many as the output buffer holds
+} UDEFX2_FLIGHT_DUMP, *PUDEFX2_FLIGHT_DUMP;
+
+#define IOCTL_UDEFX2_DUMP_FLIGHT_RECORDER CTL_CODE(FILE_DEVICE_UDEFX2C,    \
+                                                  IOCTL_INDEX_UDEFX2C + 14,    \
+                                                  METHOD_BUFFERED,         \
+                                                  FILE_READ_ACCESS)
+
+
+//
+// BULK OUT to BULK IN loopback, on the first bulk pair: every BULK OUT
+// transfer goes back out as BULK IN data, without the back-channel. It is
+// copied straight into a waiting BULK IN URB that can take it all, and
+// otherwise kept in a ring inside the driver; a BULK IN URB shorter than
+// a transfer gets the start of it, and the next one the rest. Transfers
+// larger than UDEFX2_LOOPBACK_MAX_TRANSFER fail. The sink and pattern
+// modes, when set, come first.
+// Switching the loopback off fails the URBs it holds, and drops its data;
+// switching it on zeroes the counters.
+//
+#define UDEFX2_LOOPBACK_MAX_TRANSFER    ((128 * 1024) - 8)
+
+typedef struct _UDEFX2_LOOPBACK_CONFIG {
+    ULONG   Enable;             // 0 or 1
+    ULONG   Reserved;
+} UDEFX2_LOOPBACK_CONFIG, *PUDEFX2_LOOPBACK_CONFIG;
+
+#define IOCTL_UDEFX2_SET_LOOPBACK        CTL_CODE(FILE_DEVICE_UDEFX2C,     \
+                                                  IOCTL_INDEX_UDEFX2C + 15,    \
+                                                  METHOD_BUFFERED,         \
+                                                  FILE_WRITE_ACCESS)
+
+typedef struct _UDEFX2_LOOPBACK_STATS {
+    ULONG   Enabled;
+    ULONG   Reserved;
+    ULONG64 Transfers;          // BULK OUT transfers taken
+    ULONG64 Bytes;
+    ULONG64 Direct;             // of Transfers, copied straight into a BULK IN URB
+    ULONG64 Rejected;           // too large
+} UDEFX2_LOOPBACK_STATS, *PUDEFX2_LOOPBACK_STATS;
+
+#define IOCTL_UDEFX2_GET_LOOPBACK_STATS  CTL_CODE(FILE_DEVICE_UDEFX2C,     \
+                                                  IOCTL_INDEX_UDEFX2C + 16,    \
+                                                  METHOD_BUFFERED,         \
+                                                  FILE_READ_ACCESS)
+
+
+//
+// Isochronous pair (OUT 3, IN 0x83): each way, one packet per microframe,
+// run on a timer through a ring that starts with Prefill packets in it.
+// ISOCH IN sends the COUNTER pattern; ISOCH OUT data is dropped. A stream
+// starts with its first URB, and stops once the host has none left.
+//   Underruns  IN: host packets that went out empty;
+//              OUT: microframes with nothing to consume
+//   Overruns   packets dropped on a full ring
+//   Skipped    microframes given up on, the timer being too far behind
+// Lateness is how long after its microframe each one was run, in
+// TimestampFrequency ticks: the jitter of the schedule.
+//
+typedef struct _UDEFX2_ISOCH_STREAM_STATS {
+    ULONG64 Frames;
+    ULONG64 Packets;            // host packets
+    ULONG64 Bytes;
+    ULONG64 Underruns;
+    ULONG64 Overruns;
+    ULONG64 Skipped;
+    ULONG64 Transfers;          // URBs completed
+    WRQUEUE_HISTOGRAM Lateness;
+} UDEFX2_ISOCH_STREAM_STATS, *PUDEFX2_ISOCH_STREAM_STATS;
+
+typedef struct _UDEFX2_ISOCH_STATS {
+    ULONG64 TimestampFrequency;         // ticks per second
+    ULONG   Slots;                      // ring depth, in packets
+    ULONG   Prefill;
+    UDEFX2_ISOCH_STREAM_STATS Out;
+    UDEFX2_ISOCH_STREAM_STATS In;
+} UDEFX2_ISOCH_STATS, *PUDEFX2_ISOCH_STATS;
+
+#define IOCTL_UDEFX2_GET_ISOCH_STATS     CTL_CODE(FILE_DEVICE_UDEFX2C,     \
+                                                  IOCTL_INDEX_UDEFX2C + 17,    \
+                                                  METHOD_BUFFERED,         \
+                                                  FILE_READ_ACCESS)
+
+
+//
+// Missions the driver runs itself, on a pool of workers, instead of
+// passing them to the back-channel: a BULK OUT mission whose type (the
+// text up to the first ':') is one of these gets its response on BULK IN,
+// and then a completion interrupt of UDEFX2_MISSION_SUCCEEDED or
+// UDEFX2_MISSION_FAILED, straight from the driver.
+//   ping[:text]    responds with the mission text and "_response", as the
+//                  back-channel agent does
+//   crc32c:text    responds with "crc32c:" and the CRC-32C of text, in hex
+// Missions of other types go to the back-channel, as before. One longer
+// than UDEFX2_MISSION_MAX_LENGTH, or finding the queue full, fails its
+// BULK OUT transfer. Missions run in parallel, and complete in any order.
+// Wait and Latency are in TimestampFrequency ticks, from the mission's
+// BULK OUT transfer to its handler starting, and to its completion.
+//
+#define UDEFX2_MISSION_SUCCEEDED    10
+#define UDEFX2_MISSION_FAILED       12
+#define UDEFX2_MISSION_MAX_LENGTH   256
+
+typedef struct _UDEFX2_MISSION_STATS {
+    ULONG64 TimestampFrequency;         // ticks per second
+    ULONG   Workers;
+    ULONG   QueueDepth;
+    ULONG64 Submitted;
+    ULONG64 Completed;
+    ULONG64 Failed;
+    ULONG64 Passed;                     // to the back-channel
+    ULONG64 Rejected;
+    ULONG64 Dropped;                    // queued when the device went away
+    ULONG   PeakQueued;
+    ULONG   PeakBusy;                   // workers
+    WRQUEUE_HISTOGRAM Wait;
+    WRQUEUE_HISTOGRAM Latency;
+} UDEFX2_MISSION_STATS, *PUDEFX2_MISSION_STATS;
+
+#define IOCTL_UDEFX2_GET_MISSION_STATS   CTL_CODE(FILE_DEVICE_UDEFX2C,     \
+                                                  IOCTL_INDEX_UDEFX2C + 18,    \
+                                                  METHOD_BUFFERED,         \
+                                                  FILE_READ_ACCESS)
+
+
+//
+// The device's endpoints, as the driver registered them from the
+// configuration descriptor, with the requests each has dispatched.
+//   Mode           0 one URB at a time, 1 up to WindowDepth at a time, in order
+//   Flags          1 parks URBs (loopback, interrupt, isochronous)
+//                  2 stopped under back-channel back-pressure
+//   Urbs           transfers dispatched to the endpoint
+//   Other          any other request sent to its queue
+//
+#define UDEFX2_MAX_ENDPOINTS        32
+
+typedef struct _UDEFX2_ENDPOINT_SLOT_STATS {
+    UCHAR   Address;
+    UCHAR   Type;                       // USB_ENDPOINT_TYPE_xxx
+    UCHAR   Mode;
+    UCHAR   Flags;
+    ULONG   WindowDepth;
+    ULONG64 Urbs;
+    ULONG64 Other;
+} UDEFX2_ENDPOINT_SLOT_STATS, *PUDEFX2_ENDPOINT_SLOT_STATS;
+
+typedef struct _UDEFX2_ENDPOINT_STATS {
+    ULONG   Count;                      // of Endpoints filled in
+    ULONG   Reserved;
+    UDEFX2_ENDPOINT_SLOT_STATS Endpoints[UDEFX2_MAX_ENDPOINTS];
+} UDEFX2_ENDPOINT_STATS, *PUDEFX2_ENDPOINT_STATS;
+
+#define IOCTL_UDEFX2_GET_ENDPOINT_STATS  CTL_CODE(FILE_DEVICE_UDEFX2C,     \
+                                                  IOCTL_INDEX_UDEFX2C + 19,    \
+                                                  METHOD_BUFFERED,         \
+                                                  FILE_READ_ACCESS)
@@ -0,0 +1,154 @@
+/*++
+
+Module Name:
+
+Sink.c
+
+Abstract:
+
+    Implementation of the verifying data sink declared in Sink.h.
+
+--*/
+
+#include "Sink.h"
+
+
+
+static VOID
+_SinkRecordError(
+    _Inout_ PSINK Sink,
+    _In_    ULONG64 Offset
+)
+{
+    if (Sink->Stats.Errors++ == 0) {
+        Sink->Stats.FirstErrorOffset = (LONG64)Offset;
+    }
+}
+
+
+//
+// Compares against the expected stream. The generator is run over the whole
+// transfer even past a mismatch, so the following transfers stay in step.
+//
+static BOOLEAN
+_SinkCheckPattern(
+    _Inout_ PSINK Sink,
+    _In_reads_bytes_(Length) const UCHAR *Buffer,
+    _In_    SIZE_T Length
+)
+{
+    ULONG64 offset = Sink->Expected.Offset;
+    BOOLEAN bGood = TRUE;
+
+    while (Length > 0) {
+        SIZE_T chunk = (Length < SINK_CHUNK) ? Length : SINK_CHUNK;
+
+        PatternFill(&(Sink->Expected), Sink->Scratch, chunk);
+
+        if (bGood && (memcmp(Buffer, Sink->Scratch, chunk) != 0)) {
+            SIZE_T i = 0;
+            while (Buffer[i] == Sink->Scratch[i]) {
+                ++i;
+            }
+            _SinkRecordError(Sink, offset + i);
+            bGood = FALSE;
+        }
+
+        Buffer += chunk;
+        Length -= chunk;
+        offset += chunk;
+    }
+
+    return bGood;
+}
+
+
+static BOOLEAN
+_SinkCheckCrc(
+    _Inout_ PSINK Sink,
+    _In_reads_bytes_(Length) const UCHAR *Buffer,
+    _In_    SIZE_T Length
+)
+{
+    if (Length >= SINK_CRC_TRAILER) {
+        SIZE_T payload = Length - SINK_CRC_TRAILER;
+        const UCHAR *t = Buffer + payload;
+        ULONG trailer = (ULONG)t[0] | ((ULONG)t[1] << 8) | ((ULONG)t[2] << 16) | ((ULONG)t[3] << 24);
+
+        if (Crc32c(Buffer, payload) == trailer) {
+            return TRUE;
+        }
+    }
+
+    _SinkRecordError(Sink, (ULONG64)Sink->Stats.Bytes);
+    return FALSE;
+}
+
+
+
+NTSTATUS
+SinkInit(
+    _Out_ PSINK Sink,
+    _In_  SINK_MODE Mode,
+    _In_  PATTERN_KIND Kind,
+    _In_  ULONG PacketSize,
+    _In_  ULONG64 Seed
+)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+
+    Sink->Mode = Mode;
+    Sink->Stats.Bytes = 0;
+    Sink->Stats.Transfers = 0;
+    Sink->Stats.Errors = 0;
+    Sink->Stats.FirstErrorOffset = (LONG64)SINK_NO_ERROR;
+
+    switch (Mode)
+    {
+    case SinkDiscard:
+        break;
+
+    case SinkPattern:
+        status = PatternInit(&(Sink->Expected), Kind, PacketSize, Seed);
+        break;
+
+    case SinkCrc32c:
+        Crc32cInit();
+        break;
+
+    default:
+        status = STATUS_INVALID_PARAMETER;
+        break;
+    }
+
+    return status;
+}
+
+
+BOOLEAN
+SinkConsume(
+    _Inout_ PSINK Sink,
+    _In_reads_bytes_(Length) const UCHAR *Buffer,
+    _In_    SIZE_T Length
+)
+{
+    BOOLEAN bGood = TRUE;
+
+    switch (Sink->Mode)
+    {
+    case SinkPattern:
+        bGood = _SinkCheckPattern(Sink, Buffer, Length);
+        break;
+
+    case SinkCrc32c:
+        bGood = _SinkCheckCrc(Sink, Buffer, Length);
+        break;
+
+    default:
+        break;
+    }
+
+    Sink->Stats.Bytes += (LONG64)Length;
+    Sink->Stats.Transfers++;
+    return bGood;
+}
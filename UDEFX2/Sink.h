@@ -0,0 +1,96 @@
+/*++
+
+Module Name:
+
+Sink.h
+
+Abstract:
+
+    Verifying data sink, the BULK OUT counterpart of Pattern.h: checks
+    what the host writes, counts it, and drops it.
+
+      Discard: counts only.
+      Pattern: the data must be the stream a PATTERN_GENERATOR of the same
+               kind and seed would produce, carried on across transfers.
+      Crc32c:  each transfer ends with a 4-byte trailer, the little-endian
+               CRC-32C (see Crc32c.h) of the bytes before it.
+
+    A transfer that does not check out counts as one error; the first one
+    also records where it went wrong (the first bad byte for Pattern, the
+    start of the transfer for Crc32c), as an offset in the whole stream.
+
+    Checking runs as one pass over the data, a chunk at a time, so it keeps
+    up with the pipe. Calls on one sink must be serialized; the counters
+    may be read at any time.
+
+    This module is OS-neutral; see OsShim.h.
+
+--*/
+
+#pragma once
+
+#include "OsShim.h"
+#include "Pattern.h"
+#include "Crc32c.h"
+
+EXTERN_C_START
+
+
+typedef enum _SINK_MODE
+{
+    SinkDiscard = 1,
+    SinkPattern,
+    SinkCrc32c,
+    SinkModeMax
+} SINK_MODE;
+
+#define SINK_CRC_TRAILER    sizeof(ULONG)
+#define SINK_NO_ERROR       ((ULONG64)-1)   // FirstErrorOffset, until there is one
+
+// expected data is regenerated this many bytes at a time
+#define SINK_CHUNK          1024
+
+
+typedef struct _SINK_STATS
+{
+    volatile LONG64 Bytes;              // including CRC trailers
+    volatile LONG64 Transfers;
+    volatile LONG64 Errors;             // transfers that did not check out
+    volatile LONG64 FirstErrorOffset;   // SINK_NO_ERROR if none
+} SINK_STATS, *PSINK_STATS;
+
+
+typedef struct _SINK
+{
+    SINK_MODE         Mode;
+    SINK_STATS        Stats;
+    PATTERN_GENERATOR Expected;     // Pattern mode
+    UCHAR             Scratch[SINK_CHUNK];
+} SINK, *PSINK;
+
+
+//
+// Starts over with zeroed counters. Kind, PacketSize and Seed only matter
+// in Pattern mode, and are validated as PatternInit does.
+//
+NTSTATUS
+SinkInit(
+    _Out_ PSINK Sink,
+    _In_  SINK_MODE Mode,
+    _In_  PATTERN_KIND Kind,
+    _In_  ULONG PacketSize,
+    _In_  ULONG64 Seed
+);
+
+//
+// Returns FALSE if the transfer did not check out.
+//
+BOOLEAN
+SinkConsume(
+    _Inout_ PSINK Sink,
+    _In_reads_bytes_(Length) const UCHAR *Buffer,
+    _In_    SIZE_T Length
+);
+
+
+EXTERN_C_END
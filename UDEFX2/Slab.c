@@ -0,0 +1,147 @@
+/*++
+
+Module Name:
+
+Slab.c
+
+Abstract:
+
+    Implementation of the size-class slab cache declared in Slab.h.
+
+    Every block carries a small header in front of the caller's memory,
+    recording its size class, so SlabFree knows where the block goes back to.
+    The header is 16 bytes so the caller's memory keeps the OS alignment.
+
+--*/
+
+#include "Slab.h"
+
+
+#define SLAB_CLASS_OVERSIZED  ((ULONG)-1)
+
+typedef struct _SLAB_HEADER
+{
+    ULONG  SizeClass;
+    ULONG  Reserved;
+    ULONG64 Pad;
+} SLAB_HEADER, *PSLAB_HEADER;
+
+C_ASSERT(sizeof(SLAB_HEADER) == 16);
+
+
+static ULONG
+_SlabClassOf(
+    _In_ SIZE_T BlockSize
+)
+{
+    ULONG sizeClass = 0;
+    SIZE_T classSize = ((SIZE_T)1) << SLAB_MIN_CLASS_SHIFT;
+
+    while (classSize < BlockSize) {
+        classSize <<= 1;
+        ++sizeClass;
+        if (sizeClass >= SLAB_NUM_CLASSES) {
+            return SLAB_CLASS_OVERSIZED;
+        }
+    }
+    return sizeClass;
+}
+
+
+NTSTATUS
+SlabInit(
+    _Out_ PSLAB Slab
+)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG i;
+
+    memset(Slab, 0, sizeof(*Slab));
+
+    for (i = 0; i < SLAB_NUM_CLASSES; ++i) {
+        status = DqRingInit(&(Slab->FreeList[i]), SLAB_CLASS_DEPTH);
+        if (!NT_SUCCESS(status)) {
+            SlabDestroy(Slab);
+            break;
+        }
+    }
+
+    return status;
+}
+
+
+VOID
+SlabDestroy(
+    _Inout_ PSLAB Slab
+)
+{
+    ULONG i;
+
+    for (i = 0; i < SLAB_NUM_CLASSES; ++i) {
+        PVOID block;
+
+        if (Slab->FreeList[i].Cells == NULL) {
+            continue;
+        }
+        while ((block = DqRingTryPop(&(Slab->FreeList[i]))) != NULL) {
+            OsFree(block);
+        }
+        DqRingDestroy(&(Slab->FreeList[i]));
+    }
+}
+
+
+PVOID
+SlabAlloc(
+    _Inout_ PSLAB  Slab,
+    _In_    SIZE_T Size
+)
+{
+    PSLAB_HEADER header = NULL;
+    SIZE_T blockSize = Size + sizeof(SLAB_HEADER);
+
+    if (blockSize < Size) {
+        return NULL; // overflow
+    }
+
+    ULONG sizeClass = _SlabClassOf(blockSize);
+
+    if (sizeClass == SLAB_CLASS_OVERSIZED) {
+        InterlockedIncrement64(&(Slab->Stats.Oversized));
+    } else {
+        InterlockedIncrement64(&(Slab->Stats.Allocs));
+        header = (PSLAB_HEADER)DqRingTryPop(&(Slab->FreeList[sizeClass]));
+        if (header != NULL) {
+            InterlockedIncrement64(&(Slab->Stats.Recycled));
+            return (header + 1);
+        }
+        blockSize = ((SIZE_T)1) << (SLAB_MIN_CLASS_SHIFT + sizeClass);
+    }
+
+    header = (PSLAB_HEADER)OsAllocate(blockSize);
+    if (header == NULL) {
+        return NULL;
+    }
+
+    InterlockedIncrement64(&(Slab->Stats.OsAllocs));
+    header->SizeClass = sizeClass;
+    return (header + 1);
+}
+
+
+VOID
+SlabFree(
+    _Inout_ PSLAB Slab,
+    _In_    PVOID Ptr
+)
+{
+    PSLAB_HEADER header = ((PSLAB_HEADER)Ptr) - 1;
+
+    if ((header->SizeClass != SLAB_CLASS_OVERSIZED) &&
+        DqRingTryPush(&(Slab->FreeList[header->SizeClass]), header)) {
+        return;
+    }
+
+    InterlockedIncrement64(&(Slab->Stats.OsFrees));
+    OsFree(header);
+}
@@ -0,0 +1,79 @@
+/*++
+
+Module Name:
+
+Slab.h
+
+Abstract:
+
+    Size-class slab cache. Blocks are rounded up to a power-of-two size
+    class and, when freed, parked on that class' lock-free free list for
+    the next allocation of similar size, instead of going back to the OS.
+    Requests larger than the biggest class go straight to the OS.
+
+    Once the free lists have warmed up, steady-state traffic does not
+    allocate at all. The counters tell how well that holds.
+
+    This module is OS-neutral; see OsShim.h.
+
+--*/
+
+#pragma once
+
+#include "OsShim.h"
+#include "DualQueue.h"
+
+EXTERN_C_START
+
+
+#define SLAB_MIN_CLASS_SHIFT    6   // smallest block: 64 bytes
+#define SLAB_NUM_CLASSES        8   // largest block: 8 KiB
+#define SLAB_MAX_BLOCK_SIZE     (((SIZE_T)1) << (SLAB_MIN_CLASS_SHIFT + SLAB_NUM_CLASSES - 1))
+#define SLAB_CLASS_DEPTH        64  // free blocks kept per class (power of two)
+
+
+typedef struct _SLAB_STATS
+{
+    volatile LONG64 Allocs;         // served from a size class
+    volatile LONG64 Recycled;       // ...of which came off a free list
+    volatile LONG64 OsAllocs;       // went to the OS allocator (class miss or oversized)
+    volatile LONG64 OsFrees;        // went back to the OS (oversized or free list full)
+    volatile LONG64 Oversized;      // larger than SLAB_MAX_BLOCK_SIZE
+} SLAB_STATS, *PSLAB_STATS;
+
+
+typedef struct _SLAB
+{
+    DQ_RING    FreeList[SLAB_NUM_CLASSES];
+    SLAB_STATS Stats;
+} SLAB, *PSLAB;
+
+
+NTSTATUS
+SlabInit(
+    _Out_ PSLAB Slab
+);
+
+//
+// Frees everything on the free lists. Blocks still handed out must be
+// returned with SlabFree before this is called.
+//
+VOID
+SlabDestroy(
+    _Inout_ PSLAB Slab
+);
+
+PVOID
+SlabAlloc(
+    _Inout_ PSLAB  Slab,
+    _In_    SIZE_T Size
+);
+
+VOID
+SlabFree(
+    _Inout_ PSLAB Slab,
+    _In_    PVOID Ptr
+);
+
+
+EXTERN_C_END
@@ -0,0 +1,305 @@
+/*++
+
+Module Name:
+
+Stripe.c
+
+Abstract:
+
+    Implementation of the splitter and reassembler declared in Stripe.h.
+
+--*/
+
+#include "Stripe.h"
+
+C_ASSERT(sizeof(STRIPE_HEADER) == STRIPE_HEADER_SIZE);
+C_ASSERT((STRIPE_WINDOW & (STRIPE_WINDOW - 1)) == 0);
+
+
+
+static VOID
+_StripePut32(
+    _Out_writes_bytes_(4) PUCHAR p,
+    _In_ ULONG Value
+)
+{
+    for (int i = 0; i < 4; ++i) {
+        p[i] = (UCHAR)(Value >> (8 * i));
+    }
+}
+
+
+static ULONG
+_StripeGet32(
+    _In_reads_bytes_(4) const UCHAR *p
+)
+{
+    return (ULONG)p[0] | ((ULONG)p[1] << 8) | ((ULONG)p[2] << 16) | ((ULONG)p[3] << 24);
+}
+
+
+
+NTSTATUS
+StripeSplitterInit(
+    _Out_ PSTRIPE_SPLITTER Splitter,
+    _In_  ULONG ChunkSize
+)
+{
+    if (ChunkSize <= STRIPE_HEADER_SIZE) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    Splitter->NextMessage = 0;
+    Splitter->ChunkSize = ChunkSize;
+    return STATUS_SUCCESS;
+}
+
+
+ULONG
+StripeChunk(
+    _In_ const STRIPE_SPLITTER *Splitter,
+    _In_ ULONG Message,
+    _In_ ULONG Flags,
+    _In_reads_bytes_(Length) const UCHAR *Data,
+    _In_ SIZE_T Length,
+    _In_ ULONG Index,
+    _Out_writes_bytes_to_(Splitter->ChunkSize, return) PUCHAR Chunk
+)
+{
+    SIZE_T payload = Splitter->ChunkSize - STRIPE_HEADER_SIZE;
+    SIZE_T offset = (SIZE_T)Index * payload;
+    SIZE_T size = (offset < Length) ? Length - offset : 0;
+
+    if (size > payload) {
+        size = payload;
+    } else {
+        Flags |= STRIPE_FLAG_LAST;
+    }
+
+    Chunk[0] = STRIPE_VERSION;
+    Chunk[1] = (UCHAR)Flags;
+    Chunk[2] = (UCHAR)STRIPE_HEADER_SIZE;
+    Chunk[3] = (UCHAR)(STRIPE_HEADER_SIZE >> 8);
+    _StripePut32(Chunk + 4, Message);
+    _StripePut32(Chunk + 8, (ULONG)offset);
+    _StripePut32(Chunk + 12, (ULONG)Length);
+
+    if (size != 0) {
+        memcpy(Chunk + STRIPE_HEADER_SIZE, Data + offset, size);
+    }
+    return (ULONG)(STRIPE_HEADER_SIZE + size);
+}
+
+
+
+NTSTATUS
+StripeReassemblerInit(
+    _Out_ PSTRIPE_REASSEMBLER Reassembler,
+    _In_  ULONG MaxMessage,
+    _In_  PFN_STRIPE_DELIVER Deliver,
+    _In_opt_ PVOID Context
+)
+{
+    if (Deliver == NULL) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    memset(Reassembler, 0, sizeof(*Reassembler));
+    OsLockInit(&(Reassembler->Lock));
+    Reassembler->MaxMessage = MaxMessage;
+    Reassembler->Deliver = Deliver;
+    Reassembler->Context = Context;
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+StripeReassemblerCleanup(
+    _Inout_ PSTRIPE_REASSEMBLER Reassembler
+)
+{
+    for (ULONG i = 0; i < STRIPE_WINDOW; ++i) {
+        if (Reassembler->Slots[i].Data != NULL) {
+            OsFree(Reassembler->Slots[i].Data);
+        }
+    }
+    memset(Reassembler->Slots, 0, sizeof(Reassembler->Slots));
+}
+
+
+//
+// Hands on every message that is whole and next in line. Called, and
+// returns, with Lock held, which it releases around Deliver. If another
+// thread is delivering already, leaves it to that one.
+// Returns Deliver's status for the message it stopped at, in *Stalled.
+//
+static NTSTATUS
+_StripeDrain(
+    _Inout_ PSTRIPE_REASSEMBLER Reassembler,
+    _Inout_ OS_LOCK_STATE *LockState,
+    _Out_   PULONG Stalled
+)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    PSTRIPE_SLOT slot;
+
+    if (Reassembler->bDelivering) {
+        return STATUS_SUCCESS;
+    }
+    Reassembler->bDelivering = TRUE;
+
+    for (;;) {
+        slot = &(Reassembler->Slots[Reassembler->NextMessage & (STRIPE_WINDOW - 1)]);
+        if (!slot->bBusy || (slot->Received != slot->Total)) {
+            break;
+        }
+
+        // a whole slot is left alone by StripeAccept, whatever else comes in meanwhile
+        OsLockRelease(&(Reassembler->Lock), LockState);
+        status = Reassembler->Deliver(Reassembler->Context, slot->Data, slot->Total);
+        OsLockAcquire(&(Reassembler->Lock), LockState);
+
+        if (!NT_SUCCESS(status)) {
+            ++Reassembler->Stats.Refused;
+            (*Stalled) = Reassembler->NextMessage;
+            break;
+        }
+
+        ++Reassembler->Stats.Messages;
+        OsFree(slot->Data);
+        slot->Data = NULL;
+        slot->bBusy = FALSE;
+        ++Reassembler->NextMessage;
+    }
+
+    Reassembler->bDelivering = FALSE;
+    return status;
+}
+
+
+NTSTATUS
+StripeAccept(
+    _Inout_ PSTRIPE_REASSEMBLER Reassembler,
+    _In_reads_bytes_(Length) const UCHAR *Chunk,
+    _In_ ULONG Length
+)
+{
+    OS_LOCK_STATE lockState;
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG headerSize, message, offset, total, size, stalled;
+    PSTRIPE_SLOT slot;
+
+    OsLockAcquire(&(Reassembler->Lock), &lockState);
+    ++Reassembler->Stats.Chunks;
+
+    if (Length < STRIPE_HEADER_SIZE) {
+        goto reject;
+    }
+
+    headerSize = (ULONG)Chunk[2] | ((ULONG)Chunk[3] << 8);
+    message = _StripeGet32(Chunk + 4);
+    offset = _StripeGet32(Chunk + 8);
+    total = _StripeGet32(Chunk + 12);
+
+    if ((Chunk[0] != STRIPE_VERSION) ||
+        (headerSize < STRIPE_HEADER_SIZE) || (headerSize > Length) ||
+        (total > Reassembler->MaxMessage)) {
+        goto reject;
+    }
+
+    size = Length - headerSize;
+    if ((offset > total) || (size > total - offset)) {
+        goto reject;
+    }
+
+    if (Chunk[1] & STRIPE_FLAG_UNSEQUENCED) {
+        if (size != total) {
+            goto reject;
+        }
+        OsLockRelease(&(Reassembler->Lock), &lockState);
+        status = Reassembler->Deliver(Reassembler->Context, Chunk + headerSize, total);
+        OsLockAcquire(&(Reassembler->Lock), &lockState);
+
+        if (NT_SUCCESS(status)) {
+            ++Reassembler->Stats.Messages;
+        } else {
+            ++Reassembler->Stats.Refused;
+        }
+        goto exit;
+    }
+
+    // a message already delivered, or one too far ahead
+    if ((message - Reassembler->NextMessage) >= STRIPE_WINDOW) {
+        goto reject;
+    }
+
+    slot = &(Reassembler->Slots[message & (STRIPE_WINDOW - 1)]);
+
+    if (!slot->bBusy) {
+        // next in line, all in one chunk, and nobody delivering: straight from the transfer
+        if ((message == Reassembler->NextMessage) && (size == total) && !Reassembler->bDelivering) {
+            Reassembler->bDelivering = TRUE;
+            OsLockRelease(&(Reassembler->Lock), &lockState);
+            status = Reassembler->Deliver(Reassembler->Context, Chunk + headerSize, total);
+            OsLockAcquire(&(Reassembler->Lock), &lockState);
+            Reassembler->bDelivering = FALSE;
+
+            if (!NT_SUCCESS(status)) {
+                ++Reassembler->Stats.Refused;
+                goto exit; // nothing was kept of it
+            }
+            ++Reassembler->Stats.Messages;
+            ++Reassembler->NextMessage;
+            goto drain;
+        }
+
+        slot->Data = (PUCHAR)OsAllocate((total != 0) ? total : 1);
+        if (slot->Data == NULL) {
+            goto reject;
+        }
+        slot->bBusy = TRUE;
+        slot->Message = message;
+        slot->Total = total;
+        slot->Received = 0;
+    } else if ((slot->Total != total) || (size > total - slot->Received)) {
+        goto reject;
+    }
+
+    memcpy(slot->Data + offset, Chunk + headerSize, size);
+    slot->Received += size;
+
+drain:
+    status = _StripeDrain(Reassembler, &lockState, &stalled);
+    if (!NT_SUCCESS(status)) {
+        if (stalled == message) {
+            // the message this chunk completed: give the chunk back
+            slot = &(Reassembler->Slots[message & (STRIPE_WINDOW - 1)]);
+            slot->Received -= size;
+        } else {
+            status = STATUS_SUCCESS; // this chunk is in; what it is stuck behind is held
+        }
+    }
+    goto exit;
+
+reject:
+    ++Reassembler->Stats.Rejected;
+    status = STATUS_INVALID_PARAMETER;
+
+exit:
+    OsLockRelease(&(Reassembler->Lock), &lockState);
+    return status;
+}
+
+
+VOID
+StripeRetry(
+    _Inout_ PSTRIPE_REASSEMBLER Reassembler
+)
+{
+    OS_LOCK_STATE lockState;
+    ULONG stalled;
+
+    OsLockAcquire(&(Reassembler->Lock), &lockState);
+    (VOID)_StripeDrain(Reassembler, &lockState, &stalled);
+    OsLockRelease(&(Reassembler->Lock), &lockState);
+}
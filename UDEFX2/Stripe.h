@@ -0,0 +1,213 @@
+/*++
+
+Module Name:
+
+Stripe.h
+
+Abstract:
+
+    Striping of messages across several bulk pipes. The sender cuts each
+    message into chunks, each one a transfer of its own, prefixed with a
+    STRIPE_HEADER saying which message it belongs to and where in it it
+    goes; chunks can then go down whichever pipe is free. The receiver
+    puts messages back together from chunks arriving on all pipes, in any
+    order, and hands them on whole, in the order they were cut.
+
+    Up to STRIPE_WINDOW messages can be in reassembly at once, so a sender
+    must not start message n + STRIPE_WINDOW before message n is all sent;
+    the window covers every pipe of the device with all of its URBs in
+    flight, even with one-chunk messages. A message that comes in whole and
+    in turn is handed on straight from its chunk; others are put together
+    in a buffer allocated for them. Pipes must not lose or repeat chunks,
+    which USB bulk pipes don't.
+
+    The header is the wire format; the host side can include this header
+    as is, and use the same splitter and reassembler.
+
+    This module is OS-neutral; see OsShim.h.
+
+--*/
+
+#pragma once
+
+#include "OsShim.h"
+
+EXTERN_C_START
+
+
+#define STRIPE_VERSION          1
+#define STRIPE_HEADER_SIZE      16
+#define STRIPE_WINDOW           64      // messages in reassembly at once, power of two
+
+//
+// Chunk flags
+//   LAST         the chunk that ends its message (informational)
+//   UNSEQUENCED  a whole message in one chunk, handed on as soon as it comes
+//                in, ahead of sequenced messages; Message is not used
+//
+#define STRIPE_FLAG_LAST        0x01
+#define STRIPE_FLAG_UNSEQUENCED 0x02
+
+
+//
+// On the wire, little-endian, followed by the chunk's payload: the rest of
+// the transfer, HeaderSize bytes in.
+//
+typedef struct _STRIPE_HEADER
+{
+    UCHAR   Version;
+    UCHAR   Flags;
+    USHORT  HeaderSize;     // STRIPE_HEADER_SIZE for this version
+    ULONG   Message;        // sequence number, from 0
+    ULONG   Offset;         // of the payload in the message
+    ULONG   Total;          // message length
+} STRIPE_HEADER, *PSTRIPE_HEADER;
+
+
+//
+// Sender side. ChunkSize is the largest transfer, header included; the
+// receiver's transfers must be at least that big.
+//
+typedef struct _STRIPE_SPLITTER
+{
+    volatile LONG NextMessage;
+    ULONG         ChunkSize;
+} STRIPE_SPLITTER, *PSTRIPE_SPLITTER;
+
+
+NTSTATUS
+StripeSplitterInit(
+    _Out_ PSTRIPE_SPLITTER Splitter,
+    _In_  ULONG ChunkSize
+);
+
+//
+// Chunks a message of Length bytes takes; at least one, even when empty.
+//
+FORCEINLINE
+ULONG
+StripeChunkCount(
+    _In_ const STRIPE_SPLITTER *Splitter,
+    _In_ SIZE_T Length
+)
+{
+    SIZE_T payload = Splitter->ChunkSize - STRIPE_HEADER_SIZE;
+
+    return (Length == 0) ? 1 : (ULONG)((Length + payload - 1) / payload);
+}
+
+//
+// Sequence number for the next message. Chunks of several messages can go
+// out interleaved, as long as the window is respected.
+//
+FORCEINLINE
+ULONG
+StripeBegin(
+    _Inout_ PSTRIPE_SPLITTER Splitter
+)
+{
+    return (ULONG)InterlockedIncrement(&(Splitter->NextMessage)) - 1;
+}
+
+//
+// Builds chunk Index of message Message (Data, Length) into Chunk, which
+// has room for ChunkSize bytes; returns the chunk's length. Flags are
+// added to the header, e.g. STRIPE_FLAG_UNSEQUENCED.
+//
+ULONG
+StripeChunk(
+    _In_ const STRIPE_SPLITTER *Splitter,
+    _In_ ULONG Message,
+    _In_ ULONG Flags,
+    _In_reads_bytes_(Length) const UCHAR *Data,
+    _In_ SIZE_T Length,
+    _In_ ULONG Index,
+    _Out_writes_bytes_to_(Splitter->ChunkSize, return) PUCHAR Chunk
+);
+
+
+//
+// Receiver side. Deliver is called with each whole message, in order, one
+// call at a time (unsequenced ones may come in alongside), and with no lock
+// held; the message is the reassembler's, and only good for the call.
+// A message Deliver fails is held, and offered again (first) by the next
+// StripeAccept or StripeRetry.
+//
+typedef NTSTATUS (*PFN_STRIPE_DELIVER)(
+    _In_ PVOID Context,
+    _In_reads_bytes_(Length) const UCHAR *Message,
+    _In_ ULONG Length
+);
+
+typedef struct _STRIPE_SLOT
+{
+    BOOLEAN bBusy;          // a chunk of Message came in
+    ULONG   Message;
+    ULONG   Total;
+    ULONG   Received;       // payload bytes so far
+    PUCHAR  Data;           // Total bytes, while bBusy
+} STRIPE_SLOT, *PSTRIPE_SLOT;
+
+typedef struct _STRIPE_STATS
+{
+    ULONG64 Chunks;
+    ULONG64 Messages;
+    ULONG64 Rejected;       // malformed, too big, or outside the window
+    ULONG64 Refused;        // Deliver failed, message held
+} STRIPE_STATS, *PSTRIPE_STATS;
+
+typedef struct _STRIPE_REASSEMBLER
+{
+    OS_LOCK            Lock;
+    ULONG              NextMessage;     // the one to deliver next
+    BOOLEAN            bDelivering;     // a thread is in Deliver, with Lock released
+    ULONG              MaxMessage;
+    PFN_STRIPE_DELIVER Deliver;
+    PVOID              Context;
+    STRIPE_STATS       Stats;           // under Lock
+    STRIPE_SLOT        Slots[STRIPE_WINDOW];
+} STRIPE_REASSEMBLER, *PSTRIPE_REASSEMBLER;
+
+
+//
+// Messages are up to MaxMessage bytes; chunks of bigger ones are rejected.
+//
+NTSTATUS
+StripeReassemblerInit(
+    _Out_ PSTRIPE_REASSEMBLER Reassembler,
+    _In_  ULONG MaxMessage,
+    _In_  PFN_STRIPE_DELIVER Deliver,
+    _In_opt_ PVOID Context
+);
+
+VOID
+StripeReassemblerCleanup(
+    _Inout_ PSTRIPE_REASSEMBLER Reassembler
+);
+
+//
+// Takes one chunk (one transfer), from any pipe, and delivers whatever
+// messages it completes. Fails with STATUS_INVALID_PARAMETER on a chunk
+// it cannot place, which is dropped.
+// If Deliver refuses the message this chunk completed, fails with Deliver's
+// status, and the chunk is given back as if it never came in: sending it
+// again completes the message again. Messages behind it that were whole
+// already stay accepted, and are held.
+//
+NTSTATUS
+StripeAccept(
+    _Inout_ PSTRIPE_REASSEMBLER Reassembler,
+    _In_reads_bytes_(Length) const UCHAR *Chunk,
+    _In_ ULONG Length
+);
+
+//
+// Offers held messages to Deliver again, e.g. once it has room.
+//
+VOID
+StripeRetry(
+    _Inout_ PSTRIPE_REASSEMBLER Reassembler
+);
+
+
+EXTERN_C_END
@@ -21,13 +21,334 @@ Abstract:
 
 
 
+// URBs a bulk endpoint takes out of its queue ahead of the one being handled
+#define IO_BULK_WINDOW_DEPTH 8
+
+// several bulk pairs: BULK OUT carries stripe chunks of mission requests, up to this big
+#define IO_BULK_STRIPED             (UDEFX2_BULK_PAIRS > 1)
+#define IO_STRIPE_MAX_MESSAGE       (64 * 1024)
+
+// loopback ring: twice the largest transfer, plus a record header each
+#define IO_LOOPBACK_RING_SIZE       (2 * (UDEFX2_LOOPBACK_MAX_TRANSFER + LOOP_RING_ALIGN))
+
+// URBs the loopback completes per run, between two takes of its lock
+#define IO_LOOPBACK_BATCH           (2 * IO_BULK_WINDOW_DEPTH)
+
+// isochronous rings, in packets (microframes), and how far the timer may fall behind
+#define IO_ISOCH_SLOTS              64
+#define IO_ISOCH_PREFILL            16
+#define IO_ISOCH_MAX_LAG            32
+#define IO_ISOCH_TIMER_PERIOD_MS    1
+
+// missions queued for the workers, at most
+#define IO_MISSION_QUEUE_DEPTH      64
+
 typedef struct _ENDPOINTQUEUE_CONTEXT {
     UDECXUSBDEVICE usbDeviceObj;
     WDFDEVICE      backChannelDevice;
+    PEP_SLOT       Slot;            // the endpoint's, in the device's registry
+    // ordered queues only: URBs go through the window, and are handled in order
+    ORDER_WINDOW   Window;
+    PFLIGHT_RECORDER Recorder;      // the device's
 } ENDPOINTQUEUE_CONTEXT, *PENDPOINTQUEUE_CONTEXT;
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(ENDPOINTQUEUE_CONTEXT, GetEndpointQueueContext);
 
+//
+// Per-URB traffic goes to the flight recorder rather than to WPP, which
+// would cost more than the URB itself; LogError is kept for failures.
+//
+#define IoRecordUrb(__recorder, __event, __ep, __request, __length, __status) \
+    FrRecord((__recorder), (__event), (__ep), (ULONG64)(ULONG_PTR)(__request), (ULONG)(__length), (__status))
+
+//
+// The queue endpoint __address parks URBs on; NULL until it has one.
+//
+#define IoParkedQueue(__pIoContext, __address) \
+    ((WDFQUEUE)((__pIoContext)->Endpoints.Slot[EpSlotOf(__address)].Parked))
+
+static EVT_WDF_TIMER IoEvtInterruptModerationTimer;
+static EVT_WDF_TIMER IoEvtIsochTimer;
+static EVT_WDF_WORKITEM IoEvtMissionWork;
+
+
+//
+// A URB to complete, and how.
+//
+typedef struct _IO_URB_DONE {
+    WDFREQUEST Request;
+    ULONG      Bytes;
+    NTSTATUS   Status;
+    UCHAR      Endpoint;
+} IO_URB_DONE, *PIO_URB_DONE;
+
+
+static VOID
+IoUrbDone(
+    _Out_ PIO_URB_DONE Done,
+    _In_ WDFREQUEST Request,
+    _In_ UCHAR      Endpoint,
+    _In_ ULONG      Bytes,
+    _In_ NTSTATUS   Status
+)
+{
+    Done->Request = Request;
+    Done->Endpoint = Endpoint;
+    Done->Bytes = Bytes;
+    Done->Status = Status;
+}
+
+
+//
+// Completes URBs paired up under a lock, once it is released: completing
+// one may get the next URB sent to us right away.
+//
+static VOID
+IoCompleteUrbs(
+    _In_ PFLIGHT_RECORDER pRecorder,
+    _In_reads_(Count) PIO_URB_DONE Done,
+    _In_ ULONG Count
+)
+{
+    for (ULONG i = 0; i < Count; ++i) {
+        IoRecordUrb(pRecorder, FrEventComplete, Done[i].Endpoint, Done[i].Request, Done[i].Bytes, Done[i].Status);
+        UdecxUrbSetBytesCompleted(Done[i].Request, Done[i].Bytes);
+        UdecxUrbCompleteWithNtStatus(Done[i].Request, Done[i].Status);
+    }
+}
+
+
+
+//
+// A mission request put back together from stripe chunks; copied into the
+// queue, as it was never in one URB. The reassembler calls this one message
+// at a time, so requests are queued in the order the host cut them.
+// A request the queue has no room for is refused, and held by the
+// reassembler until IoBulkOutFlowControl retries it; one the executor
+// rejects is dropped, as holding it would stall every message behind it.
+//
+static NTSTATUS
+IoStripeDeliver(
+    _In_ PVOID Context,
+    _In_reads_bytes_(Length) const UCHAR *Message,
+    _In_ ULONG Length
+)
+{
+    UDECXUSBDEVICE device = (UDECXUSBDEVICE)Context;
+    PUDECX_BACKCHANNEL_CONTEXT pBackChannelContext = GetBackChannelContext(GetUsbDeviceContext(device)->ControllerDevice);
+    ULONG readsCompleted;
+
+    NTSTATUS status = MxSubmit(&(WdfDeviceGetMissionState(device)->Exec), Message, Length);
+    if (status != STATUS_NOT_SUPPORTED) {
+        if (status == STATUS_INSUFFICIENT_RESOURCES) {
+            return status;
+        }
+        if (!NT_SUCCESS(status)) {
+            LogError(TRACE_DEVICE, "Striped mission of %d bytes dropped %!STATUS!", Length, status);
+        }
+        return STATUS_SUCCESS;
+    }
+
+    status = WRQueuePushWrite(
+        &(pBackChannelContext->missionRequest),
+        WRQUEUE_LANE_NORMAL,
+        (PVOID)Message,
+        Length,
+        &readsCompleted);
+
+    if (!NT_SUCCESS(status)) {
+        LogInfo(TRACE_DEVICE, "Striped mission request of %d bytes held %!STATUS!", Length, status);
+    }
+    return status;
+}
+
+
+static EVT_WDF_OBJECT_CONTEXT_DESTROY IoEvtStripeReassemblerDestroy;
+
+static VOID
+IoEvtStripeReassemblerDestroy(
+    _In_ WDFOBJECT Object
+)
+{
+    StripeReassemblerCleanup(WdfDeviceGetStripeReassembler(Object));
+}
+
+
+//
+// ISOCH IN data: the COUNTER pattern, one packet a microframe.
+//
+static ULONG
+IoIsochFill(
+    _In_ PVOID Context,
+    _Out_writes_bytes_(Length) PUCHAR Packet,
+    _In_ ULONG Length
+)
+{
+    PatternFill(&(((PISOCH_STATE)Context)->Source), Packet, Length);
+    return Length;
+}
+
+
+static EVT_WDF_OBJECT_CONTEXT_DESTROY IoEvtIsochStateDestroy;
+
+static VOID
+IoEvtIsochStateDestroy(
+    _In_ WDFOBJECT Object
+)
+{
+    PISOCH_STATE pIsoch = WdfDeviceGetIsochState(Object);
+
+    IsoCleanup(&(pIsoch->Out.Sched));
+    IsoCleanup(&(pIsoch->In.Sched));
+}
+
+
+//
+// Mission handlers: the mission text, the host's NUL included, in; a
+// NUL-terminated text out.
+//
+static NTSTATUS
+IoMissionPing(
+    _In_opt_ PVOID Context,
+    _In_reads_bytes_(Length) const UCHAR *Mission,
+    _In_ ULONG Length,
+    _Out_writes_bytes_to_(ResponseSize, *ResponseLength) PUCHAR Response,
+    _In_ ULONG ResponseSize,
+    _Out_ PULONG ResponseLength
+)
+{
+    static const char suffix[] = "_response";
+    ULONG textLength = (ULONG)strnlen((const char *)Mission, Length);
+
+    UNREFERENCED_PARAMETER(Context);
+
+    *ResponseLength = 0;
+    if (textLength + sizeof(suffix) > ResponseSize) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    memcpy(Response, Mission, textLength);
+    memcpy(Response + textLength, suffix, sizeof(suffix));
+    *ResponseLength = textLength + sizeof(suffix);
+    return STATUS_SUCCESS;
+}
+
+
+static NTSTATUS
+IoMissionCrc32c(
+    _In_opt_ PVOID Context,
+    _In_reads_bytes_(Length) const UCHAR *Mission,
+    _In_ ULONG Length,
+    _Out_writes_bytes_to_(ResponseSize, *ResponseLength) PUCHAR Response,
+    _In_ ULONG ResponseSize,
+    _Out_ PULONG ResponseLength
+)
+{
+    static const char prefix[] = "crc32c:";
+    static const char digits[] = "0123456789ABCDEF";
+    ULONG textLength = (ULONG)strnlen((const char *)Mission, Length);
+    ULONG crc;
+
+    UNREFERENCED_PARAMETER(Context);
+
+    *ResponseLength = 0;
+    if ((textLength < sizeof(prefix) - 1) || (ResponseSize < sizeof(prefix) + 8)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    crc = Crc32c(Mission + sizeof(prefix) - 1, textLength - (sizeof(prefix) - 1));
+
+    memcpy(Response, prefix, sizeof(prefix) - 1);
+    for (ULONG i = 0; i < 8; ++i) {
+        Response[sizeof(prefix) - 1 + i] = digits[(crc >> (28 - (4 * i))) & 0xF];
+    }
+    Response[sizeof(prefix) + 7] = 0;
+    *ResponseLength = sizeof(prefix) + 8;
+    return STATUS_SUCCESS;
+}
+
+
+C_ASSERT(UDEFX2_MISSION_MAX_LENGTH == MX_MAX_MISSION);
+
+static const MX_HANDLER g_IoMissionHandlers[] = {
+    { "ping",   IoMissionPing },
+    { "crc32c", IoMissionCrc32c },
+};
+
+
+//
+// A mission run: its response goes out as a back-channel completion
+// would, then the interrupt the back-channel agent would have raised.
+//
+static VOID
+IoMissionComplete(
+    _In_opt_ PVOID Context,
+    _In_ NTSTATUS Status,
+    _In_reads_bytes_(Length) const UCHAR *Response,
+    _In_ ULONG Length
+)
+{
+    UDECXUSBDEVICE device = (UDECXUSBDEVICE)Context;
+    NTSTATUS status;
+
+    if (Length != 0) {
+        status = BackChannelCompleteMission(GetUsbDeviceContext(device)->ControllerDevice, Response, Length);
+        if (!NT_SUCCESS(status)) {
+            LogError(TRACE_DEVICE, "Mission response of %d bytes dropped %!STATUS!", Length, status);
+            Status = status;
+        }
+    }
+
+    status = Io_RaiseInterrupt(device, NT_SUCCESS(Status) ? UDEFX2_MISSION_SUCCEEDED : UDEFX2_MISSION_FAILED);
+    if (!NT_SUCCESS(status)) {
+        LogError(TRACE_DEVICE, "Mission completion interrupt lost %!STATUS!", status);
+    }
+}
+
+
+static VOID
+IoMissionKick(
+    _In_opt_ PVOID Context,
+    _In_ ULONG Worker
+)
+{
+    WdfWorkItemEnqueue(WdfDeviceGetMissionState((UDECXUSBDEVICE)Context)->Worker[Worker]);
+}
+
+
+static VOID
+IoEvtMissionWork(
+    _In_ WDFWORKITEM WorkItem
+)
+{
+    PMISSION_WORKER pWorker = WdfWorkItemGetMissionWorker(WorkItem);
+
+    MxWork(&(WdfDeviceGetMissionState(pWorker->Device)->Exec), pWorker->Index);
+}
+
+
+static EVT_WDF_OBJECT_CONTEXT_DESTROY IoEvtMissionStateDestroy;
+
+static VOID
+IoEvtMissionStateDestroy(
+    _In_ WDFOBJECT Object
+)
+{
+    MxCleanup(&(WdfDeviceGetMissionState(Object)->Exec));
+}
+
+
+static EVT_WDF_OBJECT_CONTEXT_DESTROY IoEvtLoopbackDestroy;
+
+static VOID
+IoEvtLoopbackDestroy(
+    _In_ WDFOBJECT Object
+)
+{
+    LrCleanup(&(WdfDeviceGetLoopback(Object)->Ring));
+}
+
+
 
 NTSTATUS
 Io_AllocateContext(
@@ -59,157 +380,1590 @@ NTSTATUS. Could fail on allocation failure or the same context type already exis
         goto exit;
     }
 
-exit:
+    PINTR_STATE pIntrState;
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, INTR_STATE);
 
-    return status;
-}
+    status = WdfObjectAllocateContext(Object, &attributes, (PVOID *)&pIntrState);
+    if (!NT_SUCCESS(status)) {
+        LogError(TRACE_DEVICE, "Unable to allocate interrupt state for WDF object %p", Object);
+        goto exit;
+    }
 
+    EvRingInit(&(pIntrState->Ring));
 
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = Object;
+    status = WdfSpinLockCreate(&attributes, &(pIntrState->RaiseLock));
+    if (!NT_SUCCESS(status)) {
+        LogError(TRACE_DEVICE, "WdfSpinLockCreate failed  %!STATUS!", status);
+        goto exit;
+    }
 
+    status = WdfSpinLockCreate(&attributes, &(pIntrState->sync));
+    if (!NT_SUCCESS(status)) {
+        LogError(TRACE_DEVICE, "WdfSpinLockCreate failed  %!STATUS!", status);
+        goto exit;
+    }
 
+    // no moderation until the back-channel asks for it
+    pIntrState->ModerationSetting.MaxDelayUs = 0;
+    pIntrState->ModerationSetting.MaxBatch = 1;
+    pIntrState->Moderation.MaxDelay = 0;
+    pIntrState->Moderation.MaxBatch = 1;
 
+    WDF_TIMER_CONFIG timerConfig;
+    WDF_TIMER_CONFIG_INIT(&timerConfig, IoEvtInterruptModerationTimer);
+    timerConfig.AutomaticSerialization = FALSE;
+    timerConfig.UseHighResolutionTimer = WdfTrue;   // delays are in microseconds
 
-static VOID
-IoEvtControlUrb(
-    _In_ WDFQUEUE Queue,
-    _In_ WDFREQUEST Request,
-    _In_ size_t OutputBufferLength,
-    _In_ size_t InputBufferLength,
-    _In_ ULONG IoControlCode
-)
-{
-    UNREFERENCED_PARAMETER(Queue);
-    UNREFERENCED_PARAMETER(OutputBufferLength);
-    UNREFERENCED_PARAMETER(InputBufferLength);
+    status = WdfTimerCreate(&timerConfig, &attributes, &(pIntrState->Timer));
+    if (!NT_SUCCESS(status)) {
+        LogError(TRACE_DEVICE, "WdfTimerCreate failed  %!STATUS!", status);
+        goto exit;
+    }
 
-    //NT_VERIFY(IoControlCode == IOCTL_INTERNAL_USB_SUBMIT_URB);
+    PBULK_IN_SOURCE pSource;
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, BULK_IN_SOURCE);
 
-    if (IoControlCode == IOCTL_INTERNAL_USB_SUBMIT_URB)
-    {
-        // These are on the control pipe.
-        // We don't do anything special with these requests,
-        // but this is where we would add processing for vendor-specific commands.
-        WDF_USB_CONTROL_SETUP_PACKET setupPacket;
-        NTSTATUS status = UdecxUrbRetrieveControlSetupPacket(Request, &setupPacket);
+    status = WdfObjectAllocateContext(Object, &attributes, (PVOID *)&pSource);
+    if (!NT_SUCCESS(status)) {
+        LogError(TRACE_DEVICE, "Unable to allocate BULK IN source context for WDF object %p", Object);
+        goto exit;
+    }
 
-        if (!NT_SUCCESS(status))
-        {
-            LogError(TRACE_DEVICE, "WdfRequest %p is not a control URB? UdecxUrbRetrieveControlSetupPacket %!STATUS!",
-                Request, status);
-            UdecxUrbCompleteWithNtStatus(Request, status);
-            goto exit;
-        }
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = Object;
+    status = WdfSpinLockCreate(&attributes, &(pSource->sync));
+    if (!NT_SUCCESS(status)) {
+        LogError(TRACE_DEVICE, "WdfSpinLockCreate failed  %!STATUS!", status);
+        goto exit;
+    }
+
+    PBULK_OUT_SINK pSink;
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, BULK_OUT_SINK);
 
+    status = WdfObjectAllocateContext(Object, &attributes, (PVOID *)&pSink);
+    if (!NT_SUCCESS(status)) {
+        LogError(TRACE_DEVICE, "Unable to allocate BULK OUT sink context for WDF object %p", Object);
+        goto exit;
+    }
 
-        LogInfo(TRACE_DEVICE, "v44 control CODE %x, [type=%x dir=%x recip=%x] req=%x [wv = %x wi = %x wlen = %x]",
-            IoControlCode,
-            (int)(setupPacket.Packet.bm.Request.Type),
-            (int)(setupPacket.Packet.bm.Request.Dir),
-            (int)(setupPacket.Packet.bm.Request.Recipient),
-            (int)(setupPacket.Packet.bRequest),
-            (int)(setupPacket.Packet.wValue.Value),
-            (int)(setupPacket.Packet.wIndex.Value),
-            (int)(setupPacket.Packet.wLength)
-        );
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = Object;
+    status = WdfSpinLockCreate(&attributes, &(pSink->sync));
+    if (!NT_SUCCESS(status)) {
+        LogError(TRACE_DEVICE, "WdfSpinLockCreate failed  %!STATUS!", status);
+        goto exit;
+    }
 
+    // one ring per processor, allocated along with the context
+    PFLIGHT_RECORDER pRecorder;
+    ULONG rings = FrRingCount(KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS));
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, FLIGHT_RECORDER);
+    attributes.ContextSizeOverride = FR_RECORDER_SIZE(rings);
 
+    status = WdfObjectAllocateContext(Object, &attributes, (PVOID *)&pRecorder);
+    if (!NT_SUCCESS(status)) {
+        LogError(TRACE_DEVICE, "Unable to allocate flight recorder for WDF object %p", Object);
+        goto exit;
+    }
+    NT_VERIFY(NT_SUCCESS(FrInit(pRecorder, rings)));
 
+    PLOOPBACK pLoopback;
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, LOOPBACK);
+    attributes.EvtDestroyCallback = IoEvtLoopbackDestroy;
 
-        UdecxUrbCompleteWithNtStatus(Request, STATUS_SUCCESS);
+    status = WdfObjectAllocateContext(Object, &attributes, (PVOID *)&pLoopback);
+    if (!NT_SUCCESS(status)) {
+        LogError(TRACE_DEVICE, "Unable to allocate loopback context for WDF object %p", Object);
+        goto exit;
     }
-    else
-    {
-        LogError(TRACE_DEVICE, "control NO submit code is %x", IoControlCode);
+
+    status = LrInit(&(pLoopback->Ring), IO_LOOPBACK_RING_SIZE);
+    if (!NT_SUCCESS(status)) {
+        LogError(TRACE_DEVICE, "Unable to allocate loopback ring %!STATUS!", status);
+        goto exit;
     }
-exit:
-    return;
-}
 
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = Object;
+    status = WdfSpinLockCreate(&attributes, &(pLoopback->sync));
+    if (!NT_SUCCESS(status)) {
+        LogError(TRACE_DEVICE, "WdfSpinLockCreate failed  %!STATUS!", status);
+        goto exit;
+    }
 
-static int _Test_rebound = 0;
+    PISOCH_STATE pIsoch;
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, ISOCH_STATE);
+    attributes.EvtDestroyCallback = IoEvtIsochStateDestroy;
 
+    status = WdfObjectAllocateContext(Object, &attributes, (PVOID *)&pIsoch);
+    if (!NT_SUCCESS(status)) {
+        LogError(TRACE_DEVICE, "Unable to allocate isochronous state for WDF object %p", Object);
+        goto exit;
+    }
 
-static VOID
-IoEvtBulkOutUrb(
-    _In_ WDFQUEUE Queue,
-    _In_ WDFREQUEST Request,
-    _In_ size_t OutputBufferLength,
-    _In_ size_t InputBufferLength,
-    _In_ ULONG IoControlCode
-)
-{
-    NTSTATUS status = STATUS_SUCCESS;
-    ULONG transferBufferLength = 0;
+    NT_VERIFY(NT_SUCCESS(PatternInit(&(pIsoch->Source), PatternCounter, g_IsochMaxPacketSize, 0)));
 
-    UNREFERENCED_PARAMETER(OutputBufferLength);
-    UNREFERENCED_PARAMETER(InputBufferLength);
+    status = IsoInit(&(pIsoch->Out.Sched), IsoDirectionOut, g_IsochMaxPacketSize, IO_ISOCH_SLOTS, IO_ISOCH_PREFILL,
+                     g_IsochIntervalsPerSecond, OsTimestampFrequency(), NULL, NULL, NULL);
+    if (NT_SUCCESS(status)) {
+        status = IsoInit(&(pIsoch->In.Sched), IsoDirectionIn, g_IsochMaxPacketSize, IO_ISOCH_SLOTS, IO_ISOCH_PREFILL,
+                         g_IsochIntervalsPerSecond, OsTimestampFrequency(), IoIsochFill, NULL, pIsoch);
+    }
+    if (!NT_SUCCESS(status)) {
+        LogError(TRACE_DEVICE, "Unable to allocate isochronous rings %!STATUS!", status);
+        goto exit;
+    }
 
-    PENDPOINTQUEUE_CONTEXT pEpQContext = GetEndpointQueueContext(Queue);
-    WDFDEVICE backchannel = pEpQContext->backChannelDevice;
-    PUDECX_BACKCHANNEL_CONTEXT pBackChannelContext = GetBackChannelContext(backchannel);
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = Object;
+    status = WdfSpinLockCreate(&attributes, &(pIsoch->sync));
+    if (!NT_SUCCESS(status)) {
+        LogError(TRACE_DEVICE, "WdfSpinLockCreate failed  %!STATUS!", status);
+        goto exit;
+    }
 
-    if (IoControlCode != IOCTL_INTERNAL_USB_SUBMIT_URB)
-    {
-        LogError(TRACE_DEVICE, "WdfRequest BOUT %p Incorrect IOCTL %x, %!STATUS!",
-            Request, IoControlCode, status);
-        status = STATUS_INVALID_PARAMETER;
+    // every millisecond runs the eight microframes since the last time
+    WDF_TIMER_CONFIG_INIT_PERIODIC(&timerConfig, IoEvtIsochTimer, IO_ISOCH_TIMER_PERIOD_MS);
+    timerConfig.AutomaticSerialization = FALSE;
+    timerConfig.UseHighResolutionTimer = WdfTrue;
+
+    status = WdfTimerCreate(&timerConfig, &attributes, &(pIsoch->Timer));
+    if (!NT_SUCCESS(status)) {
+        LogError(TRACE_DEVICE, "WdfTimerCreate failed  %!STATUS!", status);
         goto exit;
     }
 
-    PUCHAR transferBuffer;
-    status = UdecxUrbRetrieveBuffer(Request, &transferBuffer, &transferBufferLength);
-    if (!NT_SUCCESS(status))
-    {
-        LogError(TRACE_DEVICE, "WdfRequest BOUT %p unable to retrieve buffer %!STATUS!",
-            Request, status);
+    PMISSION_STATE pMission;
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, MISSION_STATE);
+    attributes.EvtDestroyCallback = IoEvtMissionStateDestroy;
+
+    status = WdfObjectAllocateContext(Object, &attributes, (PVOID *)&pMission);
+    if (!NT_SUCCESS(status)) {
+        LogError(TRACE_DEVICE, "Unable to allocate mission state for WDF object %p", Object);
         goto exit;
     }
 
-    // try to get us information about a request that may be waiting for this info
-    WDFREQUEST matchingRead;
-    status = WRQueuePushWrite(
-        &(pBackChannelContext->missionRequest),
-        transferBuffer,
-        transferBufferLength,
-        &matchingRead);
+    Crc32cInit();
 
-    if (matchingRead != NULL)
-    {
-        PVOID rbuffer;
-        SIZE_T rlen;
+    status = MxInit(&(pMission->Exec), g_IoMissionHandlers, ARRAYSIZE(g_IoMissionHandlers),
+                    IO_MISSION_WORKERS, IO_MISSION_QUEUE_DEPTH, IoMissionComplete, IoMissionKick, Object);
+    if (!NT_SUCCESS(status)) {
+        LogError(TRACE_DEVICE, "Unable to allocate mission queue %!STATUS!", status);
+        goto exit;
+    }
+
+    for (ULONG i = 0; i < IO_MISSION_WORKERS; ++i) {
+        WDF_WORKITEM_CONFIG workItemConfig;
+        WDF_WORKITEM_CONFIG_INIT(&workItemConfig, IoEvtMissionWork);
+        workItemConfig.AutomaticSerialization = FALSE;
+
+        WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, MISSION_WORKER);
+        attributes.ParentObject = Object;
+
+        status = WdfWorkItemCreate(&workItemConfig, &attributes, &(pMission->Worker[i]));
+        if (!NT_SUCCESS(status)) {
+            LogError(TRACE_DEVICE, "WdfWorkItemCreate failed  %!STATUS!", status);
+            goto exit;
+        }
+        WdfWorkItemGetMissionWorker(pMission->Worker[i])->Device = Object;
+        WdfWorkItemGetMissionWorker(pMission->Worker[i])->Index = i;
+    }
+
+    if (IO_BULK_STRIPED)
+    {
+        PSTRIPE_REASSEMBLER pReassembler;
+        WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, STRIPE_REASSEMBLER);
+        attributes.EvtDestroyCallback = IoEvtStripeReassemblerDestroy;
+
+        status = WdfObjectAllocateContext(Object, &attributes, (PVOID *)&pReassembler);
+        if (!NT_SUCCESS(status)) {
+            LogError(TRACE_DEVICE, "Unable to allocate stripe reassembler for WDF object %p", Object);
+            goto exit;
+        }
+        NT_VERIFY(NT_SUCCESS(StripeReassemblerInit(pReassembler, IO_STRIPE_MAX_MESSAGE, IoStripeDeliver, Object)));
+    }
+
+exit:
+
+    return status;
+}
+
+
+
+
+
+
+//
+// Vendor requests on EP0 (VendorRequest.h), on the same state the
+// back-channel IOCTLs work on. Context is the UDECXUSBDEVICE.
+//
+static ULONG
+IoVrReadStats(
+    _In_ PVOID   Context,
+    _In_ ULONG   Block,
+    _Out_writes_to_(VR_STATS_MAX_COUNTERS, return) PULONG64 Counters
+)
+{
+    UDECXUSBDEVICE device = (UDECXUSBDEVICE)Context;
+
+    switch (Block)
+    {
+    case UDEFX2_VR_STATS_SINK:
+    {
+        UDEFX2_SINK_STATS stats;
+
+        Io_GetSinkStats(device, &stats);
+        Counters[0] = stats.Mode;
+        Counters[1] = stats.Bytes;
+        Counters[2] = stats.Transfers;
+        Counters[3] = stats.Errors;
+        Counters[4] = stats.FirstErrorOffset;
+        return 5;
+    }
+
+    case UDEFX2_VR_STATS_INTERRUPT:
+    {
+        PINTR_STATE pIntrState = WdfDeviceGetIntrState(device);
+
+        Counters[0] = (ULONG64)ReadNoFence64(&(pIntrState->Ring.Raised));
+        Counters[1] = (ULONG64)ReadNoFence64(&(pIntrState->Ring.Delivered));
+        Counters[2] = (ULONG64)ReadNoFence64(&(pIntrState->Ring.Overflows));
+        Counters[3] = (ULONG64)ReadNoFence64(&(pIntrState->Transfers));
+        Counters[4] = EvRingCount(&(pIntrState->Ring));
+        return 5;
+    }
+
+    default:
+        return 0;
+    }
+}
+
+
+static NTSTATUS
+IoVrSetBulkInPattern(
+    _In_ PVOID   Context,
+    _In_ ULONG   Pattern,
+    _In_ ULONG64 Seed
+)
+{
+    UDEFX2_PATTERN_CONFIG config;
+
+    config.Pattern = Pattern;
+    config.Reserved = 0;
+    config.Seed = Seed;
+    return Io_SetBulkInPattern((UDECXUSBDEVICE)Context, &config);
+}
+
+
+static NTSTATUS
+IoVrSetBulkOutSink(
+    _In_ PVOID   Context,
+    _In_ ULONG   Mode,
+    _In_ ULONG   Pattern,
+    _In_ ULONG64 Seed
+)
+{
+    UDEFX2_SINK_CONFIG config;
+
+    config.Mode = Mode;
+    config.Pattern = Pattern;
+    config.Seed = Seed;
+    return Io_SetBulkOutSink((UDECXUSBDEVICE)Context, &config);
+}
+
+
+static VOID
+IoVrResetCounters(
+    _In_ PVOID   Context,
+    _In_ ULONG   Blocks
+)
+{
+    UDECXUSBDEVICE device = (UDECXUSBDEVICE)Context;
+
+    if (Blocks & (1 << UDEFX2_VR_STATS_SINK)) {
+        PBULK_OUT_SINK pSink = WdfDeviceGetBulkOutSink(device);
+
+        // the sink zeroes its counters when it picks the setting up again
+        WdfSpinLockAcquire(pSink->sync);
+        InterlockedIncrement(&(pSink->Generation));
+        WdfSpinLockRelease(pSink->sync);
+    }
+
+    if (Blocks & (1 << UDEFX2_VR_STATS_INTERRUPT)) {
+        PINTR_STATE pIntrState = WdfDeviceGetIntrState(device);
+
+        InterlockedExchange64(&(pIntrState->Ring.Raised), 0);
+        InterlockedExchange64(&(pIntrState->Ring.Delivered), 0);
+        InterlockedExchange64(&(pIntrState->Ring.Overflows), 0);
+        InterlockedExchange64(&(pIntrState->Transfers), 0);
+        HistReset(&(pIntrState->Latency));
+    }
+
+    LogInfo(TRACE_DEVICE, "Counters reset, blocks %x", Blocks);
+}
+
+
+static const VENDOR_OPS IoVendorOps =
+{
+    IoVrReadStats,
+    IoVrSetBulkInPattern,
+    IoVrSetBulkOutSink,
+    IoVrResetCounters
+};
+
+
+static VOID
+IoEvtControlUrb(
+    _In_ WDFQUEUE Queue,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _In_ size_t InputBufferLength,
+    _In_ ULONG IoControlCode
+)
+{
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    PFLIGHT_RECORDER pRecorder = GetEndpointQueueContext(Queue)->Recorder;
+
+    //NT_VERIFY(IoControlCode == IOCTL_INTERNAL_USB_SUBMIT_URB);
+
+    if (IoControlCode == IOCTL_INTERNAL_USB_SUBMIT_URB)
+    {
+        // These are on the control pipe.
+        // Vendor requests go to the table in VendorRequest.c; anything else just succeeds.
+        WDF_USB_CONTROL_SETUP_PACKET setupPacket;
+        NTSTATUS status = UdecxUrbRetrieveControlSetupPacket(Request, &setupPacket);
+
+        if (!NT_SUCCESS(status))
+        {
+            LogError(TRACE_DEVICE, "WdfRequest %p is not a control URB? UdecxUrbRetrieveControlSetupPacket %!STATUS!",
+                Request, status);
+            UdecxUrbCompleteWithNtStatus(Request, status);
+            goto exit;
+        }
+
+        VENDOR_SETUP setup;
+        setup.bmRequestType = setupPacket.Packet.bm.Byte;
+        setup.bRequest = setupPacket.Packet.bRequest;
+        setup.wValue = setupPacket.Packet.wValue.Value;
+        setup.wIndex = setupPacket.Packet.wIndex.Value;
+        setup.wLength = setupPacket.Packet.wLength;
+
+        if (VrIsVendorRequest(&setup))
+        {
+            PUCHAR transferBuffer = NULL;
+            ULONG transferBufferLength = 0;
+            ULONG bytesDone = 0;
+
+            if (setup.wLength != 0) {
+                status = UdecxUrbRetrieveBuffer(Request, &transferBuffer, &transferBufferLength);
+            }
+            if (NT_SUCCESS(status)) {
+                status = VrDispatch(&IoVendorOps, GetEndpointQueueContext(Queue)->usbDeviceObj,
+                                    &setup, transferBuffer, transferBufferLength, &bytesDone);
+            }
+            if (!NT_SUCCESS(status)) {
+                // a failed control transfer is a STALL to the host
+                LogError(TRACE_DEVICE, "Vendor request %x failed %!STATUS!", setup.bRequest, status);
+            }
+
+            IoRecordUrb(pRecorder, FrEventComplete, USB_DEFAULT_ENDPOINT_ADDRESS, Request, bytesDone, status);
+            UdecxUrbSetBytesCompleted(Request, bytesDone);
+            UdecxUrbCompleteWithNtStatus(Request, status);
+            goto exit;
+        }
+
+        IoRecordUrb(pRecorder, FrEventComplete, USB_DEFAULT_ENDPOINT_ADDRESS, Request, 0, STATUS_SUCCESS);
+        UdecxUrbCompleteWithNtStatus(Request, STATUS_SUCCESS);
+    }
+    else
+    {
+        LogError(TRACE_DEVICE, "control NO submit code is %x", IoControlCode);
+    }
+exit:
+    return;
+}
+
+
+static int _Test_rebound = 0;
+
+
+//
+// Back-pressure from the mission request queue. Stopping the BULK OUT queue
+// leaves the host's URBs pending with us, which is how a device NAKing OUT
+// tokens looks from the host side; they get dispatched again on restart.
+//
+static VOID
+IoBulkOutFlowControl(
+    _In_ PVOID   Context,
+    _In_ BOOLEAN bThrottle
+)
+{
+    PIO_CONTEXT pIoContext = (PIO_CONTEXT)Context;
+
+    if (bThrottle) {
+        LogInfo(TRACE_DEVICE, "BULK OUT held off, mission requests are not being read");
+    } else {
+        LogInfo(TRACE_DEVICE, "BULK OUT resumed");
+    }
+
+    // striped requests the queue refused go first, before the pairs restart
+    if (!bThrottle && IO_BULK_STRIPED) {
+        StripeRetry(WdfDeviceGetStripeReassembler((UDECXUSBDEVICE)WdfObjectContextGetObject(pIoContext)));
+    }
+
+    // every pair feeds the same mission request queue
+    for (ULONG i = 0; i < EP_SLOTS; ++i) {
+        PEP_SLOT slot = EpAt(&(pIoContext->Endpoints), i);
+
+        if ((slot == NULL) || !(slot->Flags & EP_FLAG_FLOW_CONTROLLED) || (slot->Queue == NULL)) {
+            continue;
+        }
+        if (bThrottle) {
+            WdfIoQueueStop((WDFQUEUE)slot->Queue, NULL, WDF_NO_CONTEXT);
+        } else {
+            WdfIoQueueStart((WDFQUEUE)slot->Queue);
+            if (slot->Mode == EpModeOrdered) {
+                // what came in while stopped is not news to the queue, so no ready notification
+                OwPump(&(GetEndpointQueueContext((WDFQUEUE)slot->Queue)->Window));
+            }
+        }
+    }
+}
+
+
+
+C_ASSERT(UDEFX2_SINK_DISCARD == SinkDiscard);
+C_ASSERT(UDEFX2_SINK_PATTERN == SinkPattern);
+C_ASSERT(UDEFX2_SINK_CRC32C == SinkCrc32c);
+C_ASSERT(UDEFX2_SINK_MAX == SinkModeMax);
+
+
+NTSTATUS
+Io_SetBulkOutSink(
+    _In_ UDECXUSBDEVICE         Device,
+    _In_ PUDEFX2_SINK_CONFIG    Config
+)
+{
+    PBULK_OUT_SINK pSink = WdfDeviceGetBulkOutSink(Device);
+
+    if ((Config->Mode >= UDEFX2_SINK_MAX) ||
+        ((Config->Mode == UDEFX2_SINK_PATTERN) &&
+         ((Config->Pattern == UDEFX2_PATTERN_NONE) || (Config->Pattern >= UDEFX2_PATTERN_MAX)))) {
+        LogError(TRACE_DEVICE, "Invalid BULK OUT sink mode %d, pattern %d", Config->Mode, Config->Pattern);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    WdfSpinLockAcquire(pSink->sync);
+    pSink->Requested = *Config;
+    InterlockedIncrement(&(pSink->Generation));
+    WdfSpinLockRelease(pSink->sync);
+
+    LogInfo(TRACE_DEVICE, "BULK OUT sink set to mode %d, pattern %d, seed %I64x",
+        Config->Mode, Config->Pattern, Config->Seed);
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+Io_GetSinkStats(
+    _In_  UDECXUSBDEVICE        Device,
+    _Out_ PUDEFX2_SINK_STATS    Stats
+)
+{
+    PBULK_OUT_SINK pSink = WdfDeviceGetBulkOutSink(Device);
+
+    Stats->Mode = (ULONG)ReadNoFence(&(pSink->ActiveMode));
+    Stats->Reserved = 0;
+    Stats->Bytes = (ULONG64)ReadNoFence64(&(pSink->Sink.Stats.Bytes));
+    Stats->Transfers = (ULONG64)ReadNoFence64(&(pSink->Sink.Stats.Transfers));
+    Stats->Errors = (ULONG64)ReadNoFence64(&(pSink->Sink.Stats.Errors));
+    Stats->FirstErrorOffset = (ULONG64)ReadNoFence64(&(pSink->Sink.Stats.FirstErrorOffset));
+}
+
+
+//
+// Checks and drops a BULK OUT transfer, if a sink mode is selected.
+// Called from the BULK OUT window only, one URB at a time.
+//
+static BOOLEAN
+IoBulkOutSinkConsume(
+    _In_ UDECXUSBDEVICE Device,
+    _In_reads_bytes_(Length) PUCHAR Buffer,
+    _In_ ULONG Length
+)
+{
+    PBULK_OUT_SINK pSink = WdfDeviceGetBulkOutSink(Device);
+
+    if (ReadAcquire(&(pSink->Generation)) != pSink->Applied)
+    {
+        UDEFX2_SINK_CONFIG config;
+        LONG mode = UDEFX2_SINK_NONE;
+
+        WdfSpinLockAcquire(pSink->sync);
+        config = pSink->Requested;
+        pSink->Applied = pSink->Generation;
+        WdfSpinLockRelease(pSink->sync);
+
+        if ((config.Mode != UDEFX2_SINK_NONE) &&
+            NT_SUCCESS(SinkInit(&(pSink->Sink), (SINK_MODE)config.Mode, (PATTERN_KIND)config.Pattern,
+                                g_BulkMaxPacketSize, config.Seed))) {
+            mode = (LONG)config.Mode;
+        }
+        WriteNoFence(&(pSink->ActiveMode), mode);
+    }
+
+    if (pSink->ActiveMode == UDEFX2_SINK_NONE) {
+        return FALSE;
+    }
+
+    if (!SinkConsume(&(pSink->Sink), Buffer, Length)) {
+        LogError(TRACE_DEVICE, "BULK OUT sink: transfer of %d bytes failed verification", Length);
+    }
+    return TRUE;
+}
+
+
+//
+// Loopback (see UDEFX2_LOOPBACK_CONFIG). The BULK OUT and BULK IN windows
+// only park URBs; the pairing is left to whichever of them, or of
+// Io_SetLoopback, gets to run it, so both endpoints complete in order.
+//
+C_ASSERT((IO_LOOPBACK_RING_SIZE & (IO_LOOPBACK_RING_SIZE - 1)) == 0);
+
+//
+// A BULK IN URB takes what it can of the oldest transfer in the ring.
+//
+static VOID
+IoLoopbackFromRing(
+    _In_ PLOOPBACK  pLoopback,
+    _In_ WDFREQUEST InRequest,
+    _Out_ PIO_URB_DONE Done
+)
+{
+    PUCHAR inBuffer;
+    ULONG inLength;
+    PUCHAR data;
+    ULONG available;
+
+    NTSTATUS status = UdecxUrbRetrieveBuffer(InRequest, &inBuffer, &inLength);
+    if (!NT_SUCCESS(status)) {
+        IoUrbDone(Done, InRequest, g_BulkInEndpointAddress, 0, status);
+        return;
+    }
+
+    NT_VERIFY(LrPeek(&(pLoopback->Ring), &data, &available));
+    available = min(available, inLength);
+    memcpy(inBuffer, data, available);
+    LrConsume(&(pLoopback->Ring), available);
+
+    IoUrbDone(Done, InRequest, g_BulkInEndpointAddress, available, STATUS_SUCCESS);
+}
+
+
+//
+// Pairs up parked URBs, under sync, and returns the ones to complete.
+// A BULK OUT transfer is copied straight into a BULK IN URB when the ring
+// is empty and the URB can take it all; otherwise it goes through the ring.
+// It stays parked while the ring has no room for it.
+//
+static ULONG
+IoLoopbackPairUp(
+    _In_ PLOOPBACK   pLoopback,
+    _In_ PIO_CONTEXT pIoContext,
+    _Out_writes_to_(IO_LOOPBACK_BATCH, return) PIO_URB_DONE Done
+)
+{
+    ULONG count = 0;
+
+    WDFQUEUE outQueue = IoParkedQueue(pIoContext, g_BulkOutEndpointAddress);
+    WDFQUEUE inQueue = IoParkedQueue(pIoContext, g_BulkInEndpointAddress);
+
+    if ((outQueue == NULL) || (inQueue == NULL)) {
+        return 0;
+    }
+
+    while (count + 2 <= IO_LOOPBACK_BATCH)
+    {
+        WDFREQUEST request;
+        WDFREQUEST found;
+        WDFREQUEST inRequest = NULL;
+        PUCHAR outBuffer;
+        ULONG outLength;
+        ULONG inParked;
+
+        if (!ReadNoFence(&(pLoopback->bEnabled)))
+        {
+            // switched off: whatever is left goes back to the host
+            if (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(outQueue, &request))) {
+                IoUrbDone(&Done[count++], request, g_BulkOutEndpointAddress, 0, STATUS_CANCELLED);
+            } else if (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(inQueue, &request))) {
+                IoUrbDone(&Done[count++], request, g_BulkInEndpointAddress, 0, STATUS_CANCELLED);
+            } else {
+                LrReset(&(pLoopback->Ring));
+                break;
+            }
+            continue;
+        }
+
+        // the ring first, so data goes back out in the order it came in
+        if (!LrIsEmpty(&(pLoopback->Ring)) &&
+            NT_SUCCESS(WdfIoQueueRetrieveNextRequest(inQueue, &request)))
+        {
+            IoLoopbackFromRing(pLoopback, request, &Done[count++]);
+            continue;
+        }
+
+        // the oldest BULK OUT URB is only taken off its queue once it has somewhere to go
+        if (!NT_SUCCESS(WdfIoQueueFindRequest(outQueue, NULL, NULL, NULL, &found))) {
+            break;
+        }
+
+        NTSTATUS status = UdecxUrbRetrieveBuffer(found, &outBuffer, &outLength);
+        if (NT_SUCCESS(status) && (outLength > UDEFX2_LOOPBACK_MAX_TRANSFER)) {
+            status = STATUS_INVALID_BUFFER_SIZE;
+        }
+
+        WdfIoQueueGetState(inQueue, &inParked, NULL);
+        BOOLEAN bToIn = NT_SUCCESS(status) && LrIsEmpty(&(pLoopback->Ring)) && (inParked != 0);
+
+        if (NT_SUCCESS(status) && !bToIn && !LrHasRoom(&(pLoopback->Ring), outLength)) {
+            // until BULK IN makes room
+            WdfObjectDereference(found);
+            break;
+        }
+
+        NTSTATUS retrieved = WdfIoQueueRetrieveFoundRequest(outQueue, found, &request);
+        WdfObjectDereference(found);
+        if (!NT_SUCCESS(retrieved)) {
+            // canceled in the meantime
+            continue;
+        }
+
+        if (!NT_SUCCESS(status)) {
+            if (status == STATUS_INVALID_BUFFER_SIZE) {
+                pLoopback->Stats.Rejected++;
+            }
+            IoUrbDone(&Done[count++], request, g_BulkOutEndpointAddress, 0, status);
+            continue;
+        }
+
+        pLoopback->Stats.Transfers++;
+        pLoopback->Stats.Bytes += outLength;
+
+        if (bToIn && NT_SUCCESS(WdfIoQueueRetrieveNextRequest(inQueue, &inRequest)))
+        {
+            PUCHAR inBuffer;
+            ULONG inLength;
+
+            if (NT_SUCCESS(UdecxUrbRetrieveBuffer(inRequest, &inBuffer, &inLength)) && (inLength >= outLength))
+            {
+                // the one copy
+                memcpy(inBuffer, outBuffer, outLength);
+                pLoopback->Stats.Direct++;
+                IoUrbDone(&Done[count++], inRequest, g_BulkInEndpointAddress, outLength, STATUS_SUCCESS);
+                IoUrbDone(&Done[count++], request, g_BulkOutEndpointAddress, outLength, STATUS_SUCCESS);
+                continue;
+            }
+        }
+
+        // the ring is empty if bToIn, and has been checked for room otherwise
+        NT_VERIFY(LrPush(&(pLoopback->Ring), outBuffer, outLength));
+        IoUrbDone(&Done[count++], request, g_BulkOutEndpointAddress, outLength, STATUS_SUCCESS);
+
+        if (inRequest != NULL) {
+            IoLoopbackFromRing(pLoopback, inRequest, &Done[count++]);
+        }
+    }
+
+    return count;
+}
+
+
+//
+// Runs the loopback until there is nothing left to pair up. Whoever finds
+// it running leaves its URBs to the runner.
+//
+static VOID
+IoLoopbackRun(
+    _In_ UDECXUSBDEVICE Device
+)
+{
+    PLOOPBACK pLoopback = WdfDeviceGetLoopback(Device);
+    PIO_CONTEXT pIoContext = WdfDeviceGetIoContext(Device);
+    PFLIGHT_RECORDER pRecorder = WdfDeviceGetFlightRecorder(Device);
+    IO_URB_DONE done[IO_LOOPBACK_BATCH];
+    ULONG count;
+
+    WdfSpinLockAcquire(pLoopback->sync);
+    if (pLoopback->bRunning) {
+        pLoopback->bAgain = TRUE;
+        WdfSpinLockRelease(pLoopback->sync);
+        return;
+    }
+    pLoopback->bRunning = TRUE;
+
+    do {
+        pLoopback->bAgain = FALSE;
+        count = IoLoopbackPairUp(pLoopback, pIoContext, done);
+        WdfSpinLockRelease(pLoopback->sync);
+
+        IoCompleteUrbs(pRecorder, done, count);
+
+        WdfSpinLockAcquire(pLoopback->sync);
+    } while ((count != 0) || pLoopback->bAgain);
+
+    pLoopback->bRunning = FALSE;
+    WdfSpinLockRelease(pLoopback->sync);
+}
+
+
+//
+// Parks a first-pair URB with the loopback, if it is on; FALSE otherwise.
+// The loopback completes it.
+//
+static BOOLEAN
+IoLoopbackTake(
+    _In_ PENDPOINTQUEUE_CONTEXT pEpQContext,
+    _In_ WDFREQUEST Request,
+    _In_ ULONG      Length
+)
+{
+    UDECXUSBDEVICE device = pEpQContext->usbDeviceObj;
+    UCHAR endpoint = pEpQContext->Slot->Address;
+
+    if ((pEpQContext->Slot->Ordinal != 0) || !ReadNoFence(&(WdfDeviceGetLoopback(device)->bEnabled))) {
+        return FALSE;
+    }
+
+    IoRecordUrb(pEpQContext->Recorder, FrEventPend, endpoint, Request, Length, STATUS_PENDING);
+
+    NTSTATUS status = WdfRequestForwardToIoQueue(Request, (WDFQUEUE)pEpQContext->Slot->Parked);
+    if (!NT_SUCCESS(status)) {
+        LogError(TRACE_DEVICE, "ERROR: Unable to forward Request %p to the loopback %!STATUS!", Request, status);
+        IoRecordUrb(pEpQContext->Recorder, FrEventComplete, endpoint, Request, 0, status);
+        UdecxUrbCompleteWithNtStatus(Request, status);
+        return TRUE;
+    }
+
+    // paired up, or handed back if switched off meanwhile
+    IoLoopbackRun(device);
+    return TRUE;
+}
+
+
+NTSTATUS
+Io_SetLoopback(
+    _In_ UDECXUSBDEVICE             Device,
+    _In_ PUDEFX2_LOOPBACK_CONFIG    Config
+)
+{
+    PLOOPBACK pLoopback = WdfDeviceGetLoopback(Device);
+
+    if (Config->Enable > 1) {
+        LogError(TRACE_DEVICE, "Invalid loopback setting %d", Config->Enable);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    WdfSpinLockAcquire(pLoopback->sync);
+    if (Config->Enable && !pLoopback->bEnabled) {
+        RtlZeroMemory(&(pLoopback->Stats), sizeof(pLoopback->Stats));
+    }
+    WriteNoFence(&(pLoopback->bEnabled), (LONG)Config->Enable);
+    WdfSpinLockRelease(pLoopback->sync);
+
+    LogInfo(TRACE_DEVICE, "BULK loopback %s", Config->Enable ? "on" : "off");
+
+    // hands back what it held, if switched off
+    IoLoopbackRun(Device);
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+Io_GetLoopbackStats(
+    _In_  UDECXUSBDEVICE            Device,
+    _Out_ PUDEFX2_LOOPBACK_STATS    Stats
+)
+{
+    PLOOPBACK pLoopback = WdfDeviceGetLoopback(Device);
+
+    WdfSpinLockAcquire(pLoopback->sync);
+    *Stats = pLoopback->Stats;
+    Stats->Enabled = (ULONG)pLoopback->bEnabled;
+    Stats->Reserved = 0;
+    WdfSpinLockRelease(pLoopback->sync);
+}
+
+
+static VOID
+IoEvtBulkOutUrb(
+    _In_ WDFQUEUE Queue,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _In_ size_t InputBufferLength,
+    _In_ ULONG IoControlCode
+)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG transferBufferLength = 0;
+
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    PENDPOINTQUEUE_CONTEXT pEpQContext = GetEndpointQueueContext(Queue);
+    WDFDEVICE backchannel = pEpQContext->backChannelDevice;
+    PUDECX_BACKCHANNEL_CONTEXT pBackChannelContext = GetBackChannelContext(backchannel);
+
+    if (IoControlCode != IOCTL_INTERNAL_USB_SUBMIT_URB)
+    {
+        LogError(TRACE_DEVICE, "WdfRequest BOUT %p Incorrect IOCTL %x, %!STATUS!",
+            Request, IoControlCode, status);
+        status = STATUS_INVALID_PARAMETER;
+        goto exit;
+    }
+
+    PUCHAR transferBuffer;
+    status = UdecxUrbRetrieveBuffer(Request, &transferBuffer, &transferBufferLength);
+    if (!NT_SUCCESS(status))
+    {
+        LogError(TRACE_DEVICE, "WdfRequest BOUT %p unable to retrieve buffer %!STATUS!",
+            Request, status);
+        goto exit;
+    }
+
+    // sink mode: checked, counted and dropped, the back-channel never sees it
+    if ((pEpQContext->Slot->Ordinal == 0) &&
+        IoBulkOutSinkConsume(pEpQContext->usbDeviceObj, transferBuffer, transferBufferLength))
+    {
+        goto exit;
+    }
+
+    // loopback: back out through BULK IN, the back-channel never sees it
+    if (IoLoopbackTake(pEpQContext, Request, transferBufferLength))
+    {
+        return;
+    }
+
+    // a stripe chunk: whatever mission requests it completes are queued from in there;
+    // if the one it completes finds no room, the chunk is failed and the host sends it again
+    if (IO_BULK_STRIPED)
+    {
+        status = StripeAccept(WdfDeviceGetStripeReassembler(pEpQContext->usbDeviceObj), transferBuffer, transferBufferLength);
+        if (!NT_SUCCESS(status))
+        {
+            LogError(TRACE_DEVICE, "WdfRequest BOUT %p chunk of %d bytes not taken %!STATUS!", Request, transferBufferLength, status);
+            transferBufferLength = 0;
+        }
+        goto exit;
+    }
+
+    // a mission the driver runs itself never goes to the back-channel
+    status = MxSubmit(&(WdfDeviceGetMissionState(pEpQContext->usbDeviceObj)->Exec), transferBuffer, transferBufferLength);
+    if (status != STATUS_NOT_SUPPORTED)
+    {
+        if (!NT_SUCCESS(status))
+        {
+            LogError(TRACE_DEVICE, "WdfRequest BOUT %p mission of %d bytes refused %!STATUS!", Request, transferBufferLength, status);
+        }
+        goto exit;
+    }
+
+    // hand the mission to back-channel reads that may be waiting for it; what they cannot take is queued
+    ULONG readsCompleted;
+    BOOLEAN bTaken = FALSE;
+    if (BACKCHANNEL_DEFERRED_MISSION_REQUESTS)
+    {
+        // recorded first: once taken, the read that drains it may complete it before the push returns
+        IoRecordUrb(pEpQContext->Recorder, FrEventPend, pEpQContext->Slot->Address, Request, transferBufferLength, STATUS_PENDING);
+        status = WRQueuePushWriteDeferred(
+            &(pBackChannelContext->missionRequest),
+            WRQUEUE_LANE_NORMAL,
+            Request,
+            transferBuffer,
+            transferBufferLength,
+            &readsCompleted,
+            &bTaken);
+    } else {
+        status = WRQueuePushWrite(
+            &(pBackChannelContext->missionRequest),
+            WRQUEUE_LANE_NORMAL,
+            transferBuffer,
+            transferBufferLength,
+            &readsCompleted);
+    }
+
+    if (bTaken)
+    {
+        // completed by the read that drains it, maybe already
+        return;
+    }
+
+exit:
+    // writes not parked are completed right away
+    IoRecordUrb(pEpQContext->Recorder, FrEventComplete, pEpQContext->Slot->Address, Request, transferBufferLength, status);
+    UdecxUrbSetBytesCompleted(Request, transferBufferLength);
+    UdecxUrbCompleteWithNtStatus(Request, status);
+    return;
+}
+
+
+
+
+
+C_ASSERT(UDEFX2_PATTERN_ZEROS == PatternZeros);
+C_ASSERT(UDEFX2_PATTERN_COUNTER == PatternCounter);
+C_ASSERT(UDEFX2_PATTERN_MOD63 == PatternMod63);
+C_ASSERT(UDEFX2_PATTERN_PRBS31 == PatternPrbs31);
+C_ASSERT(UDEFX2_PATTERN_RANDOM == PatternRandom);
+C_ASSERT(UDEFX2_PATTERN_MAX == PatternKindMax);
+
+
+NTSTATUS
+Io_SetBulkInPattern(
+    _In_ UDECXUSBDEVICE         Device,
+    _In_ PUDEFX2_PATTERN_CONFIG Config
+)
+{
+    PBULK_IN_SOURCE pSource = WdfDeviceGetBulkInSource(Device);
+
+    if (Config->Pattern >= UDEFX2_PATTERN_MAX) {
+        LogError(TRACE_DEVICE, "Unknown BULK IN pattern %d", Config->Pattern);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    WdfSpinLockAcquire(pSource->sync);
+    pSource->Requested = *Config;
+    InterlockedIncrement(&(pSource->Generation));
+    WdfSpinLockRelease(pSource->sync);
+
+    LogInfo(TRACE_DEVICE, "BULK IN pattern set to %d, seed %I64x", Config->Pattern, Config->Seed);
+    return STATUS_SUCCESS;
+}
+
+
+//
+// Fills a BULK IN transfer from the pattern generator, if one is selected.
+// Called from the BULK IN window only, one URB at a time.
+//
+static BOOLEAN
+IoBulkInPatternFill(
+    _In_ UDECXUSBDEVICE Device,
+    _Out_writes_bytes_(Length) PUCHAR Buffer,
+    _In_ ULONG Length
+)
+{
+    PBULK_IN_SOURCE pSource = WdfDeviceGetBulkInSource(Device);
+
+    if (ReadAcquire(&(pSource->Generation)) != pSource->Applied)
+    {
+        UDEFX2_PATTERN_CONFIG config;
+
+        WdfSpinLockAcquire(pSource->sync);
+        config = pSource->Requested;
+        pSource->Applied = pSource->Generation;
+        WdfSpinLockRelease(pSource->sync);
+
+        pSource->bActive = (config.Pattern != UDEFX2_PATTERN_NONE) &&
+            NT_SUCCESS(PatternInit(&(pSource->Generator), (PATTERN_KIND)config.Pattern, g_BulkMaxPacketSize, config.Seed));
+    }
+
+    if (!pSource->bActive) {
+        return FALSE;
+    }
+
+    PatternFill(&(pSource->Generator), Buffer, Length);
+    return TRUE;
+}
+
+
+static VOID
+IoEvtBulkInUrb(
+    _In_ WDFQUEUE Queue,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _In_ size_t InputBufferLength,
+    _In_ ULONG IoControlCode
+)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+    PENDPOINTQUEUE_CONTEXT pEpQContext = GetEndpointQueueContext(Queue);
+    WDFDEVICE backchannel = pEpQContext->backChannelDevice;
+    PUDECX_BACKCHANNEL_CONTEXT pBackChannelContext = GetBackChannelContext(backchannel);
+
+    if (IoControlCode != IOCTL_INTERNAL_USB_SUBMIT_URB)
+    {
+        LogError(TRACE_DEVICE, "WdfRequest BIN %p Incorrect IOCTL %x, %!STATUS!",
+            Request, IoControlCode, status);
+        status = STATUS_INVALID_PARAMETER;
+        goto exit;
+    }
+
+    PUCHAR transferBuffer;
+    ULONG transferBufferLength;
+    status = UdecxUrbRetrieveBuffer(Request, &transferBuffer, &transferBufferLength);
+    if (!NT_SUCCESS(status))
+    {
+        LogError(TRACE_DEVICE, "WdfRequest BIN %p unable to retrieve buffer %!STATUS!",
+            Request, status);
+        goto exit;
+    }
+
+    // pattern source: no back-channel round trip, the data is made up right here
+    if ((pEpQContext->Slot->Ordinal == 0) &&
+        IoBulkInPatternFill(pEpQContext->usbDeviceObj, transferBuffer, transferBufferLength))
+    {
+        IoRecordUrb(pEpQContext->Recorder, FrEventComplete, g_BulkInEndpointAddress, Request, transferBufferLength, STATUS_SUCCESS);
+        UdecxUrbSetBytesCompleted(Request, transferBufferLength);
+        UdecxUrbCompleteWithNtStatus(Request, STATUS_SUCCESS);
+        goto exit;
+    }
+
+    // loopback: whatever BULK OUT sent
+    if (IoLoopbackTake(pEpQContext, Request, transferBufferLength))
+    {
+        goto exit;
+    }
+
+    // try to get us information about a request that may be waiting for this info;
+    // recorded first: once parked, a write may complete it before the pull returns
+    SIZE_T completeBytes = 0;
+    BOOLEAN bReady = FALSE;
+    IoRecordUrb(pEpQContext->Recorder, FrEventPend, pEpQContext->Slot->Address, Request, transferBufferLength, STATUS_PENDING);
+    status = WRQueuePullRead(
+        &(pBackChannelContext->missionCompletion),
+        Request,
+        transferBuffer,
+        transferBufferLength,
+        &bReady,
+        &completeBytes);
+
+    if (bReady)
+    {
+        IoRecordUrb(pEpQContext->Recorder, FrEventComplete, pEpQContext->Slot->Address, Request, completeBytes, status);
+        UdecxUrbSetBytesCompleted(Request, (ULONG)completeBytes);
+        UdecxUrbCompleteWithNtStatus(Request, status);
+    }
+
+
+exit:
+    return;
+}
+
+
+static VOID
+IoEvtCancelParkedUrb(
+    IN WDFQUEUE Queue,
+    IN WDFREQUEST  Request
+)
+{
+    UNREFERENCED_PARAMETER(Queue);
+    LogInfo(TRACE_DEVICE, "Canceling parked request %p", Request);
+    UdecxUrbCompleteWithNtStatus(Request, STATUS_CANCELLED);
+}
+
+
+//
+// How many events an INTERRUPT IN URB takes: one if it is the size of the
+// original DEVICE_INTR_FLAGS format, as many as fit if it is large enough
+// for an event packet (see IntrPacket.h), none otherwise.
+//
+static ULONG
+IoInterruptUrbCapacity(
+    _In_ WDFREQUEST request)
+{
+    PUCHAR transferBuffer;
+    ULONG transferBufferLength;
+
+    if (!NT_SUCCESS(UdecxUrbRetrieveBuffer(request, &transferBuffer, &transferBufferLength))) {
+        return 0;
+    }
+    if (transferBufferLength == sizeof(DEVICE_INTR_FLAGS)) {
+        return 1;
+    }
+    return IntrPacketCapacity(transferBufferLength);
+}
+
+
+static VOID
+IoCompletePendingRequest(
+    _In_ WDFREQUEST request,
+    _In_ PINTR_STATE pIntrState,
+    _In_ PFLIGHT_RECORDER pRecorder,
+    _In_reads_(EventCount) PRING_EVENT Events,
+    _In_ ULONG EventCount)
+{
+    PUCHAR transferBuffer;
+    ULONG transferBufferLength;
+    ULONG bytesCompleted = 0;
+
+    NTSTATUS status = UdecxUrbRetrieveBuffer(request, &transferBuffer, &transferBufferLength);
+    if (!NT_SUCCESS(status))
+    {
+        LogError(TRACE_DEVICE, "WdfRequest  %p unable to retrieve buffer %!STATUS!",
+            request, status);
+        goto exit;
+    }
+
+    if (EventCount == 0)
+    {
+        LogError(TRACE_DEVICE, "Error: req %p Invalid interrupt buffer size, %d",
+            request, transferBufferLength);
+        status = STATUS_INVALID_BLOCK_LENGTH;
+        goto exit;
+    }
+
+    if (transferBufferLength == sizeof(DEVICE_INTR_FLAGS))
+    {
+        NT_ASSERT(EventCount == 1);
+        memcpy(transferBuffer, &(Events[0].Flags), sizeof(DEVICE_INTR_FLAGS));
+        bytesCompleted = sizeof(DEVICE_INTR_FLAGS);
+    }
+    else
+    {
+        INTR_PACKET_RECORD records[INTR_PACKET_MAX_EVENTS];
+
+        for (ULONG i = 0; i < EventCount; ++i) {
+            records[i].Flags = Events[i].Flags;
+            records[i].Sequence = Events[i].Sequence;
+        }
+        bytesCompleted = (ULONG)IntrPacketEncode(transferBuffer, transferBufferLength, records, EventCount,
+            (ULONG)ReadNoFence64(&(pIntrState->Ring.Overflows)));
+    }
+    InterlockedIncrement64(&(pIntrState->Transfers));
+
+    ULONG64 now = OsTimestamp();
+    for (ULONG i = 0; i < EventCount; ++i) {
+        HistRecord(&(pIntrState->Latency), now - Events[i].RaiseTime);
+    }
+
+    UdecxUrbSetBytesCompleted(request, bytesCompleted);
+
+exit:
+    IoRecordUrb(pRecorder, FrEventComplete, g_InterruptEndpointAddress, request, bytesCompleted, status);
+    UdecxUrbCompleteWithNtStatus(request, status);
+    return;
+}
+
+
+//
+// Hands pending events to pending INTERRUPT IN URBs, oldest to oldest, once
+// moderation says they are due; until then, the timer is set for when they
+// will be. Due events are flushed all together, as far as there are URBs
+// for them; if there are not enough, the device signals wake.
+//
+static VOID
+IoDeliverInterruptEvents(
+    _In_ UDECXUSBDEVICE Device
+)
+{
+    PIO_CONTEXT pIoContext = WdfDeviceGetIoContext(Device);
+    PINTR_STATE pIntrState = WdfDeviceGetIntrState(Device);
+    PFLIGHT_RECORDER pRecorder = WdfDeviceGetFlightRecorder(Device);
+    ULONG flushing = 0;
+    ULONG64 armDelay = 0;
+    BOOLEAN bWake = FALSE;
+
+    for (;;)
+    {
+        RING_EVENT events[INTR_PACKET_MAX_EVENTS];
+        WDFREQUEST request = NULL;
+        ULONG count = 0;
+
+        // pair them up under the lock, but complete outside of it
+        WdfSpinLockAcquire(pIntrState->sync);
+
+        ULONG pending = EvRingCount(&(pIntrState->Ring));
+        if (pending == 0) {
+            WdfSpinLockRelease(pIntrState->sync);
+            break;
+        }
+
+        // once a batch is out, whatever came in meanwhile starts the next one
+        if (flushing == 0) {
+            RING_EVENT oldest;
+            ULONG64 wait;
+
+            NT_VERIFY(EvRingPeek(&(pIntrState->Ring), &oldest));
+            if (EvModerationDue(&(pIntrState->Moderation), pending, oldest.RaiseTime, OsTimestamp(), &wait)) {
+                flushing = pending;
+            } else {
+                if (!pIntrState->bTimerArmed && !pIoContext->bStopping) {
+                    pIntrState->bTimerArmed = TRUE;
+                    armDelay = wait;
+                }
+                WdfSpinLockRelease(pIntrState->sync);
+                break;
+            }
+        }
+
+        WDFQUEUE parked = IoParkedQueue(pIoContext, g_InterruptEndpointAddress);
+        if ((parked == NULL) ||
+            !NT_SUCCESS(WdfIoQueueRetrieveNextRequest(parked, &request))) {
+            // no URB left to take them?  it is safe to assume the device is sleeping
+            WdfSpinLockRelease(pIntrState->sync);
+            bWake = TRUE;
+            break;
+        }
+        count = EvRingPop(&(pIntrState->Ring), events, min(flushing, IoInterruptUrbCapacity(request)));
+        flushing -= count;
+        WdfSpinLockRelease(pIntrState->sync);
+
+        IoCompletePendingRequest(request, pIntrState, pRecorder, events, count);
+    }
+
+    if (armDelay != 0) {
+        WdfTimerStart(pIntrState->Timer,
+            WDF_REL_TIMEOUT_IN_US(((armDelay * 1000000) / OsTimestampFrequency()) + 1));
+    }
+
+    if (bWake) {
+        LogInfo(TRACE_DEVICE, "Interrupt events pending, waking device");
+        UdecxUsbDeviceSignalWake(Device);
+    }
+}
+
+
+static VOID
+IoEvtInterruptModerationTimer(
+    _In_ WDFTIMER Timer
+)
+{
+    UDECXUSBDEVICE device = (UDECXUSBDEVICE)WdfTimerGetParentObject(Timer);
+    PINTR_STATE pIntrState = WdfDeviceGetIntrState(device);
+
+    WdfSpinLockAcquire(pIntrState->sync);
+    pIntrState->bTimerArmed = FALSE;
+    WdfSpinLockRelease(pIntrState->sync);
+
+    IoDeliverInterruptEvents(device);
+}
+
+
+
+NTSTATUS
+Io_RaiseInterrupt(
+    _In_ UDECXUSBDEVICE    Device,
+    _In_ DEVICE_INTR_FLAGS LatestStatus )
+{
+    PINTR_STATE pIntrState = WdfDeviceGetIntrState(Device);
+    BOOLEAN bQueued;
+
+    WdfSpinLockAcquire(pIntrState->RaiseLock);
+    bQueued = EvRingPush(&(pIntrState->Ring), LatestStatus);
+    WdfSpinLockRelease(pIntrState->RaiseLock);
+
+    if (!bQueued) {
+        LogError(TRACE_DEVICE, "Interrupt event %x dropped, %d already pending",
+            LatestStatus, EVENT_RING_CAPACITY);
+    }
+
+    IoDeliverInterruptEvents(Device);
+
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+Io_SetInterruptModeration(
+    _In_ UDECXUSBDEVICE                 Device,
+    _In_ PUDEFX2_INTERRUPT_MODERATION   Setting
+)
+{
+    PINTR_STATE pIntrState = WdfDeviceGetIntrState(Device);
+
+    if ((Setting->MaxDelayUs > UDEFX2_MODERATION_MAX_DELAY_US) ||
+        (Setting->MaxBatch == 0) || (Setting->MaxBatch > EVENT_RING_CAPACITY)) {
+        LogError(TRACE_DEVICE, "Invalid interrupt moderation, delay %dus batch %d",
+            Setting->MaxDelayUs, Setting->MaxBatch);
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    WdfSpinLockAcquire(pIntrState->sync);
+    pIntrState->ModerationSetting = *Setting;
+    pIntrState->Moderation.MaxDelay = (Setting->MaxDelayUs * OsTimestampFrequency()) / 1000000;
+    pIntrState->Moderation.MaxBatch = Setting->MaxBatch;
+    WdfSpinLockRelease(pIntrState->sync);
+
+    LogInfo(TRACE_DEVICE, "Interrupt moderation set to %dus, batch %d", Setting->MaxDelayUs, Setting->MaxBatch);
+
+    // held events may be due under the new setting
+    IoDeliverInterruptEvents(Device);
+    return STATUS_SUCCESS;
+}
+
+
+VOID
+Io_GetInterruptStats(
+    _In_  UDECXUSBDEVICE            Device,
+    _Out_ PUDEFX2_INTERRUPT_STATS   Stats
+)
+{
+    PINTR_STATE pIntrState = WdfDeviceGetIntrState(Device);
+
+    Stats->TimestampFrequency = OsTimestampFrequency();
+    Stats->Raised = (ULONG64)ReadNoFence64(&(pIntrState->Ring.Raised));
+    Stats->Delivered = (ULONG64)ReadNoFence64(&(pIntrState->Ring.Delivered));
+    Stats->Overflows = (ULONG64)ReadNoFence64(&(pIntrState->Ring.Overflows));
+    Stats->Transfers = (ULONG64)ReadNoFence64(&(pIntrState->Transfers));
+    Stats->Pending = EvRingCount(&(pIntrState->Ring));
+    Stats->Capacity = EVENT_RING_CAPACITY;
+
+    WdfSpinLockAcquire(pIntrState->sync);
+    Stats->MaxDelayUs = pIntrState->ModerationSetting.MaxDelayUs;
+    Stats->MaxBatch = pIntrState->ModerationSetting.MaxBatch;
+    WdfSpinLockRelease(pIntrState->sync);
+
+    HistRead(&(pIntrState->Latency), (PULONG64)&(Stats->Latency));
+}
+
+
+
+C_ASSERT(sizeof(UDEFX2_FLIGHT_RECORD) == sizeof(FR_RECORD));
+C_ASSERT(FIELD_OFFSET(UDEFX2_FLIGHT_RECORD, Sequence) == FIELD_OFFSET(FR_RECORD, Sequence));
+C_ASSERT(UDEFX2_FLIGHT_EVENT_COMPLETE == FrEventComplete);
+C_ASSERT(UDEFX2_FLIGHT_EVENT_PEND == FrEventPend);
+
+
+VOID
+Io_DumpFlightRecorder(
+    _In_  UDECXUSBDEVICE        Device,
+    _Out_writes_bytes_(Length) PUDEFX2_FLIGHT_DUMP Dump,
+    _In_  size_t                Length,
+    _Out_ size_t              * Written
+)
+{
+    PFLIGHT_RECORDER pRecorder = WdfDeviceGetFlightRecorder(Device);
+    size_t room = (Length - FIELD_OFFSET(UDEFX2_FLIGHT_DUMP, Records)) / sizeof(UDEFX2_FLIGHT_RECORD);
+
+    NT_ASSERT(Length >= FIELD_OFFSET(UDEFX2_FLIGHT_DUMP, Records));
+
+    Dump->Version = UDEFX2_FLIGHT_DUMP_VERSION;
+    Dump->RecordSize = sizeof(UDEFX2_FLIGHT_RECORD);
+    Dump->Rings = pRecorder->RingMask + 1;
+    Dump->TimestampFrequency = OsTimestampFrequency();
+    Dump->Count = FrDump(pRecorder, (PFR_RECORD)Dump->Records, (ULONG)min(room, MAXULONG), &(Dump->Recorded));
+
+    *Written = FIELD_OFFSET(UDEFX2_FLIGHT_DUMP, Records) + (Dump->Count * sizeof(UDEFX2_FLIGHT_RECORD));
+}
+
+
+
+static VOID
+IoEvtInterruptInUrb(
+    _In_ WDFQUEUE Queue,
+    _In_ WDFREQUEST Request,
+    _In_ size_t OutputBufferLength,
+    _In_ size_t InputBufferLength,
+    _In_ ULONG IoControlCode
+)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+
+
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    UNREFERENCED_PARAMETER(InputBufferLength);
+
+
+    PENDPOINTQUEUE_CONTEXT pEpQContext = GetEndpointQueueContext(Queue);
+
+    UDECXUSBDEVICE tgtDevice = pEpQContext->usbDeviceObj;
+
+
+    if (IoControlCode != IOCTL_INTERNAL_USB_SUBMIT_URB)   {
+        LogError(TRACE_DEVICE, "Invalid Interrupt/IN out IOCTL code %x", IoControlCode);
+        status = STATUS_ACCESS_DENIED;
+        goto exit;
+    }
+
+    // parked behind the URBs already waiting, then served when events are due
+    status = WdfRequestForwardToIoQueue(Request, (WDFQUEUE)pEpQContext->Slot->Parked);
+    if (NT_SUCCESS(status)) {
+        IoRecordUrb(pEpQContext->Recorder, FrEventPend, g_InterruptEndpointAddress, Request, 0, STATUS_PENDING);
+        IoDeliverInterruptEvents(tgtDevice);
+    } else {
+        LogError(TRACE_DEVICE, "ERROR: Unable to forward Request %p error %!STATUS!", Request, status);
+        UdecxUrbCompleteWithNtStatus(Request, status);
+    }
+
+exit:
+    return;
+}
+
+
+//
+// Isochronous pair. URBs are parked as they come in, and go through the
+// scheduler (IsoSched.h) a packet a microframe, from the periodic timer;
+// each is completed once its last microframe is run. The host's
+// StartFrame is not honoured: every URB starts as soon as possible, and
+// gets its actual start frame back.
+//
+static PURB
+IoUrbOf(
+    _In_ WDFREQUEST Request
+)
+{
+    WDF_REQUEST_PARAMETERS params;
+
+    WDF_REQUEST_PARAMETERS_INIT(&params);
+    WdfRequestGetParameters(Request, &params);
+    return (PURB)params.Parameters.Others.Arg1;
+}
+
+
+//
+// Packets must lie within the buffer, in order.
+//
+static BOOLEAN
+IoIsochUrbValid(
+    _In_ PURB  Urb,
+    _In_ ULONG BufferLength
+)
+{
+    struct _URB_ISOCH_TRANSFER *pIsoch = &(Urb->UrbIsochronousTransfer);
+
+    if ((Urb->UrbHeader.Function != URB_FUNCTION_ISOCH_TRANSFER) || (pIsoch->NumberOfPackets == 0)) {
+        return FALSE;
+    }
+
+    for (ULONG i = 0; i < pIsoch->NumberOfPackets; ++i) {
+        ULONG end = (i + 1 < pIsoch->NumberOfPackets) ? pIsoch->IsoPacket[i + 1].Offset : BufferLength;
+
+        if ((pIsoch->IsoPacket[i].Offset > end) || (end > BufferLength)) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+
+//
+// Runs a stream's microframes due by Now, under sync; returns the URBs it
+// is done with.
+//
+static ULONG
+IoIsochRun(
+    _Inout_ PISOCH_STREAM pStream,
+    _In_opt_ WDFQUEUE Pending,
+    _In_ UCHAR Endpoint,
+    _In_ ULONG64 Now,
+    _Out_writes_to_(IO_ISOCH_MAX_LAG, return) PIO_URB_DONE Done
+)
+{
+    ULONG count = 0;
+    ULONG due = IsoFramesDue(&(pStream->Sched), Now, IO_ISOCH_MAX_LAG);
+
+    for (ULONG frame = 0; frame < due; ++frame)
+    {
+        struct _URB_ISOCH_TRANSFER *pIsoch = NULL;
+        PUCHAR packet = NULL;
+        ULONG length = 0;
+
+        // the next URB starts on this microframe
+        if ((pStream->Current == NULL) && (Pending != NULL) &&
+            NT_SUCCESS(WdfIoQueueRetrieveNextRequest(Pending, &(pStream->Current))))
+        {
+            NT_VERIFY(NT_SUCCESS(UdecxUrbRetrieveBuffer(pStream->Current, &(pStream->Buffer), &(pStream->BufferLength))));
+            pStream->NextPacket = 0;
+            pStream->Bytes = 0;
+            IoUrbOf(pStream->Current)->UrbIsochronousTransfer.StartFrame = (ULONG)pStream->Sched.NextFrame;
+        }
+
+        if (pStream->Current != NULL) {
+            pIsoch = &(IoUrbOf(pStream->Current)->UrbIsochronousTransfer);
+
+            ULONG offset = pIsoch->IsoPacket[pStream->NextPacket].Offset;
+            ULONG end = (pStream->NextPacket + 1 < pIsoch->NumberOfPackets) ?
+                        pIsoch->IsoPacket[pStream->NextPacket + 1].Offset : pStream->BufferLength;
+
+            packet = pStream->Buffer + offset;
+            length = end - offset;
+        }
+
+        ULONG moved = IsoRunFrame(&(pStream->Sched), Now, packet, length);
+
+        if (pIsoch == NULL) {
+            continue;
+        }
+
+        if (pStream->Sched.Direction == IsoDirectionIn) {
+            pIsoch->IsoPacket[pStream->NextPacket].Length = moved;
+        }
+        pIsoch->IsoPacket[pStream->NextPacket].Status = USBD_STATUS_SUCCESS;
+        pStream->Bytes += moved;
+
+        if (++(pStream->NextPacket) == pIsoch->NumberOfPackets) {
+            pIsoch->ErrorCount = 0;
+            pStream->Transfers++;
+            IoUrbDone(&Done[count++], pStream->Current, Endpoint,
+                (pStream->Sched.Direction == IsoDirectionIn) ? pStream->Bytes : pStream->BufferLength,
+                STATUS_SUCCESS);
+            pStream->Current = NULL;
+        }
+    }
 
-        // this is a back-channel read, not a USB read!
-        status = WdfRequestRetrieveOutputBuffer(matchingRead, 1, &rbuffer, &rlen);
-        SIZE_T completeBytes = 0;
+    return count;
+}
 
-        if (!NT_SUCCESS(status))  {
-            LogError(TRACE_DEVICE, "WdfRequest %p cannot retrieve mission completion buffer %!STATUS!",
-                matchingRead, status);
-        } else  {
-            completeBytes = MINLEN(rlen, transferBufferLength);
-            memcpy(rbuffer, transferBuffer, completeBytes);
-        }
 
-        WdfRequestCompleteWithInformation(matchingRead, status, completeBytes);
+static BOOLEAN
+IoIsochIdle(
+    _In_ PISOCH_STREAM pStream,
+    _In_opt_ WDFQUEUE Pending
+)
+{
+    ULONG parked = 0;
 
-        LogInfo(TRACE_DEVICE, "Mission request %p completed with matching read %p", Request, matchingRead);
-    } else {
-        LogInfo(TRACE_DEVICE, "Mission request %p enqueued", Request);
+    if (Pending != NULL) {
+        WdfIoQueueGetState(Pending, &parked, NULL);
     }
-
-exit:
-    // writes never pended, always completed
-    UdecxUrbSetBytesCompleted(Request, transferBufferLength);
-    UdecxUrbCompleteWithNtStatus(Request, status);
-    return;
+    return (pStream->Current == NULL) && (parked == 0);
 }
 
 
+static VOID
+IoEvtIsochTimer(
+    _In_ WDFTIMER Timer
+)
+{
+    UDECXUSBDEVICE device = (UDECXUSBDEVICE)WdfTimerGetParentObject(Timer);
+    PIO_CONTEXT pIoContext = WdfDeviceGetIoContext(device);
+    PISOCH_STATE pIsoch = WdfDeviceGetIsochState(device);
+    IO_URB_DONE done[2 * IO_ISOCH_MAX_LAG];
+    ULONG count;
+
+    WdfSpinLockAcquire(pIsoch->sync);
+
+    ULONG64 now = OsTimestamp();
+    WDFQUEUE outPending = IoParkedQueue(pIoContext, g_IsochOutEndpointAddress);
+    WDFQUEUE inPending = IoParkedQueue(pIoContext, g_IsochInEndpointAddress);
+    count = IoIsochRun(&(pIsoch->Out), outPending, g_IsochOutEndpointAddress, now, done);
+    count += IoIsochRun(&(pIsoch->In), inPending, g_IsochInEndpointAddress, now, done + count);
+
+    // the host has nothing left for us: both streams stop, until its next URB
+    if (pIoContext->bStopping ||
+        (IoIsochIdle(&(pIsoch->Out), outPending) &&
+         IoIsochIdle(&(pIsoch->In), inPending)))
+    {
+        pIsoch->bRunning = FALSE;
+        WdfTimerStop(Timer, FALSE);
+    }
+
+    WdfSpinLockRelease(pIsoch->sync);
 
+    IoCompleteUrbs(WdfDeviceGetFlightRecorder(device), done, count);
+}
 
 
 static VOID
-IoEvtBulkInUrb(
+IoEvtIsochUrb(
     _In_ WDFQUEUE Queue,
     _In_ WDFREQUEST Request,
     _In_ size_t OutputBufferLength,
@@ -218,18 +1972,20 @@ IoEvtBulkInUrb(
 )
 {
     NTSTATUS status = STATUS_SUCCESS;
+    BOOLEAN bStart = FALSE;
 
     UNREFERENCED_PARAMETER(OutputBufferLength);
     UNREFERENCED_PARAMETER(InputBufferLength);
 
     PENDPOINTQUEUE_CONTEXT pEpQContext = GetEndpointQueueContext(Queue);
-    WDFDEVICE backchannel = pEpQContext->backChannelDevice;
-    PUDECX_BACKCHANNEL_CONTEXT pBackChannelContext = GetBackChannelContext(backchannel);
+    UDECXUSBDEVICE device = pEpQContext->usbDeviceObj;
+    PIO_CONTEXT pIoContext = WdfDeviceGetIoContext(device);
+    PISOCH_STATE pIsoch = WdfDeviceGetIsochState(device);
+    UCHAR endpoint = pEpQContext->Slot->Address;
 
     if (IoControlCode != IOCTL_INTERNAL_USB_SUBMIT_URB)
     {
-        LogError(TRACE_DEVICE, "WdfRequest BIN %p Incorrect IOCTL %x, %!STATUS!",
-            Request, IoControlCode, status);
+        LogError(TRACE_DEVICE, "WdfRequest ISO %p Incorrect IOCTL %x", Request, IoControlCode);
         status = STATUS_INVALID_PARAMETER;
         goto exit;
     }
@@ -239,124 +1995,164 @@ IoEvtBulkInUrb(
     status = UdecxUrbRetrieveBuffer(Request, &transferBuffer, &transferBufferLength);
     if (!NT_SUCCESS(status))
     {
-        LogError(TRACE_DEVICE, "WdfRequest BIN %p unable to retrieve buffer %!STATUS!",
-            Request, status);
+        LogError(TRACE_DEVICE, "WdfRequest ISO %p unable to retrieve buffer %!STATUS!", Request, status);
         goto exit;
     }
 
-    // try to get us information about a request that may be waiting for this info
-    SIZE_T completeBytes = 0;
-    BOOLEAN bReady = FALSE;
-    status = WRQueuePullRead(
-        &(pBackChannelContext->missionCompletion),
-        Request,
-        transferBuffer,
-        transferBufferLength,
-        &bReady,
-        &completeBytes);
+    if (!IoIsochUrbValid(IoUrbOf(Request), transferBufferLength))
+    {
+        LogError(TRACE_DEVICE, "WdfRequest ISO %p is not a valid isochronous transfer", Request);
+        status = STATUS_INVALID_PARAMETER;
+        goto exit;
+    }
 
-    if (bReady)
+    // parked behind the URBs already waiting, then served a packet a microframe
+    IoRecordUrb(pEpQContext->Recorder, FrEventPend, endpoint, Request, transferBufferLength, STATUS_PENDING);
+    status = WdfRequestForwardToIoQueue(Request, (WDFQUEUE)pEpQContext->Slot->Parked);
+    if (!NT_SUCCESS(status))
     {
-        UdecxUrbSetBytesCompleted(Request, (ULONG)completeBytes);
-        UdecxUrbCompleteWithNtStatus(Request, status);
-        LogInfo(TRACE_DEVICE, "Mission response %p completed with pre-existing data", Request);
-    } else {
-        LogInfo(TRACE_DEVICE, "Mission response %p pended", Request);
+        LogError(TRACE_DEVICE, "ERROR: Unable to forward Request %p error %!STATUS!", Request, status);
+        goto exit;
     }
 
+    // the first URB starts both streams, from the microframe to come
+    WdfSpinLockAcquire(pIsoch->sync);
+    if (!pIsoch->bRunning && !pIoContext->bStopping) {
+        ULONG64 now = OsTimestamp();
 
-exit:
+        IsoStart(&(pIsoch->Out.Sched), now);
+        IsoStart(&(pIsoch->In.Sched), now);
+        pIsoch->bRunning = TRUE;
+        bStart = TRUE;
+    }
+    WdfSpinLockRelease(pIsoch->sync);
+
+    if (bStart) {
+        WdfTimerStart(pIsoch->Timer, WDF_REL_TIMEOUT_IN_MS(IO_ISOCH_TIMER_PERIOD_MS));
+    }
     return;
+
+exit:
+    IoRecordUrb(pEpQContext->Recorder, FrEventComplete, endpoint, Request, 0, status);
+    UdecxUrbCompleteWithNtStatus(Request, status);
 }
 
 
 static VOID
-IoEvtCancelInterruptInUrb(
-    IN WDFQUEUE Queue,
-    IN WDFREQUEST  Request
+IoIsochReadStats(
+    _In_  PISOCH_STREAM pStream,
+    _Out_ PUDEFX2_ISOCH_STREAM_STATS Stats
 )
 {
-    UNREFERENCED_PARAMETER(Queue);
-    LogInfo(TRACE_DEVICE, "Canceling request %p", Request);
-    UdecxUrbCompleteWithNtStatus(Request, STATUS_CANCELLED);
+    Stats->Frames = pStream->Sched.Stats.Frames;
+    Stats->Packets = pStream->Sched.Stats.Packets;
+    Stats->Bytes = pStream->Sched.Stats.Bytes;
+    Stats->Underruns = pStream->Sched.Stats.Underruns;
+    Stats->Overruns = pStream->Sched.Stats.Overruns;
+    Stats->Skipped = pStream->Sched.Stats.Skipped;
+    Stats->Transfers = pStream->Transfers;
+    HistRead(&(pStream->Sched.Lateness), (PULONG64)&(Stats->Lateness));
 }
 
 
-static VOID
-IoCompletePendingRequest(
-    _In_ WDFREQUEST request,
-    _In_ DEVICE_INTR_FLAGS LatestStatus)
+VOID
+Io_GetIsochStats(
+    _In_  UDECXUSBDEVICE            Device,
+    _Out_ PUDEFX2_ISOCH_STATS       Stats
+)
 {
-    PUCHAR transferBuffer;
-    ULONG transferBufferLength;
-
-    NTSTATUS status = UdecxUrbRetrieveBuffer(request, &transferBuffer, &transferBufferLength);
-    if (!NT_SUCCESS(status))
-    {
-        LogError(TRACE_DEVICE, "WdfRequest  %p unable to retrieve buffer %!STATUS!",
-            request, status);
-        goto exit;
-    }
-
-    if (transferBufferLength != sizeof(LatestStatus))
-    {
-        LogError(TRACE_DEVICE, "Error: req %p Invalid interrupt buffer size, %d",
-            request, transferBufferLength);
-        status = STATUS_INVALID_BLOCK_LENGTH;
-        goto exit;
-    }
+    PISOCH_STATE pIsoch = WdfDeviceGetIsochState(Device);
 
-    memcpy(transferBuffer, &LatestStatus, sizeof(LatestStatus) );
+    Stats->TimestampFrequency = OsTimestampFrequency();
+    Stats->Slots = IO_ISOCH_SLOTS;
+    Stats->Prefill = IO_ISOCH_PREFILL;
 
-    LogInfo(TRACE_DEVICE, "INTR completed req=%p, data=%x",
-        request,
-        LatestStatus
-    );
+    WdfSpinLockAcquire(pIsoch->sync);
+    IoIsochReadStats(&(pIsoch->Out), &(Stats->Out));
+    IoIsochReadStats(&(pIsoch->In), &(Stats->In));
+    WdfSpinLockRelease(pIsoch->sync);
+}
 
-    UdecxUrbSetBytesCompleted(request, transferBufferLength);
 
-exit:
-    UdecxUrbCompleteWithNtStatus(request, status);
-    return;
+VOID
+Io_GetMissionStats(
+    _In_  UDECXUSBDEVICE            Device,
+    _Out_ PUDEFX2_MISSION_STATS     Stats
+)
+{
+    PMX_EXECUTOR pExec = &(WdfDeviceGetMissionState(Device)->Exec);
+    MX_STATS stats;
+
+    MxGetStats(pExec, &stats);
+
+    Stats->TimestampFrequency = OsTimestampFrequency();
+    Stats->Workers = IO_MISSION_WORKERS;
+    Stats->QueueDepth = IO_MISSION_QUEUE_DEPTH;
+    Stats->Submitted = stats.Submitted;
+    Stats->Completed = stats.Completed;
+    Stats->Failed = stats.Failed;
+    Stats->Passed = stats.Passed;
+    Stats->Rejected = stats.Rejected;
+    Stats->Dropped = stats.Dropped;
+    Stats->PeakQueued = stats.PeakQueued;
+    Stats->PeakBusy = stats.PeakBusy;
+    HistRead(&(pExec->Wait), (PULONG64)&(Stats->Wait));
+    HistRead(&(pExec->Latency), (PULONG64)&(Stats->Latency));
 }
 
 
-
-NTSTATUS
-Io_RaiseInterrupt(
-    _In_ UDECXUSBDEVICE    Device,
-    _In_ DEVICE_INTR_FLAGS LatestStatus )
+//
+// A manual queue for URBs an endpoint parks until they can be served: by
+// the loopback, on interrupt events, or on their microframes. Not
+// power-managed; parked URBs are purged by hand on power changes.
+// Created once.
+//
+static NTSTATUS
+Io_CreateParkingQueue(
+    _In_ WDFDEVICE   ControllerDevice,
+    _Inout_ WDFQUEUE *Queue )
 {
-    PIO_CONTEXT pIoContext = WdfDeviceGetIoContext(Device);
+    NTSTATUS status = STATUS_SUCCESS;
 
-    WDFREQUEST request;
-    NTSTATUS status = WdfIoQueueRetrieveNextRequest( pIoContext->IntrDeferredQueue, &request);
+    if ((*Queue) != NULL) {
+        goto exit;
+    }
 
-    // no items in the queue?  it is safe to assume the device is sleeping
-    if (!NT_SUCCESS(status))    {
-        LogInfo(TRACE_DEVICE, "Save update and wake device as queue status was %!STATUS!", status);
+    WDF_IO_QUEUE_CONFIG queueConfig;
+    WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
 
-        WdfSpinLockAcquire(pIoContext->IntrState.sync);
-        pIoContext->IntrState.latestStatus = LatestStatus;
-        if ((pIoContext->IntrState.numUnreadUpdates) < INTR_STATE_MAX_CACHED_UPDATES)
-        {
-            ++(pIoContext->IntrState.numUnreadUpdates);
-        }
-        WdfSpinLockRelease(pIoContext->IntrState.sync);
+    queueConfig.EvtIoCanceledOnQueue = IoEvtCancelParkedUrb;
+    queueConfig.PowerManaged = WdfFalse;
 
-        UdecxUsbDeviceSignalWake(Device);
-        status = STATUS_SUCCESS;
-    } else {
-        IoCompletePendingRequest(request, LatestStatus);
+    status = WdfIoQueueCreate(ControllerDevice,
+        &queueConfig,
+        WDF_NO_OBJECT_ATTRIBUTES,
+        Queue);
+    if (!NT_SUCCESS(status)) {
+        LogError(TRACE_DEVICE, "WdfIoQueueCreate failed for a parking queue %!STATUS!", status);
+        goto exit;
     }
 
+exit:
     return status;
 }
 
 
+FORCEINLINE
+PFN_WDF_IO_QUEUE_IO_INTERNAL_DEVICE_CONTROL
+IoHandlerOf(
+    _In_ PEP_SLOT Slot
+)
+{
+    return (PFN_WDF_IO_QUEUE_IO_INTERNAL_DEVICE_CONTROL)Slot->Handler;
+}
+
 
+//
+// Sequential endpoints: one URB at a time, straight to the handler.
+//
 static VOID
-IoEvtInterruptInUrb(
+IoEvtEndpointUrb(
     _In_ WDFQUEUE Queue,
     _In_ WDFREQUEST Request,
     _In_ size_t OutputBufferLength,
@@ -364,142 +2160,168 @@ IoEvtInterruptInUrb(
     _In_ ULONG IoControlCode
 )
 {
-    NTSTATUS status = STATUS_SUCCESS;
-
-
-    UNREFERENCED_PARAMETER(Request);
-    UNREFERENCED_PARAMETER(OutputBufferLength);
-    UNREFERENCED_PARAMETER(InputBufferLength);
-
-
-    PENDPOINTQUEUE_CONTEXT pEpQContext = GetEndpointQueueContext(Queue);
-
-    UDECXUSBDEVICE tgtDevice = pEpQContext->usbDeviceObj;
-
-    PIO_CONTEXT pIoContext = WdfDeviceGetIoContext(tgtDevice);
-
-
-    if (IoControlCode != IOCTL_INTERNAL_USB_SUBMIT_URB)   {
-        LogError(TRACE_DEVICE, "Invalid Interrupt/IN out IOCTL code %x", IoControlCode);
-        status = STATUS_ACCESS_DENIED;
-        goto exit;
-    }
-
-    BOOLEAN bHasData = FALSE;
-    DEVICE_INTR_FLAGS LatestStatus = 0;
-
-    // gate cached data we may have and clear it
-    WdfSpinLockAcquire(pIoContext->IntrState.sync);
-    if( pIoContext->IntrState.numUnreadUpdates > 0)
-    {
-        bHasData = TRUE;
-        LatestStatus = pIoContext->IntrState.latestStatus;
-    }
-    pIoContext->IntrState.latestStatus = 0;
-    pIoContext->IntrState.numUnreadUpdates = 0;
-    WdfSpinLockRelease(pIoContext->IntrState.sync);
-
-
-    if (bHasData)  {
+    PEP_SLOT slot = GetEndpointQueueContext(Queue)->Slot;
 
-        IoCompletePendingRequest(Request, LatestStatus);
+    EpCount(slot, (IoControlCode == IOCTL_INTERNAL_USB_SUBMIT_URB));
+    IoHandlerOf(slot)(Queue, Request, OutputBufferLength, InputBufferLength, IoControlCode);
+}
 
-    } else {
 
-        status = WdfRequestForwardToIoQueue(Request, pIoContext->IntrDeferredQueue);
-        if (NT_SUCCESS(status)) {
-            LogInfo(TRACE_DEVICE, "Request %p forwarded for later", Request);
-        } else {
-            LogError(TRACE_DEVICE, "ERROR: Unable to forward Request %p error %!STATUS!", Request, status);
-            UdecxUrbCompleteWithNtStatus(Request, status);
-        }
+//
+// Ordered endpoints (the bulk ones) have manual queues, so the host can
+// keep several URBs pending with us, and the endpoint's window takes them
+// out itself: in the order UdeCx queued them, each getting its turn under
+// the same lock, and at most the window's depth at a time. Each one is
+// handled after the one before it, whichever thread gets there.
+//
+static PVOID
+IoFetchOrderedUrb(
+    _In_ PVOID Context
+)
+{
+    WDFREQUEST request;
 
+    if (!NT_SUCCESS(WdfIoQueueRetrieveNextRequest((WDFQUEUE)Context, &request))) {
+        return NULL; // empty, or stopped
     }
-
-exit:
-    return;
+    return request;
 }
 
 
-static NTSTATUS
-Io_CreateDeferredIntrQueue(
-    _In_ WDFDEVICE   ControllerDevice,
-    _In_ PIO_CONTEXT pIoContext )
+static VOID
+IoRunOrderedUrb(
+    _In_ PVOID Context,
+    _In_ PVOID Item
+)
 {
+    WDFQUEUE queue = (WDFQUEUE)Context;
+    WDFREQUEST request = (WDFREQUEST)Item;
+    PEP_SLOT slot = GetEndpointQueueContext(queue)->Slot;
+    WDF_REQUEST_PARAMETERS params;
+
+    WDF_REQUEST_PARAMETERS_INIT(&params);
+    WdfRequestGetParameters(request, &params);
+
+    // not a transfer goes the same way; the handler fails it
+    EpCount(slot, (params.Parameters.DeviceIoControl.IoControlCode == IOCTL_INTERNAL_USB_SUBMIT_URB));
+    IoHandlerOf(slot)(queue, request,
+        params.Parameters.DeviceIoControl.OutputBufferLength,
+        params.Parameters.DeviceIoControl.InputBufferLength,
+        params.Parameters.DeviceIoControl.IoControlCode);
+}
 
-    pIoContext->IntrState.latestStatus = 0;
-    pIoContext->IntrState.numUnreadUpdates = 0;
 
-    //
-    // Register a manual I/O queue for handling Interrupt Message Read Requests.
-    // This queue will be used for storing Requests that need to wait for an
-    // interrupt to occur before they can be completed.
-    //
-    WDF_IO_QUEUE_CONFIG queueConfig;
-    WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+static EVT_WDF_IO_QUEUE_STATE IoEvtOrderedQueueReady;
 
-    // when a request gets canceled, this is where we want to do the completion
-    queueConfig.EvtIoCanceledOnQueue = IoEvtCancelInterruptInUrb;
+static VOID
+IoEvtOrderedQueueReady(
+    _In_ WDFQUEUE   Queue,
+    _In_ WDFCONTEXT Context
+)
+{
+    UNREFERENCED_PARAMETER(Context);
 
-    //
-    // We shouldn't have to power-manage this queue, as we will manually 
-    // purge it and de-queue from it whenever we get power indications.
-    //
-    queueConfig.PowerManaged = WdfFalse;
+    OwPump(&(GetEndpointQueueContext(Queue)->Window));
+}
 
-    NTSTATUS status = WdfIoQueueCreate(ControllerDevice,
-        &queueConfig,
-        WDF_NO_OBJECT_ATTRIBUTES,
-        &(pIoContext->IntrDeferredQueue)
-    );
 
-    if (!NT_SUCCESS(status)) {
-        LogError(TRACE_DEVICE,
-            "WdfIoQueueCreate failed 0x%x\n", status);
-        goto Error;
-    }
 
+NTSTATUS
+Io_DeviceSlept(
+    _In_ UDECXUSBDEVICE  Device
+)
+{
+    PIO_CONTEXT pIoContext = WdfDeviceGetIoContext(Device);
+
+    // thi will result in all current requests being canceled, on every
+    // endpoint that parks them, as Io_StopDeferredProcessing does
+    LogInfo(TRACE_DEVICE, "About to purge deferred request queues" );
+    for (ULONG i = 0; i < EP_SLOTS; ++i) {
+        PEP_SLOT slot = EpAt(&(pIoContext->Endpoints), i);
 
-    status = WdfSpinLockCreate(WDF_NO_OBJECT_ATTRIBUTES,
-        &(pIoContext->IntrState.sync));
-    if (!NT_SUCCESS(status)) {
-        LogError(TRACE_DEVICE,
-            "WdfSpinLockCreate failed  %!STATUS!\n", status);
-        goto Error;
+        if ((slot != NULL) && (slot->Parked != NULL)) {
+            WdfIoQueuePurge((WDFQUEUE)slot->Parked, NULL, NULL);
+        }
     }
 
-Error:
-    return status;
+    return STATUS_SUCCESS;
 }
 
 
 NTSTATUS
-Io_DeviceSlept(
+Io_DeviceWokeUp(
     _In_ UDECXUSBDEVICE  Device
 )
 {
     PIO_CONTEXT pIoContext = WdfDeviceGetIoContext(Device);
 
-    // thi will result in all current requests being canceled
-    LogInfo(TRACE_DEVICE, "About to purge deferred request queue" );
-    WdfIoQueuePurge(pIoContext->IntrDeferredQueue, NULL, NULL);
+    // a purged queue takes nothing until it is started again
+    LogInfo(TRACE_DEVICE, "About to re-start paused deferred queues");
+    for (ULONG i = 0; i < EP_SLOTS; ++i) {
+        PEP_SLOT slot = EpAt(&(pIoContext->Endpoints), i);
+
+        if ((slot != NULL) && (slot->Parked != NULL)) {
+            WdfIoQueueStart((WDFQUEUE)slot->Parked);
+        }
+    }
 
     return STATUS_SUCCESS;
 }
 
 
+C_ASSERT(UDEFX2_MAX_ENDPOINTS == EP_SLOTS);
+C_ASSERT(EpModeOrdered == 1);
+C_ASSERT(EP_FLAG_PARKED == 1 && EP_FLAG_FLOW_CONTROLLED == 2);
+
+
+//
+// What each endpoint of the configuration descriptor is served by. The
+// first pair's bulk endpoints park URBs for the loopback; the others are
+// striped, and have no loopback.
+//
+static const EP_BINDING g_IoEndpointBindings[] = {
+    // type                   direction        ordinal  mode              window                flags                                          handler
+    { UD_ENDPOINT_CONTROL,     0,               EP_ANY,  EpModeSequential, 0,                    0,                                             (PVOID)IoEvtControlUrb },
+    { UD_ENDPOINT_BULK,        0,               0,       EpModeOrdered,    IO_BULK_WINDOW_DEPTH, EP_FLAG_PARKED | EP_FLAG_FLOW_CONTROLLED,      (PVOID)IoEvtBulkOutUrb },
+    { UD_ENDPOINT_BULK,        0,               EP_ANY,  EpModeOrdered,    IO_BULK_WINDOW_DEPTH, EP_FLAG_FLOW_CONTROLLED,                       (PVOID)IoEvtBulkOutUrb },
+    { UD_ENDPOINT_BULK,        EP_DIRECTION_IN, 0,       EpModeOrdered,    IO_BULK_WINDOW_DEPTH, EP_FLAG_PARKED,                                (PVOID)IoEvtBulkInUrb },
+    { UD_ENDPOINT_BULK,        EP_DIRECTION_IN, EP_ANY,  EpModeOrdered,    IO_BULK_WINDOW_DEPTH, 0,                                             (PVOID)IoEvtBulkInUrb },
+    { UD_ENDPOINT_INTERRUPT,   EP_DIRECTION_IN, EP_ANY,  EpModeSequential, 0,                    EP_FLAG_PARKED,                                (PVOID)IoEvtInterruptInUrb },
+    { UD_ENDPOINT_ISOCHRONOUS, 0,               EP_ANY,  EpModeSequential, 0,                    EP_FLAG_PARKED,                                (PVOID)IoEvtIsochUrb },
+    { UD_ENDPOINT_ISOCHRONOUS, EP_DIRECTION_IN, EP_ANY,  EpModeSequential, 0,                    EP_FLAG_PARKED,                                (PVOID)IoEvtIsochUrb },
+};
+
+
 NTSTATUS
-Io_DeviceWokeUp(
-    _In_ UDECXUSBDEVICE  Device
+Io_RegisterEndpoints(
+    _In_ UDECXUSBDEVICE  Device,
+    _In_ USHORT          MaxPacketSize0,
+    _In_reads_bytes_(Length) const UCHAR *Configuration,
+    _In_ ULONG           Length
 )
 {
-    PIO_CONTEXT pIoContext = WdfDeviceGetIoContext(Device);
+    PEP_REGISTRY pRegistry = &(WdfDeviceGetIoContext(Device)->Endpoints);
+    UCHAR unbound = 0;
 
-    // thi will result in all current requests being canceled
-    LogInfo(TRACE_DEVICE, "About to re-start paused deferred queue");
-    WdfIoQueueStart(pIoContext->IntrDeferredQueue);
+    EpRegistryInit(pRegistry);
 
-    return STATUS_SUCCESS;
+    NTSTATUS status = EpRegister(pRegistry, USB_DEFAULT_ENDPOINT_ADDRESS, UD_ENDPOINT_CONTROL, MaxPacketSize0, 0);
+    if (NT_SUCCESS(status)) {
+        status = EpRegisterConfiguration(pRegistry, Configuration, Length);
+    }
+    if (!NT_SUCCESS(status)) {
+        LogError(TRACE_DEVICE, "Endpoints of the configuration descriptor rejected %!STATUS!", status);
+        goto exit;
+    }
+
+    status = EpBind(pRegistry, g_IoEndpointBindings, ARRAYSIZE(g_IoEndpointBindings), &unbound);
+    if (!NT_SUCCESS(status)) {
+        LogError(TRACE_DEVICE, "No handler for ep %x %!STATUS!", unbound, status);
+        goto exit;
+    }
+
+exit:
+    return status;
 }
 
 
@@ -510,77 +2332,81 @@ Io_RetrieveEpQueue(
     _Out_ WDFQUEUE     * Queue
 )
 {
-    WDFQUEUE *pQueueRecord = NULL;
-    PFN_WDF_IO_QUEUE_IO_INTERNAL_DEVICE_CONTROL pIoCallback = NULL;
-
     NTSTATUS status = STATUS_SUCCESS;
     PIO_CONTEXT pIoContext = WdfDeviceGetIoContext(Device);
     PUSB_CONTEXT pUsbContext = GetUsbDeviceContext(Device);
+    PEP_SLOT slot = EpLookup(&(pIoContext->Endpoints), EpAddr);
 
     WDFDEVICE wdfController = pUsbContext->ControllerDevice;
 
-    switch (EpAddr)
-    {
-    case USB_DEFAULT_ENDPOINT_ADDRESS:
-        pQueueRecord = &(pIoContext->ControlQueue);
-        pIoCallback = IoEvtControlUrb;
-        break;
-
-    case g_BulkOutEndpointAddress:
-        pQueueRecord = &(pIoContext->BulkOutQueue);
-        pIoCallback = IoEvtBulkOutUrb;
-        break;
-
-    case g_BulkInEndpointAddress:
-        pQueueRecord = &(pIoContext->BulkInQueue);
-        pIoCallback = IoEvtBulkInUrb;
-        break;
-
-    case g_InterruptEndpointAddress:
-        status = Io_CreateDeferredIntrQueue(wdfController, pIoContext);
-        pQueueRecord = &(pIoContext->InterruptUrbQueue);
-        pIoCallback = IoEvtInterruptInUrb;
-        break;
-
-    default:
+    *Queue = NULL;
+    if (slot == NULL) {
         LogError(TRACE_DEVICE, "Io_RetrieveEpQueue received unrecognized ep %x", EpAddr);
         status = STATUS_ILLEGAL_FUNCTION;
         goto exit;
     }
 
-
-    *Queue = NULL;
-    if (!NT_SUCCESS(status)) {
-        goto exit;
+    if (slot->Flags & EP_FLAG_PARKED) {
+        status = Io_CreateParkingQueue(wdfController, (WDFQUEUE *)&(slot->Parked));
+        if (!NT_SUCCESS(status)) {
+            goto exit;
+        }
     }
 
-    if ( (*pQueueRecord)  == NULL) {
+    if (slot->Queue == NULL) {
         WDF_IO_QUEUE_CONFIG queueConfig;
-        WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchSequential);
+        WDFQUEUE queue;
+
+        if (slot->Mode == EpModeOrdered) {
+            // the window takes URBs out itself, see IoFetchOrderedUrb
+            WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+        } else {
+            WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchSequential);
 
-        //Sequential must specify this callback
-        queueConfig.EvtIoInternalDeviceControl = pIoCallback;
+            //Sequential must specify this callback
+            queueConfig.EvtIoInternalDeviceControl = IoEvtEndpointUrb;
+        }
         WDF_OBJECT_ATTRIBUTES  attributes;
         WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, ENDPOINTQUEUE_CONTEXT);
 
         status = WdfIoQueueCreate(wdfController,
             &queueConfig,
             &attributes,
-            pQueueRecord);
+            &queue);
+
+        if (!NT_SUCCESS(status)) {
+
+            LogError(TRACE_DEVICE, "WdfIoQueueCreate failed for queue of ep %x %!STATUS!", EpAddr, status);
+            goto exit;
+        }
 
         PENDPOINTQUEUE_CONTEXT pEPQContext;
-        pEPQContext = GetEndpointQueueContext(*pQueueRecord);
+        pEPQContext = GetEndpointQueueContext(queue);
         pEPQContext->usbDeviceObj      = Device;
         pEPQContext->backChannelDevice = wdfController; // this is a dirty little secret, so we contain it.
+        pEPQContext->Recorder          = WdfDeviceGetFlightRecorder(Device);
+        pEPQContext->Slot              = slot;
+
+        if (slot->Mode == EpModeOrdered) {
+            NT_VERIFY(NT_SUCCESS(OwInit(&(pEPQContext->Window), slot->WindowDepth, IoFetchOrderedUrb, IoRunOrderedUrb, queue)));
+
+            status = WdfIoQueueReadyNotify(queue, IoEvtOrderedQueueReady, WDF_NO_CONTEXT);
+            if (!NT_SUCCESS(status)) {
+                LogError(TRACE_DEVICE, "WdfIoQueueReadyNotify failed for queue of ep %x %!STATUS!", EpAddr, status);
+                WdfObjectDelete(queue);
+                goto exit;
+            }
+        }
 
-        if (!NT_SUCCESS(status)) {
+        slot->Queue = queue;
 
-            LogError(TRACE_DEVICE, "WdfIoQueueCreate failed for queue of ep %x %!STATUS!", EpAddr, status);
-            goto exit;
+        if (slot->Flags & EP_FLAG_FLOW_CONTROLLED) {
+            PUDECX_BACKCHANNEL_CONTEXT pBackChannelContext = GetBackChannelContext(wdfController);
+            WRQueueSetFlowControl(&(pBackChannelContext->missionRequest), IoBulkOutFlowControl, pIoContext);
         }
     }
 
-    *Queue = (*pQueueRecord);
+    *Queue = (WDFQUEUE)slot->Queue;
 
 exit:
 
@@ -588,6 +2414,47 @@ exit:
 }
 
 
+VOID
+Io_GetEndpointStats(
+    _In_  UDECXUSBDEVICE            Device,
+    _Out_ PUDEFX2_ENDPOINT_STATS    Stats
+)
+{
+    PEP_REGISTRY pRegistry = &(WdfDeviceGetIoContext(Device)->Endpoints);
+
+    RtlZeroMemory(Stats, sizeof(*Stats));
+
+    for (ULONG i = 0; i < EP_SLOTS; ++i) {
+        PEP_SLOT slot = EpAt(pRegistry, i);
+        PUDEFX2_ENDPOINT_SLOT_STATS pSlotStats = &(Stats->Endpoints[Stats->Count]);
+
+        if (slot == NULL) {
+            continue;
+        }
+
+        pSlotStats->Address = slot->Address;
+        pSlotStats->Type = slot->Type;
+        pSlotStats->Mode = (UCHAR)slot->Mode;
+        pSlotStats->Flags = slot->Flags;
+        pSlotStats->WindowDepth = slot->WindowDepth;
+        pSlotStats->Urbs = (ULONG64)ReadNoFence64(&(slot->Stats.Urbs));
+        pSlotStats->Other = (ULONG64)ReadNoFence64(&(slot->Stats.Other));
+        Stats->Count++;
+    }
+}
+
+
+static VOID
+IoIsochAbort(
+    _Inout_ PISOCH_STREAM pStream
+)
+{
+    if (pStream->Current != NULL) {
+        UdecxUrbCompleteWithNtStatus(pStream->Current, STATUS_CANCELLED);
+        pStream->Current = NULL;
+    }
+}
+
 
 VOID
 Io_StopDeferredProcessing(
@@ -598,8 +2465,27 @@ Io_StopDeferredProcessing(
     PIO_CONTEXT pIoContext = WdfDeviceGetIoContext(Device);
 
     pIoContext->bStopping = TRUE;
-    // plus this queue will no longer accept incoming requests
-    WdfIoQueuePurgeSynchronously( pIoContext->IntrDeferredQueue);
+    // no more moderation flushes; held events are dropped along with the device
+    WdfTimerStop(WdfDeviceGetIntrState(Device)->Timer, TRUE);
+    // the isochronous streams stop, failing the URBs they were going through
+    PISOCH_STATE pIsoch = WdfDeviceGetIsochState(Device);
+    WdfTimerStop(pIsoch->Timer, TRUE);
+    IoIsochAbort(&(pIsoch->Out));
+    IoIsochAbort(&(pIsoch->In));
+    // plus the parking queues will no longer accept incoming requests
+    for (ULONG i = 0; i < EP_SLOTS; ++i) {
+        PEP_SLOT slot = EpAt(&(pIoContext->Endpoints), i);
+
+        if ((slot != NULL) && (slot->Parked != NULL)) {
+            WdfIoQueuePurgeSynchronously((WDFQUEUE)slot->Parked);
+        }
+    }
+    // missions still queued are dropped, those running are waited for
+    PMISSION_STATE pMission = WdfDeviceGetMissionState(Device);
+    MxStop(&(pMission->Exec));
+    for (ULONG i = 0; i < IO_MISSION_WORKERS; ++i) {
+        WdfWorkItemFlush(pMission->Worker[i]);
+    }
 
     (*pIoContextCopy) = (*pIoContext);
 }
@@ -610,19 +2496,37 @@ Io_FreeEndpointQueues(
     _In_ PIO_CONTEXT   pIoContext
 )
 {
+    PEP_REGISTRY pRegistry = &(pIoContext->Endpoints);
 
-    WdfObjectDelete(pIoContext->IntrDeferredQueue);
+    for (ULONG i = 0; i < EP_SLOTS; ++i) {
+        PEP_SLOT slot = EpAt(pRegistry, i);
 
-    WdfIoQueuePurgeSynchronously(pIoContext->ControlQueue);
-    WdfObjectDelete(pIoContext->ControlQueue);
+        if ((slot != NULL) && (slot->Parked != NULL)) {
+            WdfObjectDelete((WDFQUEUE)slot->Parked);
+        }
+    }
+
+    for (ULONG i = 0; i < EP_SLOTS; ++i) {
+        PEP_SLOT slot = EpAt(pRegistry, i);
+
+        if ((slot != NULL) && (slot->Flags & EP_FLAG_FLOW_CONTROLLED) && (slot->Queue != NULL)) {
+            PENDPOINTQUEUE_CONTEXT pEpQContext = GetEndpointQueueContext((WDFQUEUE)slot->Queue);
+            PUDECX_BACKCHANNEL_CONTEXT pBackChannelContext = GetBackChannelContext(pEpQContext->backChannelDevice);
 
-    WdfIoQueuePurgeSynchronously(pIoContext->InterruptUrbQueue);
-    WdfObjectDelete(pIoContext->InterruptUrbQueue);
+            // no more back-pressure on queues that are going away, and drop the URBs they have parked
+            WRQueueSetFlowControl(&(pBackChannelContext->missionRequest), NULL, NULL);
+            WRQueuePurgeDeferredWrites(&(pBackChannelContext->missionRequest));
+            break;
+        }
+    }
 
-    WdfIoQueuePurgeSynchronously(pIoContext->BulkInQueue);
-    WdfObjectDelete(pIoContext->BulkInQueue);
+    for (ULONG i = 0; i < EP_SLOTS; ++i) {
+        PEP_SLOT slot = EpAt(pRegistry, i);
 
-    WdfIoQueuePurgeSynchronously(pIoContext->BulkOutQueue);
-    WdfObjectDelete(pIoContext->BulkOutQueue);
+        if ((slot != NULL) && (slot->Queue != NULL)) {
+            WdfIoQueuePurgeSynchronously((WDFQUEUE)slot->Queue);
+            WdfObjectDelete((WDFQUEUE)slot->Queue);
+        }
+    }
 
 }
@@ -20,30 +20,166 @@ Abstract:
 #include <wdf.h>
 #include "trace.h"
 #include "Public.h"
+#include "Pattern.h"
+#include "Sink.h"
+#include "EventRing.h"
+#include "IntrPacket.h"
+#include "Histogram.h"
+#include "OrderWindow.h"
+#include "VendorRequest.h"
+#include "FlightRecorder.h"
+#include "Stripe.h"
+#include "LoopRing.h"
+#include "IsoSched.h"
+#include "MissionExec.h"
+#include "EpRegistry.h"
+
+//
+// Every endpoint of the device, with its queues, in a slot of its own;
+// see EpRegistry.h.
+//
+typedef struct _IO_CONTEXT {
+    EP_REGISTRY       Endpoints;
+    BOOLEAN           bStopping;
+} IO_CONTEXT, *PIO_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(IO_CONTEXT, WdfDeviceGetIoContext);
 
-// in case it becomes a queue one day, an arbitrary limit
-#define INTR_STATE_MAX_CACHED_UPDATES 100
 
-typedef struct _DEVICE_INTR_STATE {
-    DEVICE_INTR_FLAGS latestStatus;
-    ULONG             numUnreadUpdates;
+//
+// Interrupt events raised but not yet delivered, oldest first.
+// Io_RaiseInterrupt is the producer; as the back-channel dispatches IOCTLs
+// in parallel, producers are serialized by RaiseLock. Taking events out,
+// along with the pending URB they go into, happens under sync.
+// Moderation holds events back, and a timer flushes them once they are due.
+//
+typedef struct _INTR_STATE {
+    WDFSPINLOCK       RaiseLock;
     WDFSPINLOCK       sync;
-} DEVICE_INTR_STATE, *PDEVICE_INTR_STATE;
+    EVENT_RING        Ring;
+    EVENT_MODERATION  Moderation;   // under sync
+    UDEFX2_INTERRUPT_MODERATION ModerationSetting;
+    WDFTIMER          Timer;
+    BOOLEAN           bTimerArmed;  // under sync
+    volatile LONG64   Transfers;
+    HISTOGRAM         Latency;      // raise to URB completion, OsTimestamp() ticks
+} INTR_STATE, *PINTR_STATE;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(INTR_STATE, WdfDeviceGetIntrState);
+
+
+//
+// URB flight recorder, sized for the processor count at allocation
+// (WDF_OBJECT_ATTRIBUTES.ContextSizeOverride).
+//
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(FLIGHT_RECORDER, WdfDeviceGetFlightRecorder);
+
+
+//
+// With several bulk pairs, BULK OUT transfers are stripe chunks, put back
+// together here into mission requests. Allocated only then.
+//
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(STRIPE_REASSEMBLER, WdfDeviceGetStripeReassembler);
+
+
+//
+// BULK IN pattern source. The back-channel only posts a new configuration;
+// the BULK IN window (one URB at a time) picks it up on its next URB, so the
+// generator itself is only ever touched from there.
+// Kept out of IO_CONTEXT, which gets copied around on teardown.
+//
+typedef struct _BULK_IN_SOURCE {
+    WDFSPINLOCK           sync;         // guards Requested
+    UDEFX2_PATTERN_CONFIG Requested;
+    volatile LONG         Generation;   // bumped with every new Requested
+    LONG                  Applied;      // Generation the generator was set up from
+    BOOLEAN               bActive;
+    PATTERN_GENERATOR     Generator;
+} BULK_IN_SOURCE, *PBULK_IN_SOURCE;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(BULK_IN_SOURCE, WdfDeviceGetBulkInSource);
+
+
+//
+// BULK OUT verifying sink, set up the same way as the BULK IN source.
+//
+typedef struct _BULK_OUT_SINK {
+    WDFSPINLOCK           sync;         // guards Requested
+    UDEFX2_SINK_CONFIG    Requested;
+    volatile LONG         Generation;   // bumped with every new Requested
+    LONG                  Applied;      // Generation the sink was set up from
+    volatile LONG         ActiveMode;   // UDEFX2_SINK_xxx the sink runs in
+    SINK                  Sink;
+} BULK_OUT_SINK, *PBULK_OUT_SINK;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(BULK_OUT_SINK, WdfDeviceGetBulkOutSink);
+
+
+//
+// BULK OUT to BULK IN loopback, first pair. URBs of both endpoints wait in
+// the parking queues of their endpoint slots, and are paired up under sync by one
+// runner at a time, which completes them outside of it, in order.
+//
+typedef struct _LOOPBACK {
+    WDFSPINLOCK           sync;
+    volatile LONG         bEnabled;
+    BOOLEAN               bRunning;     // under sync
+    BOOLEAN               bAgain;       // under sync: URBs came in during a run
+    LOOP_RING             Ring;         // under sync
+    UDEFX2_LOOPBACK_STATS Stats;        // under sync
+} LOOPBACK, *PLOOPBACK;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(LOOPBACK, WdfDeviceGetLoopback);
+
+
+//
+// One isochronous endpoint: its scheduler, and the URB whose packets it
+// is going through, taken from its endpoint's parking queue.
+//
+typedef struct _ISOCH_STREAM {
+    ISO_SCHEDULER     Sched;
+    WDFREQUEST        Current;
+    PUCHAR            Buffer;       // Current's
+    ULONG             BufferLength;
+    ULONG             NextPacket;
+    ULONG             Bytes;        // moved so far
+    ULONG64           Transfers;
+} ISOCH_STREAM, *PISOCH_STREAM;
+
+//
+// The isochronous pair, run from a periodic timer while the host has URBs
+// for it; everything under sync.
+//
+typedef struct _ISOCH_STATE {
+    WDFSPINLOCK       sync;
+    WDFTIMER          Timer;
+    BOOLEAN           bRunning;
+    ISOCH_STREAM      Out;
+    ISOCH_STREAM      In;
+    PATTERN_GENERATOR Source;       // ISOCH IN data
+} ISOCH_STATE, *PISOCH_STATE;
 
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(ISOCH_STATE, WdfDeviceGetIsochState);
 
 
-typedef struct _IO_CONTEXT {
-    WDFQUEUE          ControlQueue;
-    WDFQUEUE          BulkOutQueue;
-    WDFQUEUE          BulkInQueue;
-    WDFQUEUE          InterruptUrbQueue;
-    WDFQUEUE          IntrDeferredQueue;
-    BOOLEAN           bStopping;
+//
+// Missions run in the driver (see MissionExec.h), each worker a work item.
+//
+#define IO_MISSION_WORKERS  4
 
-    DEVICE_INTR_STATE IntrState;
-} IO_CONTEXT, *PIO_CONTEXT;
+typedef struct _MISSION_STATE {
+    MX_EXECUTOR       Exec;
+    WDFWORKITEM       Worker[IO_MISSION_WORKERS];
+} MISSION_STATE, *PMISSION_STATE;
 
-WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(IO_CONTEXT, WdfDeviceGetIoContext);
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(MISSION_STATE, WdfDeviceGetMissionState);
+
+typedef struct _MISSION_WORKER {
+    UDECXUSBDEVICE    Device;
+    ULONG             Index;
+} MISSION_WORKER, *PMISSION_WORKER;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(MISSION_WORKER, WdfWorkItemGetMissionWorker);
 
 
 
@@ -66,6 +202,109 @@ Io_RaiseInterrupt(
 
 
 
+NTSTATUS
+Io_SetInterruptModeration(
+    _In_ UDECXUSBDEVICE                 Device,
+    _In_ PUDEFX2_INTERRUPT_MODERATION   Setting
+);
+
+
+VOID
+Io_GetInterruptStats(
+    _In_  UDECXUSBDEVICE            Device,
+    _Out_ PUDEFX2_INTERRUPT_STATS   Stats
+);
+
+
+//
+// Length must be at least FIELD_OFFSET(UDEFX2_FLIGHT_DUMP, Records);
+// the dump has as many records as fit.
+//
+VOID
+Io_DumpFlightRecorder(
+    _In_  UDECXUSBDEVICE        Device,
+    _Out_writes_bytes_(Length) PUDEFX2_FLIGHT_DUMP Dump,
+    _In_  size_t                Length,
+    _Out_ size_t              * Written
+);
+
+
+
+NTSTATUS
+Io_SetBulkInPattern(
+    _In_ UDECXUSBDEVICE         Device,
+    _In_ PUDEFX2_PATTERN_CONFIG Config
+);
+
+
+
+NTSTATUS
+Io_SetBulkOutSink(
+    _In_ UDECXUSBDEVICE         Device,
+    _In_ PUDEFX2_SINK_CONFIG    Config
+);
+
+
+VOID
+Io_GetSinkStats(
+    _In_  UDECXUSBDEVICE        Device,
+    _Out_ PUDEFX2_SINK_STATS    Stats
+);
+
+
+
+NTSTATUS
+Io_SetLoopback(
+    _In_ UDECXUSBDEVICE             Device,
+    _In_ PUDEFX2_LOOPBACK_CONFIG    Config
+);
+
+
+VOID
+Io_GetLoopbackStats(
+    _In_  UDECXUSBDEVICE            Device,
+    _Out_ PUDEFX2_LOOPBACK_STATS    Stats
+);
+
+
+
+VOID
+Io_GetIsochStats(
+    _In_  UDECXUSBDEVICE            Device,
+    _Out_ PUDEFX2_ISOCH_STATS       Stats
+);
+
+
+
+VOID
+Io_GetMissionStats(
+    _In_  UDECXUSBDEVICE            Device,
+    _Out_ PUDEFX2_MISSION_STATS     Stats
+);
+
+
+
+VOID
+Io_GetEndpointStats(
+    _In_  UDECXUSBDEVICE            Device,
+    _Out_ PUDEFX2_ENDPOINT_STATS    Stats
+);
+
+
+
+//
+// Fills in the endpoint registry from the configuration descriptor set,
+// before any endpoint is created.
+//
+NTSTATUS
+Io_RegisterEndpoints(
+    _In_ UDECXUSBDEVICE  Device,
+    _In_ USHORT          MaxPacketSize0,
+    _In_reads_bytes_(Length) const UCHAR *Configuration,
+    _In_ ULONG           Length
+);
+
+
 NTSTATUS
 Io_RetrieveEpQueue(
     _In_ UDECXUSBDEVICE  Device,
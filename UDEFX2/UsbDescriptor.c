@@ -0,0 +1,262 @@
+/*++
+
+Module Name:
+
+UsbDescriptor.c
+
+Abstract:
+
+    Implementation of the descriptor validator declared in
+    UsbDescriptor.h. The validator follows the checks of the Linux USB
+    core's configuration parser (drivers/usb/core/config.c), failing where
+    it would warn and patch things up.
+
+--*/
+
+#include "UsbDescriptor.h"
+
+
+static ULONG
+_UdGet16(
+    _In_reads_bytes_(2) const UCHAR *p
+)
+{
+    return (ULONG)p[0] | ((ULONG)p[1] << 8);
+}
+
+
+//
+// One endpoint descriptor, and its companion at SuperSpeed.
+//
+static BOOLEAN
+_UdValidEndpoint(
+    _In_ UD_SPEED Speed,
+    _In_reads_bytes_(UD_ENDPOINT_LENGTH) const UCHAR *Endpoint,
+    _In_reads_bytes_opt_(UD_SS_COMPANION_LENGTH) const UCHAR *Companion
+)
+{
+    ULONG type = Endpoint[3] & 0x03;
+    ULONG maxPacket = _UdGet16(Endpoint + 4) & 0x07FF;
+    ULONG interval = Endpoint[6];
+
+    // endpoint 0 has no descriptor
+    if ((Endpoint[2] & 0x0F) == 0) {
+        return FALSE;
+    }
+
+    switch (type) {
+    case UD_ENDPOINT_BULK:
+        if (maxPacket != ((Speed == UdSpeedSuper) ? UD_BULK_MAX_PACKET_SS : UD_BULK_MAX_PACKET_HS)) {
+            return FALSE;
+        }
+        break;
+
+    case UD_ENDPOINT_INTERRUPT:
+    case UD_ENDPOINT_ISOCHRONOUS:
+        if ((interval < 1) || (interval > 16) || (maxPacket == 0) || (maxPacket > 1024)) {
+            return FALSE;
+        }
+        break;
+
+    default:
+        if (maxPacket > 512) {
+            return FALSE;
+        }
+        break;
+    }
+
+    if (Speed != UdSpeedSuper) {
+        return TRUE;
+    }
+
+    // SuperSpeed: a companion right after, within the limits of its endpoint
+    if ((Companion == NULL) || (Companion[0] < UD_SS_COMPANION_LENGTH) || (Companion[1] != UD_DT_SS_COMPANION)) {
+        return FALSE;
+    }
+
+    ULONG burst = Companion[2];
+    ULONG attributes = Companion[3];
+    ULONG perInterval = _UdGet16(Companion + 4);
+
+    if ((burst > UD_MAX_BURST) || ((type == UD_ENDPOINT_CONTROL) && (burst != 0))) {
+        return FALSE;
+    }
+
+    switch (type) {
+    case UD_ENDPOINT_BULK:
+        return (attributes & 0x1F) <= 16;               // MaxStreams
+
+    case UD_ENDPOINT_ISOCHRONOUS:
+        if ((attributes & 0x03) > 2) {                  // Mult
+            return FALSE;
+        }
+        return perInterval <= maxPacket * (burst + 1) * ((attributes & 0x03) + 1);
+
+    case UD_ENDPOINT_INTERRUPT:
+        return perInterval <= maxPacket * (burst + 1);
+
+    default:
+        return TRUE;
+    }
+}
+
+
+NTSTATUS
+UdValidateConfiguration(
+    _In_ UD_SPEED Speed,
+    _In_reads_bytes_(Length) const UCHAR *Buffer,
+    _In_ ULONG Length,
+    _Out_ PULONG Offset
+)
+{
+    UCHAR seen[32] = { 0 };     // endpoint addresses of the current setting, by number and direction
+    ULONG interfaces = 0;       // counting alternate setting 0 only
+    UCHAR number = 0;           // bInterfaceNumber of the current interface
+    ULONG declared = 0;         // bNumEndpoints of the current interface
+    ULONG endpoints = 0;
+    ULONG offset = 0;
+    UCHAR previous = UD_DT_CONFIGURATION;
+
+    if ((Length < UD_CONFIGURATION_LENGTH) ||
+        (Buffer[0] < UD_CONFIGURATION_LENGTH) ||
+        (Buffer[1] != UD_DT_CONFIGURATION) ||
+        (_UdGet16(Buffer + 2) != Length) ||
+        (Buffer[4] == 0)) {
+        goto invalid;
+    }
+
+    for (offset = Buffer[0]; offset < Length; offset += Buffer[offset]) {
+        const UCHAR *d = Buffer + offset;
+
+        if ((Length - offset < 2) || (d[0] < 2) || (d[0] > Length - offset)) {
+            goto invalid;
+        }
+
+        switch (d[1]) {
+        case UD_DT_INTERFACE:
+            if ((d[0] < UD_INTERFACE_LENGTH) || (endpoints != declared)) {
+                goto invalid;
+            }
+            // an alternate setting follows setting 0 of its interface
+            if (d[3] == 0) {
+                if ((interfaces != 0) && (d[2] == number)) {
+                    goto invalid;
+                }
+                ++interfaces;
+                number = d[2];
+            } else if ((interfaces == 0) || (d[2] != number)) {
+                goto invalid;
+            }
+            memset(seen, 0, sizeof(seen));
+            declared = d[4];
+            endpoints = 0;
+            break;
+
+        case UD_DT_ENDPOINT:
+        {
+            const UCHAR *companion = NULL;
+            ULONG index = (d[2] & 0x0F) | ((d[2] & 0x80) ? 0x10 : 0);
+
+            if ((interfaces == 0) || (d[0] < UD_ENDPOINT_LENGTH) || seen[index]) {
+                goto invalid;
+            }
+            if ((Length - offset - d[0] >= 2) && (d[d[0] + 1] == UD_DT_SS_COMPANION)) {
+                companion = d + d[0];
+                if (companion[0] > Length - offset - d[0]) {
+                    goto invalid;
+                }
+            }
+            if (!_UdValidEndpoint(Speed, d, companion)) {
+                goto invalid;
+            }
+            seen[index] = 1;
+            ++endpoints;
+            break;
+        }
+
+        case UD_DT_SS_COMPANION:
+            // checked along with its endpoint; anywhere else it is out of place
+            if ((Speed != UdSpeedSuper) || (previous != UD_DT_ENDPOINT)) {
+                goto invalid;
+            }
+            break;
+
+        case UD_DT_CONFIGURATION:
+            goto invalid;
+
+        default:
+            // class-specific and other descriptors are left to their drivers
+            break;
+        }
+        previous = d[1];
+    }
+
+    offset = 0;
+    if ((interfaces != Buffer[4]) || (endpoints != declared)) {
+        goto invalid;
+    }
+
+    *Offset = 0;
+    return STATUS_SUCCESS;
+
+invalid:
+    *Offset = offset;
+    return STATUS_INVALID_PARAMETER;
+}
+
+
+NTSTATUS
+UdValidateBos(
+    _In_reads_bytes_(Length) const UCHAR *Buffer,
+    _In_ ULONG Length,
+    _Out_ PULONG Offset
+)
+{
+    ULONG caps = 0;
+    BOOLEAN bSuperSpeed = FALSE;
+    ULONG offset = 0;
+
+    if ((Length < 5) || (Buffer[0] < 5) || (Buffer[1] != UD_DT_BOS) || (_UdGet16(Buffer + 2) != Length)) {
+        goto invalid;
+    }
+
+    for (offset = Buffer[0]; offset < Length; offset += Buffer[offset]) {
+        const UCHAR *d = Buffer + offset;
+
+        if ((Length - offset < 3) || (d[0] < 3) || (d[0] > Length - offset) ||
+            (d[1] != UD_DT_DEVICE_CAPABILITY)) {
+            goto invalid;
+        }
+
+        switch (d[2]) {
+        case UD_CAP_USB20_EXTENSION:
+            if (d[0] < UD_USB20_EXTENSION_LENGTH) {
+                goto invalid;
+            }
+            break;
+
+        case UD_CAP_SUPERSPEED:
+            if ((d[0] < UD_SUPERSPEED_CAP_LENGTH) || ((_UdGet16(d + 4) & 0x0008) == 0)) {
+                goto invalid;
+            }
+            bSuperSpeed = TRUE;
+            break;
+
+        default:
+            break;
+        }
+        ++caps;
+    }
+
+    offset = 0;
+    if ((caps != Buffer[4]) || !bSuperSpeed) {
+        goto invalid;
+    }
+
+    *Offset = 0;
+    return STATUS_SUCCESS;
+
+invalid:
+    *Offset = offset;
+    return STATUS_INVALID_PARAMETER;
+}
@@ -0,0 +1,57 @@
+/*++
+
+Module Name:
+
+UsbDescriptor.h
+
+Abstract:
+
+    Validation of configuration and BOS descriptor sets against the rules
+    USB hosts apply when parsing one (lengths, counts, packet sizes per
+    speed, companions). The sets themselves are written out at compile
+    time (UsbDescriptorSet.h); this is the check they pass on the way in,
+    and the one they are tested against.
+
+    Descriptor layouts are those of the USB 2.0 and 3.x specifications,
+    read byte by byte, so no USB headers are needed.
+
+    This module is OS-neutral; see OsShim.h.
+
+--*/
+
+#pragma once
+
+#include "OsShim.h"
+#include "UsbDescriptorSet.h"
+
+EXTERN_C_START
+
+
+typedef enum _UD_SPEED
+{
+    UdSpeedHigh,
+    UdSpeedSuper
+} UD_SPEED;
+
+//
+// Checks a configuration descriptor set as a host would parse it at Speed.
+// Fails with STATUS_INVALID_PARAMETER, and *Offset set to the descriptor at
+// fault, on the first broken rule.
+//
+NTSTATUS
+UdValidateConfiguration(
+    _In_ UD_SPEED Speed,
+    _In_reads_bytes_(Length) const UCHAR *Buffer,
+    _In_ ULONG Length,
+    _Out_ PULONG Offset
+);
+
+NTSTATUS
+UdValidateBos(
+    _In_reads_bytes_(Length) const UCHAR *Buffer,
+    _In_ ULONG Length,
+    _Out_ PULONG Offset
+);
+
+
+EXTERN_C_END
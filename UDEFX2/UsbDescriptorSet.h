@@ -0,0 +1,233 @@
+/*++
+
+Module Name:
+
+UsbDescriptorSet.h
+
+Abstract:
+
+    Descriptor sets written out at compile time, as byte array
+    initializers, from one list of endpoints:
+
+        #define MY_ENDPOINTS(EP) \
+            EP(0x02, UD_ENDPOINT_BULK,      0,  0, 15) \
+            EP(0x86, UD_ENDPOINT_INTERRUPT, 64, 1, 0)
+
+        static const UCHAR set[] = { UD_CONFIGURATION_SET(HS, MY_ENDPOINTS, ...) };
+        UD_CHECK_CONFIGURATION_SET(HS, MY_ENDPOINTS, set);
+
+    Each EP(Address, Type, MaxPacket, Interval, MaxBurst) is one endpoint:
+    MaxPacket is the wMaxPacketSize of interrupt and isochronous endpoints,
+    bulk ones get the speed's (and MaxPacket is ignored); MaxBurst is only
+    used at SuperSpeed. The speed is one of FS, HS or SS; at SS each
+    endpoint is followed by its companion descriptor.
+
+    Lengths, counts and wTotalLength are all computed from the list, and
+    the checks reject, at compile time, endpoint 0, a duplicate address,
+    and the packet sizes and intervals UdValidateConfiguration rejects.
+
+    Isochronous endpoints go in a second list, given to
+    UD_ALTERNATE_CONFIGURATION_SET: alternate setting 0 has only the first
+    list, and so takes no isochronous bandwidth (USB 2.0 5.6.3); setting 1
+    has both.
+
+    Only macros, with no types, so the Linux gadget function (simpleufn)
+    builds its descriptors from this header too.
+
+--*/
+
+#pragma once
+
+
+#ifdef C_ASSERT
+#define UD_STATIC_ASSERT(__e)       C_ASSERT(__e)
+#else
+#define UD_STATIC_ASSERT(__e)       _Static_assert((__e), #__e)
+#endif
+
+
+// bmAttributes transfer types
+#define UD_ENDPOINT_CONTROL         0
+#define UD_ENDPOINT_ISOCHRONOUS     1
+#define UD_ENDPOINT_BULK            2
+#define UD_ENDPOINT_INTERRUPT       3
+
+#define UD_BULK_MAX_PACKET_FS       64
+#define UD_BULK_MAX_PACKET_HS       512
+#define UD_BULK_MAX_PACKET_SS       1024
+#define UD_MAX_BURST                15      // bMaxBurst is packets after the first
+
+// descriptor types
+#define UD_DT_CONFIGURATION         0x02
+#define UD_DT_INTERFACE             0x04
+#define UD_DT_ENDPOINT              0x05
+#define UD_DT_BOS                   0x0F
+#define UD_DT_DEVICE_CAPABILITY     0x10
+#define UD_DT_SS_COMPANION          0x30
+
+#define UD_CAP_USB20_EXTENSION      0x02
+#define UD_CAP_SUPERSPEED           0x03
+
+// descriptor lengths
+#define UD_CONFIGURATION_LENGTH     9
+#define UD_INTERFACE_LENGTH         9
+#define UD_ENDPOINT_LENGTH          7
+#define UD_SS_COMPANION_LENGTH      6
+#define UD_USB20_EXTENSION_LENGTH   7
+#define UD_SUPERSPEED_CAP_LENGTH    10
+#define UD_BOS_LENGTH               22      // header, USB 2.0 extension, SuperSpeed capability
+
+
+//
+// Single descriptors.
+//
+#define UD_LE16(__v)                ((__v) & 0xFF), (((__v) >> 8) & 0xFF)
+
+#define UD_CONFIGURATION_DESCRIPTOR(__totalLength, __interfaces, __attributes, __maxPower) \
+    UD_CONFIGURATION_LENGTH, UD_DT_CONFIGURATION, UD_LE16(__totalLength),    \
+    (__interfaces), 1, 0, (__attributes), (__maxPower)
+
+#define UD_INTERFACE_DESCRIPTOR(__number, __alternate, __endpoints, __class, __subClass, __protocol) \
+    UD_INTERFACE_LENGTH, UD_DT_INTERFACE, (__number), (__alternate), (__endpoints), \
+    (__class), (__subClass), (__protocol), 0
+
+#define UD_ENDPOINT_DESCRIPTOR(__address, __type, __maxPacket, __interval)   \
+    UD_ENDPOINT_LENGTH, UD_DT_ENDPOINT, (__address), (__type),              \
+    UD_LE16(__maxPacket), (__interval)
+
+#define UD_SS_COMPANION_DESCRIPTOR(__maxBurst, __attributes, __bytesPerInterval) \
+    UD_SS_COMPANION_LENGTH, UD_DT_SS_COMPANION, (__maxBurst), (__attributes), \
+    UD_LE16(__bytesPerInterval)
+
+//
+// The SuperSpeed BOS descriptor set: LPM, and full speed and up.
+//
+#define UD_BOS_SET()                                                        \
+    5, UD_DT_BOS, UD_LE16(UD_BOS_LENGTH), 2,                                \
+    UD_USB20_EXTENSION_LENGTH, UD_DT_DEVICE_CAPABILITY, UD_CAP_USB20_EXTENSION, \
+    0x02, 0, 0, 0,                                                          \
+    UD_SUPERSPEED_CAP_LENGTH, UD_DT_DEVICE_CAPABILITY, UD_CAP_SUPERSPEED,   \
+    0, UD_LE16(0x000E), 1, 0x0A, UD_LE16(0x07FF)
+
+
+//
+// Per speed: wMaxPacketSize, bMaxPower (2 mA units, 8 at SuperSpeed), and
+// the bytes an endpoint takes.
+//
+#define UD_MAX_PACKET_FS(__type, __maxPacket) (((__type) == UD_ENDPOINT_BULK) ? UD_BULK_MAX_PACKET_FS : (__maxPacket))
+#define UD_MAX_PACKET_HS(__type, __maxPacket) (((__type) == UD_ENDPOINT_BULK) ? UD_BULK_MAX_PACKET_HS : (__maxPacket))
+#define UD_MAX_PACKET_SS(__type, __maxPacket) (((__type) == UD_ENDPOINT_BULK) ? UD_BULK_MAX_PACKET_SS : (__maxPacket))
+
+#define UD_MAX_POWER_FS(__ma)       (((__ma) + 1) / 2)
+#define UD_MAX_POWER_HS(__ma)       (((__ma) + 1) / 2)
+#define UD_MAX_POWER_SS(__ma)       (((__ma) + 7) / 8)
+
+#define UD_ENDPOINT_SIZE_FS         UD_ENDPOINT_LENGTH
+#define UD_ENDPOINT_SIZE_HS         UD_ENDPOINT_LENGTH
+#define UD_ENDPOINT_SIZE_SS         (UD_ENDPOINT_LENGTH + UD_SS_COMPANION_LENGTH)
+
+// companion: no burst on control endpoints; periodic ones reserve every packet of a burst
+#define UD_SS_BURST(__type, __maxBurst) (((__type) == UD_ENDPOINT_CONTROL) ? 0 : (__maxBurst))
+#define UD_SS_BYTES_PER_INTERVAL(__type, __maxPacket, __maxBurst)           \
+    ((((__type) == UD_ENDPOINT_INTERRUPT) || ((__type) == UD_ENDPOINT_ISOCHRONOUS)) ? \
+     UD_MAX_PACKET_SS(__type, __maxPacket) * (UD_SS_BURST(__type, __maxBurst) + 1) : 0)
+
+#define _UD_ENDPOINT_FS(__a, __t, __mp, __i, __b) \
+    UD_ENDPOINT_DESCRIPTOR(__a, __t, UD_MAX_PACKET_FS(__t, __mp), __i),
+#define _UD_ENDPOINT_HS(__a, __t, __mp, __i, __b) \
+    UD_ENDPOINT_DESCRIPTOR(__a, __t, UD_MAX_PACKET_HS(__t, __mp), __i),
+#define _UD_ENDPOINT_SS(__a, __t, __mp, __i, __b) \
+    UD_ENDPOINT_DESCRIPTOR(__a, __t, UD_MAX_PACKET_SS(__t, __mp), __i),     \
+    UD_SS_COMPANION_DESCRIPTOR(UD_SS_BURST(__t, __b), 0, UD_SS_BYTES_PER_INTERVAL(__t, __mp, __b)),
+
+
+//
+// Counting and checking a list.
+//
+#define UD_ENDPOINT_SLOT(__address) ((((__address) & 0x80) >> 3) | ((__address) & 0x0F))
+
+#define UD_ENDPOINT_INVALID(__a, __t, __mp, __i, __b)                       \
+    ((((__a) & 0x0F) == 0) || (((__a) & 0x70) != 0) ||                      \
+     ((__t) < UD_ENDPOINT_ISOCHRONOUS) || ((__t) > UD_ENDPOINT_INTERRUPT) || \
+     ((__b) > UD_MAX_BURST) ||                                              \
+     (((__t) != UD_ENDPOINT_BULK) &&                                        \
+      (((__i) < 1) || ((__i) > 16) || ((__mp) < 1) || ((__mp) > 1024))))
+
+#define _UD_COUNT(__a, __t, __mp, __i, __b)     + 1
+#define _UD_SLOT_SUM(__a, __t, __mp, __i, __b)  + (1ULL << UD_ENDPOINT_SLOT(__a))
+#define _UD_SLOT_OR(__a, __t, __mp, __i, __b)   | (1ULL << UD_ENDPOINT_SLOT(__a))
+#define _UD_INVALID(__a, __t, __mp, __i, __b)   + UD_ENDPOINT_INVALID(__a, __t, __mp, __i, __b)
+
+#define UD_ENDPOINT_COUNT(__list)   (0 __list(_UD_COUNT))
+
+// a sum of distinct powers of two is their OR; any duplicate makes it larger
+#define UD_CHECK_ENDPOINTS(__list)                                          \
+    UD_STATIC_ASSERT(UD_ENDPOINT_COUNT(__list) <= 30);                      \
+    UD_STATIC_ASSERT((0 __list(_UD_SLOT_SUM)) == (0 __list(_UD_SLOT_OR)));  \
+    UD_STATIC_ASSERT((0 __list(_UD_INVALID)) == 0)
+
+
+//
+// Sets. The speed goes through one more macro, so it can be a macro too.
+//
+#define _UD_ENDPOINT_SET(__speed, __list)   __list(_UD_ENDPOINT_##__speed)
+#define _UD_ENDPOINT_SET_LENGTH(__speed, __list) (UD_ENDPOINT_COUNT(__list) * UD_ENDPOINT_SIZE_##__speed)
+#define _UD_MAX_POWER(__speed, __ma)        UD_MAX_POWER_##__speed(__ma)
+
+// the endpoint descriptors (and companions) of a list, in its order
+#define UD_ENDPOINT_SET(__speed, __list)            _UD_ENDPOINT_SET(__speed, __list)
+#define UD_ENDPOINT_SET_LENGTH(__speed, __list)     _UD_ENDPOINT_SET_LENGTH(__speed, __list)
+
+// where endpoint __index of a set starts
+#define UD_ENDPOINT_OFFSET(__speed, __index)        ((__index) * _UD_ENDPOINT_SIZE(__speed))
+#define _UD_ENDPOINT_SIZE(__speed)                  UD_ENDPOINT_SIZE_##__speed
+
+#define UD_CONFIGURATION_SET_LENGTH(__speed, __list) \
+    (UD_CONFIGURATION_LENGTH + UD_INTERFACE_LENGTH + UD_ENDPOINT_SET_LENGTH(__speed, __list))
+
+//
+// A configuration with a single interface holding the endpoints of the list.
+//
+#define UD_CONFIGURATION_SET(__speed, __list, __attributes, __maxPowerMa, __class, __subClass, __protocol) \
+    UD_CONFIGURATION_DESCRIPTOR(UD_CONFIGURATION_SET_LENGTH(__speed, __list), 1, \
+                                (__attributes), _UD_MAX_POWER(__speed, __maxPowerMa)), \
+    UD_INTERFACE_DESCRIPTOR(0, 0, UD_ENDPOINT_COUNT(__list), (__class), (__subClass), (__protocol)), \
+    UD_ENDPOINT_SET(__speed, __list)
+
+#define UD_CHECK_CONFIGURATION_SET(__speed, __list, __set)                  \
+    UD_CHECK_ENDPOINTS(__list);                                             \
+    UD_STATIC_ASSERT(sizeof(__set) == UD_CONFIGURATION_SET_LENGTH(__speed, __list)); \
+    UD_STATIC_ASSERT(sizeof(__set) <= 0xFFFF)
+
+#define UD_ALTERNATE_CONFIGURATION_SET_LENGTH(__speed, __list, __altList)   \
+    (UD_CONFIGURATION_SET_LENGTH(__speed, __list) + UD_INTERFACE_LENGTH +   \
+     UD_ENDPOINT_SET_LENGTH(__speed, __list) + UD_ENDPOINT_SET_LENGTH(__speed, __altList))
+
+//
+// A configuration with a single interface in two settings: 0 holds the
+// endpoints of __list, 1 those of __list and then __altList.
+//
+#define UD_ALTERNATE_CONFIGURATION_SET(__speed, __list, __altList, __attributes, __maxPowerMa, __class, __subClass, __protocol) \
+    UD_CONFIGURATION_DESCRIPTOR(UD_ALTERNATE_CONFIGURATION_SET_LENGTH(__speed, __list, __altList), 1, \
+                                (__attributes), _UD_MAX_POWER(__speed, __maxPowerMa)), \
+    UD_INTERFACE_DESCRIPTOR(0, 0, UD_ENDPOINT_COUNT(__list), (__class), (__subClass), (__protocol)), \
+    UD_ENDPOINT_SET(__speed, __list)                                        \
+    UD_INTERFACE_DESCRIPTOR(0, 1, UD_ENDPOINT_COUNT(__list) + UD_ENDPOINT_COUNT(__altList), \
+                            (__class), (__subClass), (__protocol)),         \
+    UD_ENDPOINT_SET(__speed, __list)                                        \
+    UD_ENDPOINT_SET(__speed, __altList)
+
+// the two lists together must pass UD_CHECK_ENDPOINTS, and setting 0 must take no isochronous bandwidth
+#define _UD_ISOCHRONOUS(__a, __t, __mp, __i, __b) + ((__t) == UD_ENDPOINT_ISOCHRONOUS)
+
+#define UD_CHECK_ALTERNATE_CONFIGURATION_SET(__speed, __list, __altList, __set) \
+    UD_CHECK_ENDPOINTS(__list);                                             \
+    UD_CHECK_ENDPOINTS(__altList);                                          \
+    UD_STATIC_ASSERT(UD_ENDPOINT_COUNT(__list) + UD_ENDPOINT_COUNT(__altList) <= 30); \
+    UD_STATIC_ASSERT((0 __list(_UD_SLOT_SUM) __altList(_UD_SLOT_SUM)) ==    \
+                     (0 __list(_UD_SLOT_OR) __altList(_UD_SLOT_OR)));       \
+    UD_STATIC_ASSERT((0 __list(_UD_ISOCHRONOUS)) == 0);                     \
+    UD_STATIC_ASSERT(sizeof(__set) == UD_ALTERNATE_CONFIGURATION_SET_LENGTH(__speed, __list, __altList)); \
+    UD_STATIC_ASSERT(sizeof(__set) <= 0xFFFF)
+
+UD_STATIC_ASSERT(UD_BOS_LENGTH == 5 + UD_USB20_EXTENSION_LENGTH + UD_SUPERSPEED_CAP_LENGTH);
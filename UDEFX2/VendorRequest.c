@@ -0,0 +1,177 @@
+/*++
+
+Module Name:
+
+VendorRequest.c
+
+Abstract:
+
+    Implementation of the vendor request dispatcher declared in
+    VendorRequest.h.
+
+--*/
+
+#include "VendorRequest.h"
+
+
+typedef NTSTATUS (*PFN_VR_HANDLER)(
+    _In_ const VENDOR_OPS *Ops,
+    _In_ PVOID Context,
+    _In_ const VENDOR_SETUP *Setup,
+    _Inout_updates_bytes_(Length) PUCHAR Buffer,
+    _In_ ULONG Length,
+    _Out_ PULONG BytesDone
+);
+
+typedef struct _VR_ENTRY
+{
+    PFN_VR_HANDLER Handler;     // NULL: no such request
+    USHORT         MinLength;   // data stage
+    USHORT         MaxLength;
+} VR_ENTRY;
+
+
+
+static ULONG64
+_VrGet64(
+    _In_reads_bytes_(8) const UCHAR *p
+)
+{
+    ULONG64 value = 0;
+
+    for (int i = 7; i >= 0; --i) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+
+static NTSTATUS
+_VrGetStats(
+    _In_ const VENDOR_OPS *Ops,
+    _In_ PVOID Context,
+    _In_ const VENDOR_SETUP *Setup,
+    _Inout_updates_bytes_(Length) PUCHAR Buffer,
+    _In_ ULONG Length,
+    _Out_ PULONG BytesDone
+)
+{
+    ULONG64 counters[VR_STATS_MAX_COUNTERS];
+    ULONG count = Ops->ReadStats(Context, Setup->wIndex, counters);
+    ULONG done = 0;
+
+    for (ULONG i = 0; (i < count) && (done < Length); ++i) {
+        for (ULONG b = 0; (b < 8) && (done < Length); ++b) {
+            Buffer[done++] = (UCHAR)(counters[i] >> (8 * b));
+        }
+    }
+
+    *BytesDone = done;
+    return (count != 0) ? STATUS_SUCCESS : STATUS_INVALID_PARAMETER;
+}
+
+
+static NTSTATUS
+_VrSetPattern(
+    _In_ const VENDOR_OPS *Ops,
+    _In_ PVOID Context,
+    _In_ const VENDOR_SETUP *Setup,
+    _Inout_updates_bytes_(Length) PUCHAR Buffer,
+    _In_ ULONG Length,
+    _Out_ PULONG BytesDone
+)
+{
+    *BytesDone = 0;
+    if ((Length != 0) && (Length != sizeof(ULONG64))) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    return Ops->SetBulkInPattern(Context, Setup->wValue, (Length != 0) ? _VrGet64(Buffer) : 0);
+}
+
+
+static NTSTATUS
+_VrSetSink(
+    _In_ const VENDOR_OPS *Ops,
+    _In_ PVOID Context,
+    _In_ const VENDOR_SETUP *Setup,
+    _Inout_updates_bytes_(Length) PUCHAR Buffer,
+    _In_ ULONG Length,
+    _Out_ PULONG BytesDone
+)
+{
+    *BytesDone = 0;
+    if ((Length != 0) && (Length != sizeof(ULONG64))) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    return Ops->SetBulkOutSink(Context, Setup->wValue & 0xFF, Setup->wValue >> 8,
+                               (Length != 0) ? _VrGet64(Buffer) : 0);
+}
+
+
+static NTSTATUS
+_VrResetCounters(
+    _In_ const VENDOR_OPS *Ops,
+    _In_ PVOID Context,
+    _In_ const VENDOR_SETUP *Setup,
+    _Inout_updates_bytes_(Length) PUCHAR Buffer,
+    _In_ ULONG Length,
+    _Out_ PULONG BytesDone
+)
+{
+    UNREFERENCED_PARAMETER(Buffer);
+    UNREFERENCED_PARAMETER(Length);
+
+    *BytesDone = 0;
+    Ops->ResetCounters(Context, Setup->wValue);
+    return STATUS_SUCCESS;
+}
+
+
+//
+// [direction][bRequest]; direction 1 is IN.
+//
+static const VR_ENTRY VrTable[2][UDEFX2_VR_COUNT] =
+{
+    [1][UDEFX2_VR_GET_STATS]        = { _VrGetStats,      1, 0xFFFF },
+    [0][UDEFX2_VR_SET_PATTERN]      = { _VrSetPattern,    0, sizeof(ULONG64) },
+    [0][UDEFX2_VR_SET_SINK]         = { _VrSetSink,       0, sizeof(ULONG64) },
+    [0][UDEFX2_VR_RESET_COUNTERS]   = { _VrResetCounters, 0, 0 },
+};
+
+
+
+NTSTATUS
+VrDispatch(
+    _In_ const VENDOR_OPS *Ops,
+    _In_ PVOID Context,
+    _In_ const VENDOR_SETUP *Setup,
+    _Inout_updates_bytes_to_opt_(Length, *BytesDone) PUCHAR Buffer,
+    _In_ ULONG Length,
+    _Out_ PULONG BytesDone
+)
+{
+    const VR_ENTRY *entry;
+
+    *BytesDone = 0;
+
+    if (!VrIsVendorRequest(Setup) ||
+        ((Setup->bmRequestType & VR_RECIPIENT_MASK) != 0) ||
+        (Setup->bRequest >= UDEFX2_VR_COUNT)) {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    entry = &(VrTable[(Setup->bmRequestType & VR_DIR_IN) ? 1 : 0][Setup->bRequest]);
+    if (entry->Handler == NULL) {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    // the whole data stage is there, and it is a length the request takes
+    if ((Setup->wLength < entry->MinLength) ||
+        (Setup->wLength > entry->MaxLength) ||
+        (Length < Setup->wLength) ||
+        ((Buffer == NULL) && (Setup->wLength != 0))) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    return entry->Handler(Ops, Context, Setup, Buffer, Setup->wLength, BytesDone);
+}
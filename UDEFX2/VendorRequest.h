@@ -0,0 +1,136 @@
+/*++
+
+Module Name:
+
+VendorRequest.h
+
+Abstract:
+
+    Vendor control requests on the default endpoint, so the device can be
+    queried and set up by the host itself, without the back-channel.
+    The request codes below are the wire protocol; the host-side driver
+    can include this header as is.
+
+    Requests are looked up in a table built at compile time, indexed by
+    direction and bRequest: one bounds check and one load, no allocation.
+    Only vendor requests to the device (bmRequestType 0x40 and 0xC0) go
+    there. The table also holds the data stage lengths each request takes,
+    so handlers see only well-formed requests.
+
+    Handlers act on the device through a VENDOR_OPS table supplied by the
+    owner; see USBCom.c for the UdeCx one.
+
+    This module is OS-neutral; see OsShim.h.
+
+--*/
+
+#pragma once
+
+#include "OsShim.h"
+
+EXTERN_C_START
+
+
+//
+// bRequest codes. All multi-byte data is little-endian.
+//
+//  GET_STATS       IN.  wIndex: UDEFX2_VR_STATS_xxx block. Data: the block's
+//                  counters, 8 bytes each, as many as wLength has room for.
+//  SET_PATTERN     OUT. wValue: BULK IN pattern (UDEFX2_PATTERN_xxx).
+//                  Data: none, or an 8-byte seed (0 if none).
+//  SET_SINK        OUT. wValue: BULK OUT sink mode (UDEFX2_SINK_xxx) in the
+//                  low byte, pattern in the high byte. Data: as SET_PATTERN.
+//  RESET_COUNTERS  OUT. wValue: mask of blocks, bit n for block n. No data.
+//                  The sink is reset, pattern stream included, as of the
+//                  next BULK OUT transfer.
+//
+#define UDEFX2_VR_GET_STATS         0x01
+#define UDEFX2_VR_SET_PATTERN       0x02
+#define UDEFX2_VR_SET_SINK          0x03
+#define UDEFX2_VR_RESET_COUNTERS    0x04
+#define UDEFX2_VR_COUNT             0x05    // table size, one past the last code
+
+// GET_STATS blocks
+#define UDEFX2_VR_STATS_SINK        0   // Mode, Bytes, Transfers, Errors, FirstErrorOffset
+#define UDEFX2_VR_STATS_INTERRUPT   1   // Raised, Delivered, Overflows, Transfers, Pending
+#define UDEFX2_VR_STATS_BLOCKS      2
+
+#define VR_STATS_MAX_COUNTERS       8
+
+
+#define VR_TYPE_VENDOR          0x40    // bmRequestType bits 6..5
+#define VR_TYPE_MASK            0x60
+#define VR_DIR_IN               0x80
+#define VR_RECIPIENT_MASK       0x1F    // 0 is the device
+
+typedef struct _VENDOR_SETUP
+{
+    UCHAR   bmRequestType;
+    UCHAR   bRequest;
+    USHORT  wValue;
+    USHORT  wIndex;
+    USHORT  wLength;
+} VENDOR_SETUP, *PVENDOR_SETUP;
+
+
+//
+// What the handlers need from the device. Context is the one given to
+// VrDispatch.
+//
+typedef struct _VENDOR_OPS
+{
+    // Fills Counters for Block; returns how many, 0 for an unknown block.
+    ULONG (*ReadStats)(
+        _In_ PVOID   Context,
+        _In_ ULONG   Block,
+        _Out_writes_to_(VR_STATS_MAX_COUNTERS, return) PULONG64 Counters
+    );
+
+    NTSTATUS (*SetBulkInPattern)(
+        _In_ PVOID   Context,
+        _In_ ULONG   Pattern,
+        _In_ ULONG64 Seed
+    );
+
+    NTSTATUS (*SetBulkOutSink)(
+        _In_ PVOID   Context,
+        _In_ ULONG   Mode,
+        _In_ ULONG   Pattern,
+        _In_ ULONG64 Seed
+    );
+
+    // Blocks is a mask, bit n for block n; unknown bits are ignored.
+    VOID (*ResetCounters)(
+        _In_ PVOID   Context,
+        _In_ ULONG   Blocks
+    );
+} VENDOR_OPS, *PVENDOR_OPS;
+
+
+FORCEINLINE
+BOOLEAN
+VrIsVendorRequest(
+    _In_ const VENDOR_SETUP *Setup
+)
+{
+    return (Setup->bmRequestType & VR_TYPE_MASK) == VR_TYPE_VENDOR;
+}
+
+//
+// Runs a vendor request. Buffer holds the data stage, wLength bytes of its
+// Length; *BytesDone is what an IN request returns.
+// Fails with STATUS_NOT_SUPPORTED on a request that is not in the table,
+// which the caller should stall.
+//
+NTSTATUS
+VrDispatch(
+    _In_ const VENDOR_OPS *Ops,
+    _In_ PVOID Context,
+    _In_ const VENDOR_SETUP *Setup,
+    _Inout_updates_bytes_to_opt_(Length, *BytesDone) PUCHAR Buffer,
+    _In_ ULONG Length,
+    _Out_ PULONG BytesDone
+);
+
+
+EXTERN_C_END
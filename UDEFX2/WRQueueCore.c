@@ -0,0 +1,1260 @@
+/*++
+
+Module Name:
+
+WRQueueCore.c
+
+Abstract:
+
+    Implementation of the write-to-read queue declared in WRQueueCore.h.
+
+    Pairing is a dual queue holding either one token per pending write, or
+    the pending reads themselves. The writes sit in per-priority lanes (or
+    in PushBack, if a read left part of one), so whoever gets a token can
+    pick the write it is entitled to by priority.
+
+--*/
+
+#include "WRQueueCore.h"
+
+
+#define WRQ_MINLEN(__a, __b)  ( ((__a) < (__b)) ? (__a) : (__b) )
+
+
+//
+// A read waiting for a write. Lives outside the request, because a canceled
+// read stays referenced by the dual queue until it is popped.
+//
+typedef struct _PARKED_READ
+{
+    DQ_WAITER     Waiter; // must be first
+    OS_REQUEST    Request;
+    PWRQUEUE      Q;
+    volatile LONG CancelHandoff; // claimer vs. cancel routine: the second one to get here completes
+    ULONG64       ParkTime;      // OsTimestamp()
+} PARKED_READ, *PPARKED_READ;
+
+
+//
+// Life of a write queued by reference (BUFFER_CONTENT.DeferredState).
+// It is queued ARMING, and only becomes PARKED (cancelable) afterwards; a
+// reader that pops it meanwhile waits, like a writer does for a parked read.
+// The writer does not get preempted in between.
+//
+#define WRQ_DEFERRED_ARMING  0
+#define WRQ_DEFERRED_PARKED  1
+#define WRQ_DEFERRED_TAKEN   2  // retrieved by a reader, no longer cancelable
+#define WRQ_DEFERRED_GONE    3  // canceled, or could not be parked: nothing left but the entry
+
+
+//
+// Pairing holds one of these per queued write; the writes themselves sit in
+// the lanes (or PushBack), so that readers can pick them by priority.
+//
+#define WRQ_TOKEN           ((PVOID)(ULONG_PTR)1)
+#define WRQ_LANE_PUSHBACK   WRQUEUE_NUM_LANES
+
+
+static VOID
+_WrqCompleteRead(
+    _In_ PWRQUEUE   Q,
+    _In_ OS_REQUEST rqRead,
+    _In_ NTSTATUS   status,
+    _In_ SIZE_T     bytes
+)
+{
+    Q->Ops->CompleteRead(Q->OpsContext, rqRead, status, bytes);
+}
+
+
+static VOID
+_WrqCompleteWrite(
+    _In_ PWRQUEUE   Q,
+    _In_ OS_REQUEST rqWrite,
+    _In_ NTSTATUS   status,
+    _In_ SIZE_T     bytes
+)
+{
+    Q->Ops->CompleteWrite(Q->OpsContext, rqWrite, status, bytes);
+}
+
+
+static VOID
+_WrqReleaseWaiter(
+    _In_ PDQ_WAITER Waiter
+)
+{
+    PPARKED_READ pParked = CONTAINING_RECORD(Waiter, PARKED_READ, Waiter);
+    SlabFree(&(pParked->Q->EntryCache), pParked);
+}
+
+
+VOID
+WrqCancelRead(
+    _In_ PVOID ParkedRead
+)
+{
+    PPARKED_READ pParked = (PPARKED_READ)ParkedRead;
+    PWRQUEUE Q = pParked->Q;
+    OS_REQUEST request = pParked->Request;
+
+    if (DqCancelWaiter(&(Q->Pairing), &(pParked->Waiter))) {
+        // still inside the dual queue; whoever pops it will free it
+        _WrqCompleteRead(Q, request, STATUS_CANCELLED, 0);
+    } else if (InterlockedIncrement(&(pParked->CancelHandoff)) == 2) {
+        // a writer claimed it but lost the race against cancellation, and is done with it
+        SlabFree(&(Q->EntryCache), pParked);
+        _WrqCompleteRead(Q, request, STATUS_CANCELLED, 0);
+    }
+}
+
+
+//
+// Called by a writer after it claimed a parked read.
+// Returns TRUE if the read is now exclusively ours to complete.
+//
+static BOOLEAN
+_WrqTakeParkedRead(
+    _In_  PPARKED_READ pParked,
+    _Out_ OS_REQUEST  *rqRead
+)
+{
+    OS_REQUEST request = pParked->Request;
+    PWRQUEUE Q = pParked->Q;
+
+    if (Q->Ops->DisarmRead(Q->OpsContext, request)) {
+        HistRecord(&(Q->ReadResidency), OsTimestamp() - pParked->ParkTime);
+        InterlockedIncrement64(&(Q->MatchedOnWrite));
+        SlabFree(&(Q->EntryCache), pParked);
+        (*rqRead) = request;
+        return TRUE;
+    }
+
+    // cancel routine is running or about to; the write goes to someone else
+    if (InterlockedIncrement(&(pParked->CancelHandoff)) == 2) {
+        SlabFree(&(Q->EntryCache), pParked);
+        _WrqCompleteRead(Q, request, STATUS_CANCELLED, 0);
+    }
+    return FALSE;
+}
+
+
+static BOOLEAN
+_WrqAboveHighWater(
+    _In_ PWRQUEUE Q
+)
+{
+    return ((ReadNoFence64(&(Q->QueuedBytes)) >= (LONG64)Q->Limits.HighWaterBytes) ||
+            (ReadNoFence(&(Q->QueuedEntries)) >= Q->Limits.HighWaterEntries));
+}
+
+
+static BOOLEAN
+_WrqBelowLowWater(
+    _In_ PWRQUEUE Q
+)
+{
+    return ((ReadNoFence64(&(Q->QueuedBytes)) <= (LONG64)Q->Limits.LowWaterBytes) &&
+            (ReadNoFence(&(Q->QueuedEntries)) <= Q->Limits.LowWaterEntries));
+}
+
+
+//
+// Tells FlowControl about the throttle state, until it has caught up with it.
+// Only one thread delivers at a time, with FlowLock released around the call:
+// a transition made meanwhile (the callback's own writes included) is left
+// to that thread, and one undone meanwhile is never delivered at all.
+//
+static VOID
+_WrqFlowDeliver(
+    _In_ PWRQUEUE Q
+)
+{
+    OS_LOCK_STATE lockState;
+
+    for (;;) {
+        PFN_WRQUEUE_FLOW_CONTROL flowControl;
+        PVOID context;
+        BOOLEAN bThrottle;
+
+        OsLockAcquire(&(Q->FlowLock), &lockState);
+        bThrottle = (BOOLEAN)(Q->bThrottled != FALSE);
+        if (Q->bFlowDelivering || (Q->bFlowDelivered == bThrottle) || (Q->FlowControl == NULL)) {
+            OsLockRelease(&(Q->FlowLock), &lockState);
+            return;
+        }
+        Q->bFlowDelivering = TRUE;
+        flowControl = Q->FlowControl;
+        context = Q->FlowContext;
+        OsLockRelease(&(Q->FlowLock), &lockState);
+
+        flowControl(context, bThrottle);
+
+        OsLockAcquire(&(Q->FlowLock), &lockState);
+        Q->bFlowDelivered = bThrottle;
+        Q->bFlowDelivering = FALSE;
+        OsLockRelease(&(Q->FlowLock), &lockState);
+    }
+}
+
+
+//
+// Waits until nobody is calling FlowControl, and keeps it that way until
+// _WrqFlowEndExclusive. For installing or removing the callback.
+//
+static VOID
+_WrqFlowBeginExclusive(
+    _In_ PWRQUEUE Q
+)
+{
+    OS_LOCK_STATE lockState;
+
+    for (;;) {
+        OsLockAcquire(&(Q->FlowLock), &lockState);
+        if (!Q->bFlowDelivering) {
+            Q->bFlowDelivering = TRUE;
+            OsLockRelease(&(Q->FlowLock), &lockState);
+            return;
+        }
+        OsLockRelease(&(Q->FlowLock), &lockState);
+        OsCpuRelax();
+    }
+}
+
+static VOID
+_WrqFlowEndExclusive(
+    _In_ PWRQUEUE Q
+)
+{
+    OS_LOCK_STATE lockState;
+
+    OsLockAcquire(&(Q->FlowLock), &lockState);
+    Q->bFlowDelivering = FALSE;
+    OsLockRelease(&(Q->FlowLock), &lockState);
+}
+
+
+//
+// Re-evaluates the producer throttle against the current depth.
+// Only called by whoever saw a watermark crossed, so off the common path.
+//
+static VOID
+_WrqFlowEvaluate(
+    _In_ PWRQUEUE Q
+)
+{
+    OS_LOCK_STATE lockState;
+
+    OsLockAcquire(&(Q->FlowLock), &lockState);
+
+    if (!Q->bThrottled) {
+        // publish first, look at the depth second: a reader draining meanwhile
+        // either sees the throttle (and re-evaluates after us) or we see its drain
+        InterlockedExchange(&(Q->bThrottled), TRUE);
+
+        if (_WrqAboveHighWater(Q)) {
+            Q->ThrottleStart = OsTimestamp();
+            ++(Q->Throttles);
+        } else {
+            InterlockedExchange(&(Q->bThrottled), FALSE);
+        }
+    } else if (_WrqBelowLowWater(Q)) {
+        InterlockedExchange(&(Q->bThrottled), FALSE);
+        Q->ThrottledTime += OsTimestamp() - Q->ThrottleStart;
+    }
+
+    OsLockRelease(&(Q->FlowLock), &lockState);
+
+    _WrqFlowDeliver(Q);
+}
+
+
+static VOID
+_WrqRaisePeak64(
+    _Inout_ volatile LONG64 *Peak,
+    _In_    LONG64 Value
+)
+{
+    LONG64 seen = ReadNoFence64(Peak);
+    while ((Value > seen) && (InterlockedCompareExchange64(Peak, Value, seen) != seen)) {
+        seen = ReadNoFence64(Peak);
+    }
+}
+
+static VOID
+_WrqRaisePeak(
+    _Inout_ volatile LONG *Peak,
+    _In_    LONG Value
+)
+{
+    LONG seen = ReadNoFence(Peak);
+    while ((Value > seen) && (InterlockedCompareExchange(Peak, Value, seen) != seen)) {
+        seen = ReadNoFence(Peak);
+    }
+}
+
+
+static VOID
+_WrqUnreserve(
+    _In_ PWRQUEUE Q,
+    _In_ SIZE_T Bytes,
+    _In_ LONG   Entries
+)
+{
+    InterlockedAdd64(&(Q->QueuedBytes), -(LONG64)Bytes);
+    InterlockedAdd(&(Q->QueuedEntries), -Entries);
+
+    if (ReadAcquire(&(Q->bThrottled)) && _WrqBelowLowWater(Q)) {
+        _WrqFlowEvaluate(Q);
+    }
+}
+
+
+//
+// Makes an entry for wbuffer[offset..wlen), counted against the queue limits
+// until its last byte is handed out. The bytes are copied, unless rqDeferred
+// is given, in which case the entry refers to wbuffer (which rqDeferred owns).
+// With a Reservation that has room left for it, the entry takes that room,
+// counted already, instead of its own.
+//
+static PBUFFER_CONTENT
+_WrqAllocEntry(
+    _In_ PWRQUEUE Q,
+    _Inout_opt_ PWRQUEUE_RESERVATION Reservation,
+    _In_reads_bytes_(wlen) PUCHAR wbuffer,
+    _In_ SIZE_T wlen,
+    _In_ SIZE_T offset,
+    _In_opt_ OS_REQUEST rqDeferred
+)
+{
+    PBUFFER_CONTENT pEntry;
+    SIZE_T remaining = wlen - offset;
+    LONG64 bytes;
+    LONG entries;
+
+    if ((Reservation != NULL) &&
+        (Reservation->Entries > 0) && (Reservation->Bytes >= remaining)) {
+        Reservation->Bytes -= remaining;
+        Reservation->Entries -= 1;
+        bytes = ReadNoFence64(&(Q->QueuedBytes));
+        entries = ReadNoFence(&(Q->QueuedEntries));
+    } else {
+        Reservation = NULL;
+        bytes = InterlockedAdd64(&(Q->QueuedBytes), (LONG64)remaining);
+        entries = InterlockedIncrement(&(Q->QueuedEntries));
+
+        if ((bytes > (LONG64)Q->Limits.MaxBytes) || (entries > Q->Limits.MaxEntries)) {
+            InterlockedIncrement64(&(Q->Refused));
+            _WrqUnreserve(Q, remaining, 1);
+            return NULL;
+        }
+    }
+
+    pEntry = SlabAlloc(&(Q->EntryCache),
+        sizeof(BUFFER_CONTENT) + ((rqDeferred != NULL) ? 0 : remaining));
+    if (pEntry == NULL) {
+        if (Reservation != NULL) {
+            Reservation->Bytes += remaining;
+            Reservation->Entries += 1;
+        } else {
+            _WrqUnreserve(Q, remaining, 1);
+        }
+        return NULL;
+    }
+
+    _WrqRaisePeak64(&(Q->PeakBytes), bytes);
+    _WrqRaisePeak(&(Q->PeakEntries), entries);
+
+    pEntry->DeferredWrite = rqDeferred;
+    pEntry->DeferredState = WRQ_DEFERRED_ARMING;
+    pEntry->EnqueueTime = OsTimestamp();
+    if (rqDeferred != NULL) {
+        pEntry->Data = wbuffer;
+        pEntry->BufferLength = wlen;
+        pEntry->Cursor = offset;
+    } else {
+        memcpy(&(pEntry->BufferStart), wbuffer + offset, remaining);
+        pEntry->Data = &(pEntry->BufferStart);
+        pEntry->BufferLength = remaining;
+        pEntry->Cursor = 0;
+    }
+    return pEntry;
+}
+
+
+//
+// Frees an entry without completing its deferred write (if any).
+//
+static VOID
+_WrqFreeEntry(
+    _In_ PWRQUEUE Q,
+    _In_ PBUFFER_CONTENT pEntry
+)
+{
+    SIZE_T remaining = BUFFER_CONTENT_REMAINING(pEntry);
+
+    SlabFree(&(Q->EntryCache), pEntry);
+    _WrqUnreserve(Q, remaining, 1);
+}
+
+
+//
+// Marks Bytes of the entry as handed out; once it is exhausted, completes
+// its deferred write (if any) and frees it.
+// Returns TRUE if the entry still has data.
+//
+static BOOLEAN
+_WrqAdvanceEntry(
+    _In_ PWRQUEUE Q,
+    _In_ PBUFFER_CONTENT pEntry,
+    _In_ SIZE_T Bytes
+)
+{
+    pEntry->Cursor += Bytes;
+    if (BUFFER_CONTENT_REMAINING(pEntry) == 0) {
+        HistRecord(&(Q->WriteResidency), OsTimestamp() - pEntry->EnqueueTime);
+        if (pEntry->DeferredWrite != NULL) {
+            _WrqCompleteWrite(Q, pEntry->DeferredWrite, STATUS_SUCCESS, pEntry->BufferLength);
+        }
+        SlabFree(&(Q->EntryCache), pEntry);
+        _WrqUnreserve(Q, Bytes, 1);
+        return FALSE;
+    }
+
+    _WrqUnreserve(Q, Bytes, 0);
+    return TRUE;
+}
+
+
+//
+// The writer's side, once a deferred entry is queued: move the request
+// where it can be canceled, then let readers at it.
+//
+static VOID
+_WrqParkWrite(
+    _In_ PWRQUEUE Q,
+    _In_ PBUFFER_CONTENT pEntry
+)
+{
+    OS_REQUEST rqWrite = pEntry->DeferredWrite;
+    NTSTATUS status = Q->Ops->ParkWrite(Q->OpsContext, rqWrite);
+
+    if (NT_SUCCESS(status)) {
+        InterlockedExchange(&(pEntry->DeferredState), WRQ_DEFERRED_PARKED);
+        return;
+    }
+
+    // the entry is someone else's as soon as it is GONE
+    InterlockedExchange(&(pEntry->DeferredState), WRQ_DEFERRED_GONE);
+    _WrqCompleteWrite(Q, rqWrite, status, 0);
+}
+
+
+//
+// The reader's side, for an entry it just popped: makes sure a deferred
+// write is still there to be read from, and takes it out of reach of
+// cancellation. Returns FALSE (and disposes of the entry) if it is not.
+//
+static BOOLEAN
+_WrqTakeEntry(
+    _In_ PWRQUEUE Q,
+    _In_ PBUFFER_CONTENT pEntry
+)
+{
+    OS_REQUEST rqWrite = pEntry->DeferredWrite;
+    LONG state;
+
+    if (rqWrite == NULL) {
+        return TRUE;
+    }
+
+    while ((state = ReadAcquire(&(pEntry->DeferredState))) == WRQ_DEFERRED_ARMING) {
+        OsCpuRelax(); // writer is still parking it
+    }
+
+    if (state == WRQ_DEFERRED_TAKEN) {
+        return TRUE; // pushed back by a previous reader
+    }
+
+    if ((state == WRQ_DEFERRED_PARKED) && Q->Ops->TakeWrite(Q->OpsContext, rqWrite)) {
+        pEntry->DeferredState = WRQ_DEFERRED_TAKEN;
+        return TRUE;
+    }
+
+    // canceled (and completed) while queued
+    _WrqFreeEntry(Q, pEntry);
+    return FALSE;
+}
+
+
+//
+// Fills a parked read we have claimed straight from src, without completing it.
+// Returns how many bytes it took; (*pStatus) is what to complete it with.
+//
+static SIZE_T
+_WrqFillParkedRead(
+    _In_ PWRQUEUE Q,
+    _In_ OS_REQUEST rqRead,
+    _In_reads_bytes_(srclen) PUCHAR src,
+    _In_ SIZE_T srclen,
+    _Out_ NTSTATUS *pStatus
+)
+{
+    PUCHAR rbuffer;
+    SIZE_T rlen;
+    SIZE_T copied = 0;
+    NTSTATUS status = Q->Ops->GetReadBuffer(Q->OpsContext, rqRead, &rbuffer, &rlen);
+
+    if (NT_SUCCESS(status)) {
+        copied = WRQ_MINLEN(rlen, srclen);
+        memcpy(rbuffer, src, copied);
+    }
+
+    (*pStatus) = status;
+    return copied;
+}
+
+
+//
+// Fills a parked read we have claimed straight from src, and completes it.
+// Returns how many bytes it took.
+//
+static SIZE_T
+_WrqCompleteParkedRead(
+    _In_ PWRQUEUE Q,
+    _In_ OS_REQUEST rqRead,
+    _In_reads_bytes_(srclen) PUCHAR src,
+    _In_ SIZE_T srclen
+)
+{
+    NTSTATUS status;
+    SIZE_T copied = _WrqFillParkedRead(Q, rqRead, src, srclen, &status);
+
+    _WrqCompleteRead(Q, rqRead, status, copied);
+    return copied;
+}
+
+
+//
+// Makes a write whose token has just been queued available to readers.
+// A reader holding that token spins until it is, so the caller must not
+// get preempted in between.
+//
+static VOID
+_WrqPublishEntry(
+    _In_ PWRQUEUE Q,
+    _In_ PBUFFER_CONTENT pEntry,
+    _In_ ULONG Lane
+)
+{
+    PDQ_RING ring = &(Q->PushBack);
+
+    if (Lane != WRQ_LANE_PUSHBACK) {
+        ring = &(Q->Lanes[Lane]);
+        InterlockedIncrement(&(Q->LaneDepth[Lane]));
+    }
+
+    // rings have room for twice MaxEntries, so they are never found full
+    NT_VERIFY(DqRingTryPush(ring, pEntry));
+}
+
+
+static PBUFFER_CONTENT
+_WrqPopLane(
+    _In_ PWRQUEUE Q,
+    _In_ ULONG Lane
+)
+{
+    PBUFFER_CONTENT pEntry = (PBUFFER_CONTENT)DqRingTryPop(&(Q->Lanes[Lane]));
+    ULONG lower;
+
+    if (pEntry == NULL) {
+        return NULL;
+    }
+
+    InterlockedDecrement(&(Q->LaneDepth[Lane]));
+    InterlockedExchange(&(Q->LaneSkips[Lane]), 0);
+
+    // every lane with data that had to wait for this one is a step closer to its turn
+    for (lower = Lane + 1; lower < WRQUEUE_NUM_LANES; ++lower) {
+        if (ReadNoFence(&(Q->LaneDepth[lower])) > 0) {
+            InterlockedIncrement(&(Q->LaneSkips[lower]));
+        }
+    }
+    return pEntry;
+}
+
+
+//
+// Pops the write a token entitles a reader to: a pushed back one first, then
+// a lane that was passed over too often, then the highest lane with data.
+//
+static PBUFFER_CONTENT
+_WrqPopEntry(
+    _In_ PWRQUEUE Q
+)
+{
+    for (;;) {
+        PBUFFER_CONTENT pEntry = (PBUFFER_CONTENT)DqRingTryPop(&(Q->PushBack));
+        ULONG lane;
+
+        if (pEntry != NULL) {
+            return pEntry;
+        }
+
+        for (lane = 0; lane < WRQUEUE_NUM_LANES; ++lane) {
+            if ((ReadNoFence(&(Q->LaneSkips[lane])) >= WRQUEUE_LANE_STARVATION_LIMIT) &&
+                ((pEntry = _WrqPopLane(Q, lane)) != NULL)) {
+                return pEntry;
+            }
+        }
+
+        for (lane = 0; lane < WRQUEUE_NUM_LANES; ++lane) {
+            if ((pEntry = _WrqPopLane(Q, lane)) != NULL) {
+                return pEntry;
+            }
+        }
+
+        OsCpuRelax(); // its writer is still publishing it
+    }
+}
+
+
+//
+// A reader took pWriteEntry but could not finish it; put the rest back at
+// the head of the queue, or hand it to reads that parked in the meantime.
+//
+static VOID
+_WrqPushBackEntry(
+    _In_ PWRQUEUE Q,
+    _In_ PBUFFER_CONTENT pWriteEntry
+)
+{
+    for (;;) {
+        PDQ_WAITER pWaiter;
+        OS_REQUEST rqRead;
+        OS_NO_PREEMPT_STATE np;
+
+        OsEnterNoPreempt(&np);
+        DQ_RESULT res = DqOfferFront(&(Q->Pairing), WRQ_TOKEN, &pWaiter);
+        if (res == DqQueued) {
+            _WrqPublishEntry(Q, pWriteEntry, WRQ_LANE_PUSHBACK);
+        }
+        OsLeaveNoPreempt(&np);
+
+        if (res == DqQueued) {
+            return;
+        }
+
+        if (_WrqTakeParkedRead(CONTAINING_RECORD(pWaiter, PARKED_READ, Waiter), &rqRead) &&
+            !_WrqAdvanceEntry(Q, pWriteEntry, _WrqCompleteParkedRead(Q, rqRead,
+                BUFFER_CONTENT_DATA(pWriteEntry), BUFFER_CONTENT_REMAINING(pWriteEntry)))) {
+            return;
+        }
+    }
+}
+
+
+//
+// Fills a read from the queue, starting with the write bHaveToken entitles
+// it to, if any.
+// Message mode takes one write per read; stream mode keeps packing queued
+// writes, in one copy pass, until the read is full. Either way, whatever
+// does not fit stays at the head of the queue for the next read.
+//
+static BOOLEAN
+_WrqFillRead(
+    _In_  PWRQUEUE Q,
+    _In_  BOOLEAN bHaveToken,
+    _Out_writes_bytes_to_(rlen, *completedBytes) PVOID rbuffer,
+    _In_  SIZE_T rlen,
+    _Out_ PSIZE_T completedBytes
+)
+{
+    PBUFFER_CONTENT pWriteEntry;
+    PVOID token;
+    BOOLEAN bGotAny = FALSE;
+    SIZE_T copied = 0;
+
+    for (;;) {
+        if (!bHaveToken) {
+            if (bGotAny && ((Q->Mode == WRQueueModeMessage) || (copied == rlen))) {
+                break;
+            }
+            if (DqRequest(&(Q->Pairing), NULL, &token) != DqMatched) {
+                break;
+            }
+        }
+        bHaveToken = FALSE;
+
+        pWriteEntry = _WrqPopEntry(Q);
+        if (!_WrqTakeEntry(Q, pWriteEntry)) {
+            continue;
+        }
+
+        SIZE_T minlen = WRQ_MINLEN(BUFFER_CONTENT_REMAINING(pWriteEntry), rlen - copied);
+        memcpy((PUCHAR)rbuffer + copied, BUFFER_CONTENT_DATA(pWriteEntry), minlen);
+        copied += minlen;
+        bGotAny = TRUE;
+
+        if (_WrqAdvanceEntry(Q, pWriteEntry, minlen)) {
+            _WrqPushBackEntry(Q, pWriteEntry); // read is full
+            break;
+        }
+    }
+
+    (*completedBytes) = copied;
+    return bGotAny;
+}
+
+
+static VOID
+_WrqDestroyRings(
+    _Inout_ PWRQUEUE Q
+)
+{
+    ULONG lane;
+
+    for (lane = 0; lane < WRQUEUE_NUM_LANES; ++lane) {
+        DqRingDestroy(&(Q->Lanes[lane]));
+    }
+    DqRingDestroy(&(Q->PushBack));
+}
+
+
+NTSTATUS
+WrqInit(
+    _Out_    PWRQUEUE Q,
+    _In_     WRQUEUE_MODE Mode,
+    _In_opt_ PWRQUEUE_LIMITS Limits,
+    _In_     PCWRQUEUE_OPS Ops,
+    _In_opt_ PVOID OpsContext
+)
+{
+    NTSTATUS status;
+    ULONG lane;
+
+    memset(Q, 0, sizeof(*Q));
+
+    Q->Mode = Mode;
+    Q->Ops = Ops;
+    Q->OpsContext = OpsContext;
+    OsLockInit(&(Q->FlowLock));
+
+    if (Limits != NULL) {
+        Q->Limits = (*Limits);
+    } else {
+        WRQUEUE_LIMITS_INIT(&(Q->Limits));
+    }
+
+    if ((Q->Limits.MaxEntries > WRQUEUE_CAPACITY) ||
+        (Q->Limits.HighWaterBytes > Q->Limits.MaxBytes) ||
+        (Q->Limits.HighWaterEntries > Q->Limits.MaxEntries) ||
+        (Q->Limits.LowWaterBytes >= Q->Limits.HighWaterBytes) ||
+        (Q->Limits.LowWaterEntries >= Q->Limits.HighWaterEntries)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    status = SlabInit(&(Q->EntryCache));
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = DqRingInit(&(Q->PushBack), 2 * WRQUEUE_CAPACITY);
+    for (lane = 0; NT_SUCCESS(status) && (lane < WRQUEUE_NUM_LANES); ++lane) {
+        status = DqRingInit(&(Q->Lanes[lane]), 2 * WRQUEUE_CAPACITY);
+    }
+    if (!NT_SUCCESS(status)) {
+        goto Error;
+    }
+
+    status = DqInit(&(Q->Pairing), WRQUEUE_CAPACITY, _WrqReleaseWaiter);
+    if (!NT_SUCCESS(status)) {
+        goto Error;
+    }
+
+    Q->bInitialized = TRUE;
+    return STATUS_SUCCESS;
+
+Error:
+    _WrqDestroyRings(Q);
+    SlabDestroy(&(Q->EntryCache));
+    return status;
+}
+
+
+VOID
+WrqDestroy(
+    _Inout_ PWRQUEUE Q
+)
+{
+    PBUFFER_CONTENT pWriteEntry;
+    PDQ_WAITER pWaiter;
+    OS_LOCK_STATE lockState;
+
+    if (!Q->bInitialized) {
+        return;
+    }
+
+    // the producer may be gone already, so just forget it rather than release it
+    _WrqFlowBeginExclusive(Q);
+    OsLockAcquire(&(Q->FlowLock), &lockState);
+    Q->FlowControl = NULL;
+    OsLockRelease(&(Q->FlowLock), &lockState);
+    _WrqFlowEndExclusive(Q);
+
+    // clean up whichever side is populated; depth accounting no longer matters
+    while (DqDrainItem(&(Q->Pairing)) != NULL) {
+        pWriteEntry = _WrqPopEntry(Q);
+        if (_WrqTakeEntry(Q, pWriteEntry)) {
+            if (pWriteEntry->DeferredWrite != NULL) {
+                _WrqCompleteWrite(Q, pWriteEntry->DeferredWrite, STATUS_CANCELLED, 0);
+            }
+            SlabFree(&(Q->EntryCache), pWriteEntry);
+        }
+    }
+
+    while ((pWaiter = DqDrainWaiter(&(Q->Pairing))) != NULL) {
+        PPARKED_READ pParked = CONTAINING_RECORD(pWaiter, PARKED_READ, Waiter);
+        OS_REQUEST rqRead;
+
+        if (!DqClaimWaiter(pWaiter)) {
+            SlabFree(&(Q->EntryCache), pParked); // already canceled and completed
+        } else if (_WrqTakeParkedRead(pParked, &rqRead)) {
+            _WrqCompleteRead(Q, rqRead, STATUS_CANCELLED, 0);
+        }
+    }
+
+    DqDestroy(&(Q->Pairing));
+    _WrqDestroyRings(Q);
+    SlabDestroy(&(Q->EntryCache));
+    Q->bInitialized = FALSE;
+}
+
+
+static NTSTATUS
+_WrqPushWrite(
+    _Inout_  PWRQUEUE Q,
+    _In_     ULONG Lane,
+    _Inout_opt_ PWRQUEUE_RESERVATION Reservation,
+    _In_opt_ OS_REQUEST rqDeferred,
+    _In_     PVOID wbuffer,
+    _In_     SIZE_T wlen,
+    _Out_    PULONG readsCompleted,
+    _Out_    PBOOLEAN pbTaken
+)
+{
+    NTSTATUS status;
+    PBUFFER_CONTENT pNewEntry = NULL;
+    PUCHAR src = (PUCHAR)wbuffer;
+    SIZE_T remaining = wlen;
+
+    if (pbTaken == NULL) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    (*pbTaken) = FALSE;
+
+    if ((readsCompleted == NULL) || (Lane >= WRQUEUE_NUM_LANES)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    (*readsCompleted) = 0;
+    status = STATUS_SUCCESS; // til proven otherwise
+
+    for (;;) {
+        PDQ_WAITER pWaiter;
+        OS_REQUEST rqRead;
+        OS_NO_PREEMPT_STATE np;
+        BOOLEAN bDeferred = (pNewEntry != NULL) && (pNewEntry->DeferredWrite != NULL);
+
+        if (pNewEntry != NULL) {
+            // a reader that gets our token waits until the entry is published
+            // (and parked), so do not get preempted in between
+            OsEnterNoPreempt(&np);
+        }
+
+        DQ_RESULT res = DqOffer(&(Q->Pairing), (pNewEntry != NULL) ? WRQ_TOKEN : NULL, &pWaiter);
+
+        if (pNewEntry != NULL) {
+            if (res == DqQueued) {
+                _WrqPublishEntry(Q, pNewEntry, Lane);
+                if (bDeferred) {
+                    _WrqParkWrite(Q, pNewEntry);
+                    (*pbTaken) = TRUE;
+                }
+            }
+            OsLeaveNoPreempt(&np);
+        }
+
+        if (res == DqMatched) {
+            if (!_WrqTakeParkedRead(CONTAINING_RECORD(pWaiter, PARKED_READ, Waiter), &rqRead)) {
+                continue; // that read was being canceled, try the next one
+            }
+
+            if (pNewEntry != NULL) {
+                if (!_WrqAdvanceEntry(Q, pNewEntry, _WrqCompleteParkedRead(Q, rqRead,
+                        BUFFER_CONTENT_DATA(pNewEntry), BUFFER_CONTENT_REMAINING(pNewEntry)))) {
+                    (*pbTaken) = bDeferred; // ...and completed along with the entry
+                    pNewEntry = NULL;
+                    remaining = 0;
+                }
+            } else {
+                NTSTATUS rstatus;
+                SIZE_T taken = _WrqFillParkedRead(Q, rqRead, src, remaining, &rstatus);
+
+                // queue what the read leaves before completing it: once part of
+                // the write is out, failing it would have all of it sent again
+                if (NT_SUCCESS(rstatus) && (taken < remaining)) {
+                    pNewEntry = _WrqAllocEntry(Q, Reservation, (PUCHAR)wbuffer, wlen, (wlen - remaining) + taken, rqDeferred);
+                    if (pNewEntry == NULL) {
+                        _WrqCompleteRead(Q, rqRead, STATUS_INSUFFICIENT_RESOURCES, 0);
+                        ++(*readsCompleted);
+                        status = STATUS_INSUFFICIENT_RESOURCES; // too full, or out of memory
+                        break;
+                    }
+                }
+                _WrqCompleteRead(Q, rqRead, rstatus, taken);
+                src += taken;
+                remaining -= taken;
+            }
+            ++(*readsCompleted);
+
+            if (remaining == 0) {
+                break;
+            }
+            continue; // the rest goes to the next read, or gets queued
+        }
+
+        if (res == DqQueued) {
+            pNewEntry = NULL; // owned by the queue now
+            InterlockedIncrement64(&(Q->WritesQueued));
+            HistRecord(&(Q->Depth), (ULONG64)ReadNoFence(&(Q->QueuedEntries)));
+            if (!ReadAcquire(&(Q->bThrottled)) && _WrqAboveHighWater(Q)) {
+                _WrqFlowEvaluate(Q);
+            }
+            break;
+        }
+
+        if (res == DqFull) {
+            // an entry holds a place in the limits, which keep the tokens below capacity
+            NT_ASSERT(pNewEntry == NULL);
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            break;
+        }
+
+        // nobody waiting: queue the rest instead, in case a read parks meanwhile
+        pNewEntry = _WrqAllocEntry(Q, Reservation, (PUCHAR)wbuffer, wlen, wlen - remaining, rqDeferred);
+        if (pNewEntry == NULL) {
+            status = STATUS_INSUFFICIENT_RESOURCES; // too full, or out of memory
+            break;
+        }
+    }
+
+    if (pNewEntry != NULL) {
+        _WrqFreeEntry(Q, pNewEntry); // never queued, the caller still owns its write
+    }
+
+    return status;
+}
+
+
+NTSTATUS
+WrqPushWrite(
+    _Inout_  PWRQUEUE Q,
+    _In_     ULONG Lane,
+    _In_opt_ OS_REQUEST rqDeferred,
+    _In_     PVOID wbuffer,
+    _In_     SIZE_T wlen,
+    _Out_    PULONG readsCompleted,
+    _Out_    PBOOLEAN pbTaken
+)
+{
+    return _WrqPushWrite(Q, Lane, NULL, rqDeferred, wbuffer, wlen, readsCompleted, pbTaken);
+}
+
+
+NTSTATUS
+WrqReserve(
+    _Inout_ PWRQUEUE Q,
+    _In_    SIZE_T Bytes,
+    _In_    LONG Entries,
+    _Out_   PWRQUEUE_RESERVATION Reservation
+)
+{
+    LONG64 bytes;
+    LONG entries;
+
+    Reservation->Bytes = 0;
+    Reservation->Entries = 0;
+
+    if ((Entries <= 0) || (Entries > Q->Limits.MaxEntries) || (Bytes > Q->Limits.MaxBytes)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    bytes = InterlockedAdd64(&(Q->QueuedBytes), (LONG64)Bytes);
+    entries = InterlockedAdd(&(Q->QueuedEntries), Entries);
+
+    if ((bytes > (LONG64)Q->Limits.MaxBytes) || (entries > Q->Limits.MaxEntries)) {
+        InterlockedIncrement64(&(Q->Refused));
+        _WrqUnreserve(Q, Bytes, Entries);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    _WrqRaisePeak64(&(Q->PeakBytes), bytes);
+    _WrqRaisePeak(&(Q->PeakEntries), entries);
+    Reservation->Bytes = Bytes;
+    Reservation->Entries = Entries;
+
+    if (!ReadAcquire(&(Q->bThrottled)) && _WrqAboveHighWater(Q)) {
+        _WrqFlowEvaluate(Q);
+    }
+    return STATUS_SUCCESS;
+}
+
+
+NTSTATUS
+WrqPushWriteReserved(
+    _Inout_ PWRQUEUE Q,
+    _In_    ULONG Lane,
+    _Inout_ PWRQUEUE_RESERVATION Reservation,
+    _In_    PVOID wbuffer,
+    _In_    SIZE_T wlen,
+    _Out_   PULONG readsCompleted
+)
+{
+    BOOLEAN bTaken;
+
+    return _WrqPushWrite(Q, Lane, Reservation, NULL, wbuffer, wlen, readsCompleted, &bTaken);
+}
+
+
+VOID
+WrqReleaseReservation(
+    _Inout_ PWRQUEUE Q,
+    _Inout_ PWRQUEUE_RESERVATION Reservation
+)
+{
+    if ((Reservation->Bytes != 0) || (Reservation->Entries != 0)) {
+        _WrqUnreserve(Q, Reservation->Bytes, Reservation->Entries);
+    }
+    Reservation->Bytes = 0;
+    Reservation->Entries = 0;
+}
+
+
+NTSTATUS
+WrqPushWriteBatch(
+    _Inout_ PWRQUEUE Q,
+    _In_reads_(Count) PWRQUEUE_BUFFER Writes,
+    _In_ ULONG Count,
+    _Out_writes_to_(MaxCompletions, *CompletionCount) PWRQUEUE_COMPLETION Completions,
+    _In_ ULONG MaxCompletions,
+    _Out_ PULONG CompletionCount
+)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    PDQ_WAITER waiters[WRQUEUE_MAX_BATCH];
+    ULONG iWrite = 0;
+    SIZE_T offset = 0; // into Writes[iWrite]
+    ULONG firstPiece = 0; // the first completion holding part of Writes[iWrite]
+
+    if ((Writes == NULL) || (Completions == NULL) || (CompletionCount == NULL)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    (*CompletionCount) = 0;
+
+    //
+    // Pair with parked reads, a batch of them per reservation, one write (or
+    // what is left of it) per read. While reads are parked, no write is queued,
+    // so this keeps the order.
+    //
+    while (iWrite < Count) {
+        ULONG want = WRQ_MINLEN(Count - iWrite, MaxCompletions - (*CompletionCount));
+        ULONG claimed = DqClaimWaiters(&(Q->Pairing), WRQ_MINLEN(want, WRQUEUE_MAX_BATCH), waiters);
+        ULONG i;
+
+        if (claimed == 0) {
+            break;
+        }
+
+        for (i = 0; i < claimed; ++i) {
+            OS_REQUEST rqRead;
+            PWRQUEUE_COMPLETION pCompletion;
+
+            if (!_WrqTakeParkedRead(CONTAINING_RECORD(waiters[i], PARKED_READ, Waiter), &rqRead)) {
+                continue; // being canceled
+            }
+
+            // we only claimed as many reads as there are writes left, so there is one for each
+            if (offset == 0) {
+                firstPiece = (*CompletionCount);
+            }
+            pCompletion = &(Completions[(*CompletionCount)++]);
+            pCompletion->Request = rqRead;
+            pCompletion->Information = _WrqFillParkedRead(Q, rqRead,
+                (PUCHAR)Writes[iWrite].Buffer + offset,
+                Writes[iWrite].Length - offset,
+                &(pCompletion->Status));
+
+            offset += pCompletion->Information;
+            if (offset == Writes[iWrite].Length) {
+                ++iWrite;
+                offset = 0;
+            }
+        }
+    }
+
+    // whatever is left goes the usual way, reads parking meanwhile included
+    for (; iWrite < Count; ++iWrite, offset = 0) {
+        ULONG readsCompleted;
+        BOOLEAN bTaken;
+        NTSTATUS wstatus = WrqPushWrite(Q, Writes[iWrite].Lane, NULL,
+            (PUCHAR)Writes[iWrite].Buffer + offset,
+            Writes[iWrite].Length - offset,
+            &readsCompleted,
+            &bTaken);
+
+        if (!NT_SUCCESS(wstatus)) {
+            if (offset != 0) {
+                // the rest of a write reads have started on was refused: take it
+                // back from them, they are not completed yet
+                for (ULONG i = firstPiece; i < (*CompletionCount); ++i) {
+                    Completions[i].Status = wstatus;
+                    Completions[i].Information = 0;
+                }
+            }
+            if (NT_SUCCESS(status)) {
+                status = wstatus;
+            }
+        }
+    }
+
+    return status;
+}
+
+
+VOID
+WrqSetFlowControl(
+    _Inout_  PWRQUEUE Q,
+    _In_opt_ PFN_WRQUEUE_FLOW_CONTROL FlowControl,
+    _In_opt_ PVOID Context
+)
+{
+    OS_LOCK_STATE lockState;
+    PFN_WRQUEUE_FLOW_CONTROL previous;
+    PVOID previousContext;
+    BOOLEAN bRelease;
+
+    _WrqFlowBeginExclusive(Q);
+
+    OsLockAcquire(&(Q->FlowLock), &lockState);
+    previous = Q->FlowControl;
+    previousContext = Q->FlowContext;
+    bRelease = (previous != NULL) && Q->bFlowDelivered;
+    Q->FlowControl = FlowControl;
+    Q->FlowContext = Context;
+    Q->bFlowDelivered = FALSE; // the new one has not been told anything
+    OsLockRelease(&(Q->FlowLock), &lockState);
+
+    // do not leave the previous producer held off
+    if (bRelease) {
+        previous(previousContext, FALSE);
+    }
+
+    _WrqFlowEndExclusive(Q);
+
+    // the new one hears about a throttle in force like any transition
+    _WrqFlowDeliver(Q);
+}
+
+
+NTSTATUS
+WrqPullRead(
+    _Inout_ PWRQUEUE Q,
+    _In_    OS_REQUEST rqRead,
+    _Out_writes_bytes_to_opt_(rlen, *completedBytes) PVOID rbuffer,
+    _In_    SIZE_T rlen,
+    _Out_   PBOOLEAN pbReadyToComplete,
+    _Out_   PSIZE_T completedBytes
+)
+{
+    NTSTATUS status;
+    PVOID pItem;
+    PPARKED_READ pParked = NULL;
+    OS_NO_PREEMPT_STATE np;
+    DQ_RESULT res;
+
+    if ((pbReadyToComplete == NULL) || (completedBytes == NULL) || (rbuffer == NULL)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // defaults
+    (*pbReadyToComplete) = FALSE;
+    (*completedBytes) = 0;
+    status = STATUS_SUCCESS;
+
+    // fast path, a write is already waiting
+    if (_WrqFillRead(Q, FALSE, rbuffer, rlen, completedBytes)) {
+        InterlockedIncrement64(&(Q->MatchedOnRead));
+        (*pbReadyToComplete) = TRUE;
+        goto Exit;
+    }
+
+    // no dangling writes found, must pend this read
+    pParked = SlabAlloc(&(Q->EntryCache), sizeof(PARKED_READ));
+    if (pParked == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        (*pbReadyToComplete) = TRUE;
+        goto Exit;
+    }
+
+    pParked->Request = rqRead;
+    pParked->Q = Q;
+    pParked->CancelHandoff = 0;
+    pParked->ParkTime = OsTimestamp();
+
+    // a writer that pops this read spins until it is armed, so do not get preempted in between
+    OsEnterNoPreempt(&np);
+
+    do {
+        res = DqRequest(&(Q->Pairing), &(pParked->Waiter), &pItem);
+        // a write showed up after all, unless it is what is left of a canceled deferred one
+    } while ((res == DqMatched) && !_WrqFillRead(Q, TRUE, rbuffer, rlen, completedBytes));
+
+    switch (res) {
+    case DqMatched:
+        InterlockedIncrement64(&(Q->MatchedOnRead));
+        (*pbReadyToComplete) = TRUE;
+        break;
+
+    case DqQueued:
+        // while reads are parked, the balance counts them (canceled ones a writer has reserved included)
+        InterlockedIncrement64(&(Q->ReadsParked));
+        _WrqRaisePeak(&(Q->PeakParkedReads), -ReadNoFence(&(Q->Pairing.Balance)));
+        status = Q->Ops->ArmRead(Q->OpsContext, rqRead, pParked);
+        if (!NT_SUCCESS(status)) {
+            // canceled already; nobody can claim an unarmed read, so withdrawing cannot fail
+            NT_VERIFY(DqCancelWaiter(&(Q->Pairing), &(pParked->Waiter)));
+            (*pbReadyToComplete) = TRUE;
+        } else {
+            // if this fails, the cancel routine beat us to it and completed the read
+            (VOID)DqArmWaiter(&(pParked->Waiter));
+            status = STATUS_SUCCESS;
+        }
+        pParked = NULL; // the dual queue owns it now
+        break;
+
+    default:
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        (*pbReadyToComplete) = TRUE;
+        break;
+    }
+
+    OsLeaveNoPreempt(&np);
+
+Exit:
+    if (pParked != NULL) {
+        SlabFree(&(Q->EntryCache), pParked);
+    }
+    return status;
+}
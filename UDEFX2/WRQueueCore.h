@@ -0,0 +1,390 @@
+/*++
+
+Module Name:
+
+WRQueueCore.h
+
+Abstract:
+
+    The write-to-read queue proper: pairs writes with reads, queuing
+    whichever side arrives first, by priority lane, within depth limits,
+    with producer back-pressure and residency statistics.
+
+    Requests are opaque here (OS_REQUEST). Everything the queue needs to do
+    with one, from filling a read buffer to completing it or making it
+    cancelable, goes through a WRQUEUE_OPS table supplied by the owner;
+    see Misc.c for the WDF/UdeCx one.
+
+    This module is OS-neutral; see OsShim.h.
+
+--*/
+
+#pragma once
+
+#include "OsShim.h"
+#include "DualQueue.h"
+#include "Slab.h"
+#include "Histogram.h"
+
+EXTERN_C_START
+
+
+// max number of writes queued, or reads parked, per queue (power of two)
+#define WRQUEUE_CAPACITY 1024
+
+
+typedef struct _BUFFER_CONTENT
+{
+    SIZE_T      BufferLength;
+    SIZE_T      Cursor;        // bytes already handed out to reads
+    PUCHAR      Data;          // &BufferStart, or the deferred write's own buffer
+    OS_REQUEST  DeferredWrite; // to complete once Data is consumed; NULL if Data was copied
+    volatile LONG DeferredState;
+    ULONG64     EnqueueTime;   // OsTimestamp()
+    UCHAR       BufferStart;   // variable-size structure, first byte of last field
+} BUFFER_CONTENT, *PBUFFER_CONTENT;
+
+#define BUFFER_CONTENT_DATA(__e)       ((__e)->Data + (__e)->Cursor)
+#define BUFFER_CONTENT_REMAINING(__e)  ((__e)->BufferLength - (__e)->Cursor)
+
+
+//
+// How queued writes are handed to reads.
+//   Message: a read gets (the rest of) one write; it never mixes two writes.
+//   Stream:  a read is packed with as many queued writes as fit (byte stream).
+//            A stream queue must be drained by one reader at a time (e.g. a
+//            sequential queue, or an OrderWindow): WrqPullRead does not
+//            serialize the packing, so concurrent reads interleave the bytes.
+// In both modes a write larger than the read is not truncated: the rest stays
+// at the head of the queue and goes to the following read(s).
+//
+typedef enum _WRQUEUE_MODE
+{
+    WRQueueModeMessage,
+    WRQueueModeStream
+} WRQUEUE_MODE;
+
+
+//
+// Priority lanes. Reads are served from the highest lane that has data, except
+// that a lane passed over WRQUEUE_LANE_STARVATION_LIMIT times in a row (while
+// it had data) gets the next turn. Order is kept within a lane.
+//
+#define WRQUEUE_NUM_LANES               4
+#define WRQUEUE_LANE_URGENT             0
+#define WRQUEUE_LANE_HIGH               1
+#define WRQUEUE_LANE_NORMAL             2
+#define WRQUEUE_LANE_BULK               3
+#define WRQUEUE_LANE_STARVATION_LIMIT   8
+
+
+//
+// Bounds on what a queue may hold, counting every write copied into the queue
+// until its last byte is read.
+// Crossing either high watermark throttles the producer (see
+// WrqSetFlowControl), which is released once both levels are back at or
+// below their low watermarks. The hard limits catch whatever the producer
+// still pushes in between; those writes are refused.
+//
+typedef struct _WRQUEUE_LIMITS
+{
+    SIZE_T  MaxBytes;
+    LONG    MaxEntries;         // at most WRQUEUE_CAPACITY
+    SIZE_T  HighWaterBytes;
+    LONG    HighWaterEntries;
+    SIZE_T  LowWaterBytes;
+    LONG    LowWaterEntries;
+} WRQUEUE_LIMITS, *PWRQUEUE_LIMITS;
+
+#define WRQUEUE_DEFAULT_MAX_BYTES   (1024 * 1024)
+
+FORCEINLINE
+VOID
+WRQUEUE_LIMITS_INIT(
+    _Out_ PWRQUEUE_LIMITS Limits
+)
+{
+    Limits->MaxBytes = WRQUEUE_DEFAULT_MAX_BYTES;
+    Limits->MaxEntries = WRQUEUE_CAPACITY;
+    Limits->HighWaterBytes = (WRQUEUE_DEFAULT_MAX_BYTES / 4) * 3;
+    Limits->HighWaterEntries = (WRQUEUE_CAPACITY / 4) * 3;
+    Limits->LowWaterBytes = WRQUEUE_DEFAULT_MAX_BYTES / 4;
+    Limits->LowWaterEntries = WRQUEUE_CAPACITY / 4;
+}
+
+
+//
+// Producer throttle: called with bThrottle TRUE when the queue crosses a high
+// watermark, and FALSE once it has drained to the low watermarks.
+// Calls are serialized, and made with no queue lock held, so the callback may
+// push writes itself (e.g. by restarting a queue that dispatches them inline);
+// the change it makes is delivered once it returns. Transitions that are
+// undone before they could be delivered are dropped.
+//
+typedef VOID (*PFN_WRQUEUE_FLOW_CONTROL)(
+    _In_ PVOID   Context,
+    _In_ BOOLEAN bThrottle
+);
+
+
+//
+// What the queue needs from the owner of the requests. Context is the one
+// given to WrqInit. Any of these may be called with preemption disabled.
+//
+typedef struct _WRQUEUE_OPS
+{
+    //
+    // Parked reads. ArmRead makes Read cancelable, its cancellation ending
+    // up in WrqCancelRead(ParkedRead); failing means it is canceled already.
+    // DisarmRead undoes that, and returns FALSE if cancellation got there
+    // first (WrqCancelRead is then on its way).
+    //
+    NTSTATUS (*ArmRead)(
+        _In_ PVOID      Context,
+        _In_ OS_REQUEST Read,
+        _In_ PVOID      ParkedRead
+    );
+
+    BOOLEAN (*DisarmRead)(
+        _In_ PVOID      Context,
+        _In_ OS_REQUEST Read
+    );
+
+    NTSTATUS (*GetReadBuffer)(
+        _In_  PVOID      Context,
+        _In_  OS_REQUEST Read,
+        _Out_ PUCHAR    *Buffer,
+        _Out_ PSIZE_T    Length
+    );
+
+    VOID (*CompleteRead)(
+        _In_ PVOID      Context,
+        _In_ OS_REQUEST Read,
+        _In_ NTSTATUS   Status,
+        _In_ SIZE_T     Bytes
+    );
+
+    //
+    // Deferred writes. ParkWrite puts Write where it can be canceled (the
+    // owner completes it then), keeping its handle valid; TakeWrite gets it
+    // back out of reach of cancellation, and returns FALSE if it was
+    // canceled meanwhile. Either way, TakeWrite releases the handle.
+    // May be NULL if WrqPushWrite is never given a deferred write.
+    //
+    NTSTATUS (*ParkWrite)(
+        _In_ PVOID      Context,
+        _In_ OS_REQUEST Write
+    );
+
+    BOOLEAN (*TakeWrite)(
+        _In_ PVOID      Context,
+        _In_ OS_REQUEST Write
+    );
+
+    VOID (*CompleteWrite)(
+        _In_ PVOID      Context,
+        _In_ OS_REQUEST Write,
+        _In_ NTSTATUS   Status,
+        _In_ SIZE_T     Bytes
+    );
+} WRQUEUE_OPS, *PWRQUEUE_OPS;
+
+typedef const WRQUEUE_OPS *PCWRQUEUE_OPS;
+
+
+typedef struct _WRQUEUE
+{
+    // holds either a token per pending write, or pending reads (PARKED_READ), never both
+    DUAL_QUEUE Pairing;
+    DQ_RING    Lanes[WRQUEUE_NUM_LANES]; // the pending writes (PBUFFER_CONTENT), by priority
+    DQ_RING    PushBack;                 // partially read writes, served before any lane
+    volatile LONG LaneDepth[WRQUEUE_NUM_LANES];
+    volatile LONG LaneSkips[WRQUEUE_NUM_LANES];
+    SLAB       EntryCache;   // BUFFER_CONTENT and PARKED_READ storage, recycled
+    WRQUEUE_MODE Mode;
+    WRQUEUE_LIMITS Limits;
+    PCWRQUEUE_OPS Ops;
+    PVOID      OpsContext;
+
+    // depth, including writes a reader is in the middle of
+    volatile LONG64 QueuedBytes;
+    volatile LONG   QueuedEntries;
+    volatile LONG64 PeakBytes;
+    volatile LONG   PeakEntries;
+    volatile LONG64 Refused;
+
+    // back-pressure state; transitions happen under FlowLock, and are
+    // delivered to FlowControl outside it, by one thread at a time
+    OS_LOCK         FlowLock;
+    volatile LONG   bThrottled;
+    BOOLEAN         bFlowDelivered;     // what FlowControl was last told
+    BOOLEAN         bFlowDelivering;    // a thread is calling FlowControl
+    PFN_WRQUEUE_FLOW_CONTROL FlowControl;
+    PVOID           FlowContext;
+    ULONG64         ThrottleStart;  // OsTimestamp()
+    LONG64          Throttles;
+    ULONG64         ThrottledTime;  // OsTimestamp() ticks
+
+    // residency and matching profile
+    HISTOGRAM       WriteResidency;
+    HISTOGRAM       ReadResidency;
+    HISTOGRAM       Depth;
+    volatile LONG64 WritesQueued;
+    volatile LONG64 ReadsParked;
+    volatile LONG64 MatchedOnWrite;
+    volatile LONG64 MatchedOnRead;
+    volatile LONG   PeakParkedReads;
+
+    BOOLEAN    bInitialized;
+} WRQUEUE, *PWRQUEUE;
+
+
+NTSTATUS
+WrqInit(
+    _Out_    PWRQUEUE Q,
+    _In_     WRQUEUE_MODE Mode,
+    _In_opt_ PWRQUEUE_LIMITS Limits,    // NULL for WRQUEUE_LIMITS_INIT defaults
+    _In_     PCWRQUEUE_OPS Ops,
+    _In_opt_ PVOID OpsContext
+);
+
+//
+// Completes whatever is still queued, reads and deferred writes alike,
+// with STATUS_CANCELLED.
+//
+VOID
+WrqDestroy(
+    _Inout_ PWRQUEUE Q
+);
+
+//
+// Pending reads are filled and completed right here, as many as the write
+// spans; whatever they do not take gets queued in the given lane.
+// With rqDeferred, it is queued by reference: rqDeferred itself is parked,
+// later reads copy straight out of wbuffer, and the last one completes it.
+// On return, *pbTaken tells whether the queue owns rqDeferred now (it may
+// even have completed it already); if not, the caller completes it.
+// A write goes whole or not at all: if it fails, no read got any of it
+// (the read it would have started on may have been failed along with it).
+//
+NTSTATUS
+WrqPushWrite(
+    _Inout_  PWRQUEUE Q,
+    _In_     ULONG Lane,            // WRQUEUE_LANE_xxx
+    _In_opt_ OS_REQUEST rqDeferred,
+    _In_     PVOID wbuffer,
+    _In_     SIZE_T wlen,
+    _Out_    PULONG readsCompleted,
+    _Out_    PBOOLEAN pbTaken
+);
+
+//
+// Room for a message sent as several writes, so that it goes whole or not at
+// all. WrqReserve holds room in the hard limits for Entries writes of Bytes
+// in all, or fails as a write that size would. Writes pushed against it with
+// WrqPushWriteReserved are queued in that room, as far as it goes, so only
+// running out of memory can refuse them; WrqReleaseReservation then gives
+// back whatever reads took directly, and must follow.
+// A reservation belongs to one thread at a time.
+//
+typedef struct _WRQUEUE_RESERVATION
+{
+    SIZE_T  Bytes;
+    LONG    Entries;
+} WRQUEUE_RESERVATION, *PWRQUEUE_RESERVATION;
+
+NTSTATUS
+WrqReserve(
+    _Inout_ PWRQUEUE Q,
+    _In_    SIZE_T Bytes,
+    _In_    LONG Entries,
+    _Out_   PWRQUEUE_RESERVATION Reservation
+);
+
+NTSTATUS
+WrqPushWriteReserved(
+    _Inout_ PWRQUEUE Q,
+    _In_    ULONG Lane,             // WRQUEUE_LANE_xxx
+    _Inout_ PWRQUEUE_RESERVATION Reservation,
+    _In_    PVOID wbuffer,
+    _In_    SIZE_T wlen,
+    _Out_   PULONG readsCompleted
+);
+
+VOID
+WrqReleaseReservation(
+    _Inout_ PWRQUEUE Q,
+    _Inout_ PWRQUEUE_RESERVATION Reservation
+);
+
+//
+// Batched write side: pushes Writes[] in order, same as WrqPushWrite for
+// each, but pairs them with parked reads a batch per reservation, and leaves
+// those reads for the caller to complete, e.g. after it is done with its own
+// bookkeeping. Reads that park while the batch is being pushed, or beyond
+// MaxCompletions, are completed right away instead. A write refused part
+// way fails the caller's completions that held the rest of it.
+//
+#define WRQUEUE_MAX_BATCH 64
+
+typedef struct _WRQUEUE_BUFFER
+{
+    PVOID   Buffer;
+    SIZE_T  Length;
+    ULONG   Lane;
+} WRQUEUE_BUFFER, *PWRQUEUE_BUFFER;
+
+typedef struct _WRQUEUE_COMPLETION
+{
+    OS_REQUEST Request;
+    NTSTATUS   Status;
+    SIZE_T     Information;
+} WRQUEUE_COMPLETION, *PWRQUEUE_COMPLETION;
+
+NTSTATUS
+WrqPushWriteBatch(
+    _Inout_ PWRQUEUE Q,
+    _In_reads_(Count) PWRQUEUE_BUFFER Writes,
+    _In_ ULONG Count,
+    _Out_writes_to_(MaxCompletions, *CompletionCount) PWRQUEUE_COMPLETION Completions,
+    _In_ ULONG MaxCompletions,
+    _Out_ PULONG CompletionCount
+);
+
+//
+// Serves rqRead from queued writes if there are any, otherwise parks it
+// (and arms it through the ops). *pbReadyToComplete tells whether the
+// caller completes it now, with the returned status and *completedBytes.
+//
+NTSTATUS
+WrqPullRead(
+    _Inout_ PWRQUEUE Q,
+    _In_    OS_REQUEST rqRead,
+    _Out_writes_bytes_to_opt_(rlen, *completedBytes) PVOID rbuffer,
+    _In_    SIZE_T rlen,
+    _Out_   PBOOLEAN pbReadyToComplete,
+    _Out_   PSIZE_T completedBytes
+);
+
+//
+// For the owner's cancellation path of a read armed with ArmRead.
+//
+VOID
+WrqCancelRead(
+    _In_ PVOID ParkedRead
+);
+
+//
+// Installs (or, with NULL, removes) the producer throttle. If the queue is
+// throttled already, the previous callback is released, and the new one is
+// told so right away. Not to be called from the callback itself.
+//
+VOID
+WrqSetFlowControl(
+    _Inout_  PWRQUEUE Q,
+    _In_opt_ PFN_WRQUEUE_FLOW_CONTROL FlowControl,
+    _In_opt_ PVOID Context
+);
+
+
+EXTERN_C_END
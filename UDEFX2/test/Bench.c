@@ -0,0 +1,1253 @@
+/*++
+
+Module Name:
+
+Bench.c
+
+Abstract:
+
+    Benchmarks of the portable modules, for the figures quoted when they
+    change. Each benchmark is a case, so one can be run by name:
+
+        make bench
+        out/Bench BenchWrqThreads
+
+    Figures are wall-clock, on whatever the machine is doing; compare runs
+    on the same machine only.
+
+Environment:
+
+    User mode; see Test.h
+
+--*/
+
+#include "WRQueueCore.h"
+#include "MissionExec.h"
+#include "EpRegistry.h"
+#include "EventRing.h"
+#include "FlightRecorder.h"
+#include "Stripe.h"
+#include "Pattern.h"
+#include "Sink.h"
+#include "Test.h"
+
+#include <semaphore.h>
+
+
+static
+double
+Nanoseconds(
+    _In_ ULONG64 Ticks
+)
+{
+    return (double)Ticks * 1e9 / (double)OsTimestampFrequency();
+}
+
+//
+// Lower bound of the bucket holding the Fraction-th value, in ns.
+//
+static
+double
+Percentile(
+    _In_ PHISTOGRAM Hist,
+    _In_ double Fraction
+)
+{
+    ULONG64 target = (ULONG64)((double)Hist->Count * Fraction);
+    ULONG64 seen = 0;
+
+    for (ULONG i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += (ULONG64)Hist->Buckets[i];
+        if (seen > target) {
+            return Nanoseconds(HistBucketLow(i));
+        }
+    }
+    return Nanoseconds((ULONG64)Hist->Max);
+}
+
+
+//
+// Write-to-read queue. Reads that would park are canceled on the spot:
+// the benchmarks poll.
+//
+typedef struct _BENCH_READ
+{
+    PVOID          Parked;
+    volatile LONG  Armed;
+    volatile LONG  Completions;
+    NTSTATUS       Status;
+    SIZE_T         Bytes;
+    UCHAR          Buffer[64 * 1024];
+} BENCH_READ, *PBENCH_READ;
+
+static
+NTSTATUS
+BenchArmRead(
+    _In_ PVOID Context,
+    _In_ OS_REQUEST Read,
+    _In_ PVOID ParkedRead
+)
+{
+    PBENCH_READ read = (PBENCH_READ)Read;
+
+    UNREFERENCED_PARAMETER(Context);
+
+    read->Parked = ParkedRead;
+    WriteRelease(&(read->Armed), 1);
+    return STATUS_SUCCESS;
+}
+
+static
+BOOLEAN
+BenchDisarmRead(
+    _In_ PVOID Context,
+    _In_ OS_REQUEST Read
+)
+{
+    UNREFERENCED_PARAMETER(Context);
+
+    return (InterlockedCompareExchange(&(((PBENCH_READ)Read)->Armed), 0, 1) == 1);
+}
+
+static
+NTSTATUS
+BenchGetReadBuffer(
+    _In_  PVOID Context,
+    _In_  OS_REQUEST Read,
+    _Out_ PUCHAR *Buffer,
+    _Out_ PSIZE_T Length
+)
+{
+    UNREFERENCED_PARAMETER(Context);
+
+    *Buffer = ((PBENCH_READ)Read)->Buffer;
+    *Length = sizeof(((PBENCH_READ)Read)->Buffer);
+    return STATUS_SUCCESS;
+}
+
+static
+VOID
+BenchCompleteRead(
+    _In_ PVOID Context,
+    _In_ OS_REQUEST Read,
+    _In_ NTSTATUS Status,
+    _In_ SIZE_T Bytes
+)
+{
+    PBENCH_READ read = (PBENCH_READ)Read;
+
+    UNREFERENCED_PARAMETER(Context);
+
+    read->Status = Status;
+    read->Bytes = Bytes;
+    WriteRelease(&(read->Completions), 1);
+}
+
+static
+NTSTATUS
+BenchParkWrite(
+    _In_ PVOID Context,
+    _In_ OS_REQUEST Write
+)
+{
+    UNREFERENCED_PARAMETER(Context);
+    UNREFERENCED_PARAMETER(Write);
+
+    return STATUS_SUCCESS;
+}
+
+static
+BOOLEAN
+BenchTakeWrite(
+    _In_ PVOID Context,
+    _In_ OS_REQUEST Write
+)
+{
+    UNREFERENCED_PARAMETER(Context);
+    UNREFERENCED_PARAMETER(Write);
+
+    return TRUE;
+}
+
+static
+VOID
+BenchCompleteWrite(
+    _In_ PVOID Context,
+    _In_ OS_REQUEST Write,
+    _In_ NTSTATUS Status,
+    _In_ SIZE_T Bytes
+)
+{
+    UNREFERENCED_PARAMETER(Context);
+    UNREFERENCED_PARAMETER(Write);
+    UNREFERENCED_PARAMETER(Status);
+    UNREFERENCED_PARAMETER(Bytes);
+}
+
+static const WRQUEUE_OPS BenchOps =
+{
+    BenchArmRead,
+    BenchDisarmRead,
+    BenchGetReadBuffer,
+    BenchCompleteRead,
+    BenchParkWrite,
+    BenchTakeWrite,
+    BenchCompleteWrite
+};
+
+static
+BOOLEAN
+Push(
+    _Inout_ PWRQUEUE Q,
+    _In_reads_bytes_(Length) const VOID *Data,
+    _In_ SIZE_T Length
+)
+{
+    ULONG completed;
+    BOOLEAN bTaken;
+
+    return NT_SUCCESS(WrqPushWrite(Q, WRQUEUE_LANE_NORMAL, NULL, (PVOID)Data, Length, &completed, &bTaken));
+}
+
+//
+// Bytes of one read, or -1 if there was nothing to read.
+//
+static
+LONG
+Pull(
+    _Inout_ PWRQUEUE Q,
+    _Inout_ PBENCH_READ Read
+)
+{
+    BOOLEAN bReady;
+    SIZE_T bytes;
+
+    Read->Completions = 0;
+    (VOID)WrqPullRead(Q, Read, Read->Buffer, sizeof(Read->Buffer), &bReady, &bytes);
+    if (bReady) {
+        return (LONG)bytes;
+    }
+
+    if (InterlockedCompareExchange(&(Read->Armed), 0, 1) == 1) {
+        WrqCancelRead(Read->Parked);
+    }
+    while (ReadAcquire(&(Read->Completions)) == 0) {
+        TestYield();
+    }
+    return NT_SUCCESS(Read->Status) ? (LONG)Read->Bytes : -1;
+}
+
+
+//
+// One write and the read it completes, on one thread, 64 bytes: the cost
+// of a round trip through the queue, with no contention.
+//
+#define LATENCY_ROUNDS  TEST_ROUNDS(1000000)
+
+static
+VOID
+BenchWrqLatency(
+    VOID
+)
+{
+    static WRQUEUE q;
+    static BENCH_READ read;
+    static HISTOGRAM hist;
+    UCHAR message[64] = { 0 };
+    ULONG64 start;
+
+    TEST_CHECK(NT_SUCCESS(WrqInit(&q, WRQueueModeMessage, NULL, &BenchOps, NULL)));
+    memset(&hist, 0, sizeof(hist));
+
+    start = OsTimestamp();
+    for (ULONG i = 0; i < LATENCY_ROUNDS; ++i) {
+        ULONG64 before = OsTimestamp();
+
+        TEST_CHECK(Push(&q, message, sizeof(message)));
+        TEST_CHECK(Pull(&q, &read) == sizeof(message));
+        HistRecord(&hist, OsTimestamp() - before);
+    }
+
+    printf("    push + pull, 64 B: %.0f ns a round (timing included), p50 %.0f ns, p99 %.0f ns\n",
+           Nanoseconds(OsTimestamp() - start) / LATENCY_ROUNDS,
+           Percentile(&hist, 0.50), Percentile(&hist, 0.99));
+    WrqDestroy(&q);
+}
+
+//
+// Batches of 32 writes of one size, then the reads for them; the limits
+// are raised to hold a batch of the largest.
+//
+#define SIZE_BYTES      TEST_ROUNDS(64 * 1024 * 1024)
+
+static
+VOID
+BenchWrqSizes(
+    VOID
+)
+{
+    static WRQUEUE q;
+    static BENCH_READ read;
+    static UCHAR message[64 * 1024];
+    WRQUEUE_LIMITS limits;
+
+    WRQUEUE_LIMITS_INIT(&limits);
+    limits.MaxBytes = 4 * 32 * sizeof(message);
+    limits.HighWaterBytes = limits.MaxBytes;
+    TEST_CHECK(NT_SUCCESS(WrqInit(&q, WRQueueModeMessage, &limits, &BenchOps, NULL)));
+
+    for (ULONG size = 16; size <= sizeof(message); size *= 4) {
+        ULONG count = (SIZE_BYTES / size) & ~31u;
+        ULONG64 start;
+        double ns;
+
+        if (count == 0) {
+            count = 32;
+        }
+        start = OsTimestamp();
+        for (ULONG i = 0; i < count; i += 32) {
+            for (ULONG j = 0; j < 32; ++j) {
+                TEST_CHECK(Push(&q, message, size));
+            }
+            for (ULONG j = 0; j < 32; ++j) {
+                TEST_CHECK(Pull(&q, &read) == (LONG)size);
+            }
+        }
+        ns = Nanoseconds(OsTimestamp() - start) / count;
+        printf("    %6u B: %8.0f ns a message, %8.1f MB/s\n", size, ns, (double)size * 1e3 / ns);
+    }
+    WrqDestroy(&q);
+}
+
+//
+// Writers and readers, as many of each, 64-byte messages; writers back
+// off while the queue is throttled.
+//
+#define THREAD_MESSAGES TEST_ROUNDS(200000)
+
+typedef struct _THREADS_CONTEXT
+{
+    WRQUEUE         Queue;
+    ULONG           Writers;
+    volatile LONG   Received;
+} THREADS_CONTEXT, *PTHREADS_CONTEXT;
+
+static
+VOID
+ThroughputThread(
+    _In_ ULONG Index,
+    _In_opt_ PVOID Context
+)
+{
+    PTHREADS_CONTEXT threads = (PTHREADS_CONTEXT)Context;
+    LONG total = (LONG)(threads->Writers * THREAD_MESSAGES);
+
+    if (Index < threads->Writers) {
+        UCHAR message[64] = { 0 };
+
+        for (ULONG i = 0; i < THREAD_MESSAGES; ++i) {
+            while (ReadAcquire(&(threads->Queue.bThrottled)) || !Push(&(threads->Queue), message, sizeof(message))) {
+                TestYield();
+            }
+        }
+
+    } else {
+        PBENCH_READ read = (PBENCH_READ)OsAllocate(sizeof(BENCH_READ));
+
+        TEST_CHECK(read != NULL);
+        while (ReadAcquire(&(threads->Received)) < total) {
+            if (Pull(&(threads->Queue), read) >= 0) {
+                InterlockedIncrement(&(threads->Received));
+            } else {
+                TestYield();
+            }
+        }
+        OsFree(read);
+    }
+}
+
+static
+VOID
+BenchWrqThreads(
+    VOID
+)
+{
+    static THREADS_CONTEXT threads;
+
+    for (ULONG count = 1; count <= 4; count *= 2) {
+        ULONG64 start;
+        double seconds;
+
+        memset(&threads, 0, sizeof(threads));
+        TEST_CHECK(NT_SUCCESS(WrqInit(&(threads.Queue), WRQueueModeMessage, NULL, &BenchOps, NULL)));
+        threads.Writers = count;
+
+        start = OsTimestamp();
+        TestRunThreads(2 * count, ThroughputThread, &threads);
+        seconds = Nanoseconds(OsTimestamp() - start) / 1e9;
+
+        TEST_CHECK(threads.Received == (LONG)(count * THREAD_MESSAGES));
+        printf("    %u writer(s), %u reader(s): %10.0f messages/s\n",
+               count, count, (double)threads.Received / seconds);
+        WrqDestroy(&(threads.Queue));
+    }
+}
+
+
+
+
+//
+// Writes queued by reference against copied, then read: batches of 32,
+// as BenchWrqSizes. A deferred write's request is never completed here,
+// so any non-NULL handle does.
+//
+#define DEFERRED_BYTES  TEST_ROUNDS(64 * 1024 * 1024)
+
+static
+VOID
+BenchWrqDeferred(
+    VOID
+)
+{
+    static WRQUEUE q;
+    static BENCH_READ read;
+    static UCHAR message[64 * 1024];
+    WRQUEUE_LIMITS limits;
+
+    WRQUEUE_LIMITS_INIT(&limits);
+    limits.MaxBytes = 4 * 32 * sizeof(message);
+    limits.HighWaterBytes = limits.MaxBytes;
+    TEST_CHECK(NT_SUCCESS(WrqInit(&q, WRQueueModeMessage, &limits, &BenchOps, NULL)));
+
+    for (ULONG size = 64; size <= sizeof(message); size *= 4) {
+        ULONG count = (DEFERRED_BYTES / size) & ~31u;
+        double ns[2];
+
+        if (count == 0) {
+            count = 32;
+        }
+        for (ULONG deferred = 0; deferred < 2; ++deferred) {
+            OS_REQUEST rqDeferred = deferred ? (OS_REQUEST)message : NULL;
+            ULONG64 start = OsTimestamp();
+
+            for (ULONG i = 0; i < count; i += 32) {
+                for (ULONG j = 0; j < 32; ++j) {
+                    ULONG completed;
+                    BOOLEAN bTaken;
+
+                    TEST_CHECK(NT_SUCCESS(WrqPushWrite(&q, WRQUEUE_LANE_NORMAL, rqDeferred, message, size,
+                                                       &completed, &bTaken)));
+                }
+                for (ULONG j = 0; j < 32; ++j) {
+                    TEST_CHECK(Pull(&q, &read) == (LONG)size);
+                }
+            }
+            ns[deferred] = Nanoseconds(OsTimestamp() - start) / count;
+        }
+        printf("    %6u B: copied %8.0f ns, deferred %8.0f ns a message\n", size, ns[0], ns[1]);
+    }
+    WrqDestroy(&q);
+}
+
+
+//
+// Reads parked, then drained by as many 64-byte writes, pushed one by one
+// or as a batch of 1, 8 or 64; the batch leaves the reads to complete here.
+//
+#define BATCH_MESSAGES  TEST_ROUNDS(1000000)
+
+static
+VOID
+BenchWrqBatch(
+    VOID
+)
+{
+    static WRQUEUE q;
+    static BENCH_READ reads[WRQUEUE_MAX_BATCH];
+    static UCHAR message[64];
+    WRQUEUE_BUFFER writes[WRQUEUE_MAX_BATCH];
+    WRQUEUE_COMPLETION completions[WRQUEUE_MAX_BATCH];
+
+    TEST_CHECK(NT_SUCCESS(WrqInit(&q, WRQueueModeMessage, NULL, &BenchOps, NULL)));
+    for (ULONG i = 0; i < WRQUEUE_MAX_BATCH; ++i) {
+        writes[i].Buffer = message;
+        writes[i].Length = sizeof(message);
+        writes[i].Lane = WRQUEUE_LANE_NORMAL;
+    }
+
+    for (ULONG size = 1; size <= WRQUEUE_MAX_BATCH; size *= 8) {
+        double ns[2];
+
+        for (ULONG batched = 0; batched < 2; ++batched) {
+            ULONG64 start = OsTimestamp();
+
+            for (ULONG i = 0; i < BATCH_MESSAGES; i += size) {
+                for (ULONG j = 0; j < size; ++j) {
+                    BOOLEAN bReady;
+                    SIZE_T bytes;
+
+                    reads[j].Completions = 0;
+                    (VOID)WrqPullRead(&q, &reads[j], reads[j].Buffer, sizeof(reads[j].Buffer), &bReady, &bytes);
+                    TEST_CHECK(!bReady);
+                }
+
+                if (batched) {
+                    ULONG count;
+
+                    TEST_CHECK(NT_SUCCESS(WrqPushWriteBatch(&q, writes, size, completions, size, &count)));
+                    TEST_CHECK(count == size);
+                    for (ULONG j = 0; j < count; ++j) {
+                        BenchCompleteRead(NULL, completions[j].Request, completions[j].Status,
+                                          completions[j].Information);
+                    }
+                } else {
+                    for (ULONG j = 0; j < size; ++j) {
+                        TEST_CHECK(Push(&q, message, sizeof(message)));
+                    }
+                }
+            }
+            ns[batched] = Nanoseconds(OsTimestamp() - start) / BATCH_MESSAGES;
+        }
+        printf("    %2u reads: one by one %.0f ns, batched %.0f ns a message\n", size, ns[0], ns[1]);
+    }
+    WrqDestroy(&q);
+}
+
+
+//
+// An urgent message behind a backlog of 512 bulk ones, kept topped up:
+// the time from its write to its read, in the urgent lane and, for
+// comparison, in the bulk lane with the rest. One thread writes and reads.
+//
+#define LANE_ROUNDS     TEST_ROUNDS(100000)
+#define LANE_BACKLOG    512
+
+static
+VOID
+BenchWrqLanes(
+    VOID
+)
+{
+    static const ULONG lanes[] = { WRQUEUE_LANE_URGENT, WRQUEUE_LANE_BULK };
+    static WRQUEUE q;
+    static BENCH_READ read;
+    static HISTOGRAM hist;
+    UCHAR bulk[64] = { 0 };
+    UCHAR urgent[64] = { 1 };
+
+    for (ULONG l = 0; l < 2; ++l) {
+        // behind the whole backlog each time, the bulk lane gets fewer rounds
+        ULONG rounds = (lanes[l] == WRQUEUE_LANE_URGENT) ? LANE_ROUNDS : (LANE_ROUNDS / 64);
+        ULONG completed;
+        BOOLEAN bTaken;
+
+        TEST_CHECK(NT_SUCCESS(WrqInit(&q, WRQueueModeMessage, NULL, &BenchOps, NULL)));
+        memset(&hist, 0, sizeof(hist));
+        for (ULONG i = 0; i < LANE_BACKLOG; ++i) {
+            TEST_CHECK(NT_SUCCESS(WrqPushWrite(&q, WRQUEUE_LANE_BULK, NULL, bulk, sizeof(bulk), &completed, &bTaken)));
+        }
+
+        for (ULONG i = 0; i < rounds; ++i) {
+            ULONG64 before = OsTimestamp();
+
+            TEST_CHECK(NT_SUCCESS(WrqPushWrite(&q, lanes[l], NULL, urgent, sizeof(urgent), &completed, &bTaken)));
+            do {
+                TEST_CHECK(Pull(&q, &read) == sizeof(bulk));
+                if (read.Buffer[0] == 0) {
+                    TEST_CHECK(NT_SUCCESS(WrqPushWrite(&q, WRQUEUE_LANE_BULK, NULL, bulk, sizeof(bulk),
+                                                       &completed, &bTaken)));
+                }
+            } while (read.Buffer[0] == 0);
+            HistRecord(&hist, OsTimestamp() - before);
+        }
+
+        printf("    %s lane: p50 %.0f ns, p99 %.0f ns, p999 %.0f ns\n",
+               (lanes[l] == WRQUEUE_LANE_URGENT) ? "urgent" : "bulk  ",
+               Percentile(&hist, 0.50), Percentile(&hist, 0.99), Percentile(&hist, 0.999));
+        WrqDestroy(&q);
+    }
+}
+
+//
+// Allocations a message takes through the queue, and those it would take
+// from the OS without the slab in front; then an allocation and its free,
+// slab against the OS allocator, at a few sizes.
+//
+#define SLAB_MESSAGES   TEST_ROUNDS(1000000)
+#define SLAB_ROUNDS     TEST_ROUNDS(2000000)
+
+static
+VOID
+BenchSlab(
+    VOID
+)
+{
+    static WRQUEUE q;
+    static BENCH_READ read;
+    static SLAB slab;
+    UCHAR message[64] = { 0 };
+
+    TEST_CHECK(NT_SUCCESS(WrqInit(&q, WRQueueModeMessage, NULL, &BenchOps, NULL)));
+    for (ULONG i = 0; i < SLAB_MESSAGES; ++i) {
+        TEST_CHECK(Push(&q, message, sizeof(message)));
+        TEST_CHECK(Pull(&q, &read) == sizeof(message));
+    }
+    printf("    queue, 64 B: %.3f allocations a message, %.6f of them from the OS\n",
+           (double)q.EntryCache.Stats.Allocs / SLAB_MESSAGES,
+           (double)q.EntryCache.Stats.OsAllocs / SLAB_MESSAGES);
+    WrqDestroy(&q);
+
+    TEST_CHECK(NT_SUCCESS(SlabInit(&slab)));
+    for (SIZE_T size = 64; size <= 4096; size *= 4) {
+        ULONG64 start;
+        double ns[2];
+
+        start = OsTimestamp();
+        for (ULONG i = 0; i < SLAB_ROUNDS; ++i) {
+            PVOID block = SlabAlloc(&slab, size);
+
+            TEST_CHECK(block != NULL);
+            *(volatile UCHAR *)block = 0;
+            SlabFree(&slab, block);
+        }
+        ns[0] = Nanoseconds(OsTimestamp() - start) / SLAB_ROUNDS;
+
+        start = OsTimestamp();
+        for (ULONG i = 0; i < SLAB_ROUNDS; ++i) {
+            PVOID block = OsAllocate(size);
+
+            TEST_CHECK(block != NULL);
+            *(volatile UCHAR *)block = 0;
+            OsFree(block);
+        }
+        ns[1] = Nanoseconds(OsTimestamp() - start) / SLAB_ROUNDS;
+
+        printf("    %4u B: slab %.1f ns, OS %.1f ns an allocation and free\n",
+               (unsigned)size, ns[0], ns[1]);
+    }
+    SlabDestroy(&slab);
+}
+
+
+//
+// Pattern generation into a 64 KiB buffer, a BULK IN transfer's worth,
+// for each pattern, with the vector path and without.
+//
+#define PATTERN_BYTES   TEST_ROUNDS(1024ull * 1024 * 1024)
+
+static
+VOID
+BenchPatterns(
+    VOID
+)
+{
+    static const char *names[] = { NULL, "zeros", "counter", "mod-63", "PRBS-31", "random" };
+    static UCHAR buffer[64 * 1024];
+    PATTERN_GENERATOR gen;
+
+    for (ULONG kind = PatternZeros; kind < PatternKindMax; ++kind) {
+        double gbs[2];
+
+        for (ULONG simd = 0; simd < 2; ++simd) {
+            ULONG64 start;
+
+            TEST_CHECK(NT_SUCCESS(PatternInit(&gen, (PATTERN_KIND)kind, 512, 1)));
+            gen.bUseSimd = simd ? PATTERN_HAVE_SIMD : FALSE;
+
+            start = OsTimestamp();
+            for (ULONG64 done = 0; done < PATTERN_BYTES; done += sizeof(buffer)) {
+                PatternFill(&gen, buffer, sizeof(buffer));
+            }
+            gbs[simd] = (double)PATTERN_BYTES / Nanoseconds(OsTimestamp() - start);
+        }
+        printf("    %-8s scalar %6.2f GB/s, vector %6.2f GB/s\n", names[kind], gbs[0], gbs[1]);
+    }
+}
+
+
+//
+// CRC-32C over 64 KiB transfers, on the CRC instructions and on the
+// table; then the sink checking them, in each mode.
+//
+#define SINK_BYTES      TEST_ROUNDS(1024ull * 1024 * 1024)
+
+static
+VOID
+BenchSink(
+    VOID
+)
+{
+    static UCHAR transfer[64 * 1024];
+    static SINK sink;
+    static const char *modes[] = { NULL, NULL, "pattern", "CRC-32C" };
+    PATTERN_GENERATOR host;
+    volatile ULONG crc = 0;
+
+    Crc32cInit();
+    TEST_CHECK(NT_SUCCESS(PatternInit(&host, PatternRandom, 512, 1)));
+    PatternFill(&host, transfer, sizeof(transfer));
+
+    for (ULONG hw = 0; hw < 2; ++hw) {
+        ULONG64 start;
+
+        Crc32cUseHardware((BOOLEAN)hw);
+        if (hw && !Crc32cIsAccelerated()) {
+            printf("    CRC-32C, instructions: none on this CPU\n");
+            break;
+        }
+        start = OsTimestamp();
+        for (ULONG64 done = 0; done < SINK_BYTES; done += sizeof(transfer)) {
+            crc ^= Crc32c(transfer, sizeof(transfer));
+        }
+        printf("    CRC-32C, %-12s %6.2f GB/s\n", hw ? "instructions" : "table",
+               (double)SINK_BYTES / Nanoseconds(OsTimestamp() - start));
+    }
+    Crc32cUseHardware(TRUE);
+
+    for (ULONG mode = SinkPattern; mode < SinkModeMax; ++mode) {
+        ULONG64 start;
+        ULONG64 bytes = (mode == SinkPattern) ? (SINK_BYTES / 8) : SINK_BYTES;
+
+        TEST_CHECK(NT_SUCCESS(SinkInit(&sink, (SINK_MODE)mode, PatternCounter, 512, 1)));
+        start = OsTimestamp();
+        for (ULONG64 done = 0; done < bytes; done += sizeof(transfer)) {
+            (VOID)SinkConsume(&sink, transfer, sizeof(transfer));
+        }
+        printf("    sink, %-8s %6.2f GB/s\n", modes[mode], (double)bytes / Nanoseconds(OsTimestamp() - start));
+    }
+}
+
+
+//
+// Interrupt moderation, as IoDeliverInterruptEvents does it: events raised
+// at a steady rate, delivered when due on a raise or when the timer it
+// arms runs out. For each setting: the events each URB carries, which is
+// what saves CPU in the driver, where completing a URB costs far more than
+// anything here; the time spent here per event, reading the clock included;
+// and the latency moderation adds, from raise to delivery.
+//
+#define MODERATION_EVENTS   TEST_ROUNDS(200000)
+
+typedef struct _BENCH_MODERATION
+{
+    EVENT_RING          Ring;
+    EVENT_MODERATION    Moderation;
+    ULONG64             Timer;          // when it runs out, 0 if not armed
+    ULONG64             Urbs;
+    HISTOGRAM           Latency;
+} BENCH_MODERATION, *PBENCH_MODERATION;
+
+static
+VOID
+BenchDeliver(
+    _Inout_ PBENCH_MODERATION Bench,
+    _In_ ULONG64 Now
+)
+{
+    RING_EVENT events[EVENT_RING_CAPACITY];
+    RING_EVENT oldest;
+    ULONG64 wait;
+    ULONG count;
+
+    if (!EvRingPeek(&(Bench->Ring), &oldest)) {
+        return;
+    }
+    if (!EvModerationDue(&(Bench->Moderation), EvRingCount(&(Bench->Ring)), oldest.RaiseTime, Now, &wait)) {
+        if (Bench->Timer == 0) {
+            Bench->Timer = Now + wait;
+        }
+        return;
+    }
+
+    count = EvRingPop(&(Bench->Ring), events, EVENT_RING_CAPACITY);
+    for (ULONG i = 0; i < count; ++i) {
+        HistRecord(&(Bench->Latency), Now - events[i].RaiseTime);
+    }
+    Bench->Urbs++;
+}
+
+static
+VOID
+BenchModeration(
+    VOID
+)
+{
+    static const struct
+    {
+        ULONG   IntervalUs;             // between events
+        ULONG   MaxBatch;
+        ULONG   MaxDelayUs;
+    } settings[] =
+    {
+        { 1,  1,  0 },   { 1,  4,  20 },  { 1,  16, 20 },  { 1,  16, 100 }, { 1,  32, 100 },
+        { 10, 1,  0 },   { 10, 4,  20 },  { 10, 16, 20 },  { 10, 16, 100 }, { 10, 32, 100 },
+    };
+    static BENCH_MODERATION bench;
+    ULONG64 frequency = OsTimestampFrequency();
+
+    printf("    interval  batch  delay   events/URB  ns/event    p50 added   p99 added\n");
+    for (ULONG s = 0; s < sizeof(settings) / sizeof(settings[0]); ++s) {
+        ULONG events = MODERATION_EVENTS / settings[s].IntervalUs;
+        ULONG64 interval = (settings[s].IntervalUs * frequency) / 1000000;
+        ULONG64 next;
+        ULONG64 cpu = 0;
+        ULONG raised = 0;
+
+        memset(&bench, 0, sizeof(bench));
+        EvRingInit(&(bench.Ring));
+        bench.Moderation.MaxBatch = settings[s].MaxBatch;
+        bench.Moderation.MaxDelay = (settings[s].MaxDelayUs * frequency) / 1000000;
+
+        next = OsTimestamp();
+        while ((raised < events) || (EvRingCount(&(bench.Ring)) != 0)) {
+            ULONG64 now = OsTimestamp();
+
+            if ((raised < events) && (now >= next)) {
+                (VOID)EvRingPush(&(bench.Ring), raised++);
+                BenchDeliver(&bench, OsTimestamp());
+                next += interval;
+            } else if ((bench.Timer != 0) && (now >= bench.Timer)) {
+                bench.Timer = 0;
+                BenchDeliver(&bench, now);
+            } else {
+                continue;
+            }
+            cpu += OsTimestamp() - now;
+        }
+
+        TEST_CHECK(bench.Ring.Overflows == 0);
+        printf("    %5u us  %5u  %3u us  %10.2f  %8.0f  %8.1f us  %8.1f us\n",
+               settings[s].IntervalUs, settings[s].MaxBatch, settings[s].MaxDelayUs,
+               (double)events / (double)bench.Urbs, Nanoseconds(cpu) / events,
+               Percentile(&(bench.Latency), 0.5) / 1000, Percentile(&(bench.Latency), 0.99) / 1000);
+    }
+}
+
+
+//
+// Recording a URB in the flight recorder, on one ring; and reading the
+// clock alone, which is most of it here, as clock_gettime stands in for
+// the performance counter.
+//
+#define RECORDER_EVENTS TEST_ROUNDS(20000000)
+
+static
+VOID
+BenchFlightRecorder(
+    VOID
+)
+{
+    static FLIGHT_RECORDER recorder;
+    volatile ULONG64 sink = 0;
+    ULONG64 start;
+    double clock;
+
+    start = OsTimestamp();
+    for (ULONG i = 0; i < RECORDER_EVENTS; ++i) {
+        sink += OsTimestamp();
+    }
+    clock = Nanoseconds(OsTimestamp() - start) / RECORDER_EVENTS;
+
+    TEST_CHECK(NT_SUCCESS(FrInit(&recorder, 1)));
+    start = OsTimestamp();
+    for (ULONG i = 0; i < RECORDER_EVENTS; ++i) {
+        FrRecord(&recorder, FrEventComplete, 0x81, i, 512, 0);
+    }
+    printf("    %.1f ns an event, of which %.1f ns reading the clock\n",
+           Nanoseconds(OsTimestamp() - start) / RECORDER_EVENTS, clock);
+}
+
+
+//
+// Mission completions through BULK IN: whole, down one pipe, against cut
+// into 4 KiB stripe chunks (BACKCHANNEL_STRIPE_CHUNK_SIZE) dealt out to 2
+// or 4 pipes, each a queue, drained in turn and put back together. What
+// striping buys, pipes moving data at once on the bus, is not measured
+// here; this is what it costs the CPU on the way.
+//
+#define STRIPE_BYTES        TEST_ROUNDS(256 * 1024 * 1024)
+#define STRIPE_CHUNK        4096
+#define STRIPE_MAX_PIPES    4
+
+static
+NTSTATUS
+BenchStripeDeliver(
+    _In_ PVOID Context,
+    _In_reads_bytes_(Length) const UCHAR *Message,
+    _In_ ULONG Length
+)
+{
+    UNREFERENCED_PARAMETER(Message);
+
+    *(PULONG64)Context += Length;
+    return STATUS_SUCCESS;
+}
+
+static
+VOID
+BenchStripe(
+    VOID
+)
+{
+    static const ULONG sizes[] = { 512, 4096, 16 * 1024, 64 * 1024 };
+    static const ULONG pipeCounts[] = { 1, 2, 4 };
+    static WRQUEUE pipes[STRIPE_MAX_PIPES];
+    static BENCH_READ read;
+    static STRIPE_REASSEMBLER reassembler;
+    static UCHAR message[64 * 1024];
+    static UCHAR chunk[STRIPE_CHUNK];
+    STRIPE_SPLITTER splitter;
+    ULONG64 delivered;
+
+    for (ULONG s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        ULONG messages = STRIPE_BYTES / sizes[s];
+        double gbs[3];
+
+        for (ULONG p = 0; p < sizeof(pipeCounts) / sizeof(pipeCounts[0]); ++p) {
+            ULONG count = pipeCounts[p];
+            ULONG next = 0;
+            ULONG64 start;
+
+            for (ULONG i = 0; i < count; ++i) {
+                TEST_CHECK(NT_SUCCESS(WrqInit(&pipes[i], WRQueueModeMessage, NULL, &BenchOps, NULL)));
+            }
+            TEST_CHECK(NT_SUCCESS(StripeSplitterInit(&splitter, STRIPE_CHUNK)));
+            TEST_CHECK(NT_SUCCESS(StripeReassemblerInit(&reassembler, sizeof(message), BenchStripeDeliver, &delivered)));
+            delivered = 0;
+
+            start = OsTimestamp();
+            for (ULONG m = 0; m < messages; ++m) {
+                if (count == 1) {
+                    TEST_CHECK(Push(&pipes[0], message, sizes[s]));
+                    delivered += (ULONG64)Pull(&pipes[0], &read);
+                    continue;
+                }
+
+                ULONG id = StripeBegin(&splitter);
+                ULONG chunks = StripeChunkCount(&splitter, sizes[s]);
+                ULONG queued[STRIPE_MAX_PIPES] = { 0 };
+
+                for (ULONG i = 0; i < chunks; ++i) {
+                    ULONG length = StripeChunk(&splitter, id, 0, message, sizes[s], i, chunk);
+
+                    TEST_CHECK(Push(&pipes[next], chunk, length));
+                    queued[next]++;
+                    next = (next + 1) % count;
+                }
+                for (ULONG i = 0; i < count; ++i) {
+                    for (; queued[i] != 0; --queued[i]) {
+                        LONG bytes = Pull(&pipes[i], &read);
+
+                        TEST_CHECK(NT_SUCCESS(StripeAccept(&reassembler, read.Buffer, (ULONG)bytes)));
+                    }
+                }
+            }
+            gbs[p] = (double)delivered / Nanoseconds(OsTimestamp() - start);
+            TEST_CHECK(delivered == (ULONG64)messages * sizes[s]);
+
+            StripeReassemblerCleanup(&reassembler);
+            for (ULONG i = 0; i < count; ++i) {
+                WrqDestroy(&pipes[i]);
+            }
+        }
+        printf("    %6u B messages: one pipe %5.2f GB/s, striped over 2 %5.2f GB/s, over 4 %5.2f GB/s\n",
+               sizes[s], gbs[0], gbs[1], gbs[2]);
+    }
+}
+
+
+
+//
+// Missions: ping, through workers that wait on a semaphore each, as the
+// driver's work items are queued. Saturated, the queue kept full; serial,
+// one mission at a time, each waited for.
+//
+#define MISSIONS        TEST_ROUNDS(1000000)
+
+typedef struct _MISSION_POOL
+{
+    MX_EXECUTOR     Exec;
+    ULONG           Workers;
+    pthread_t       Threads[MX_MAX_WORKERS];
+    sem_t           Kicks[MX_MAX_WORKERS];
+    ULONG           Index[MX_MAX_WORKERS];
+    volatile LONG   Quit;
+    volatile LONG64 Completed;
+} MISSION_POOL, *PMISSION_POOL;
+
+static MISSION_POOL g_Pool;
+
+static
+NTSTATUS
+HandlePing(
+    _In_opt_ PVOID Context,
+    _In_reads_bytes_(Length) const UCHAR *Mission,
+    _In_ ULONG Length,
+    _Out_writes_bytes_to_(ResponseSize, *ResponseLength) PUCHAR Response,
+    _In_ ULONG ResponseSize,
+    _Out_ PULONG ResponseLength
+)
+{
+    static const char suffix[] = "_response";
+
+    UNREFERENCED_PARAMETER(Context);
+
+    if (Length + sizeof(suffix) > ResponseSize) {
+        *ResponseLength = 0;
+        return STATUS_INVALID_PARAMETER;
+    }
+    memcpy(Response, Mission, Length);
+    memcpy(Response + Length, suffix, sizeof(suffix));
+    *ResponseLength = Length + sizeof(suffix);
+    return STATUS_SUCCESS;
+}
+
+static const MX_HANDLER Handlers[] = { { "ping", HandlePing } };
+
+static
+VOID
+PoolComplete(
+    _In_opt_ PVOID Context,
+    _In_ NTSTATUS Status,
+    _In_reads_bytes_(Length) const UCHAR *Response,
+    _In_ ULONG Length
+)
+{
+    UNREFERENCED_PARAMETER(Context);
+    UNREFERENCED_PARAMETER(Response);
+    UNREFERENCED_PARAMETER(Length);
+
+    TEST_CHECK(NT_SUCCESS(Status));
+    InterlockedIncrement64(&(g_Pool.Completed));
+}
+
+static
+VOID
+PoolKick(
+    _In_opt_ PVOID Context,
+    _In_ ULONG Worker
+)
+{
+    UNREFERENCED_PARAMETER(Context);
+
+    TEST_CHECK(sem_post(&(g_Pool.Kicks[Worker])) == 0);
+}
+
+static
+void *
+PoolWorker(
+    _In_ void *Parameter
+)
+{
+    ULONG worker = *(PULONG)Parameter;
+
+    for (;;) {
+        while (sem_wait(&(g_Pool.Kicks[worker])) != 0) {
+        }
+        if (ReadAcquire(&(g_Pool.Quit)) != 0) {
+            return NULL;
+        }
+        MxWork(&(g_Pool.Exec), worker);
+    }
+}
+
+static
+VOID
+PoolRun(
+    _In_ ULONG Workers
+)
+{
+    static const char mission[] = "ping:abc";
+    ULONG64 start;
+    double seconds;
+    ULONG64 full = 0;
+
+    memset(&g_Pool, 0, sizeof(g_Pool));
+    TEST_CHECK(NT_SUCCESS(MxInit(&(g_Pool.Exec), Handlers, 1, Workers, 64, PoolComplete, PoolKick, NULL)));
+    g_Pool.Workers = Workers;
+    for (ULONG i = 0; i < Workers; ++i) {
+        g_Pool.Index[i] = i;
+        TEST_CHECK(sem_init(&(g_Pool.Kicks[i]), 0, 0) == 0);
+        TEST_CHECK(pthread_create(&(g_Pool.Threads[i]), NULL, PoolWorker, &(g_Pool.Index[i])) == 0);
+    }
+
+    start = OsTimestamp();
+    for (ULONG i = 0; i < MISSIONS; ++i) {
+        while (MxSubmit(&(g_Pool.Exec), (const UCHAR *)mission, sizeof(mission)) != STATUS_SUCCESS) {
+            ++full;
+            TestYield();
+        }
+    }
+    while (ReadAcquire64(&(g_Pool.Completed)) < MISSIONS) {
+        TestYield();
+    }
+    seconds = Nanoseconds(OsTimestamp() - start) / 1e9;
+    printf("    %u worker(s), saturated: %10.0f missions/s (queue full %llu times)\n",
+           Workers, MISSIONS / seconds, (unsigned long long)full);
+
+    HistReset(&(g_Pool.Exec.Latency));
+    start = OsTimestamp();
+    for (ULONG i = 0; i < MISSIONS / 10; ++i) {
+        TEST_CHECK(MxSubmit(&(g_Pool.Exec), (const UCHAR *)mission, sizeof(mission)) == STATUS_SUCCESS);
+        while (ReadAcquire64(&(g_Pool.Completed)) < (LONG64)(MISSIONS + i + 1)) {
+            TestYield();
+        }
+    }
+    seconds = Nanoseconds(OsTimestamp() - start) / 1e9;
+    printf("    %u worker(s), serial:    %10.0f missions/s, latency p50 %.0f ns, p99 %.0f ns\n",
+           Workers, (MISSIONS / 10) / seconds,
+           Percentile(&(g_Pool.Exec.Latency), 0.50), Percentile(&(g_Pool.Exec.Latency), 0.99));
+
+    MxStop(&(g_Pool.Exec));
+    WriteRelease(&(g_Pool.Quit), 1);
+    for (ULONG i = 0; i < Workers; ++i) {
+        TEST_CHECK(sem_post(&(g_Pool.Kicks[i])) == 0);
+        TEST_CHECK(pthread_join(g_Pool.Threads[i], NULL) == 0);
+        sem_destroy(&(g_Pool.Kicks[i]));
+    }
+    MxCleanup(&(g_Pool.Exec));
+}
+
+static
+VOID
+BenchMissions(
+    VOID
+)
+{
+    PoolRun(1);
+    PoolRun(4);
+}
+
+
+//
+// Endpoint lookup: the registry against the switch on the address that
+// Io_RetrieveEpQueue used before it, for the same endpoints and handlers.
+//
+#define LOOKUPS         TEST_ROUNDS(100000000)
+
+static int HandlerControl;
+static int HandlerBulkOut0;
+static int HandlerBulkOut;
+static int HandlerBulkIn0;
+static int HandlerBulkIn;
+static int HandlerInterrupt;
+static int HandlerIsoch;
+
+static const EP_BINDING Bindings[] =
+{
+    { UD_ENDPOINT_CONTROL,     0,               EP_ANY, EpModeSequential, 0, 0, &HandlerControl },
+    { UD_ENDPOINT_BULK,        0,               0,      EpModeOrdered,    8, 0, &HandlerBulkOut0 },
+    { UD_ENDPOINT_BULK,        0,               EP_ANY, EpModeOrdered,    8, 0, &HandlerBulkOut },
+    { UD_ENDPOINT_BULK,        EP_DIRECTION_IN, 0,      EpModeOrdered,    8, 0, &HandlerBulkIn0 },
+    { UD_ENDPOINT_BULK,        EP_DIRECTION_IN, EP_ANY, EpModeOrdered,    8, 0, &HandlerBulkIn },
+    { UD_ENDPOINT_INTERRUPT,   EP_DIRECTION_IN, EP_ANY, EpModeSequential, 0, 0, &HandlerInterrupt },
+    { UD_ENDPOINT_ISOCHRONOUS, 0,               EP_ANY, EpModeSequential, 0, 0, &HandlerIsoch },
+    { UD_ENDPOINT_ISOCHRONOUS, EP_DIRECTION_IN, EP_ANY, EpModeSequential, 0, 0, &HandlerIsoch },
+};
+
+static
+__attribute__((noinline))
+PVOID
+LookupSwitch(
+    _In_ UCHAR Address
+)
+{
+    switch (Address) {
+    case 0x00:
+        return &HandlerControl;
+    case 0x02:
+        return &HandlerBulkOut0;
+    case 0x84:
+        return &HandlerBulkIn0;
+    case 0x86:
+        return &HandlerInterrupt;
+    case 0x03:
+    case 0x83:
+        return &HandlerIsoch;
+    default:
+        for (ULONG pair = 1; pair < 4; ++pair) {
+            if (Address == (UCHAR)(5 + (2 * pair))) {
+                return &HandlerBulkOut;
+            }
+            if (Address == (UCHAR)(0x86 + (2 * pair))) {
+                return &HandlerBulkIn;
+            }
+        }
+        return NULL;
+    }
+}
+
+static
+__attribute__((noinline))
+PVOID
+LookupTable(
+    _In_ PEP_REGISTRY Registry,
+    _In_ UCHAR Address
+)
+{
+    PEP_SLOT slot = EpLookup(Registry, Address);
+
+    return (slot != NULL) ? slot->Handler : NULL;
+}
+
+static
+VOID
+BenchEpLookup(
+    VOID
+)
+{
+    static const UCHAR addresses[] = { 0x00, 0x02, 0x84, 0x86, 0x03, 0x83, 0x07, 0x88 };
+    static EP_REGISTRY registry;
+    volatile ULONG_PTR sink = 0;
+    ULONG64 start;
+    double ns[2];
+
+    EpRegistryInit(&registry);
+    TEST_CHECK(NT_SUCCESS(EpRegister(&registry, 0x00, UD_ENDPOINT_CONTROL, 64, 0)));
+    for (ULONG i = 1; i < sizeof(addresses); ++i) {
+        UCHAR type = ((addresses[i] & 0x0F) == 3) ? UD_ENDPOINT_ISOCHRONOUS :
+                     (addresses[i] == 0x86) ? UD_ENDPOINT_INTERRUPT : UD_ENDPOINT_BULK;
+
+        TEST_CHECK(NT_SUCCESS(EpRegister(&registry, addresses[i], type, 512, 0)));
+    }
+    TEST_CHECK(NT_SUCCESS(EpBind(&registry, Bindings, sizeof(Bindings) / sizeof(Bindings[0]), NULL)));
+
+    // both give the same answers
+    for (ULONG i = 0; i < sizeof(addresses); ++i) {
+        TEST_CHECK(LookupSwitch(addresses[i]) == LookupTable(&registry, addresses[i]));
+    }
+
+    start = OsTimestamp();
+    for (ULONG i = 0; i < LOOKUPS; ++i) {
+        sink += (ULONG_PTR)LookupSwitch(addresses[i & 7]);
+    }
+    ns[0] = Nanoseconds(OsTimestamp() - start) / LOOKUPS;
+
+    start = OsTimestamp();
+    for (ULONG i = 0; i < LOOKUPS; ++i) {
+        sink += (ULONG_PTR)LookupTable(&registry, addresses[i & 7]);
+    }
+    ns[1] = Nanoseconds(OsTimestamp() - start) / LOOKUPS;
+
+    printf("    switch %.2f ns, registry %.2f ns a lookup\n", ns[0], ns[1]);
+}
+
+static const TEST_CASE Cases[] =
+{
+    TEST_CASE_ENTRY(BenchWrqLatency),
+    TEST_CASE_ENTRY(BenchWrqSizes),
+    TEST_CASE_ENTRY(BenchWrqThreads),
+    TEST_CASE_ENTRY(BenchWrqDeferred),
+    TEST_CASE_ENTRY(BenchWrqBatch),
+    TEST_CASE_ENTRY(BenchWrqLanes),
+    TEST_CASE_ENTRY(BenchSlab),
+    TEST_CASE_ENTRY(BenchPatterns),
+    TEST_CASE_ENTRY(BenchSink),
+    TEST_CASE_ENTRY(BenchModeration),
+    TEST_CASE_ENTRY(BenchFlightRecorder),
+    TEST_CASE_ENTRY(BenchStripe),
+    TEST_CASE_ENTRY(BenchMissions),
+    TEST_CASE_ENTRY(BenchEpLookup),
+};
+
+TEST_MAIN(Cases)
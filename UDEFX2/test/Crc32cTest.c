@@ -0,0 +1,119 @@
+/*++
+
+Module Name:
+
+Crc32cTest.c
+
+Abstract:
+
+    Tests of CRC-32C: the published check values, the CRC instructions
+    against the table at every length and alignment, and a CRC carried on
+    over pieces.
+
+Environment:
+
+    User mode; see Test.h
+
+--*/
+
+#include "Crc32c.h"
+#include "Test.h"
+
+
+//
+// The check value, and the iSCSI test vectors of RFC 3720, B.4; with and
+// without the CRC instructions.
+//
+static
+VOID
+CaseVectors(
+    VOID
+)
+{
+    UCHAR buffer[32];
+
+    Crc32cInit();
+    for (ULONG hw = 0; hw < 2; ++hw) {
+        Crc32cUseHardware((BOOLEAN)hw);
+
+        TEST_CHECK(Crc32c((const UCHAR *)"123456789", 9) == 0xE3069283);
+        TEST_CHECK(Crc32c(buffer, 0) == 0);
+
+        memset(buffer, 0, sizeof(buffer));
+        TEST_CHECK(Crc32c(buffer, sizeof(buffer)) == 0x8A9136AA);
+        memset(buffer, 0xFF, sizeof(buffer));
+        TEST_CHECK(Crc32c(buffer, sizeof(buffer)) == 0x62A8AB43);
+        for (ULONG i = 0; i < sizeof(buffer); ++i) {
+            buffer[i] = (UCHAR)i;
+        }
+        TEST_CHECK(Crc32c(buffer, sizeof(buffer)) == 0x46DD794E);
+        for (ULONG i = 0; i < sizeof(buffer); ++i) {
+            buffer[i] = (UCHAR)(31 - i);
+        }
+        TEST_CHECK(Crc32c(buffer, sizeof(buffer)) == 0x113FDB5C);
+    }
+
+    Crc32cUseHardware(TRUE);
+    printf("    CRC instructions: %s\n", Crc32cIsAccelerated() ? "yes" : "no, table only");
+}
+
+//
+// Random data, every length up to 1 KiB at every alignment up to 8, and
+// a CRC carried on over random pieces: the two paths agree.
+//
+static
+VOID
+CaseHardwareMatchesTable(
+    VOID
+)
+{
+    static UCHAR data[4096 + 8];
+    unsigned seed = 1;
+    ULONG crc[2];
+
+    Crc32cInit();
+    for (ULONG i = 0; i < sizeof(data); ++i) {
+        seed = (seed * 1103515245) + 12345;
+        data[i] = (UCHAR)(seed >> 16);
+    }
+
+    for (ULONG align = 0; align < 8; ++align) {
+        for (ULONG length = 0; length <= 1024; ++length) {
+            for (ULONG hw = 0; hw < 2; ++hw) {
+                Crc32cUseHardware((BOOLEAN)hw);
+                crc[hw] = Crc32c(data + align, length);
+            }
+            TEST_CHECK(crc[0] == crc[1]);
+        }
+    }
+
+    for (ULONG hw = 0; hw < 2; ++hw) {
+        ULONG done = 0;
+
+        Crc32cUseHardware((BOOLEAN)hw);
+        crc[hw] = Crc32cStart();
+        while (done < 4096) {
+            ULONG piece;
+
+            seed = (seed * 1103515245) + 12345;
+            piece = 1 + ((seed >> 16) % 100);
+            if (piece > 4096 - done) {
+                piece = 4096 - done;
+            }
+            crc[hw] = Crc32cUpdate(crc[hw], data + done, piece);
+            done += piece;
+        }
+        TEST_CHECK(Crc32cFinish(crc[hw]) == Crc32c(data, 4096));
+    }
+    TEST_CHECK(crc[0] == crc[1]);
+    Crc32cUseHardware(TRUE);
+}
+
+
+static const TEST_CASE Cases[] =
+{
+    TEST_CASE_ENTRY(CaseVectors),
+    TEST_CASE_ENTRY(CaseHardwareMatchesTable),
+};
+
+TEST_MAIN(Cases)
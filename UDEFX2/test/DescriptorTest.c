@@ -0,0 +1,425 @@
+/*++
+
+Module Name:
+
+DescriptorTest.c
+
+Abstract:
+
+    Tests of the descriptor sets built by UsbDescriptorSet.h, as the host
+    checks them (UdValidateConfiguration, UdValidateBos): sets of both
+    speeds, alternate settings out of order, lengths that do not add up;
+    the SuperSpeed set, each endpoint with its companion, bulk endpoints
+    of 1024-byte packets and bursts of 16, and its BOS descriptor set;
+    and of the endpoint registry built from them: one slot per endpoint
+    across the alternate settings, bindings, and lookups.
+
+    The endpoint lists are laid out as usbdevice.c's are: bulk pairs and
+    an interrupt endpoint in alternate setting 0, the same again and an
+    isochronous pair in alternate setting 1.
+
+Environment:
+
+    User mode; see Test.h
+
+--*/
+
+#include "UsbDescriptor.h"
+#include "EpRegistry.h"
+#include "Test.h"
+
+
+#define TEST_ENDPOINTS(EP)                                                  \
+    EP(0x02, UD_ENDPOINT_BULK, 0, 0, UD_MAX_BURST)                          \
+    EP(0x84, UD_ENDPOINT_BULK, 0, 0, UD_MAX_BURST)                          \
+    EP(0x86, UD_ENDPOINT_INTERRUPT, 64, 1, 0)                               \
+    EP(0x07, UD_ENDPOINT_BULK, 0, 0, UD_MAX_BURST)                          \
+    EP(0x88, UD_ENDPOINT_BULK, 0, 0, UD_MAX_BURST)
+
+#define TEST_ISOCH_ENDPOINTS(EP)                                            \
+    EP(0x03, UD_ENDPOINT_ISOCHRONOUS, 1024, 1, 0)                           \
+    EP(0x83, UD_ENDPOINT_ISOCHRONOUS, 1024, 1, 0)
+
+static const UCHAR SetHigh[] =
+{
+    UD_ALTERNATE_CONFIGURATION_SET(HS, TEST_ENDPOINTS, TEST_ISOCH_ENDPOINTS, 0xA0, 100, 0xFF, 0x00, 0x00)
+};
+
+static const UCHAR SetSuper[] =
+{
+    UD_ALTERNATE_CONFIGURATION_SET(SS, TEST_ENDPOINTS, TEST_ISOCH_ENDPOINTS, 0xA0, 100, 0xFF, 0x00, 0x00)
+};
+
+UD_CHECK_ALTERNATE_CONFIGURATION_SET(HS, TEST_ENDPOINTS, TEST_ISOCH_ENDPOINTS, SetHigh);
+UD_CHECK_ALTERNATE_CONFIGURATION_SET(SS, TEST_ENDPOINTS, TEST_ISOCH_ENDPOINTS, SetSuper);
+
+static const UCHAR Bos[] = { UD_BOS_SET() };
+
+static int HandlerControl;
+static int HandlerBulkOut0;
+static int HandlerBulkOut;
+static int HandlerBulkIn0;
+static int HandlerBulkIn;
+static int HandlerInterrupt;
+static int HandlerIsoch;
+
+static const EP_BINDING Bindings[] =
+{
+    { UD_ENDPOINT_CONTROL,     0,                 EP_ANY, EpModeSequential, 0, 0,                                          &HandlerControl },
+    { UD_ENDPOINT_BULK,        0,                 0,      EpModeOrdered,    8, EP_FLAG_PARKED | EP_FLAG_FLOW_CONTROLLED,  &HandlerBulkOut0 },
+    { UD_ENDPOINT_BULK,        0,                 EP_ANY, EpModeOrdered,    8, EP_FLAG_FLOW_CONTROLLED,                   &HandlerBulkOut },
+    { UD_ENDPOINT_BULK,        EP_DIRECTION_IN,   0,      EpModeOrdered,    8, EP_FLAG_PARKED,                            &HandlerBulkIn0 },
+    { UD_ENDPOINT_BULK,        EP_DIRECTION_IN,   EP_ANY, EpModeOrdered,    8, 0,                                         &HandlerBulkIn },
+    { UD_ENDPOINT_INTERRUPT,   EP_DIRECTION_IN,   EP_ANY, EpModeSequential, 0, EP_FLAG_PARKED,                            &HandlerInterrupt },
+    { UD_ENDPOINT_ISOCHRONOUS, 0,                 EP_ANY, EpModeSequential, 0, EP_FLAG_PARKED,                            &HandlerIsoch },
+    { UD_ENDPOINT_ISOCHRONOUS, EP_DIRECTION_IN,   EP_ANY, EpModeSequential, 0, EP_FLAG_PARKED,                            &HandlerIsoch },
+};
+
+#define BINDING_COUNT   (sizeof(Bindings) / sizeof(Bindings[0]))
+
+// the first endpoint of alternate setting 0, bulk OUT 0x02, and the interrupt one
+#define FIRST_ENDPOINT      (UD_CONFIGURATION_LENGTH + UD_INTERFACE_LENGTH)
+#define INTERRUPT_ENDPOINT  (FIRST_ENDPOINT + UD_ENDPOINT_OFFSET(SS, 2))
+
+//
+// Where alternate setting 1's interface descriptor is in a set.
+//
+static
+ULONG
+AlternateOffset(
+    _In_reads_bytes_(Length) const UCHAR *Set,
+    _In_ ULONG Length
+)
+{
+    for (ULONG offset = UD_CONFIGURATION_LENGTH; offset < Length; offset += Set[offset]) {
+        if ((Set[offset + 1] == UD_DT_INTERFACE) && (Set[offset + 3] == 1)) {
+            return offset;
+        }
+    }
+    TEST_CHECK(!"no alternate setting");
+    return 0;
+}
+
+static
+NTSTATUS
+Validate(
+    _In_ UD_SPEED Speed,
+    _In_reads_bytes_(Length) const UCHAR *Set,
+    _In_ ULONG Length
+)
+{
+    ULONG offset;
+
+    return UdValidateConfiguration(Speed, Set, Length, &offset);
+}
+
+
+static
+VOID
+CaseValidSets(
+    VOID
+)
+{
+    ULONG offset;
+
+    TEST_CHECK(NT_SUCCESS(Validate(UdSpeedHigh, SetHigh, sizeof(SetHigh))));
+    TEST_CHECK(NT_SUCCESS(Validate(UdSpeedSuper, SetSuper, sizeof(SetSuper))));
+    TEST_CHECK(NT_SUCCESS(UdValidateBos(Bos, sizeof(Bos), &offset)));
+
+    // one interface, whatever the alternate settings
+    TEST_CHECK(SetHigh[4] == 1);
+    TEST_CHECK((SetHigh[2] | (SetHigh[3] << 8)) == sizeof(SetHigh));
+    TEST_CHECK(sizeof(SetSuper) == UD_ALTERNATE_CONFIGURATION_SET_LENGTH(SS, TEST_ENDPOINTS, TEST_ISOCH_ENDPOINTS));
+
+    // a set of one speed is not one of the other
+    TEST_CHECK(!NT_SUCCESS(Validate(UdSpeedSuper, SetHigh, sizeof(SetHigh))));
+    TEST_CHECK(!NT_SUCCESS(Validate(UdSpeedHigh, SetSuper, sizeof(SetSuper))));
+}
+
+static
+VOID
+CaseBrokenSets(
+    VOID
+)
+{
+    UCHAR set[sizeof(SetSuper)];
+    ULONG alternate = AlternateOffset(SetSuper, sizeof(SetSuper));
+    ULONG offset;
+
+    // alternate setting 1 of an interface there is no setting 0 of
+    memcpy(set, SetSuper, sizeof(set));
+    set[alternate + 2] = 1;
+    TEST_CHECK(UdValidateConfiguration(UdSpeedSuper, set, sizeof(set), &offset) == STATUS_INVALID_PARAMETER);
+    TEST_CHECK(offset == alternate);
+
+    // a second alternate setting 0: the isochronous pair in it
+    memcpy(set, SetSuper, sizeof(set));
+    set[alternate + 3] = 0;
+    TEST_CHECK(!NT_SUCCESS(Validate(UdSpeedSuper, set, sizeof(set))));
+
+    // cut short, and a total length that does not match
+    TEST_CHECK(!NT_SUCCESS(Validate(UdSpeedSuper, SetSuper, sizeof(SetSuper) - 1)));
+    memcpy(set, SetSuper, sizeof(set));
+    set[2] += 1;
+    TEST_CHECK(!NT_SUCCESS(Validate(UdSpeedSuper, set, sizeof(set))));
+}
+
+//
+// Every endpoint of the SuperSpeed set, in both settings, and the
+// companion after it: bulk ones bursting 16 packets of 1024 bytes,
+// periodic ones reserving what they send each interval.
+//
+static
+VOID
+CaseSuperSpeed(
+    VOID
+)
+{
+    ULONG bulk = 0;
+    ULONG interrupt = 0;
+    ULONG isochronous = 0;
+    ULONG offset;
+
+    TEST_CHECK(NT_SUCCESS(Validate(UdSpeedSuper, SetSuper, sizeof(SetSuper))));
+    TEST_CHECK(SetSuper[8] == UD_MAX_POWER_SS(100));
+    TEST_CHECK(SetSuper[8] == 13);
+
+    for (offset = UD_CONFIGURATION_LENGTH; offset < sizeof(SetSuper); offset += SetSuper[offset]) {
+        const UCHAR *d = SetSuper + offset;
+        const UCHAR *companion = d + UD_ENDPOINT_LENGTH;
+        ULONG maxPacket = d[4] | (d[5] << 8);
+        ULONG perInterval;
+
+        if (d[1] != UD_DT_ENDPOINT) {
+            TEST_CHECK(d[1] != UD_DT_SS_COMPANION);
+            continue;
+        }
+
+        TEST_CHECK((companion[0] == UD_SS_COMPANION_LENGTH) && (companion[1] == UD_DT_SS_COMPANION));
+        perInterval = companion[4] | (companion[5] << 8);
+        offset += UD_ENDPOINT_LENGTH;
+
+        switch (d[3]) {
+        case UD_ENDPOINT_BULK:
+            TEST_CHECK(maxPacket == UD_BULK_MAX_PACKET_SS);
+            TEST_CHECK((companion[2] == UD_MAX_BURST) && (companion[2] == 15));
+            TEST_CHECK((companion[3] == 0) && (perInterval == 0));
+            bulk++;
+            break;
+
+        case UD_ENDPOINT_INTERRUPT:
+            TEST_CHECK((maxPacket == 64) && (d[6] == 1));
+            TEST_CHECK((companion[2] == 0) && (perInterval == 64));
+            interrupt++;
+            break;
+
+        case UD_ENDPOINT_ISOCHRONOUS:
+            TEST_CHECK((maxPacket == 1024) && (companion[2] == 0) && (perInterval == 1024));
+            isochronous++;
+            break;
+
+        default:
+            TEST_CHECK(!"unexpected endpoint type");
+            break;
+        }
+    }
+    TEST_CHECK(offset == sizeof(SetSuper));
+    TEST_CHECK((bulk == 8) && (interrupt == 2) && (isochronous == 2));
+
+    // the same lists at high speed: no companions, bulk packets of 512
+    TEST_CHECK(NT_SUCCESS(Validate(UdSpeedHigh, SetHigh, sizeof(SetHigh))));
+    TEST_CHECK((SetHigh[FIRST_ENDPOINT + 4] | (SetHigh[FIRST_ENDPOINT + 5] << 8)) == UD_BULK_MAX_PACKET_HS);
+    TEST_CHECK(SetHigh[FIRST_ENDPOINT + UD_ENDPOINT_LENGTH + 1] == UD_DT_ENDPOINT);
+}
+
+//
+// What a SuperSpeed host refuses, at the endpoint at fault.
+//
+static
+VOID
+CaseSuperSpeedRejects(
+    VOID
+)
+{
+    UCHAR set[sizeof(SetSuper)];
+    ULONG offset;
+
+    // a bulk endpoint of high-speed packets
+    memcpy(set, SetSuper, sizeof(set));
+    set[FIRST_ENDPOINT + 4] = (UCHAR)UD_BULK_MAX_PACKET_HS;
+    set[FIRST_ENDPOINT + 5] = (UCHAR)(UD_BULK_MAX_PACKET_HS >> 8);
+    TEST_CHECK(UdValidateConfiguration(UdSpeedSuper, set, sizeof(set), &offset) == STATUS_INVALID_PARAMETER);
+    TEST_CHECK(offset == FIRST_ENDPOINT);
+
+    // a burst of 17
+    memcpy(set, SetSuper, sizeof(set));
+    set[FIRST_ENDPOINT + UD_ENDPOINT_LENGTH + 2] = UD_MAX_BURST + 1;
+    TEST_CHECK(UdValidateConfiguration(UdSpeedSuper, set, sizeof(set), &offset) == STATUS_INVALID_PARAMETER);
+    TEST_CHECK(offset == FIRST_ENDPOINT);
+
+    // an interrupt endpoint reserving more than it can send
+    memcpy(set, SetSuper, sizeof(set));
+    TEST_CHECK(set[INTERRUPT_ENDPOINT + 2] == 0x86);
+    set[INTERRUPT_ENDPOINT + UD_ENDPOINT_LENGTH + 4] = 65;
+    TEST_CHECK(UdValidateConfiguration(UdSpeedSuper, set, sizeof(set), &offset) == STATUS_INVALID_PARAMETER);
+    TEST_CHECK(offset == INTERRUPT_ENDPOINT);
+
+    // the first endpoint without its companion
+    memcpy(set, SetSuper, FIRST_ENDPOINT + UD_ENDPOINT_LENGTH);
+    memcpy(set + FIRST_ENDPOINT + UD_ENDPOINT_LENGTH,
+           SetSuper + FIRST_ENDPOINT + UD_ENDPOINT_SIZE_SS,
+           sizeof(SetSuper) - FIRST_ENDPOINT - UD_ENDPOINT_SIZE_SS);
+    set[2] = (UCHAR)(sizeof(set) - UD_SS_COMPANION_LENGTH);
+    set[3] = (UCHAR)((sizeof(set) - UD_SS_COMPANION_LENGTH) >> 8);
+    TEST_CHECK(UdValidateConfiguration(UdSpeedSuper, set, sizeof(set) - UD_SS_COMPANION_LENGTH, &offset) == STATUS_INVALID_PARAMETER);
+    TEST_CHECK(offset == FIRST_ENDPOINT);
+}
+
+//
+// The BOS set, byte for byte, and what UdValidateBos refuses in it.
+//
+static
+VOID
+CaseBos(
+    VOID
+)
+{
+    const UCHAR *superSpeed = Bos + 5 + UD_USB20_EXTENSION_LENGTH;
+    UCHAR bos[sizeof(Bos)];
+    ULONG offset;
+
+    TEST_CHECK(sizeof(Bos) == UD_BOS_LENGTH);
+    TEST_CHECK((Bos[1] == UD_DT_BOS) && ((Bos[2] | (Bos[3] << 8)) == UD_BOS_LENGTH) && (Bos[4] == 2));
+    TEST_CHECK((Bos[7] == UD_CAP_USB20_EXTENSION) && (Bos[8] == 0x02));     // LPM
+    TEST_CHECK((superSpeed[0] == UD_SUPERSPEED_CAP_LENGTH) && (superSpeed[2] == UD_CAP_SUPERSPEED));
+    TEST_CHECK((superSpeed[4] | (superSpeed[5] << 8)) == 0x000E);           // full, high and SuperSpeed
+    TEST_CHECK(superSpeed[6] == 1);                                         // full speed and up work
+    TEST_CHECK((superSpeed[7] == 0x0A) && ((superSpeed[8] | (superSpeed[9] << 8)) == 0x07FF));
+    TEST_CHECK(NT_SUCCESS(UdValidateBos(Bos, sizeof(Bos), &offset)));
+
+    // a total length that does not match
+    memcpy(bos, Bos, sizeof(bos));
+    bos[2] -= 1;
+    TEST_CHECK(!NT_SUCCESS(UdValidateBos(bos, sizeof(bos), &offset)));
+    TEST_CHECK(!NT_SUCCESS(UdValidateBos(Bos, sizeof(Bos) - 1, &offset)));
+
+    // more capabilities declared than there are
+    memcpy(bos, Bos, sizeof(bos));
+    bos[4] = 3;
+    TEST_CHECK(!NT_SUCCESS(UdValidateBos(bos, sizeof(bos), &offset)));
+
+    // a SuperSpeed capability that leaves SuperSpeed out
+    memcpy(bos, Bos, sizeof(bos));
+    bos[5 + UD_USB20_EXTENSION_LENGTH + 4] &= ~0x08;
+    TEST_CHECK(UdValidateBos(bos, sizeof(bos), &offset) == STATUS_INVALID_PARAMETER);
+    TEST_CHECK(offset == 5 + UD_USB20_EXTENSION_LENGTH);
+
+    // none at all
+    memcpy(bos, Bos, 5 + UD_USB20_EXTENSION_LENGTH);
+    bos[2] = 5 + UD_USB20_EXTENSION_LENGTH;
+    bos[4] = 1;
+    TEST_CHECK(!NT_SUCCESS(UdValidateBos(bos, 5 + UD_USB20_EXTENSION_LENGTH, &offset)));
+}
+
+
+//
+// The endpoints of both settings, each once; an endpoint described again
+// must be described the same way.
+//
+static
+VOID
+CaseRegister(
+    VOID
+)
+{
+    static EP_REGISTRY registry;
+    UCHAR set[sizeof(SetHigh)];
+    ULONG count = 0;
+
+    EpRegistryInit(&registry);
+    TEST_CHECK(NT_SUCCESS(EpRegisterConfiguration(&registry, SetHigh, sizeof(SetHigh))));
+    for (ULONG i = 0; i < EP_SLOTS; ++i) {
+        count += (EpAt(&registry, i) != NULL) ? 1 : 0;
+    }
+    TEST_CHECK(count == UD_ENDPOINT_COUNT(TEST_ENDPOINTS) + UD_ENDPOINT_COUNT(TEST_ISOCH_ENDPOINTS));
+    TEST_CHECK(EpLookup(&registry, 0x83)->Type == UD_ENDPOINT_ISOCHRONOUS);
+    TEST_CHECK(EpLookup(&registry, 0x02)->MaxPacketSize == UD_BULK_MAX_PACKET_HS);
+
+    // registering it again: every endpoint is there already, the same
+    TEST_CHECK(NT_SUCCESS(EpRegisterConfiguration(&registry, SetHigh, sizeof(SetHigh))));
+
+    // but not if one of them differs
+    EpRegistryInit(&registry);
+    TEST_CHECK(NT_SUCCESS(EpRegister(&registry, 0x03, UD_ENDPOINT_ISOCHRONOUS, 512, 1)));
+    TEST_CHECK(!NT_SUCCESS(EpRegisterConfiguration(&registry, SetHigh, sizeof(SetHigh))));
+
+    // alternate setting 1 giving the isochronous OUT endpoint a bulk one's address
+    memcpy(set, SetHigh, sizeof(set));
+    TEST_CHECK(set[sizeof(set) - (2 * UD_ENDPOINT_LENGTH) + 2] == 0x03);
+    set[sizeof(set) - (2 * UD_ENDPOINT_LENGTH) + 2] = 0x02;
+    EpRegistryInit(&registry);
+    TEST_CHECK(!NT_SUCCESS(EpRegisterConfiguration(&registry, set, sizeof(set))));
+
+    // cut short
+    EpRegistryInit(&registry);
+    TEST_CHECK(!NT_SUCCESS(EpRegisterConfiguration(&registry, SetHigh, sizeof(SetHigh) - 1)));
+
+    TEST_CHECK(!NT_SUCCESS(EpRegister(&registry, 0x05, 4, 64, 0)));
+}
+
+static
+VOID
+CaseBind(
+    VOID
+)
+{
+    static EP_REGISTRY registry;
+    UCHAR unbound = 0;
+
+    for (ULONG speed = 0; speed < 2; ++speed) {
+        const UCHAR *set = (speed == 0) ? SetHigh : SetSuper;
+        ULONG length = (speed == 0) ? sizeof(SetHigh) : sizeof(SetSuper);
+
+        EpRegistryInit(&registry);
+        TEST_CHECK(NT_SUCCESS(EpRegister(&registry, 0, UD_ENDPOINT_CONTROL, 64, 0)));
+        TEST_CHECK(NT_SUCCESS(EpRegisterConfiguration(&registry, set, length)));
+        TEST_CHECK(NT_SUCCESS(EpBind(&registry, Bindings, BINDING_COUNT, &unbound)));
+
+        TEST_CHECK(EpLookup(&registry, 0x00)->Handler == &HandlerControl);
+        TEST_CHECK(EpLookup(&registry, 0x02)->Handler == &HandlerBulkOut0);
+        TEST_CHECK((EpLookup(&registry, 0x07)->Handler == &HandlerBulkOut) && (EpLookup(&registry, 0x07)->Ordinal == 1));
+        TEST_CHECK(EpLookup(&registry, 0x84)->Handler == &HandlerBulkIn0);
+        TEST_CHECK((EpLookup(&registry, 0x88)->Handler == &HandlerBulkIn) && (EpLookup(&registry, 0x88)->Ordinal == 1));
+        TEST_CHECK(EpLookup(&registry, 0x86)->Handler == &HandlerInterrupt);
+        TEST_CHECK((EpLookup(&registry, 0x03)->Handler == &HandlerIsoch) && (EpLookup(&registry, 0x83)->Handler == &HandlerIsoch));
+
+        TEST_CHECK(EpLookup(&registry, 0x02)->Flags == (EP_FLAG_PARKED | EP_FLAG_FLOW_CONTROLLED));
+        TEST_CHECK((EpLookup(&registry, 0x02)->Mode == EpModeOrdered) && (EpLookup(&registry, 0x02)->WindowDepth == 8));
+        TEST_CHECK(EpLookup(&registry, 0x02)->MaxPacketSize == ((speed == 0) ? UD_BULK_MAX_PACKET_HS : UD_BULK_MAX_PACKET_SS));
+        TEST_CHECK(EpLookup(&registry, 0x86)->Interval == 1);
+
+        // direction counts: no IN endpoint 2, no OUT endpoint 4
+        TEST_CHECK((EpLookup(&registry, 0x82) == NULL) && (EpLookup(&registry, 0x04) == NULL));
+    }
+
+    // an endpoint no binding covers
+    EpRegistryInit(&registry);
+    TEST_CHECK(NT_SUCCESS(EpRegister(&registry, 0x85, UD_ENDPOINT_BULK, 512, 0)));
+    TEST_CHECK(NT_SUCCESS(EpRegister(&registry, 0x8A, UD_ENDPOINT_INTERRUPT, 64, 1)));
+    TEST_CHECK(EpBind(&registry, Bindings, 5, &unbound) == STATUS_NOT_SUPPORTED);
+    TEST_CHECK(unbound == 0x8A);
+}
+
+
+static const TEST_CASE Cases[] =
+{
+    TEST_CASE_ENTRY(CaseValidSets),
+    TEST_CASE_ENTRY(CaseBrokenSets),
+    TEST_CASE_ENTRY(CaseSuperSpeed),
+    TEST_CASE_ENTRY(CaseSuperSpeedRejects),
+    TEST_CASE_ENTRY(CaseBos),
+    TEST_CASE_ENTRY(CaseRegister),
+    TEST_CASE_ENTRY(CaseBind),
+};
+
+TEST_MAIN(Cases)
@@ -0,0 +1,463 @@
+/*++
+
+Module Name:
+
+DualQueueTest.c
+
+Abstract:
+
+    Tests of the lock-free dual queue: matching both ways, capacity, waiters
+    canceled while parked giving their place back, and cancellation racing
+    matchers on several threads.
+
+Environment:
+
+    User mode; see Test.h
+
+--*/
+
+#include "DualQueue.h"
+#include "Test.h"
+
+
+typedef struct _TEST_WAITER
+{
+    DQ_WAITER     Waiter;
+    PVOID         Item;
+    volatile LONG bDone;
+} TEST_WAITER, *PTEST_WAITER;
+
+static volatile LONG64 g_Allocated;
+static volatile LONG64 g_Freed;
+
+static
+PTEST_WAITER
+NewWaiter(
+    VOID
+)
+{
+    PTEST_WAITER waiter = (PTEST_WAITER)OsAllocate(sizeof(TEST_WAITER));
+
+    TEST_CHECK(waiter != NULL);
+    InterlockedIncrement64(&g_Allocated);
+    return waiter;
+}
+
+static
+VOID
+FreeWaiter(
+    _In_ PTEST_WAITER Waiter
+)
+{
+    InterlockedIncrement64(&g_Freed);
+    OsFree(Waiter);
+}
+
+static
+VOID
+ReleaseWaiter(
+    _In_ PDQ_WAITER Waiter
+)
+{
+    FreeWaiter(CONTAINING_RECORD(Waiter, TEST_WAITER, Waiter));
+}
+
+//
+// Hands Item to a waiter DqOffer matched.
+//
+static
+VOID
+Fulfill(
+    _In_ PDQ_WAITER Matched,
+    _In_ PVOID Item
+)
+{
+    PTEST_WAITER waiter = CONTAINING_RECORD(Matched, TEST_WAITER, Waiter);
+
+    waiter->Item = Item;
+    WriteRelease(&(waiter->bDone), 1);
+}
+
+static
+PVOID
+WaitFulfilled(
+    _In_ PTEST_WAITER Waiter
+)
+{
+    while (ReadAcquire(&(Waiter->bDone)) == 0) {
+        TestYield();
+    }
+    return Waiter->Item;
+}
+
+static
+VOID
+DrainWaiters(
+    _Inout_ PDUAL_QUEUE Q
+)
+{
+    PDQ_WAITER waiter;
+
+    while ((waiter = DqDrainWaiter(Q)) != NULL) {
+        TEST_CHECK(!DqClaimWaiter(waiter));
+        FreeWaiter(CONTAINING_RECORD(waiter, TEST_WAITER, Waiter));
+    }
+}
+
+
+static
+VOID
+CaseMatchBothWays(
+    VOID
+)
+{
+    DUAL_QUEUE q;
+    PDQ_WAITER matched;
+    PVOID item;
+    PTEST_WAITER waiter;
+
+    TEST_CHECK(NT_SUCCESS(DqInit(&q, 4, ReleaseWaiter)));
+
+    TEST_CHECK(DqRequest(&q, NULL, &item) == DqEmpty);
+    TEST_CHECK(DqOffer(&q, NULL, &matched) == DqEmpty);
+
+    // data first: queued in order, a pushed-back item ahead of them
+    TEST_CHECK(DqOffer(&q, (PVOID)1, &matched) == DqQueued);
+    TEST_CHECK(DqOffer(&q, (PVOID)2, &matched) == DqQueued);
+    TEST_CHECK(DqOfferFront(&q, (PVOID)3, &matched) == DqQueued);
+    TEST_CHECK((DqRequest(&q, NULL, &item) == DqMatched) && (item == (PVOID)3));
+    TEST_CHECK((DqRequest(&q, NULL, &item) == DqMatched) && (item == (PVOID)1));
+    TEST_CHECK((DqRequest(&q, NULL, &item) == DqMatched) && (item == (PVOID)2));
+
+    // capacity counts queued items, not the pushed-back one
+    for (ULONG i = 1; i <= 4; ++i) {
+        TEST_CHECK(DqOffer(&q, (PVOID)(ULONG_PTR)i, &matched) == DqQueued);
+    }
+    TEST_CHECK(DqOffer(&q, (PVOID)5, &matched) == DqFull);
+    TEST_CHECK(DqOfferFront(&q, (PVOID)6, &matched) == DqQueued);
+    TEST_CHECK(DqDrainItem(&q) == (PVOID)6);
+    for (ULONG i = 1; i <= 4; ++i) {
+        TEST_CHECK(DqDrainItem(&q) == (PVOID)(ULONG_PTR)i);
+    }
+    TEST_CHECK(DqDrainItem(&q) == NULL);
+
+    // waiter first: parked ARMING, matched once armed
+    waiter = NewWaiter();
+    TEST_CHECK(DqRequest(&q, &(waiter->Waiter), &item) == DqQueued);
+    TEST_CHECK(waiter->Waiter.State == DQ_WAITER_ARMING);
+    TEST_CHECK(DqArmWaiter(&(waiter->Waiter)));
+    TEST_CHECK(DqOffer(&q, (PVOID)7, &matched) == DqMatched);
+    TEST_CHECK((matched == &(waiter->Waiter)) && (matched->State == DQ_WAITER_CLAIMED));
+    TEST_CHECK(!DqCancelWaiter(&q, matched));
+    FreeWaiter(waiter);
+
+    TEST_CHECK(q.Balance == 0);
+    DqDestroy(&q);
+}
+
+//
+// Waiters canceled while parked give their place back: parking and
+// canceling forever never finds the queue full.
+//
+static
+VOID
+CaseCancelGivesSlotBack(
+    VOID
+)
+{
+    DUAL_QUEUE q;
+    PVOID item;
+
+    TEST_CHECK(NT_SUCCESS(DqInit(&q, 8, ReleaseWaiter)));
+
+    for (ULONG i = 0; i < 1000; ++i) {
+        PTEST_WAITER waiter = NewWaiter();
+
+        TEST_CHECK(DqRequest(&q, &(waiter->Waiter), &item) == DqQueued);
+        TEST_CHECK(DqArmWaiter(&(waiter->Waiter)));
+        TEST_CHECK(DqCancelWaiter(&q, &(waiter->Waiter)));
+        TEST_CHECK(q.Balance == 0);
+    }
+
+    DrainWaiters(&q);
+    TEST_CHECK(q.WaiterSlots == 0);
+    TEST_CHECK(g_Allocated == g_Freed);
+    DqDestroy(&q);
+}
+
+//
+// Canceled waiters behind a live one cannot be popped, so they fill the
+// ring; once the live one is matched they go, and the queue works again.
+//
+static
+VOID
+CaseCanceledBehindLiveHead(
+    VOID
+)
+{
+    DUAL_QUEUE q;
+    PDQ_WAITER matched;
+    PVOID item;
+    PTEST_WAITER head;
+    PTEST_WAITER waiter;
+    ULONG parked;
+
+    TEST_CHECK(NT_SUCCESS(DqInit(&q, 8, ReleaseWaiter)));
+
+    head = NewWaiter();
+    TEST_CHECK(DqRequest(&q, &(head->Waiter), &item) == DqQueued);
+    TEST_CHECK(DqArmWaiter(&(head->Waiter)));
+
+    for (parked = 0; parked < 100; ++parked) {
+        waiter = NewWaiter();
+        if (DqRequest(&q, &(waiter->Waiter), &item) != DqQueued) {
+            FreeWaiter(waiter);
+            break;
+        }
+        // every other one canceled before it is even armed
+        if ((parked % 2) == 0) {
+            TEST_CHECK(DqArmWaiter(&(waiter->Waiter)));
+        }
+        TEST_CHECK(DqCancelWaiter(&q, &(waiter->Waiter)));
+    }
+    // the ring is twice the capacity; one cell holds the live head
+    TEST_CHECK(parked == (2 * 8) - 1);
+    TEST_CHECK(q.Balance == -1);
+
+    TEST_CHECK(DqOffer(&q, (PVOID)1, &matched) == DqMatched);
+    TEST_CHECK(matched == &(head->Waiter));
+    FreeWaiter(head);
+
+    waiter = NewWaiter();
+    TEST_CHECK(DqRequest(&q, &(waiter->Waiter), &item) == DqQueued);
+    TEST_CHECK(DqArmWaiter(&(waiter->Waiter)));
+    TEST_CHECK(DqOffer(&q, (PVOID)2, &matched) == DqMatched);
+    TEST_CHECK(matched == &(waiter->Waiter));
+    FreeWaiter(waiter);
+
+    DrainWaiters(&q);
+    TEST_CHECK((q.Balance == 0) && (q.WaiterSlots == 0));
+    TEST_CHECK(g_Allocated == g_Freed);
+    DqDestroy(&q);
+}
+
+
+//
+// One waiter, one producer, one canceler, over and over: exactly one of
+// the matcher and the canceler wins, and the item is never lost, going
+// either to the waiter or to the next request.
+//
+typedef struct _RACE_CONTEXT
+{
+    DUAL_QUEUE     Queue;
+    PTEST_WAITER   Waiter;
+    volatile LONG  Round;           // raised by the main thread
+    volatile LONG  Done[2];         // round each side finished
+    volatile LONG  bCanceled;
+} RACE_CONTEXT, *PRACE_CONTEXT;
+
+static
+VOID
+RaceSide(
+    _In_ ULONG Index,
+    _In_opt_ PVOID Context
+)
+{
+    PRACE_CONTEXT race = (PRACE_CONTEXT)Context;
+    LONG rounds = TEST_ROUNDS(20000);
+
+    for (LONG round = 1; round <= rounds; ++round) {
+        while (ReadAcquire(&(race->Round)) < round) {
+            TestYield();
+        }
+
+        // take turns at being first
+        for (LONG i = (round + (LONG)Index) % 3; i > 0; --i) {
+            TestYield();
+        }
+
+        if (Index == 0) {
+            PDQ_WAITER matched;
+
+            TEST_CHECK(DqOffer(&(race->Queue), (PVOID)(ULONG_PTR)round, &matched) != DqFull);
+            if (matched != NULL) {
+                Fulfill(matched, (PVOID)(ULONG_PTR)round);
+            }
+        } else {
+            WriteRelease(&(race->bCanceled), DqCancelWaiter(&(race->Queue), &(race->Waiter->Waiter)) ? 1 : 0);
+        }
+        WriteRelease(&(race->Done[Index]), round);
+    }
+}
+
+static
+VOID
+RaceDriver(
+    _In_ ULONG Index,
+    _In_opt_ PVOID Context
+)
+{
+    PRACE_CONTEXT race = (PRACE_CONTEXT)Context;
+    LONG rounds = TEST_ROUNDS(20000);
+    LONG canceled = 0;
+
+    if (Index != 0) {
+        RaceSide(Index - 1, Context);
+        return;
+    }
+
+    for (LONG round = 1; round <= rounds; ++round) {
+        PTEST_WAITER waiter = NewWaiter();
+        PVOID item;
+
+        TEST_CHECK(DqRequest(&(race->Queue), &(waiter->Waiter), &item) == DqQueued);
+        TEST_CHECK(DqArmWaiter(&(waiter->Waiter)));
+        race->Waiter = waiter;
+        WriteRelease(&(race->Round), round);
+
+        while ((ReadAcquire(&(race->Done[0])) < round) || (ReadAcquire(&(race->Done[1])) < round)) {
+            TestYield();
+        }
+
+        if (ReadAcquire(&(race->bCanceled))) {
+            // the waiter is the queue's to release; the item waits for the next request
+            ++canceled;
+            TEST_CHECK(DqRequest(&(race->Queue), NULL, &item) == DqMatched);
+        } else {
+            item = WaitFulfilled(waiter);
+            FreeWaiter(waiter);
+        }
+        TEST_CHECK(item == (PVOID)(ULONG_PTR)round);
+        TEST_CHECK(race->Queue.Balance == 0);
+    }
+
+    printf("    %ld of %ld rounds canceled\n", (long)canceled, (long)rounds);
+}
+
+static
+VOID
+CaseCancelClaimRace(
+    VOID
+)
+{
+    static RACE_CONTEXT race;
+
+    memset(&race, 0, sizeof(race));
+    TEST_CHECK(NT_SUCCESS(DqInit(&(race.Queue), 8, ReleaseWaiter)));
+
+    TestRunThreads(3, RaceDriver, &race);
+
+    DrainWaiters(&(race.Queue));
+    TEST_CHECK(g_Allocated == g_Freed);
+    DqDestroy(&(race.Queue));
+}
+
+
+//
+// Producers and consumers on several threads, consumers canceling some of
+// their waiters: every item is taken exactly once, and every waiter freed.
+//
+#define STRESS_THREADS      4
+#define STRESS_ITEMS        TEST_ROUNDS(100000)
+
+typedef struct _STRESS_CONTEXT
+{
+    DUAL_QUEUE     Queue;
+    volatile LONG *Taken;           // by item
+    volatile LONG  Producers;       // still running
+} STRESS_CONTEXT, *PSTRESS_CONTEXT;
+
+static
+VOID
+StressThread(
+    _In_ ULONG Index,
+    _In_opt_ PVOID Context
+)
+{
+    PSTRESS_CONTEXT stress = (PSTRESS_CONTEXT)Context;
+    unsigned seed = Index + 1;
+
+    if (Index < STRESS_THREADS) {
+        for (LONG i = 0; i < STRESS_ITEMS; ++i) {
+            PVOID item = (PVOID)(ULONG_PTR)((Index * STRESS_ITEMS) + i + 1);
+            PDQ_WAITER matched;
+            DQ_RESULT result;
+
+            while ((result = DqOffer(&(stress->Queue), item, &matched)) == DqFull) {
+                TestYield();
+            }
+            if (result == DqMatched) {
+                Fulfill(matched, item);
+            }
+        }
+        InterlockedDecrement(&(stress->Producers));
+        return;
+    }
+
+    for (LONG taken = 0; taken < STRESS_ITEMS; ) {
+        PTEST_WAITER waiter = NewWaiter();
+        DQ_RESULT result;
+        PVOID item;
+
+        seed = (seed * 1103515245) + 12345;
+        result = DqRequest(&(stress->Queue), &(waiter->Waiter), &item);
+
+        if (result == DqFull) {
+            FreeWaiter(waiter);
+            TestYield();
+            continue;
+        }
+        if (result == DqQueued) {
+            TEST_CHECK(DqArmWaiter(&(waiter->Waiter)));
+            if ((((seed >> 16) % 3) == 0) && DqCancelWaiter(&(stress->Queue), &(waiter->Waiter))) {
+                continue;
+            }
+            item = WaitFulfilled(waiter);
+        }
+        FreeWaiter(waiter);
+
+        TEST_CHECK(InterlockedIncrement(&(stress->Taken[(ULONG_PTR)item - 1])) == 1);
+        ++taken;
+    }
+}
+
+static
+VOID
+CaseProducersConsumersCancel(
+    VOID
+)
+{
+    static STRESS_CONTEXT stress;
+    LONG total = STRESS_THREADS * STRESS_ITEMS;
+
+    memset(&stress, 0, sizeof(stress));
+    TEST_CHECK(NT_SUCCESS(DqInit(&(stress.Queue), 64, ReleaseWaiter)));
+    stress.Taken = (volatile LONG *)OsAllocate(total * sizeof(LONG));
+    TEST_CHECK(stress.Taken != NULL);
+    stress.Producers = STRESS_THREADS;
+
+    TestRunThreads(2 * STRESS_THREADS, StressThread, &stress);
+
+    for (LONG i = 0; i < total; ++i) {
+        TEST_CHECK(stress.Taken[i] == 1);
+    }
+    TEST_CHECK(stress.Queue.Balance <= 0);
+    DrainWaiters(&(stress.Queue));
+    TEST_CHECK((stress.Queue.Balance == 0) && (stress.Queue.WaiterSlots == 0));
+    TEST_CHECK(g_Allocated == g_Freed);
+
+    OsFree((PVOID)stress.Taken);
+    DqDestroy(&(stress.Queue));
+}
+
+
+static const TEST_CASE Cases[] =
+{
+    TEST_CASE_ENTRY(CaseMatchBothWays),
+    TEST_CASE_ENTRY(CaseCancelGivesSlotBack),
+    TEST_CASE_ENTRY(CaseCanceledBehindLiveHead),
+    TEST_CASE_ENTRY(CaseCancelClaimRace),
+    TEST_CASE_ENTRY(CaseProducersConsumersCancel),
+};
+
+TEST_MAIN(Cases)
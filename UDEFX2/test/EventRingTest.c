@@ -0,0 +1,174 @@
+/*++
+
+Module Name:
+
+EventRingTest.c
+
+Abstract:
+
+    Tests of the event ring: overflow and the sequence gaps it leaves,
+    moderation, and one producer and one consumer thread running at once.
+
+Environment:
+
+    User mode; see Test.h
+
+--*/
+
+#include "EventRing.h"
+#include "Test.h"
+
+
+//
+// A full ring drops what is raised; the dropped events still take their
+// sequence numbers, so the consumer sees the gap.
+//
+static
+VOID
+CaseOverflow(
+    VOID
+)
+{
+    static EVENT_RING ring;
+    RING_EVENT events[EVENT_RING_CAPACITY];
+    RING_EVENT event;
+
+    EvRingInit(&ring);
+    TEST_CHECK(!EvRingPeek(&ring, &event));
+    TEST_CHECK(EvRingPop(&ring, events, EVENT_RING_CAPACITY) == 0);
+
+    for (ULONG i = 0; i < EVENT_RING_CAPACITY; ++i) {
+        TEST_CHECK(EvRingPush(&ring, i));
+    }
+    TEST_CHECK(!EvRingPush(&ring, 1000));
+    TEST_CHECK(!EvRingPush(&ring, 1001));
+    TEST_CHECK((EvRingCount(&ring) == EVENT_RING_CAPACITY) && (ring.Overflows == 2));
+
+    TEST_CHECK(EvRingPeek(&ring, &event) && (event.Sequence == 0));
+    TEST_CHECK(EvRingPop(&ring, events, 3) == 3);
+    TEST_CHECK((events[2].Flags == 2) && (events[2].Sequence == 2));
+
+    // the two dropped still took their sequence numbers
+    TEST_CHECK(EvRingPush(&ring, 7));
+    TEST_CHECK(EvRingPop(&ring, events, EVENT_RING_CAPACITY) == EVENT_RING_CAPACITY - 2);
+    TEST_CHECK(events[EVENT_RING_CAPACITY - 4].Sequence == EVENT_RING_CAPACITY - 1);
+    TEST_CHECK(events[EVENT_RING_CAPACITY - 3].Sequence == EVENT_RING_CAPACITY + 2);
+    TEST_CHECK((ring.Raised == EVENT_RING_CAPACITY + 3) && (ring.Delivered == EVENT_RING_CAPACITY + 1));
+    TEST_CHECK(EvRingCount(&ring) == 0);
+}
+
+//
+// Due at MaxBatch events or once the oldest is MaxDelay old; until then,
+// the time left.
+//
+static
+VOID
+CaseModeration(
+    VOID
+)
+{
+    EVENT_MODERATION moderation = { 100, 4 };
+    ULONG64 wait;
+
+    TEST_CHECK(!EvModerationDue(&moderation, 1, 1000, 1030, &wait) && (wait == 70));
+    TEST_CHECK(EvModerationDue(&moderation, 4, 1000, 1030, &wait) && (wait == 0));
+    TEST_CHECK(EvModerationDue(&moderation, 1, 1000, 1100, &wait));
+
+    // a clock read before the event was stamped
+    TEST_CHECK(!EvModerationDue(&moderation, 1, 1000, 900, &wait) && (wait == 100));
+
+    moderation.MaxBatch = 1;
+    TEST_CHECK(EvModerationDue(&moderation, 1, 1000, 1000, &wait));
+    moderation.MaxBatch = 4;
+    moderation.MaxDelay = 0;
+    TEST_CHECK(EvModerationDue(&moderation, 1, 1000, 1000, &wait));
+}
+
+//
+// A producer raising events as fast as it can, backing off now and then,
+// and a consumer taking them in batches: what comes out is in order, and
+// every gap in the sequence is an overflow.
+//
+#define SPSC_EVENTS     TEST_ROUNDS(2000000)
+
+typedef struct _SPSC_CONTEXT
+{
+    EVENT_RING      Ring;
+    volatile LONG   Done;
+    ULONG64         Received;
+    ULONG64         Gaps;
+} SPSC_CONTEXT, *PSPSC_CONTEXT;
+
+static
+VOID
+SpscThread(
+    _In_ ULONG Index,
+    _In_opt_ PVOID Context
+)
+{
+    PSPSC_CONTEXT spsc = (PSPSC_CONTEXT)Context;
+
+    if (Index == 0) {
+        for (ULONG i = 0; i < SPSC_EVENTS; ++i) {
+            if (!EvRingPush(&(spsc->Ring), i) && ((i % 4) == 0)) {
+                TestYield();
+            }
+        }
+        WriteRelease(&(spsc->Done), 1);
+
+    } else {
+        RING_EVENT events[16];
+        ULONG next = 0;
+        BOOLEAN done;
+
+        do {
+            ULONG count;
+
+            done = (ReadAcquire(&(spsc->Done)) != 0);
+            count = EvRingPop(&(spsc->Ring), events, 16);
+            for (ULONG i = 0; i < count; ++i) {
+                TEST_CHECK(events[i].Flags == events[i].Sequence);
+                TEST_CHECK(events[i].Sequence >= next);
+                spsc->Gaps += events[i].Sequence - next;
+                next = events[i].Sequence + 1;
+            }
+            spsc->Received += count;
+            if (count == 0) {
+                TestYield();
+            }
+        } while (!done || (EvRingCount(&(spsc->Ring)) != 0));
+
+        spsc->Gaps += SPSC_EVENTS - next;
+    }
+}
+
+static
+VOID
+CaseProducerConsumer(
+    VOID
+)
+{
+    static SPSC_CONTEXT spsc;
+
+    memset(&spsc, 0, sizeof(spsc));
+    EvRingInit(&(spsc.Ring));
+
+    TestRunThreads(2, SpscThread, &spsc);
+
+    TEST_CHECK(spsc.Ring.Raised == SPSC_EVENTS);
+    TEST_CHECK(spsc.Received == (ULONG64)spsc.Ring.Delivered);
+    TEST_CHECK(spsc.Gaps == (ULONG64)spsc.Ring.Overflows);
+    TEST_CHECK(spsc.Received + spsc.Gaps == SPSC_EVENTS);
+    printf("    %llu events, %llu overflows\n",
+           (unsigned long long)spsc.Received, (unsigned long long)spsc.Gaps);
+}
+
+
+static const TEST_CASE Cases[] =
+{
+    TEST_CASE_ENTRY(CaseOverflow),
+    TEST_CASE_ENTRY(CaseModeration),
+    TEST_CASE_ENTRY(CaseProducerConsumer),
+};
+
+TEST_MAIN(Cases)
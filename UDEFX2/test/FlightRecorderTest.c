@@ -0,0 +1,212 @@
+/*++
+
+Module Name:
+
+FlightRecorderTest.c
+
+Abstract:
+
+    Tests of the flight recorder and of FrDump, which decodes its rings:
+    ring counts, the last FR_RING_RECORDS records kept in order as a ring
+    wraps, and threads recording while another dumps, none of the records
+    it copies out torn.
+
+Environment:
+
+    User mode; see Test.h
+
+--*/
+
+#include "FlightRecorder.h"
+#include "Test.h"
+
+
+static
+VOID
+CaseInit(
+    VOID
+)
+{
+    static union
+    {
+        FLIGHT_RECORDER Recorder;
+        UCHAR           Bytes[FR_RECORDER_SIZE(4)];
+    } fr;
+
+    TEST_CHECK(FrRingCount(0) == 1);
+    TEST_CHECK(FrRingCount(1) == 1);
+    TEST_CHECK(FrRingCount(3) == 4);
+    TEST_CHECK(FrRingCount(FR_MAX_RINGS) == FR_MAX_RINGS);
+    TEST_CHECK(FrRingCount(1000) == FR_MAX_RINGS);
+
+    TEST_CHECK(!NT_SUCCESS(FrInit(&fr.Recorder, 0)));
+    TEST_CHECK(!NT_SUCCESS(FrInit(&fr.Recorder, 3)));
+    TEST_CHECK(!NT_SUCCESS(FrInit(&fr.Recorder, FR_MAX_RINGS * 2)));
+    TEST_CHECK(NT_SUCCESS(FrInit(&fr.Recorder, 4)));
+    TEST_CHECK(fr.Recorder.RingMask == 3);
+}
+
+//
+// One ring: what was recorded, field for field and in order; once it has
+// wrapped, the newest FR_RING_RECORDS only.
+//
+static
+VOID
+CaseWrap(
+    VOID
+)
+{
+    static FLIGHT_RECORDER recorder;
+    static FR_RECORD records[2 * FR_RING_RECORDS];
+    ULONG64 recorded;
+    ULONG64 before;
+    ULONG count;
+
+    TEST_CHECK(NT_SUCCESS(FrInit(&recorder, 1)));
+    TEST_CHECK(FrDump(&recorder, records, FR_RING_RECORDS, &recorded) == 0);
+    TEST_CHECK(recorded == 0);
+
+    before = OsTimestamp();
+    for (ULONG i = 0; i < 100; ++i) {
+        FrRecord(&recorder, (i & 1) ? FrEventPend : FrEventComplete, 0x81, 0x1000 + i, i * 3, -(LONG)i);
+    }
+
+    count = FrDump(&recorder, records, 2 * FR_RING_RECORDS, &recorded);
+    TEST_CHECK((count == 100) && (recorded == 100));
+    for (ULONG i = 0; i < count; ++i) {
+        TEST_CHECK(records[i].Sequence == (LONG)(i + 1));
+        TEST_CHECK((records[i].RequestId == 0x1000 + i) && (records[i].Length == i * 3));
+        TEST_CHECK((records[i].Status == -(LONG)i) && (records[i].Endpoint == 0x81));
+        TEST_CHECK(records[i].Event == ((i & 1) ? FrEventPend : FrEventComplete));
+        TEST_CHECK((records[i].Ring == 0) && (records[i].Timestamp >= before));
+        if (i != 0) {
+            TEST_CHECK(records[i].Timestamp >= records[i - 1].Timestamp);
+        }
+    }
+
+    // no more than there is room for
+    TEST_CHECK(FrDump(&recorder, records, 10, &recorded) == 10);
+    TEST_CHECK(records[9].RequestId == 0x1000 + 9);
+
+    for (ULONG i = 100; i < 1000; ++i) {
+        FrRecord(&recorder, FrEventComplete, 0x02, 0x1000 + i, i * 3, 0);
+    }
+    count = FrDump(&recorder, records, 2 * FR_RING_RECORDS, &recorded);
+    TEST_CHECK((count == FR_RING_RECORDS) && (recorded == 1000));
+    for (ULONG i = 0; i < count; ++i) {
+        TEST_CHECK(records[i].RequestId == 0x1000 + (1000 - FR_RING_RECORDS) + i);
+        TEST_CHECK(records[i].Sequence == (LONG)((1000 - FR_RING_RECORDS) + i + 1));
+    }
+}
+
+//
+// Threads recording flat out, each on a ring of its own, and one dumping
+// as they go. Every field of a record is derived from its RequestId, so a
+// torn one shows; within a ring, records come out oldest first.
+//
+// ThreadSanitizer cannot tell that the sequence check makes FrDump's copy
+// of a record being rewritten harmless, so there the dump waits until the
+// writers are done.
+//
+#define RECORD_THREADS  4
+#define THREAD_RECORDS  TEST_ROUNDS(2000000)
+
+#if defined(__SANITIZE_THREAD__)
+#define DUMP_WHILE_RECORDING    FALSE
+#else
+#define DUMP_WHILE_RECORDING    TRUE
+#endif
+
+typedef struct _RECORD_CONTEXT
+{
+    union
+    {
+        FLIGHT_RECORDER Recorder;
+        UCHAR           Bytes[FR_RECORDER_SIZE(FR_MAX_RINGS)];
+    } fr;
+    FR_RECORD       Records[FR_MAX_RINGS * FR_RING_RECORDS];
+    volatile LONG   Writers;
+    ULONG64         Dumps;
+} RECORD_CONTEXT, *PRECORD_CONTEXT;
+
+static
+VOID
+CheckDump(
+    _In_ PRECORD_CONTEXT Context,
+    _In_ ULONG Count
+)
+{
+    for (ULONG i = 0; i < Count; ++i) {
+        PFR_RECORD record = &(Context->Records[i]);
+        ULONG n = (ULONG)record->RequestId;
+
+        TEST_CHECK(record->Length == n);
+        TEST_CHECK(record->Status == (LONG)~n);
+        TEST_CHECK(record->Endpoint == (UCHAR)(record->RequestId >> 32));
+        TEST_CHECK(record->Event == ((n & 1) ? FrEventPend : FrEventComplete));
+        TEST_CHECK(record->Sequence == (LONG)(n + 1));
+
+        if ((i != 0) && (record->Ring == Context->Records[i - 1].Ring)) {
+            TEST_CHECK(record->Sequence > Context->Records[i - 1].Sequence);
+        }
+    }
+}
+
+static
+VOID
+RecordThread(
+    _In_ ULONG Index,
+    _In_opt_ PVOID Context
+)
+{
+    PRECORD_CONTEXT ctx = (PRECORD_CONTEXT)Context;
+
+    if (Index == RECORD_THREADS) {
+        ULONG64 recorded;
+
+        while (DUMP_WHILE_RECORDING && (ReadAcquire(&(ctx->Writers)) != 0)) {
+            CheckDump(ctx, FrDump(&(ctx->fr.Recorder), ctx->Records, FR_MAX_RINGS * FR_RING_RECORDS, &recorded));
+            ctx->Dumps++;
+        }
+        return;
+    }
+
+    for (ULONG i = 0; i < THREAD_RECORDS; ++i) {
+        FrRecord(&(ctx->fr.Recorder), (i & 1) ? FrEventPend : FrEventComplete,
+                 (UCHAR)(Index + 1), ((ULONG64)(Index + 1) << 32) | i, i, (LONG)~i);
+    }
+    InterlockedDecrement(&(ctx->Writers));
+}
+
+static
+VOID
+CaseRecordWhileDumping(
+    VOID
+)
+{
+    static RECORD_CONTEXT ctx;
+    ULONG64 recorded;
+    ULONG count;
+
+    TEST_CHECK(NT_SUCCESS(FrInit(&ctx.fr.Recorder, FR_MAX_RINGS)));
+    ctx.Writers = RECORD_THREADS;
+    ctx.Dumps = 0;
+
+    TestRunThreads(RECORD_THREADS + 1, RecordThread, &ctx);
+
+    count = FrDump(&ctx.fr.Recorder, ctx.Records, FR_MAX_RINGS * FR_RING_RECORDS, &recorded);
+    TEST_CHECK(recorded == (ULONG64)RECORD_THREADS * THREAD_RECORDS);
+    TEST_CHECK(count == RECORD_THREADS * FR_RING_RECORDS);
+    CheckDump(&ctx, count);
+    printf("    %llu dumps taken while recording\n", (unsigned long long)ctx.Dumps);
+}
+
+
+static const TEST_CASE Cases[] =
+{
+    TEST_CASE_ENTRY(CaseInit),
+    TEST_CASE_ENTRY(CaseWrap),
+    TEST_CASE_ENTRY(CaseRecordWhileDumping),
+};
+
+TEST_MAIN(Cases)
@@ -0,0 +1,141 @@
+/*++
+
+Module Name:
+
+HistogramTest.c
+
+Abstract:
+
+    Tests of the log-linear histogram: bucket boundaries and their error
+    bound, reading out and resetting, and threads recording at once.
+
+Environment:
+
+    User mode; see Test.h
+
+--*/
+
+#include "Histogram.h"
+#include "Test.h"
+
+
+//
+// Each bucket holds [HistBucketLow(b), HistBucketLow(b + 1)), the small
+// values one each, the others no wider than a quarter of their low end.
+//
+static
+VOID
+CaseBuckets(
+    VOID
+)
+{
+    for (ULONG64 v = 0; v < (1ull << HISTOGRAM_SUB_BITS); ++v) {
+        TEST_CHECK((HistBucketOf(v) == v) && (HistBucketLow((ULONG)v) == v));
+    }
+
+    for (ULONG b = 0; b < HISTOGRAM_BUCKETS - 1; ++b) {
+        ULONG64 low = HistBucketLow(b);
+        ULONG64 next = HistBucketLow(b + 1);
+
+        TEST_CHECK(next > low);
+        TEST_CHECK(HistBucketOf(low) == b);
+        TEST_CHECK(HistBucketOf(next - 1) == b);
+        if (b >= (1u << HISTOGRAM_SUB_BITS)) {
+            TEST_CHECK((next - low) * 4 <= low);
+        }
+    }
+
+    // exact up to 2^33 - 1, then everything lands in the last bucket
+    TEST_CHECK(HistBucketOf((1ull << 33) - 1) == HISTOGRAM_BUCKETS - 1);
+    TEST_CHECK(HistBucketLow(HISTOGRAM_BUCKETS - 1) < (1ull << 33));
+    TEST_CHECK(HistBucketOf(1ull << 33) == HISTOGRAM_BUCKETS - 1);
+    TEST_CHECK(HistBucketOf(~0ull) == HISTOGRAM_BUCKETS - 1);
+}
+
+//
+// Count, Sum and Max, and the buckets, as HistRead lays them out.
+//
+static
+VOID
+CaseReadReset(
+    VOID
+)
+{
+    static HISTOGRAM hist;
+    ULONG64 counters[HISTOGRAM_WORDS];
+    static const ULONG64 values[] = { 0, 1, 5, 5, 1000, 1ull << 40 };
+    ULONG64 sum = 0;
+
+    memset(&hist, 0, sizeof(hist));
+    for (ULONG i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+        HistRecord(&hist, values[i]);
+        sum += values[i];
+    }
+
+    HistRead(&hist, counters);
+    TEST_CHECK(counters[0] == sizeof(values) / sizeof(values[0]));
+    TEST_CHECK(counters[1] == sum);
+    TEST_CHECK(counters[2] == (1ull << 40));
+    TEST_CHECK(counters[3 + 0] == 1);
+    TEST_CHECK(counters[3 + 1] == 1);
+    TEST_CHECK(counters[3 + HistBucketOf(5)] == 2);
+    TEST_CHECK(counters[3 + HistBucketOf(1000)] == 1);
+    TEST_CHECK(counters[3 + HISTOGRAM_BUCKETS - 1] == 1);
+
+    HistReset(&hist);
+    HistRead(&hist, counters);
+    for (ULONG i = 0; i < HISTOGRAM_WORDS; ++i) {
+        TEST_CHECK(counters[i] == 0);
+    }
+}
+
+//
+// Threads recording into one histogram lose nothing.
+//
+#define THREADS         4
+#define THREAD_RECORDS  TEST_ROUNDS(1000000)
+
+static
+VOID
+RecordThread(
+    _In_ ULONG Index,
+    _In_opt_ PVOID Context
+)
+{
+    PHISTOGRAM hist = (PHISTOGRAM)Context;
+
+    for (ULONG i = 0; i < THREAD_RECORDS; ++i) {
+        HistRecord(hist, (ULONG64)((i * THREADS) + Index));
+    }
+}
+
+static
+VOID
+CaseThreads(
+    VOID
+)
+{
+    static HISTOGRAM hist;
+    ULONG64 records = (ULONG64)THREADS * THREAD_RECORDS;
+    ULONG64 total = 0;
+
+    memset(&hist, 0, sizeof(hist));
+    TestRunThreads(THREADS, RecordThread, &hist);
+
+    for (ULONG i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        total += (ULONG64)hist.Buckets[i];
+    }
+    TEST_CHECK((total == records) && ((ULONG64)hist.Count == records));
+    TEST_CHECK((ULONG64)hist.Sum == (records * (records - 1)) / 2);
+    TEST_CHECK((ULONG64)hist.Max == records - 1);
+}
+
+
+static const TEST_CASE Cases[] =
+{
+    TEST_CASE_ENTRY(CaseBuckets),
+    TEST_CASE_ENTRY(CaseReadReset),
+    TEST_CASE_ENTRY(CaseThreads),
+};
+
+TEST_MAIN(Cases)
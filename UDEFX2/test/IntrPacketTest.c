@@ -0,0 +1,191 @@
+/*++
+
+Module Name:
+
+IntrPacketTest.c
+
+Abstract:
+
+    Tests of the INTERRUPT IN packet format: packets of 0, 1 and 15 events
+    and their header, byte for byte; events drained through URBs too small
+    for all of them; and packets the decoder must refuse.
+
+Environment:
+
+    User mode; see Test.h
+
+--*/
+
+#include "IntrPacket.h"
+#include "EventRing.h"
+#include "Test.h"
+
+
+static
+VOID
+MakeRecords(
+    _Out_writes_(Count) PINTR_PACKET_RECORD Records,
+    _In_ ULONG Count
+)
+{
+    for (ULONG i = 0; i < Count; ++i) {
+        Records[i].Flags = 0xA5000000 | i;
+        Records[i].Sequence = 1000 + i;
+    }
+}
+
+//
+// What goes out is what comes back, and the header says so on the wire.
+//
+static
+VOID
+CaseRoundTrip(
+    VOID
+)
+{
+    static const ULONG counts[] = { 0, 1, INTR_PACKET_MAX_EVENTS };
+    INTR_PACKET_RECORD records[INTR_PACKET_MAX_EVENTS];
+    INTR_PACKET_RECORD decoded[INTR_PACKET_MAX_EVENTS];
+    INTR_PACKET_HEADER header;
+    UCHAR buffer[INTR_PACKET_MAX_SIZE];
+
+    MakeRecords(records, INTR_PACKET_MAX_EVENTS);
+
+    for (ULONG c = 0; c < sizeof(counts) / sizeof(counts[0]); ++c) {
+        ULONG count = counts[c];
+        SIZE_T size;
+
+        memset(buffer, 0xEE, sizeof(buffer));
+        size = IntrPacketEncode(buffer, sizeof(buffer), records, count, 0x01020304);
+        TEST_CHECK(size == 8 + (8 * count));
+
+        // version, count, record size, reserved, then the overflows, little-endian
+        TEST_CHECK((buffer[0] == INTR_PACKET_VERSION) && (buffer[1] == count));
+        TEST_CHECK((buffer[2] == sizeof(INTR_PACKET_RECORD)) && (buffer[3] == 0));
+        TEST_CHECK((buffer[4] == 0x04) && (buffer[5] == 0x03) && (buffer[6] == 0x02) && (buffer[7] == 0x01));
+        if (count != 0) {
+            TEST_CHECK((buffer[8] == 0x00) && (buffer[11] == 0xA5) && (buffer[12] == (UCHAR)1000));
+        }
+        if (size < sizeof(buffer)) {
+            TEST_CHECK(buffer[size] == 0xEE);
+        }
+
+        TEST_CHECK(NT_SUCCESS(IntrPacketDecode(buffer, size, &header, decoded)));
+        TEST_CHECK((header.Version == INTR_PACKET_VERSION) && (header.Count == count));
+        TEST_CHECK(header.Overflows == 0x01020304);
+        TEST_CHECK(memcmp(decoded, records, count * sizeof(INTR_PACKET_RECORD)) == 0);
+    }
+}
+
+//
+// How many records fit a transfer, and a ring of 15 events drained into
+// 64-byte URBs, as IoDeliverInterruptEvents does it: 7, 7 and 1, in order.
+//
+static
+VOID
+CaseTruncation(
+    VOID
+)
+{
+    static EVENT_RING ring;
+    RING_EVENT events[INTR_PACKET_MAX_EVENTS];
+    INTR_PACKET_RECORD records[INTR_PACKET_MAX_EVENTS];
+    INTR_PACKET_HEADER header;
+    UCHAR urb[64];
+    ULONG next = 0;
+    ULONG urbs = 0;
+
+    TEST_CHECK(IntrPacketCapacity(0) == 0);
+    TEST_CHECK(IntrPacketCapacity(sizeof(ULONG)) == 0);
+    TEST_CHECK(IntrPacketCapacity(INTR_PACKET_SIZE(1) - 1) == 0);
+    TEST_CHECK(IntrPacketCapacity(INTR_PACKET_SIZE(1)) == 1);
+    TEST_CHECK(IntrPacketCapacity(INTR_PACKET_SIZE(2) - 1) == 1);
+    TEST_CHECK(IntrPacketCapacity(64) == 7);
+    TEST_CHECK(IntrPacketCapacity(INTR_PACKET_MAX_SIZE) == INTR_PACKET_MAX_EVENTS);
+    TEST_CHECK(IntrPacketCapacity(4096) == INTR_PACKET_MAX_EVENTS);
+
+    EvRingInit(&ring);
+    for (ULONG i = 0; i < INTR_PACKET_MAX_EVENTS; ++i) {
+        TEST_CHECK(EvRingPush(&ring, 1u << (i % 4)));
+    }
+
+    while (EvRingCount(&ring) != 0) {
+        ULONG count = EvRingPop(&ring, events, IntrPacketCapacity(sizeof(urb)));
+        SIZE_T size;
+
+        for (ULONG i = 0; i < count; ++i) {
+            records[i].Flags = events[i].Flags;
+            records[i].Sequence = events[i].Sequence;
+        }
+        size = IntrPacketEncode(urb, sizeof(urb), records, count, 0);
+        TEST_CHECK(size <= sizeof(urb));
+
+        TEST_CHECK(NT_SUCCESS(IntrPacketDecode(urb, size, &header, records)));
+        TEST_CHECK(header.Count == ((urbs < 2) ? 7 : 1));
+        for (ULONG i = 0; i < header.Count; ++i, ++next) {
+            TEST_CHECK((records[i].Sequence == next) && (records[i].Flags == (1u << (next % 4))));
+        }
+        urbs++;
+    }
+    TEST_CHECK((urbs == 3) && (next == INTR_PACKET_MAX_EVENTS));
+}
+
+//
+// A reader skips fields appended to a record it does not know, and refuses
+// what it cannot read.
+//
+static
+VOID
+CaseDecodeRejects(
+    VOID
+)
+{
+    INTR_PACKET_RECORD records[INTR_PACKET_MAX_EVENTS];
+    INTR_PACKET_HEADER header;
+    UCHAR buffer[8 + (2 * 12)];
+    SIZE_T size;
+
+    // records of 12 bytes, from a later device
+    memset(buffer, 0, sizeof(buffer));
+    buffer[0] = INTR_PACKET_VERSION;
+    buffer[1] = 2;
+    buffer[2] = 12;
+    buffer[8] = 0x11;
+    buffer[12] = 5;
+    buffer[20] = 0x22;
+    buffer[24] = 6;
+    TEST_CHECK(NT_SUCCESS(IntrPacketDecode(buffer, sizeof(buffer), &header, records)));
+    TEST_CHECK((records[0].Flags == 0x11) && (records[0].Sequence == 5));
+    TEST_CHECK((records[1].Flags == 0x22) && (records[1].Sequence == 6));
+
+    // shorter than its header says, or than a header
+    TEST_CHECK(!NT_SUCCESS(IntrPacketDecode(buffer, sizeof(buffer) - 1, &header, records)));
+    TEST_CHECK(!NT_SUCCESS(IntrPacketDecode(buffer, sizeof(INTR_PACKET_HEADER) - 1, &header, records)));
+
+    MakeRecords(records, 2);
+    size = IntrPacketEncode(buffer, sizeof(buffer), records, 2, 0);
+
+    buffer[0] = INTR_PACKET_VERSION + 1;
+    TEST_CHECK(!NT_SUCCESS(IntrPacketDecode(buffer, size, &header, records)));
+    buffer[0] = INTR_PACKET_VERSION;
+
+    buffer[1] = INTR_PACKET_MAX_EVENTS + 1;
+    TEST_CHECK(!NT_SUCCESS(IntrPacketDecode(buffer, sizeof(buffer), &header, records)));
+    buffer[1] = 2;
+
+    buffer[2] = sizeof(INTR_PACKET_RECORD) - 1;
+    TEST_CHECK(!NT_SUCCESS(IntrPacketDecode(buffer, size, &header, records)));
+    buffer[2] = sizeof(INTR_PACKET_RECORD);
+
+    TEST_CHECK(NT_SUCCESS(IntrPacketDecode(buffer, size, &header, records)));
+}
+
+
+static const TEST_CASE Cases[] =
+{
+    TEST_CASE_ENTRY(CaseRoundTrip),
+    TEST_CASE_ENTRY(CaseTruncation),
+    TEST_CASE_ENTRY(CaseDecodeRejects),
+};
+
+TEST_MAIN(Cases)
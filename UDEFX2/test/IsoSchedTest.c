@@ -0,0 +1,295 @@
+/*++
+
+Module Name:
+
+IsoSchedTest.c
+
+Abstract:
+
+    Tests of the isochronous scheduler on a simulated clock: a steady host
+    sees neither underruns nor overruns, a host often absent sees both, a
+    stalled timer gives up the frames beyond the lag allowed, and a source
+    running dry shows up as underruns.
+
+    The clock is in OsTimestamp() ticks, 1 ns; at 8000 frames a second a
+    frame is 125000 of them.
+
+Environment:
+
+    User mode; see Test.h
+
+--*/
+
+#include "IsoSched.h"
+#include "Test.h"
+
+
+#define TEST_FREQUENCY  1000000000ull
+#define TEST_RATE       8000
+#define TEST_PACKET     1024
+#define TEST_SLOTS      64
+#define TEST_PREFILL    16
+#define TEST_MAX_LAG    64
+#define TEST_MS         1000000ull
+
+//
+// An IN source, and an OUT host, number their packets from 1; the other
+// end checks the numbers follow on.
+//
+typedef struct _TEST_STREAM
+{
+    ISO_SCHEDULER Sched;
+    ULONG64       Clock;
+    ULONG         Seed;
+    BOOLEAN       Starved;          // source produces half the time
+    ULONG         NextPacket;       // IN source, OUT host
+    ULONG         Expected;         // sink
+    ULONG         OutOfOrder;
+} TEST_STREAM, *PTEST_STREAM;
+
+static
+ULONG
+Random(
+    _Inout_ PTEST_STREAM Stream,
+    _In_ ULONG Range
+)
+{
+    Stream->Seed = (Stream->Seed * 1103515245) + 12345;
+    return (Stream->Seed >> 8) % Range;
+}
+
+static
+ULONG
+StreamFill(
+    _In_ PVOID Context,
+    _Out_writes_bytes_(Length) PUCHAR Packet,
+    _In_ ULONG Length
+)
+{
+    PTEST_STREAM stream = (PTEST_STREAM)Context;
+
+    if (stream->Starved && (Random(stream, 2) == 0)) {
+        return 0;
+    }
+    memset(Packet, 0, Length);
+    memcpy(Packet, &(stream->NextPacket), 4);
+    ++(stream->NextPacket);
+    return Length;
+}
+
+static
+VOID
+StreamDrain(
+    _In_ PVOID Context,
+    _In_reads_bytes_(Length) const UCHAR *Packet,
+    _In_ ULONG Length
+)
+{
+    PTEST_STREAM stream = (PTEST_STREAM)Context;
+    ULONG number;
+
+    // the prefill is zeros
+    TEST_CHECK(Length >= 4);
+    memcpy(&number, Packet, 4);
+    if (number != 0) {
+        if (number != stream->Expected) {
+            ++(stream->OutOfOrder);
+        }
+        stream->Expected = number + 1;
+    }
+}
+
+static
+VOID
+StreamInit(
+    _Out_ PTEST_STREAM Stream,
+    _In_ ISO_DIRECTION Direction
+)
+{
+    memset(Stream, 0, sizeof(*Stream));
+    Stream->Seed = 1;
+    Stream->NextPacket = 1;
+    Stream->Expected = 1;
+    TEST_CHECK(NT_SUCCESS(IsoInit(&(Stream->Sched), Direction, TEST_PACKET, TEST_SLOTS, TEST_PREFILL,
+                                  TEST_RATE, TEST_FREQUENCY, StreamFill, StreamDrain, Stream)));
+    IsoStart(&(Stream->Sched), 0);
+}
+
+//
+// Ticks of a timer firing every Period, late by up to Jitter, each running
+// the frames due; the host has a packet for a frame but Absent percent of
+// the time. Returns the host packets that moved data.
+//
+static
+ULONG64
+StreamRun(
+    _Inout_ PTEST_STREAM Stream,
+    _In_ ULONG64 Period,
+    _In_ ULONG Jitter,
+    _In_ ULONG Absent,
+    _In_ ULONG Ticks
+)
+{
+    PISO_SCHEDULER sched = &(Stream->Sched);
+    ULONG64 moved = 0;
+
+    for (ULONG t = 0; t < Ticks; ++t) {
+        ULONG due;
+
+        Stream->Clock += Period + ((Jitter != 0) ? Random(Stream, Jitter) : 0);
+        due = IsoFramesDue(sched, Stream->Clock, TEST_MAX_LAG);
+
+        for (ULONG i = 0; i < due; ++i) {
+            UCHAR packet[TEST_PACKET];
+            BOOLEAN host = (Random(Stream, 100) >= Absent);
+
+            if (host && (sched->Direction == IsoDirectionOut)) {
+                memset(packet, 0, sizeof(packet));
+                memcpy(packet, &(Stream->NextPacket), 4);
+                ++(Stream->NextPacket);
+            }
+            if (IsoRunFrame(sched, Stream->Clock, host ? packet : NULL, TEST_PACKET) != 0) {
+                ++moved;
+                if (sched->Direction == IsoDirectionIn) {
+                    StreamDrain(Stream, packet, TEST_PACKET);
+                }
+            }
+        }
+    }
+    return moved;
+}
+
+
+static
+VOID
+CaseInit(
+    VOID
+)
+{
+    ISO_SCHEDULER sched;
+
+    TEST_CHECK(!NT_SUCCESS(IsoInit(&sched, IsoDirectionOut, TEST_PACKET, 8, 9, TEST_RATE, TEST_FREQUENCY, NULL, NULL, NULL)));
+    TEST_CHECK(NT_SUCCESS(IsoInit(&sched, IsoDirectionOut, TEST_PACKET, 8, 8, TEST_RATE, TEST_FREQUENCY, NULL, NULL, NULL)));
+    TEST_CHECK(IsoFrameTime(&sched, TEST_RATE) == sched.Base + TEST_FREQUENCY);
+    IsoCleanup(&sched);
+}
+
+//
+// A 1 ms timer with no jitter: eight frames a tick, and a host that is
+// always there; every frame moves a packet, in order.
+//
+static
+VOID
+CaseSteady(
+    VOID
+)
+{
+    static TEST_STREAM in;
+    static TEST_STREAM out;
+
+    StreamInit(&in, IsoDirectionIn);
+    StreamInit(&out, IsoDirectionOut);
+
+    TEST_CHECK(StreamRun(&in, TEST_MS, 0, 0, 1000) == 8001);
+    TEST_CHECK(StreamRun(&out, TEST_MS, 0, 0, 1000) == 8001);
+
+    TEST_CHECK(in.Sched.Stats.Frames == 8001);
+    TEST_CHECK((in.Sched.Stats.Underruns == 0) && (in.Sched.Stats.Overruns == 0));
+    TEST_CHECK((out.Sched.Stats.Underruns == 0) && (out.Sched.Stats.Overruns == 0));
+    TEST_CHECK((in.OutOfOrder == 0) && (out.OutOfOrder == 0));
+    TEST_CHECK(in.Sched.Stats.Skipped == 0);
+
+    IsoCleanup(&(in.Sched));
+    IsoCleanup(&(out.Sched));
+}
+
+//
+// The host gone half the time, with a jittery timer: IN packets pile up
+// and overrun, OUT ones run dry.
+//
+static
+VOID
+CaseHostAbsent(
+    VOID
+)
+{
+    static TEST_STREAM in;
+    static TEST_STREAM out;
+
+    StreamInit(&in, IsoDirectionIn);
+    StreamInit(&out, IsoDirectionOut);
+
+    (VOID)StreamRun(&in, TEST_MS, 300000, 50, 1000);
+    (VOID)StreamRun(&out, TEST_MS, 300000, 50, 1000);
+
+    TEST_CHECK(in.Sched.Stats.Overruns != 0);
+    TEST_CHECK(out.Sched.Stats.Underruns != 0);
+    printf("    IN overruns %llu, OUT underruns %llu\n",
+           (unsigned long long)in.Sched.Stats.Overruns, (unsigned long long)out.Sched.Stats.Underruns);
+
+    IsoCleanup(&(in.Sched));
+    IsoCleanup(&(out.Sched));
+}
+
+//
+// The timer stalls for 20 ms: of the 168 frames due at the next tick, all
+// but the last TEST_MAX_LAG are given up on.
+//
+static
+VOID
+CaseStall(
+    VOID
+)
+{
+    static TEST_STREAM in;
+
+    StreamInit(&in, IsoDirectionIn);
+    (VOID)StreamRun(&in, TEST_MS, 0, 0, 10);
+    TEST_CHECK(in.Sched.Stats.Skipped == 0);
+
+    in.Clock += 20 * TEST_MS;
+    (VOID)StreamRun(&in, TEST_MS, 0, 0, 1);
+    TEST_CHECK(in.Sched.Stats.Skipped == (20 * 8) + 8 - TEST_MAX_LAG);
+
+    // and then it carries on as before
+    (VOID)StreamRun(&in, TEST_MS, 0, 0, 10);
+    TEST_CHECK(in.Sched.Stats.Skipped == (20 * 8) + 8 - TEST_MAX_LAG);
+
+    // the oldest frame still run was due TEST_MAX_LAG - 1 frames earlier
+    TEST_CHECK((ULONG64)in.Sched.Lateness.Max == (TEST_MAX_LAG - 1) * (TEST_FREQUENCY / TEST_RATE));
+
+    IsoCleanup(&(in.Sched));
+}
+
+//
+// A source that produces half the time: the host sees underruns.
+//
+static
+VOID
+CaseStarvedSource(
+    VOID
+)
+{
+    static TEST_STREAM in;
+
+    StreamInit(&in, IsoDirectionIn);
+    in.Starved = TRUE;
+    (VOID)StreamRun(&in, TEST_MS, 0, 0, 100);
+    TEST_CHECK(in.Sched.Stats.Underruns != 0);
+    TEST_CHECK(in.Sched.Stats.Overruns == 0);
+    TEST_CHECK(in.OutOfOrder == 0);
+
+    IsoCleanup(&(in.Sched));
+}
+
+
+static const TEST_CASE Cases[] =
+{
+    TEST_CASE_ENTRY(CaseInit),
+    TEST_CASE_ENTRY(CaseSteady),
+    TEST_CASE_ENTRY(CaseHostAbsent),
+    TEST_CASE_ENTRY(CaseStall),
+    TEST_CASE_ENTRY(CaseStarvedSource),
+};
+
+TEST_MAIN(Cases)
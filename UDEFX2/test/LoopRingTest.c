@@ -0,0 +1,231 @@
+/*++
+
+Module Name:
+
+LoopRingTest.c
+
+Abstract:
+
+    Tests of the loopback ring: sizes it takes, message boundaries through
+    the wrap, LrHasRoom agreeing with LrPush, and a producer and consumer
+    thread running at once, the consumer taking messages in pieces.
+
+Environment:
+
+    User mode; see Test.h
+
+--*/
+
+#include "LoopRing.h"
+#include "Test.h"
+
+
+//
+// Message n: its length, and its bytes.
+//
+static
+ULONG
+MessageLength(
+    _In_ ULONG Message,
+    _In_ ULONG Max
+)
+{
+    return ((Message * 2654435761u) >> 7) % (Max + 1);
+}
+
+static
+UCHAR
+MessageByte(
+    _In_ ULONG Message,
+    _In_ ULONG Offset
+)
+{
+    return (UCHAR)((Message * 31) + Offset);
+}
+
+static
+BOOLEAN
+PushMessage(
+    _Inout_ PLOOP_RING Ring,
+    _In_ ULONG Message,
+    _In_ ULONG Length
+)
+{
+    UCHAR data[4096];
+
+    TEST_CHECK(Length <= sizeof(data));
+    for (ULONG i = 0; i < Length; ++i) {
+        data[i] = MessageByte(Message, i);
+    }
+    return LrPush(Ring, data, Length);
+}
+
+//
+// Takes the oldest message, in pieces of at most Piece bytes, checking it
+// is message n, whole.
+//
+static
+VOID
+PullMessage(
+    _Inout_ PLOOP_RING Ring,
+    _In_ ULONG Message,
+    _In_ ULONG Length,
+    _In_ ULONG Piece
+)
+{
+    ULONG taken = 0;
+    BOOLEAN released;
+
+    do {
+        PUCHAR data;
+        ULONG available;
+        ULONG bytes;
+
+        TEST_CHECK(LrPeek(Ring, &data, &available));
+        TEST_CHECK(available == Length - taken);
+        bytes = (available < Piece) ? available : Piece;
+        for (ULONG i = 0; i < bytes; ++i) {
+            TEST_CHECK(data[i] == MessageByte(Message, taken + i));
+        }
+        taken += bytes;
+        released = LrConsume(Ring, bytes);
+        TEST_CHECK(released == (taken == Length));
+    } while (!released);
+}
+
+
+static
+VOID
+CaseInit(
+    VOID
+)
+{
+    LOOP_RING ring;
+
+    TEST_CHECK(!NT_SUCCESS(LrInit(&ring, 32)));
+    TEST_CHECK(!NT_SUCCESS(LrInit(&ring, 96)));
+    TEST_CHECK(NT_SUCCESS(LrInit(&ring, 64)));
+    TEST_CHECK(LrIsEmpty(&ring) && (LrMaxMessage(&ring) == 24));
+    LrCleanup(&ring);
+}
+
+static
+VOID
+CaseBoundaries(
+    VOID
+)
+{
+    LOOP_RING ring;
+    PUCHAR data;
+    ULONG length;
+    ULONG max;
+
+    TEST_CHECK(NT_SUCCESS(LrInit(&ring, 256)));
+    max = LrMaxMessage(&ring);
+
+    TEST_CHECK(!LrPeek(&ring, &data, &length));
+    TEST_CHECK(!LrHasRoom(&ring, max + 1) && !PushMessage(&ring, 0, max + 1));
+
+    // an empty message is a message
+    TEST_CHECK(PushMessage(&ring, 0, 0));
+    TEST_CHECK(!LrIsEmpty(&ring));
+    TEST_CHECK(LrPeek(&ring, &data, &length) && (length == 0));
+    TEST_CHECK(LrConsume(&ring, 0) && LrIsEmpty(&ring));
+
+    // sizes all round the buffer, so messages land on every offset and wrap
+    for (ULONG m = 1; m < 2000; ++m) {
+        ULONG size = m % (max + 1);
+
+        TEST_CHECK(LrHasRoom(&ring, size));
+        TEST_CHECK(PushMessage(&ring, m, size));
+        PullMessage(&ring, m, size, (m % 5) + 1);
+        TEST_CHECK(LrIsEmpty(&ring));
+    }
+
+    // filled up: LrHasRoom says no exactly when LrPush would
+    for (ULONG m = 0; ; ++m) {
+        BOOLEAN room = LrHasRoom(&ring, 40);
+
+        TEST_CHECK(PushMessage(&ring, m, 40) == room);
+        if (!room) {
+            TEST_CHECK(m >= 2);
+            break;
+        }
+    }
+
+    LrReset(&ring);
+    TEST_CHECK(LrIsEmpty(&ring) && LrHasRoom(&ring, max));
+    LrCleanup(&ring);
+}
+
+//
+// The producer pushes messages of every size up to the largest, waiting
+// when the ring is full; the consumer takes them in pieces of varying
+// size. Every message comes out whole, in order.
+//
+#define SPSC_MESSAGES   TEST_ROUNDS(500000)
+#define SPSC_CAPACITY   4096
+
+typedef struct _SPSC_CONTEXT
+{
+    LOOP_RING       Ring;
+    ULONG           Max;
+    ULONG64         Full;
+} SPSC_CONTEXT, *PSPSC_CONTEXT;
+
+static
+VOID
+SpscThread(
+    _In_ ULONG Index,
+    _In_opt_ PVOID Context
+)
+{
+    PSPSC_CONTEXT spsc = (PSPSC_CONTEXT)Context;
+
+    for (ULONG m = 0; m < SPSC_MESSAGES; ++m) {
+        ULONG length = MessageLength(m, spsc->Max);
+
+        if (Index == 0) {
+            while (!LrHasRoom(&(spsc->Ring), length)) {
+                ++(spsc->Full);
+                TestYield();
+            }
+            TEST_CHECK(PushMessage(&(spsc->Ring), m, length));
+
+        } else {
+            while (LrIsEmpty(&(spsc->Ring))) {
+                TestYield();
+            }
+            PullMessage(&(spsc->Ring), m, length, (m % 3 == 0) ? length + 1 : (m % 97) + 1);
+        }
+    }
+}
+
+static
+VOID
+CaseProducerConsumer(
+    VOID
+)
+{
+    static SPSC_CONTEXT spsc;
+
+    memset(&spsc, 0, sizeof(spsc));
+    TEST_CHECK(NT_SUCCESS(LrInit(&(spsc.Ring), SPSC_CAPACITY)));
+    spsc.Max = LrMaxMessage(&(spsc.Ring));
+
+    TestRunThreads(2, SpscThread, &spsc);
+
+    TEST_CHECK(LrIsEmpty(&(spsc.Ring)));
+    printf("    %u messages, ring full %llu times\n", SPSC_MESSAGES, (unsigned long long)spsc.Full);
+    LrCleanup(&(spsc.Ring));
+}
+
+
+static const TEST_CASE Cases[] =
+{
+    TEST_CASE_ENTRY(CaseInit),
+    TEST_CASE_ENTRY(CaseBoundaries),
+    TEST_CASE_ENTRY(CaseProducerConsumer),
+};
+
+TEST_MAIN(Cases)
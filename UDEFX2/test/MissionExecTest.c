@@ -0,0 +1,377 @@
+/*++
+
+Module Name:
+
+MissionExecTest.c
+
+Abstract:
+
+    Tests of the mission executor: lookup by type, a full queue, stopping
+    with jobs queued, and submitters racing a pool of workers, every
+    mission completed exactly once with its own response.
+
+    Workers are threads waiting on a semaphore each, which the kick
+    callback posts, as the driver's work items are queued.
+
+Environment:
+
+    User mode; see Test.h
+
+--*/
+
+#include "MissionExec.h"
+#include "Test.h"
+
+#include <semaphore.h>
+#include <stdlib.h>
+
+
+#define TEST_SUFFIX     "_response"
+
+static
+NTSTATUS
+HandlePing(
+    _In_opt_ PVOID Context,
+    _In_reads_bytes_(Length) const UCHAR *Mission,
+    _In_ ULONG Length,
+    _Out_writes_bytes_to_(ResponseSize, *ResponseLength) PUCHAR Response,
+    _In_ ULONG ResponseSize,
+    _Out_ PULONG ResponseLength
+)
+{
+    UNREFERENCED_PARAMETER(Context);
+
+    *ResponseLength = 0;
+    if ((Length > 0) && (Mission[Length - 1] == 0)) {
+        --Length;
+    }
+    if (Length + sizeof(TEST_SUFFIX) > ResponseSize) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    memcpy(Response, Mission, Length);
+    memcpy(Response + Length, TEST_SUFFIX, sizeof(TEST_SUFFIX));
+    *ResponseLength = Length + sizeof(TEST_SUFFIX);
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+HandleFail(
+    _In_opt_ PVOID Context,
+    _In_reads_bytes_(Length) const UCHAR *Mission,
+    _In_ ULONG Length,
+    _Out_writes_bytes_to_(ResponseSize, *ResponseLength) PUCHAR Response,
+    _In_ ULONG ResponseSize,
+    _Out_ PULONG ResponseLength
+)
+{
+    UNREFERENCED_PARAMETER(Context);
+    UNREFERENCED_PARAMETER(Mission);
+    UNREFERENCED_PARAMETER(Length);
+    UNREFERENCED_PARAMETER(Response);
+    UNREFERENCED_PARAMETER(ResponseSize);
+
+    *ResponseLength = 0;
+    return STATUS_UNSUCCESSFUL;
+}
+
+static const MX_HANDLER Handlers[] =
+{
+    { "ping", HandlePing },
+    { "fail", HandleFail },
+};
+
+
+typedef struct _TEST_POOL
+{
+    MX_EXECUTOR     Exec;
+    ULONG           Workers;
+    pthread_t       Threads[MX_MAX_WORKERS];
+    sem_t           Kicks[MX_MAX_WORKERS];
+    volatile LONG   Quit;
+    volatile LONG   Kicked;
+
+    volatile LONG64 Completed;
+    volatile LONG64 Failed;
+    volatile LONG  *Seen;               // completions of each mission, by number
+    ULONG           Missions;
+} TEST_POOL, *PTEST_POOL;
+
+typedef struct _TEST_WORKER
+{
+    PTEST_POOL  Pool;
+    ULONG       Index;
+} TEST_WORKER, *PTEST_WORKER;
+
+static TEST_WORKER g_Workers[MX_MAX_WORKERS];
+
+//
+// A ping's response is the mission, "ping:<number>", and TEST_SUFFIX.
+//
+static
+VOID
+PoolComplete(
+    _In_opt_ PVOID Context,
+    _In_ NTSTATUS Status,
+    _In_reads_bytes_(Length) const UCHAR *Response,
+    _In_ ULONG Length
+)
+{
+    PTEST_POOL pool = (PTEST_POOL)Context;
+
+    if (!NT_SUCCESS(Status)) {
+        TEST_CHECK((Status == STATUS_UNSUCCESSFUL) && (Length == 0));
+        InterlockedIncrement64(&(pool->Failed));
+
+    } else {
+        TEST_CHECK((Length > 5 + sizeof(TEST_SUFFIX)) && (memcmp(Response, "ping:", 5) == 0));
+        TEST_CHECK(memcmp(Response + Length - sizeof(TEST_SUFFIX), TEST_SUFFIX, sizeof(TEST_SUFFIX)) == 0);
+        if (pool->Seen != NULL) {
+            ULONG number = (ULONG)strtoul((const char *)Response + 5, NULL, 10);
+
+            TEST_CHECK(number < pool->Missions);
+            TEST_CHECK(InterlockedIncrement(&(pool->Seen[number])) == 1);
+        }
+    }
+    InterlockedIncrement64(&(pool->Completed));
+}
+
+static
+VOID
+PoolKick(
+    _In_opt_ PVOID Context,
+    _In_ ULONG Worker
+)
+{
+    PTEST_POOL pool = (PTEST_POOL)Context;
+
+    InterlockedIncrement(&(pool->Kicked));
+    if (Worker < pool->Workers) {
+        TEST_CHECK(sem_post(&(pool->Kicks[Worker])) == 0);
+    }
+}
+
+static
+void *
+PoolWorker(
+    _In_ void *Parameter
+)
+{
+    PTEST_WORKER worker = (PTEST_WORKER)Parameter;
+    PTEST_POOL pool = worker->Pool;
+
+    for (;;) {
+        while (sem_wait(&(pool->Kicks[worker->Index])) != 0) {
+        }
+        if (ReadAcquire(&(pool->Quit)) != 0) {
+            return NULL;
+        }
+        MxWork(&(pool->Exec), worker->Index);
+    }
+}
+
+//
+// An executor of Workers workers; Threads of them get a thread, the
+// others are kicked but never run.
+//
+static
+VOID
+PoolInit(
+    _Out_ PTEST_POOL Pool,
+    _In_ ULONG Workers,
+    _In_ ULONG Threads,
+    _In_ ULONG Capacity
+)
+{
+    memset(Pool, 0, sizeof(*Pool));
+    TEST_CHECK(NT_SUCCESS(MxInit(&(Pool->Exec), Handlers, sizeof(Handlers) / sizeof(Handlers[0]),
+                                 Workers, Capacity, PoolComplete, PoolKick, Pool)));
+    Pool->Workers = Threads;
+    for (ULONG i = 0; i < Threads; ++i) {
+        g_Workers[i].Pool = Pool;
+        g_Workers[i].Index = i;
+        TEST_CHECK(sem_init(&(Pool->Kicks[i]), 0, 0) == 0);
+        TEST_CHECK(pthread_create(&(Pool->Threads[i]), NULL, PoolWorker, &(g_Workers[i])) == 0);
+    }
+}
+
+static
+VOID
+PoolCleanup(
+    _Inout_ PTEST_POOL Pool
+)
+{
+    MxStop(&(Pool->Exec));
+    WriteRelease(&(Pool->Quit), 1);
+    for (ULONG i = 0; i < Pool->Workers; ++i) {
+        TEST_CHECK(sem_post(&(Pool->Kicks[i])) == 0);
+        TEST_CHECK(pthread_join(Pool->Threads[i], NULL) == 0);
+        sem_destroy(&(Pool->Kicks[i]));
+    }
+    MxCleanup(&(Pool->Exec));
+}
+
+static
+NTSTATUS
+Submit(
+    _Inout_ PTEST_POOL Pool,
+    _In_ const char *Mission
+)
+{
+    return MxSubmit(&(Pool->Exec), (const UCHAR *)Mission, (ULONG)strlen(Mission) + 1);
+}
+
+
+static
+VOID
+CaseLookup(
+    VOID
+)
+{
+    static TEST_POOL pool;
+    UCHAR tooLong[MX_MAX_MISSION + 1];
+    MX_STATS stats;
+
+    PoolInit(&pool, 1, 1, 16);
+
+    TEST_CHECK(MxLookup(&(pool.Exec), (const UCHAR *)"ping", 4) == &(Handlers[0]));
+    TEST_CHECK(MxLookup(&(pool.Exec), (const UCHAR *)"fail:x", 6) == &(Handlers[1]));
+    TEST_CHECK(MxLookup(&(pool.Exec), (const UCHAR *)"pingx", 5) == NULL);
+    TEST_CHECK(MxLookup(&(pool.Exec), (const UCHAR *)"pin", 3) == NULL);
+
+    TEST_CHECK(Submit(&pool, "hello") == STATUS_NOT_SUPPORTED);
+    TEST_CHECK(Submit(&pool, "pingx:1") == STATUS_NOT_SUPPORTED);
+
+    memset(tooLong, 0, sizeof(tooLong));
+    memcpy(tooLong, "ping:", 5);
+    TEST_CHECK(MxSubmit(&(pool.Exec), tooLong, sizeof(tooLong)) == STATUS_INSUFFICIENT_RESOURCES);
+
+    TEST_CHECK(NT_SUCCESS(Submit(&pool, "fail:1")));
+    TEST_CHECK(NT_SUCCESS(Submit(&pool, "ping:1")));
+    while (ReadAcquire64(&(pool.Completed)) < 2) {
+        TestYield();
+    }
+    TEST_CHECK(pool.Failed == 1);
+
+    MxGetStats(&(pool.Exec), &stats);
+    TEST_CHECK((stats.Submitted == 2) && (stats.Completed == 1) && (stats.Failed == 1));
+    TEST_CHECK((stats.Passed == 2) && (stats.Rejected == 1));
+    PoolCleanup(&pool);
+}
+
+//
+// With no worker running, the queue fills up; a worker then drains it,
+// and stopping drops what is queued.
+//
+static
+VOID
+CaseFullAndStop(
+    VOID
+)
+{
+    static TEST_POOL pool;
+    MX_STATS stats;
+
+    PoolInit(&pool, 2, 0, 8);
+
+    for (ULONG i = 0; i < 8; ++i) {
+        TEST_CHECK(NT_SUCCESS(Submit(&pool, "ping:0")));
+    }
+    TEST_CHECK(Submit(&pool, "ping:0") == STATUS_INSUFFICIENT_RESOURCES);
+
+    // each idle worker kicked once, however many jobs
+    TEST_CHECK(pool.Kicked == 2);
+
+    MxWork(&(pool.Exec), 0);
+    TEST_CHECK(pool.Completed == 8);
+
+    for (ULONG i = 0; i < 5; ++i) {
+        TEST_CHECK(NT_SUCCESS(Submit(&pool, "ping:0")));
+    }
+    MxStop(&(pool.Exec));
+    TEST_CHECK(Submit(&pool, "ping:0") == STATUS_INSUFFICIENT_RESOURCES);
+
+    // worker 1, kicked earlier, finds nothing
+    MxWork(&(pool.Exec), 1);
+    TEST_CHECK(pool.Completed == 8);
+
+    MxGetStats(&(pool.Exec), &stats);
+    TEST_CHECK((stats.Submitted == 13) && (stats.Completed == 8) && (stats.Dropped == 5));
+    TEST_CHECK((stats.Rejected == 2) && (stats.PeakQueued == 8));
+    PoolCleanup(&pool);
+}
+
+//
+// Submitters racing workers, with a small queue so it fills up: each
+// retries until its mission is taken. Every ping completes once, with its
+// own response; every tenth mission fails.
+//
+#define RACE_WORKERS        4
+#define RACE_SUBMITTERS     4
+#define RACE_MISSIONS       TEST_ROUNDS(100000)
+
+static
+VOID
+SubmitThread(
+    _In_ ULONG Index,
+    _In_opt_ PVOID Context
+)
+{
+    PTEST_POOL pool = (PTEST_POOL)Context;
+
+    for (ULONG i = 0; i < RACE_MISSIONS; ++i) {
+        ULONG number = (Index * RACE_MISSIONS) + i;
+        char mission[32];
+
+        snprintf(mission, sizeof(mission), "%s:%u", ((number % 10) == 9) ? "fail" : "ping", number);
+        while (Submit(pool, mission) == STATUS_INSUFFICIENT_RESOURCES) {
+            TestYield();
+        }
+    }
+}
+
+static
+VOID
+CaseWorkersRace(
+    VOID
+)
+{
+    static TEST_POOL pool;
+    ULONG missions = RACE_SUBMITTERS * RACE_MISSIONS;
+    MX_STATS stats;
+
+    PoolInit(&pool, RACE_WORKERS, RACE_WORKERS, 16);
+    pool.Missions = missions;
+    pool.Seen = (volatile LONG *)OsAllocate(missions * sizeof(LONG));
+    TEST_CHECK(pool.Seen != NULL);
+    memset((PVOID)pool.Seen, 0, missions * sizeof(LONG));
+
+    TestRunThreads(RACE_SUBMITTERS, SubmitThread, &pool);
+    while (ReadAcquire64(&(pool.Completed)) < (LONG64)missions) {
+        TestYield();
+    }
+
+    for (ULONG i = 0; i < missions; ++i) {
+        TEST_CHECK(pool.Seen[i] == (((i % 10) == 9) ? 0 : 1));
+    }
+    TEST_CHECK(pool.Failed == missions / 10);
+
+    MxGetStats(&(pool.Exec), &stats);
+    TEST_CHECK((stats.Submitted == missions) && (stats.Completed + stats.Failed == missions));
+    TEST_CHECK((stats.PeakBusy <= RACE_WORKERS) && (stats.PeakQueued <= 16));
+    printf("    %u missions, %llu refused while full, %u workers busy at most\n",
+           missions, (unsigned long long)stats.Rejected, stats.PeakBusy);
+
+    PoolCleanup(&pool);
+    OsFree((PVOID)pool.Seen);
+}
+
+
+static const TEST_CASE Cases[] =
+{
+    TEST_CASE_ENTRY(CaseLookup),
+    TEST_CASE_ENTRY(CaseFullAndStop),
+    TEST_CASE_ENTRY(CaseWorkersRace),
+};
+
+TEST_MAIN(Cases)
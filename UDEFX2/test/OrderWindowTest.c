@@ -0,0 +1,222 @@
+/*++
+
+Module Name:
+
+OrderWindowTest.c
+
+Abstract:
+
+    Tests of the in-flight window: items run one at a time, in the order
+    Fetch handed them out, never more than Depth of them taken ahead, and
+    none stranded when the threads pumping it race each other.
+
+    Fetch is a FIFO under a mutex, standing in for a manual WDF queue.
+
+Environment:
+
+    User mode; see Test.h
+
+--*/
+
+#include "OrderWindow.h"
+#include "Test.h"
+
+
+typedef struct _TEST_SOURCE
+{
+    ORDER_WINDOW    Window;
+    pthread_mutex_t Mutex;
+    ULONG_PTR      *Items;
+    LONG            Head;           // under Mutex
+    LONG            Tail;           // under Mutex
+    LONG            Capacity;
+    volatile LONG   Inside;         // threads in Run
+    LONG            NextExpected;   // in Run only
+    ULONG           MaxBacklog;     // in Run only
+} TEST_SOURCE, *PTEST_SOURCE;
+
+static
+VOID
+SourceInit(
+    _Out_ PTEST_SOURCE Source,
+    _In_ LONG Capacity
+)
+{
+    memset(Source, 0, sizeof(*Source));
+    TEST_CHECK(pthread_mutex_init(&(Source->Mutex), NULL) == 0);
+    Source->Items = (ULONG_PTR *)OsAllocate(Capacity * sizeof(ULONG_PTR));
+    TEST_CHECK(Source->Items != NULL);
+    Source->Capacity = Capacity;
+    Source->NextExpected = 1;
+}
+
+static
+VOID
+SourceCleanup(
+    _Inout_ PTEST_SOURCE Source
+)
+{
+    pthread_mutex_destroy(&(Source->Mutex));
+    OsFree(Source->Items);
+}
+
+//
+// Items are numbered from 1 in the order they are added.
+//
+static
+VOID
+SourceAdd(
+    _Inout_ PTEST_SOURCE Source
+)
+{
+    pthread_mutex_lock(&(Source->Mutex));
+    TEST_CHECK(Source->Tail < Source->Capacity);
+    Source->Items[Source->Tail] = (ULONG_PTR)Source->Tail + 1;
+    ++(Source->Tail);
+    pthread_mutex_unlock(&(Source->Mutex));
+}
+
+static
+PVOID
+SourceFetch(
+    _In_ PVOID Context
+)
+{
+    PTEST_SOURCE source = (PTEST_SOURCE)Context;
+    PVOID item = NULL;
+
+    pthread_mutex_lock(&(source->Mutex));
+    if (source->Head < source->Tail) {
+        item = (PVOID)source->Items[source->Head];
+        ++(source->Head);
+    }
+    pthread_mutex_unlock(&(source->Mutex));
+    return item;
+}
+
+static
+VOID
+SourceRun(
+    _In_ PVOID Context,
+    _In_ PVOID Item
+)
+{
+    PTEST_SOURCE source = (PTEST_SOURCE)Context;
+    ULONG backlog;
+
+    TEST_CHECK(InterlockedIncrement(&(source->Inside)) == 1);
+
+    TEST_CHECK((LONG)(ULONG_PTR)Item == source->NextExpected);
+    ++(source->NextExpected);
+
+    backlog = OwBacklog(&(source->Window));
+    if (backlog > source->MaxBacklog) {
+        source->MaxBacklog = backlog;
+    }
+
+    // give the other threads a chance to take items while this one runs
+    if (((ULONG_PTR)Item % 16) == 0) {
+        TestYield();
+    }
+
+    InterlockedDecrement(&(source->Inside));
+}
+
+
+static
+VOID
+CaseInit(
+    VOID
+)
+{
+    static TEST_SOURCE source;
+
+    SourceInit(&source, 1);
+    TEST_CHECK(!NT_SUCCESS(OwInit(&(source.Window), 0, SourceFetch, SourceRun, &source)));
+    TEST_CHECK(!NT_SUCCESS(OwInit(&(source.Window), ORDER_WINDOW_SLOTS + 1, SourceFetch, SourceRun, &source)));
+    TEST_CHECK(NT_SUCCESS(OwInit(&(source.Window), ORDER_WINDOW_SLOTS, SourceFetch, SourceRun, &source)));
+
+    // nothing to fetch: nothing runs
+    OwPump(&(source.Window));
+    TEST_CHECK((source.NextExpected == 1) && (OwBacklog(&(source.Window)) == 0));
+    SourceCleanup(&source);
+}
+
+//
+// More waiting than the window holds, pumped once: it refills as it runs.
+//
+static
+VOID
+CaseBurstBeyondDepth(
+    VOID
+)
+{
+    static TEST_SOURCE source;
+
+    SourceInit(&source, 100);
+    TEST_CHECK(NT_SUCCESS(OwInit(&(source.Window), 4, SourceFetch, SourceRun, &source)));
+
+    for (ULONG i = 0; i < 100; ++i) {
+        SourceAdd(&source);
+    }
+    OwPump(&(source.Window));
+
+    TEST_CHECK(source.NextExpected == 101);
+    TEST_CHECK(source.MaxBacklog <= 4);
+    TEST_CHECK(OwBacklog(&(source.Window)) == 0);
+    SourceCleanup(&source);
+}
+
+//
+// Threads adding items and pumping, as URBs arriving on several CPUs do.
+//
+#define PUMP_THREADS    4
+#define PUMP_ITEMS      TEST_ROUNDS(100000)
+#define PUMP_DEPTH      8
+
+static
+VOID
+PumpThread(
+    _In_ ULONG Index,
+    _In_opt_ PVOID Context
+)
+{
+    PTEST_SOURCE source = (PTEST_SOURCE)Context;
+
+    UNREFERENCED_PARAMETER(Index);
+
+    for (LONG i = 0; i < PUMP_ITEMS; ++i) {
+        SourceAdd(source);
+        OwPump(&(source->Window));
+    }
+}
+
+static
+VOID
+CaseThreadsPumping(
+    VOID
+)
+{
+    static TEST_SOURCE source;
+
+    SourceInit(&source, PUMP_THREADS * PUMP_ITEMS);
+    TEST_CHECK(NT_SUCCESS(OwInit(&(source.Window), PUMP_DEPTH, SourceFetch, SourceRun, &source)));
+
+    TestRunThreads(PUMP_THREADS, PumpThread, &source);
+
+    TEST_CHECK(source.NextExpected == (PUMP_THREADS * PUMP_ITEMS) + 1);
+    TEST_CHECK(source.MaxBacklog <= PUMP_DEPTH);
+    TEST_CHECK(OwBacklog(&(source.Window)) == 0);
+    printf("    %u items taken ahead at most\n", source.MaxBacklog);
+    SourceCleanup(&source);
+}
+
+
+static const TEST_CASE Cases[] =
+{
+    TEST_CASE_ENTRY(CaseInit),
+    TEST_CASE_ENTRY(CaseBurstBeyondDepth),
+    TEST_CASE_ENTRY(CaseThreadsPumping),
+};
+
+TEST_MAIN(Cases)
@@ -0,0 +1,163 @@
+/*++
+
+Module Name:
+
+PatternTest.c
+
+Abstract:
+
+    Tests of the test pattern generator: the vector path against the
+    scalar one, byte for byte, for every pattern; each pattern's own
+    definition; and fills of any length continuing one stream.
+
+Environment:
+
+    User mode; see Test.h
+
+--*/
+
+#include "Pattern.h"
+#include "Test.h"
+
+
+#define STREAM_BYTES    (TEST_ROUNDS(4 * 1024 * 1024) & ~4095)
+#define PACKET          512
+#define SEED            0x0123456789ABCDEFull
+
+static UCHAR g_Stream[2][4 * 1024 * 1024];
+
+//
+// STREAM_BYTES of Kind into g_Stream[Which], in fills of random lengths
+// drawn from Seed (or in one, for a Seed of 0).
+//
+static
+VOID
+FillStream(
+    _In_ PATTERN_KIND Kind,
+    _In_ BOOLEAN bUseSimd,
+    _In_ unsigned Seed,
+    _In_ ULONG Which
+)
+{
+    PATTERN_GENERATOR gen;
+    SIZE_T done = 0;
+
+    TEST_CHECK(NT_SUCCESS(PatternInit(&gen, Kind, PACKET, SEED)));
+    gen.bUseSimd = bUseSimd;
+
+    while (done < STREAM_BYTES) {
+        SIZE_T length = STREAM_BYTES - done;
+
+        if (Seed != 0) {
+            Seed = (Seed * 1103515245) + 12345;
+            if (length > 1 + ((Seed >> 8) % 5000)) {
+                length = 1 + ((Seed >> 8) % 5000);
+            }
+        }
+        PatternFill(&gen, &g_Stream[Which][done], length);
+        done += length;
+    }
+    TEST_CHECK(gen.Offset == STREAM_BYTES);
+}
+
+static
+VOID
+CaseScalarMatchesSimd(
+    VOID
+)
+{
+    for (ULONG kind = PatternZeros; kind < PatternKindMax; ++kind) {
+        FillStream((PATTERN_KIND)kind, FALSE, 0, 0);
+        FillStream((PATTERN_KIND)kind, PATTERN_HAVE_SIMD, 0, 1);
+        TEST_CHECK(memcmp(g_Stream[0], g_Stream[1], STREAM_BYTES) == 0);
+
+        // and in pieces, starting and stopping anywhere in a vector
+        FillStream((PATTERN_KIND)kind, PATTERN_HAVE_SIMD, 7, 1);
+        TEST_CHECK(memcmp(g_Stream[0], g_Stream[1], STREAM_BYTES) == 0);
+        FillStream((PATTERN_KIND)kind, FALSE, 11, 1);
+        TEST_CHECK(memcmp(g_Stream[0], g_Stream[1], STREAM_BYTES) == 0);
+    }
+    printf("    vector path: %s\n", PATTERN_HAVE_SIMD ? "yes" : "none on this target, scalar only");
+}
+
+//
+// What each pattern is defined to be, checked on the stream itself.
+//
+#define BIT_AT(__s, __n)    (((__s)[(__n) / 8] >> (7 - ((__n) % 8))) & 1)
+
+static
+VOID
+CaseDefinitions(
+    VOID
+)
+{
+    PATTERN_GENERATOR a;
+    PATTERN_GENERATOR b;
+    UCHAR first[64];
+
+    FillStream(PatternZeros, PATTERN_HAVE_SIMD, 3, 0);
+    for (ULONG i = 0; i < STREAM_BYTES; ++i) {
+        TEST_CHECK(g_Stream[0][i] == 0);
+    }
+
+    FillStream(PatternCounter, PATTERN_HAVE_SIMD, 3, 0);
+    for (ULONG i = 0; i < STREAM_BYTES; i += 4) {
+        ULONG word = (ULONG)g_Stream[0][i] | ((ULONG)g_Stream[0][i + 1] << 8) |
+                     ((ULONG)g_Stream[0][i + 2] << 16) | ((ULONG)g_Stream[0][i + 3] << 24);
+
+        TEST_CHECK(word == i / 4);
+    }
+
+    FillStream(PatternMod63, PATTERN_HAVE_SIMD, 3, 0);
+    for (ULONG i = 0; i < STREAM_BYTES; ++i) {
+        TEST_CHECK(g_Stream[0][i] == (UCHAR)((i % PACKET) % 63));
+    }
+
+    // each bit the xor of the ones 28 and 31 before it, most significant bit first
+    FillStream(PatternPrbs31, PATTERN_HAVE_SIMD, 3, 0);
+    for (ULONG n = 31; n < 8 * STREAM_BYTES; ++n) {
+        TEST_CHECK(BIT_AT(g_Stream[0], n) == (BIT_AT(g_Stream[0], n - 28) ^ BIT_AT(g_Stream[0], n - 31)));
+    }
+
+    // Random: the seed picks the stream, and a reset starts it over
+    TEST_CHECK(NT_SUCCESS(PatternInit(&a, PatternRandom, PACKET, SEED)));
+    TEST_CHECK(NT_SUCCESS(PatternInit(&b, PatternRandom, PACKET, SEED + 1)));
+    PatternFill(&a, first, sizeof(first));
+    PatternFill(&b, g_Stream[0], sizeof(first));
+    TEST_CHECK(memcmp(first, g_Stream[0], sizeof(first)) != 0);
+    PatternFill(&a, g_Stream[0], 100);
+    PatternReset(&a);
+    PatternFill(&a, g_Stream[0], sizeof(first));
+    TEST_CHECK((memcmp(first, g_Stream[0], sizeof(first)) == 0) && (a.Offset == sizeof(first)));
+
+    TEST_CHECK(!NT_SUCCESS(PatternInit(&a, (PATTERN_KIND)0, PACKET, 0)));
+    TEST_CHECK(!NT_SUCCESS(PatternInit(&a, PatternKindMax, PACKET, 0)));
+    TEST_CHECK(!NT_SUCCESS(PatternInit(&a, PatternCounter, 0, 0)));
+    TEST_CHECK(!NT_SUCCESS(PatternInit(&a, PatternCounter, PATTERN_MAX_PACKET + 1, 0)));
+}
+
+//
+// The host sees the same bytes whatever its transfer sizes are.
+//
+static
+VOID
+CaseFillLengths(
+    VOID
+)
+{
+    for (ULONG kind = PatternZeros; kind < PatternKindMax; ++kind) {
+        FillStream((PATTERN_KIND)kind, PATTERN_HAVE_SIMD, 0, 0);
+        FillStream((PATTERN_KIND)kind, PATTERN_HAVE_SIMD, 5, 1);
+        TEST_CHECK(memcmp(g_Stream[0], g_Stream[1], STREAM_BYTES) == 0);
+    }
+}
+
+
+static const TEST_CASE Cases[] =
+{
+    TEST_CASE_ENTRY(CaseScalarMatchesSimd),
+    TEST_CASE_ENTRY(CaseDefinitions),
+    TEST_CASE_ENTRY(CaseFillLengths),
+};
+
+TEST_MAIN(Cases)
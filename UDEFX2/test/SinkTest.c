@@ -0,0 +1,128 @@
+/*++
+
+Module Name:
+
+SinkTest.c
+
+Abstract:
+
+    Tests of the verifying data sink: the offset of the first bad byte in
+    the whole stream, the stream kept in step past a bad transfer, and
+    CRC-32C trailers.
+
+Environment:
+
+    User mode; see Test.h
+
+--*/
+
+#include "Sink.h"
+#include "Test.h"
+
+
+#define PACKET          512
+#define SEED            42
+
+//
+// Transfers of random lengths, as the host writes them, from a generator
+// of the same kind and seed; one byte of one of them is wrong.
+//
+static
+VOID
+CasePatternFirstMismatch(
+    VOID
+)
+{
+    static SINK sink;
+    static UCHAR transfer[16 * 1024];
+    PATTERN_GENERATOR host;
+    ULONG64 stream = 0;
+    ULONG64 bad[2] = { 0, 0 };
+    unsigned seed = 1;
+
+    for (ULONG kind = PatternZeros; kind < PatternKindMax; ++kind) {
+        TEST_CHECK(NT_SUCCESS(SinkInit(&sink, SinkPattern, (PATTERN_KIND)kind, PACKET, SEED)));
+        TEST_CHECK(NT_SUCCESS(PatternInit(&host, (PATTERN_KIND)kind, PACKET, SEED)));
+        stream = 0;
+
+        for (ULONG t = 0; t < 200; ++t) {
+            ULONG length;
+
+            seed = (seed * 1103515245) + 12345;
+            length = 1 + ((seed >> 8) % sizeof(transfer));
+            PatternFill(&host, transfer, length);
+
+            // transfers 50 and 120 have a bad byte, somewhere past the first chunk
+            if ((t == 50) || (t == 120)) {
+                ULONG at = (length > SINK_CHUNK) ? SINK_CHUNK + ((seed >> 4) % (length - SINK_CHUNK)) : length - 1;
+
+                transfer[at] ^= 0x10;
+                bad[t == 120] = stream + at;
+                TEST_CHECK(!SinkConsume(&sink, transfer, length));
+            } else {
+                TEST_CHECK(SinkConsume(&sink, transfer, length));
+            }
+            stream += length;
+        }
+
+        TEST_CHECK((sink.Stats.Transfers == 200) && ((ULONG64)sink.Stats.Bytes == stream));
+        TEST_CHECK(sink.Stats.Errors == 2);
+        TEST_CHECK((ULONG64)sink.Stats.FirstErrorOffset == bad[0]);
+    }
+
+    TEST_CHECK(!NT_SUCCESS(SinkInit(&sink, SinkModeMax, PatternCounter, PACKET, SEED)));
+    TEST_CHECK(!NT_SUCCESS(SinkInit(&sink, SinkPattern, PatternKindMax, PACKET, SEED)));
+}
+
+//
+// Each transfer ends with the CRC-32C of what comes before it; a bad one
+// is reported at its start in the stream.
+//
+static
+VOID
+CaseCrcTrailer(
+    VOID
+)
+{
+    static SINK sink;
+    UCHAR transfer[100];
+    ULONG crc;
+
+    TEST_CHECK(NT_SUCCESS(SinkInit(&sink, SinkCrc32c, PatternZeros, PACKET, 0)));
+    for (ULONG i = 0; i < sizeof(transfer); ++i) {
+        transfer[i] = (UCHAR)(i * 7);
+    }
+    crc = Crc32c(transfer, 96);
+    transfer[96] = (UCHAR)crc;
+    transfer[97] = (UCHAR)(crc >> 8);
+    transfer[98] = (UCHAR)(crc >> 16);
+    transfer[99] = (UCHAR)(crc >> 24);
+
+    TEST_CHECK(SinkConsume(&sink, transfer, 100));
+    TEST_CHECK(SinkConsume(&sink, transfer, 100));
+    transfer[10] ^= 1;
+    TEST_CHECK(!SinkConsume(&sink, transfer, 100));
+    transfer[10] ^= 1;
+    TEST_CHECK(SinkConsume(&sink, transfer, 100));
+
+    // too short to hold a trailer
+    TEST_CHECK(!SinkConsume(&sink, transfer, SINK_CRC_TRAILER - 1));
+
+    TEST_CHECK((sink.Stats.Transfers == 5) && (sink.Stats.Errors == 2));
+    TEST_CHECK(sink.Stats.FirstErrorOffset == 200);
+
+    // a discarding sink only counts
+    TEST_CHECK(NT_SUCCESS(SinkInit(&sink, SinkDiscard, PatternZeros, PACKET, 0)));
+    TEST_CHECK(SinkConsume(&sink, transfer, 3));
+    TEST_CHECK((sink.Stats.Bytes == 3) && (sink.Stats.Errors == 0));
+    TEST_CHECK((ULONG64)sink.Stats.FirstErrorOffset == SINK_NO_ERROR);
+}
+
+
+static const TEST_CASE Cases[] =
+{
+    TEST_CASE_ENTRY(CasePatternFirstMismatch),
+    TEST_CASE_ENTRY(CaseCrcTrailer),
+};
+
+TEST_MAIN(Cases)
@@ -0,0 +1,174 @@
+/*++
+
+Module Name:
+
+SlabTest.c
+
+Abstract:
+
+    Tests of the size-class slab cache: which class a size lands in, blocks
+    coming back off the free lists, what happens once a free list is full,
+    and threads allocating and freeing at once.
+
+Environment:
+
+    User mode; see Test.h
+
+--*/
+
+#include "Slab.h"
+#include "Test.h"
+
+
+#define HEADER_SIZE     16          // SLAB_HEADER, in front of every block
+
+//
+// Sizes at the edge of each class: the largest that fits, and one more,
+// which takes the next class (or the OS, past the last).
+//
+static
+VOID
+CaseSizeClasses(
+    VOID
+)
+{
+    static SLAB slab;
+
+    TEST_CHECK(NT_SUCCESS(SlabInit(&slab)));
+
+    for (ULONG c = 0; c < SLAB_NUM_CLASSES; ++c) {
+        SIZE_T fits = (((SIZE_T)1) << (SLAB_MIN_CLASS_SHIFT + c)) - HEADER_SIZE;
+        PUCHAR a = (PUCHAR)SlabAlloc(&slab, fits);
+        PUCHAR b;
+
+        TEST_CHECK(a != NULL);
+        memset(a, 0xA5, fits);
+        SlabFree(&slab, a);
+
+        // the same class hands the block back, the next one does not
+        b = (PUCHAR)SlabAlloc(&slab, fits);
+        TEST_CHECK(b == a);
+        SlabFree(&slab, b);
+        b = (PUCHAR)SlabAlloc(&slab, fits + 1);
+        TEST_CHECK((b != NULL) && (b != a));
+        memset(b, 0x5A, fits + 1);
+        SlabFree(&slab, b);
+    }
+
+    // the one past the last class was the only oversized request, and went to the OS both ways
+    TEST_CHECK(slab.Stats.Oversized == 1);
+    TEST_CHECK(slab.Stats.Allocs == (2 * SLAB_NUM_CLASSES) + (SLAB_NUM_CLASSES - 1));
+    TEST_CHECK(slab.Stats.Recycled == (2 * SLAB_NUM_CLASSES) - 1);
+    TEST_CHECK(slab.Stats.OsAllocs == SLAB_NUM_CLASSES + 1);
+    TEST_CHECK(slab.Stats.OsFrees == 1);
+
+    // a size that would overflow with the header is refused
+    TEST_CHECK(SlabAlloc(&slab, ~(SIZE_T)0) == NULL);
+    SlabDestroy(&slab);
+}
+
+//
+// A free list holds SLAB_CLASS_DEPTH blocks; those freed beyond that go
+// back to the OS, and the allocations beyond that come from it again.
+//
+#define EXHAUST_BLOCKS  (SLAB_CLASS_DEPTH + 8)
+
+static
+VOID
+CaseExhaustion(
+    VOID
+)
+{
+    static SLAB slab;
+    static PVOID blocks[EXHAUST_BLOCKS];
+
+    TEST_CHECK(NT_SUCCESS(SlabInit(&slab)));
+
+    for (ULONG round = 0; round < 2; ++round) {
+        for (ULONG i = 0; i < EXHAUST_BLOCKS; ++i) {
+            blocks[i] = SlabAlloc(&slab, 100);
+            TEST_CHECK(blocks[i] != NULL);
+            memset(blocks[i], (int)i, 100);
+        }
+        for (ULONG i = 0; i < EXHAUST_BLOCKS; ++i) {
+            TEST_CHECK(((PUCHAR)blocks[i])[99] == (UCHAR)i);
+            SlabFree(&slab, blocks[i]);
+        }
+    }
+
+    TEST_CHECK(slab.Stats.Allocs == 2 * EXHAUST_BLOCKS);
+    TEST_CHECK(slab.Stats.Recycled == SLAB_CLASS_DEPTH);
+    TEST_CHECK(slab.Stats.OsAllocs == EXHAUST_BLOCKS + (EXHAUST_BLOCKS - SLAB_CLASS_DEPTH));
+    TEST_CHECK(slab.Stats.OsFrees == 2 * (EXHAUST_BLOCKS - SLAB_CLASS_DEPTH));
+    TEST_CHECK(slab.Stats.Oversized == 0);
+    SlabDestroy(&slab);
+}
+
+//
+// Threads allocating blocks of several classes, writing them, and freeing
+// them, a few held at a time: a block is never handed to two at once.
+//
+#define THREADS         4
+#define THREAD_ROUNDS   TEST_ROUNDS(200000)
+#define THREAD_HELD     8
+
+static
+VOID
+SlabThread(
+    _In_ ULONG Index,
+    _In_opt_ PVOID Context
+)
+{
+    PSLAB slab = (PSLAB)Context;
+    PULONG held[THREAD_HELD] = { NULL };
+    unsigned seed = Index + 1;
+
+    for (ULONG i = 0; i < THREAD_ROUNDS; ++i) {
+        ULONG slot = i % THREAD_HELD;
+        SIZE_T size;
+
+        if (held[slot] != NULL) {
+            TEST_CHECK((held[slot][0] == Index) && (held[slot][1] == i - THREAD_HELD));
+            SlabFree(slab, held[slot]);
+        }
+
+        seed = (seed * 1103515245) + 12345;
+        size = 8 + ((seed >> 16) % 1000);
+        held[slot] = (PULONG)SlabAlloc(slab, size);
+        TEST_CHECK(held[slot] != NULL);
+        held[slot][0] = Index;
+        held[slot][1] = i;
+    }
+
+    for (ULONG slot = 0; slot < THREAD_HELD; ++slot) {
+        SlabFree(slab, held[slot]);
+    }
+}
+
+static
+VOID
+CaseThreads(
+    VOID
+)
+{
+    static SLAB slab;
+
+    TEST_CHECK(NT_SUCCESS(SlabInit(&slab)));
+    TestRunThreads(THREADS, SlabThread, &slab);
+
+    TEST_CHECK(slab.Stats.Allocs == (LONG64)THREADS * THREAD_ROUNDS);
+    TEST_CHECK(slab.Stats.OsAllocs - slab.Stats.OsFrees <= SLAB_NUM_CLASSES * SLAB_CLASS_DEPTH);
+    printf("    %.2f%% of allocations recycled\n",
+           100.0 * (double)slab.Stats.Recycled / (double)slab.Stats.Allocs);
+    SlabDestroy(&slab);
+}
+
+
+static const TEST_CASE Cases[] =
+{
+    TEST_CASE_ENTRY(CaseSizeClasses),
+    TEST_CASE_ENTRY(CaseExhaustion),
+    TEST_CASE_ENTRY(CaseThreads),
+};
+
+TEST_MAIN(Cases)
@@ -0,0 +1,551 @@
+/*++
+
+Module Name:
+
+StripeTest.c
+
+Abstract:
+
+    Tests of striping: chunk layout, reassembly of chunks arriving out of
+    order and of messages completing out of order, the reassembly window,
+    malformed chunks, unsequenced messages, messages Deliver refuses, and
+    chunks coming in on several pipes at once.
+
+Environment:
+
+    User mode; see Test.h
+
+--*/
+
+#include "Stripe.h"
+#include "Test.h"
+
+
+#define TEST_CHUNK_SIZE     512
+#define TEST_MAX_MESSAGE    4096
+#define TEST_UNSEQUENCED    0xFFFFFFFF
+
+typedef struct _TEST_CHUNK
+{
+    ULONG   Message;
+    ULONG   Length;
+    UCHAR   Data[TEST_CHUNK_SIZE];
+} TEST_CHUNK, *PTEST_CHUNK;
+
+//
+// Message n is its number, then bytes derived from it; its length varies
+// from one chunk to several.
+//
+static
+ULONG
+MessageLength(
+    _In_ ULONG Message
+)
+{
+    return 4 + ((Message * Message * Message * 37) % 3000);
+}
+
+static
+VOID
+MessageBuild(
+    _In_ ULONG Message,
+    _Out_writes_bytes_(TEST_MAX_MESSAGE) PUCHAR Data
+)
+{
+    ULONG length = MessageLength(Message);
+
+    memcpy(Data, &Message, 4);
+    for (ULONG i = 4; i < length; ++i) {
+        Data[i] = (UCHAR)(Message + i);
+    }
+}
+
+//
+// Cuts messages 0 .. Count - 1 into chunks, in order; returns how many.
+//
+static
+ULONG
+CutMessages(
+    _Inout_ PSTRIPE_SPLITTER Splitter,
+    _In_ ULONG Count,
+    _Out_ PTEST_CHUNK *Chunks
+)
+{
+    static UCHAR data[TEST_MAX_MESSAGE];
+    ULONG total = 0;
+    ULONG n = 0;
+
+    for (ULONG m = 0; m < Count; ++m) {
+        total += StripeChunkCount(Splitter, MessageLength(m));
+    }
+    *Chunks = (PTEST_CHUNK)OsAllocate(total * sizeof(TEST_CHUNK));
+    TEST_CHECK(*Chunks != NULL);
+
+    for (ULONG m = 0; m < Count; ++m) {
+        ULONG message = StripeBegin(Splitter);
+        ULONG length = MessageLength(message);
+
+        TEST_CHECK(message == m);
+        MessageBuild(message, data);
+        for (ULONG i = 0; i < StripeChunkCount(Splitter, length); ++i, ++n) {
+            (*Chunks)[n].Message = message;
+            (*Chunks)[n].Length = StripeChunk(Splitter, message, 0, data, length, i, (*Chunks)[n].Data);
+        }
+    }
+    return n;
+}
+
+
+typedef struct _TEST_SINK
+{
+    volatile LONG   Delivered;      // sequenced messages
+    volatile LONG   Unsequenced;
+    volatile LONG   Inside;         // sequenced deliveries in progress
+    volatile LONG   Calls;
+    volatile LONG   Room;           // deliveries accepted before refusing; -1 for no limit
+    LONG            RefuseEvery;    // refuse every n-th call too; 0 for never
+    volatile LONG   Refusals;
+} TEST_SINK, *PTEST_SINK;
+
+static
+NTSTATUS
+SinkDeliver(
+    _In_ PVOID Context,
+    _In_reads_bytes_(Length) const UCHAR *Message,
+    _In_ ULONG Length
+)
+{
+    PTEST_SINK sink = (PTEST_SINK)Context;
+    LONG call = InterlockedIncrement(&(sink->Calls));
+    ULONG number;
+
+    TEST_CHECK(Length >= 4);
+    memcpy(&number, Message, 4);
+
+    if (number == TEST_UNSEQUENCED) {
+        InterlockedIncrement(&(sink->Unsequenced));
+        return STATUS_SUCCESS;
+    }
+
+    TEST_CHECK(InterlockedIncrement(&(sink->Inside)) == 1);
+
+    if ((ReadAcquire(&(sink->Room)) == 0) ||
+        ((sink->RefuseEvery != 0) && ((call % sink->RefuseEvery) == 0))) {
+        InterlockedIncrement(&(sink->Refusals));
+        InterlockedDecrement(&(sink->Inside));
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    // whole, and in the order they were cut
+    TEST_CHECK(number == (ULONG)ReadNoFence(&(sink->Delivered)));
+    TEST_CHECK(Length == MessageLength(number));
+    for (ULONG i = 4; i < Length; ++i) {
+        TEST_CHECK(Message[i] == (UCHAR)(number + i));
+    }
+
+    if (ReadNoFence(&(sink->Room)) > 0) {
+        InterlockedDecrement(&(sink->Room));
+    }
+    InterlockedDecrement(&(sink->Inside));
+    WriteRelease(&(sink->Delivered), (LONG)number + 1);
+    return STATUS_SUCCESS;
+}
+
+static
+VOID
+SinkInit(
+    _Out_ PTEST_SINK Sink
+)
+{
+    memset(Sink, 0, sizeof(*Sink));
+    Sink->Room = -1;
+}
+
+static
+NTSTATUS
+Accept(
+    _Inout_ PSTRIPE_REASSEMBLER Reassembler,
+    _In_ const TEST_CHUNK *Chunk
+)
+{
+    return StripeAccept(Reassembler, Chunk->Data, Chunk->Length);
+}
+
+
+static
+VOID
+CaseChunkLayout(
+    VOID
+)
+{
+    STRIPE_SPLITTER splitter;
+    UCHAR data[1000];
+    UCHAR chunk[TEST_CHUNK_SIZE];
+    ULONG payload = TEST_CHUNK_SIZE - STRIPE_HEADER_SIZE;
+    ULONG length;
+
+    TEST_CHECK(!NT_SUCCESS(StripeSplitterInit(&splitter, STRIPE_HEADER_SIZE)));
+    TEST_CHECK(NT_SUCCESS(StripeSplitterInit(&splitter, TEST_CHUNK_SIZE)));
+    TEST_CHECK(sizeof(STRIPE_HEADER) == STRIPE_HEADER_SIZE);
+
+    TEST_CHECK(StripeChunkCount(&splitter, 0) == 1);
+    TEST_CHECK(StripeChunkCount(&splitter, payload) == 1);
+    TEST_CHECK(StripeChunkCount(&splitter, payload + 1) == 2);
+    TEST_CHECK(StripeChunkCount(&splitter, sizeof(data)) == 3);
+
+    for (ULONG i = 0; i < sizeof(data); ++i) {
+        data[i] = (UCHAR)i;
+    }
+    TEST_CHECK(StripeBegin(&splitter) == 0);
+    TEST_CHECK(StripeBegin(&splitter) == 1);
+
+    length = StripeChunk(&splitter, 1, 0, data, sizeof(data), 1, chunk);
+    TEST_CHECK(length == STRIPE_HEADER_SIZE + payload);
+    TEST_CHECK((chunk[0] == STRIPE_VERSION) && (chunk[1] == 0) && (chunk[2] == STRIPE_HEADER_SIZE) && (chunk[3] == 0));
+    TEST_CHECK((chunk[4] == 1) && (chunk[8] == (UCHAR)payload) && (chunk[9] == (UCHAR)(payload >> 8)));
+    TEST_CHECK((chunk[12] == (UCHAR)sizeof(data)) && (chunk[13] == (UCHAR)(sizeof(data) >> 8)));
+    TEST_CHECK(memcmp(chunk + STRIPE_HEADER_SIZE, data + payload, payload) == 0);
+
+    length = StripeChunk(&splitter, 1, 0, data, sizeof(data), 2, chunk);
+    TEST_CHECK(length == STRIPE_HEADER_SIZE + sizeof(data) - (2 * payload));
+    TEST_CHECK(chunk[1] == STRIPE_FLAG_LAST);
+
+    length = StripeChunk(&splitter, 0, STRIPE_FLAG_UNSEQUENCED, data, 0, 0, chunk);
+    TEST_CHECK((length == STRIPE_HEADER_SIZE) && (chunk[1] == (STRIPE_FLAG_UNSEQUENCED | STRIPE_FLAG_LAST)));
+}
+
+//
+// Chunks of each message shuffled, and messages completing out of order:
+// they still come out whole and in order.
+//
+static
+VOID
+CaseOutOfOrder(
+    VOID
+)
+{
+    STRIPE_SPLITTER splitter;
+    STRIPE_REASSEMBLER reassembler;
+    TEST_SINK sink;
+    PTEST_CHUNK chunks;
+    ULONG count;
+    ULONG messages = 3 * STRIPE_WINDOW;
+    unsigned seed = 7;
+
+    SinkInit(&sink);
+    TEST_CHECK(NT_SUCCESS(StripeSplitterInit(&splitter, TEST_CHUNK_SIZE)));
+    TEST_CHECK(NT_SUCCESS(StripeReassemblerInit(&reassembler, TEST_MAX_MESSAGE, SinkDeliver, &sink)));
+    count = CutMessages(&splitter, messages, &chunks);
+
+    // shuffle within runs of chunks spanning less than the window
+    for (ULONG start = 0; start < count; start += 48) {
+        ULONG run = ((count - start) < 48) ? (count - start) : 48;
+
+        for (ULONG i = run - 1; i > 0; --i) {
+            ULONG j;
+            TEST_CHUNK swap;
+
+            seed = (seed * 1103515245) + 12345;
+            j = (seed >> 16) % (i + 1);
+            swap = chunks[start + i];
+            chunks[start + i] = chunks[start + j];
+            chunks[start + j] = swap;
+        }
+    }
+
+    for (ULONG i = 0; i < count; ++i) {
+        TEST_CHECK(NT_SUCCESS(Accept(&reassembler, &(chunks[i]))));
+    }
+    TEST_CHECK(sink.Delivered == (LONG)messages);
+    TEST_CHECK(reassembler.Stats.Chunks == count);
+    TEST_CHECK((reassembler.Stats.Messages == messages) && (reassembler.Stats.Rejected == 0));
+
+    StripeReassemblerCleanup(&reassembler);
+    OsFree(chunks);
+}
+
+//
+// A chunk more than STRIPE_WINDOW messages ahead is rejected; one just
+// inside is held until the messages before it are in.
+//
+static
+VOID
+CaseWindow(
+    VOID
+)
+{
+    STRIPE_SPLITTER splitter;
+    STRIPE_REASSEMBLER reassembler;
+    TEST_SINK sink;
+    PTEST_CHUNK chunks;
+    ULONG count;
+    ULONG first[STRIPE_WINDOW + 2];  // first chunk of each message
+    ULONG n = 0;
+
+    SinkInit(&sink);
+    TEST_CHECK(NT_SUCCESS(StripeSplitterInit(&splitter, TEST_CHUNK_SIZE)));
+    TEST_CHECK(NT_SUCCESS(StripeReassemblerInit(&reassembler, TEST_MAX_MESSAGE, SinkDeliver, &sink)));
+    count = CutMessages(&splitter, STRIPE_WINDOW + 1, &chunks);
+    for (ULONG i = 0; i < count; ++i) {
+        if ((i == 0) || (chunks[i].Message != chunks[i - 1].Message)) {
+            first[n++] = i;
+        }
+    }
+    first[n] = count;
+
+    // message STRIPE_WINDOW is one too far while message 0 is not in
+    TEST_CHECK(Accept(&reassembler, &(chunks[first[STRIPE_WINDOW]])) == STATUS_INVALID_PARAMETER);
+    TEST_CHECK(reassembler.Stats.Rejected == 1);
+
+    // the last message inside the window, then all the others but message 0
+    for (ULONG m = STRIPE_WINDOW; m-- > 1; ) {
+        for (ULONG i = first[m]; i < first[m + 1]; ++i) {
+            TEST_CHECK(NT_SUCCESS(Accept(&reassembler, &(chunks[i]))));
+        }
+    }
+    TEST_CHECK(sink.Delivered == 0);
+
+    for (ULONG i = first[0]; i < first[1]; ++i) {
+        TEST_CHECK(NT_SUCCESS(Accept(&reassembler, &(chunks[i]))));
+    }
+    TEST_CHECK(sink.Delivered == STRIPE_WINDOW);
+
+    // now it is in: the window has moved on
+    for (ULONG i = first[STRIPE_WINDOW]; i < count; ++i) {
+        TEST_CHECK(NT_SUCCESS(Accept(&reassembler, &(chunks[i]))));
+    }
+    TEST_CHECK(sink.Delivered == STRIPE_WINDOW + 1);
+
+    // behind the window: rejected too
+    TEST_CHECK(Accept(&reassembler, &(chunks[0])) == STATUS_INVALID_PARAMETER);
+
+    StripeReassemblerCleanup(&reassembler);
+    OsFree(chunks);
+}
+
+static
+VOID
+CaseMalformed(
+    VOID
+)
+{
+    STRIPE_SPLITTER splitter;
+    STRIPE_REASSEMBLER reassembler;
+    TEST_SINK sink;
+    UCHAR data[TEST_MAX_MESSAGE + 1] = { 0 };
+    UCHAR chunk[TEST_CHUNK_SIZE];
+    ULONG length;
+
+    SinkInit(&sink);
+    TEST_CHECK(NT_SUCCESS(StripeSplitterInit(&splitter, TEST_CHUNK_SIZE)));
+    TEST_CHECK(NT_SUCCESS(StripeReassemblerInit(&reassembler, TEST_MAX_MESSAGE, SinkDeliver, &sink)));
+
+    length = StripeChunk(&splitter, 0, 0, data, 100, 0, chunk);
+    TEST_CHECK(StripeAccept(&reassembler, chunk, STRIPE_HEADER_SIZE - 1) == STATUS_INVALID_PARAMETER);
+
+    chunk[0] = STRIPE_VERSION + 1;
+    TEST_CHECK(StripeAccept(&reassembler, chunk, length) == STATUS_INVALID_PARAMETER);
+    chunk[0] = STRIPE_VERSION;
+
+    // a payload running past the message's total
+    TEST_CHECK(StripeAccept(&reassembler, chunk, length + 1) == STATUS_INVALID_PARAMETER);
+
+    // too big a message
+    length = StripeChunk(&splitter, 0, 0, data, sizeof(data), 0, chunk);
+    TEST_CHECK(StripeAccept(&reassembler, chunk, length) == STATUS_INVALID_PARAMETER);
+
+    TEST_CHECK((reassembler.Stats.Rejected == 4) && (sink.Calls == 0));
+    StripeReassemblerCleanup(&reassembler);
+}
+
+//
+// Unsequenced messages go straight on, ahead of sequenced ones held.
+//
+static
+VOID
+CaseUnsequenced(
+    VOID
+)
+{
+    STRIPE_SPLITTER splitter;
+    STRIPE_REASSEMBLER reassembler;
+    TEST_SINK sink;
+    PTEST_CHUNK chunks;
+    UCHAR chunk[TEST_CHUNK_SIZE];
+    ULONG marker = TEST_UNSEQUENCED;
+    ULONG length;
+
+    SinkInit(&sink);
+    TEST_CHECK(NT_SUCCESS(StripeSplitterInit(&splitter, TEST_CHUNK_SIZE)));
+    TEST_CHECK(NT_SUCCESS(StripeReassemblerInit(&reassembler, TEST_MAX_MESSAGE, SinkDeliver, &sink)));
+    (VOID)CutMessages(&splitter, 2, &chunks);
+
+    TEST_CHECK(NT_SUCCESS(Accept(&reassembler, &(chunks[1]))));
+    length = StripeChunk(&splitter, 12345, STRIPE_FLAG_UNSEQUENCED, (const UCHAR *)&marker, sizeof(marker), 0, chunk);
+    TEST_CHECK(NT_SUCCESS(StripeAccept(&reassembler, chunk, length)));
+    TEST_CHECK((sink.Unsequenced == 1) && (sink.Delivered == 0));
+    TEST_CHECK(NT_SUCCESS(Accept(&reassembler, &(chunks[0]))));
+    TEST_CHECK(sink.Delivered == 2);
+
+    StripeReassemblerCleanup(&reassembler);
+    OsFree(chunks);
+}
+
+//
+// A refused message is bounced with the chunk that completed it, or held
+// if it was whole already, and goes on once Deliver has room again.
+//
+static
+VOID
+CaseRefused(
+    VOID
+)
+{
+    STRIPE_SPLITTER splitter;
+    STRIPE_REASSEMBLER reassembler;
+    TEST_SINK sink;
+    PTEST_CHUNK chunks;
+    ULONG count;
+    ULONG first[5];
+    ULONG n = 0;
+
+    SinkInit(&sink);
+    TEST_CHECK(NT_SUCCESS(StripeSplitterInit(&splitter, TEST_CHUNK_SIZE)));
+    TEST_CHECK(NT_SUCCESS(StripeReassemblerInit(&reassembler, TEST_MAX_MESSAGE, SinkDeliver, &sink)));
+
+    // messages 0 and 3 of several chunks, 1 and 2 of one
+    count = CutMessages(&splitter, 4, &chunks);
+    for (ULONG i = 0; i < count; ++i) {
+        if ((i == 0) || (chunks[i].Message != chunks[i - 1].Message)) {
+            first[n++] = i;
+        }
+    }
+    first[n] = count;
+    TEST_CHECK((first[1] - first[0] == 1) && (first[4] - first[3] > 1));
+
+    sink.Room = 0;
+
+    // message 0 would be the straight path: bounced
+    TEST_CHECK(Accept(&reassembler, &(chunks[0])) == STATUS_INSUFFICIENT_RESOURCES);
+    TEST_CHECK(sink.Delivered == 0);
+
+    // 1 and 2 come in whole behind it, then 0 again, refused again
+    TEST_CHECK(NT_SUCCESS(Accept(&reassembler, &(chunks[first[2]]))));
+    TEST_CHECK(NT_SUCCESS(Accept(&reassembler, &(chunks[first[1]]))));
+    TEST_CHECK(Accept(&reassembler, &(chunks[0])) == STATUS_INSUFFICIENT_RESOURCES);
+
+    // room for one: 0 goes, 1 and 2 are held
+    sink.Room = 1;
+    TEST_CHECK(NT_SUCCESS(Accept(&reassembler, &(chunks[0]))));
+    TEST_CHECK(sink.Delivered == 1);
+
+    // the first chunks of 3 come in; its last one is refused
+    for (ULONG i = first[3]; i < count - 1; ++i) {
+        TEST_CHECK(NT_SUCCESS(Accept(&reassembler, &(chunks[i]))));
+    }
+    TEST_CHECK(sink.Delivered == 1);
+
+    sink.Room = 2;
+    StripeRetry(&reassembler);
+    TEST_CHECK(sink.Delivered == 3);
+    TEST_CHECK(Accept(&reassembler, &(chunks[count - 1])) == STATUS_INSUFFICIENT_RESOURCES);
+
+    // sent again, it completes message 3
+    sink.Room = -1;
+    TEST_CHECK(NT_SUCCESS(Accept(&reassembler, &(chunks[count - 1]))));
+    TEST_CHECK(sink.Delivered == 4);
+    TEST_CHECK(reassembler.Stats.Refused == (ULONG64)sink.Refusals);
+
+    StripeReassemblerCleanup(&reassembler);
+    OsFree(chunks);
+}
+
+
+//
+// Chunks dealt out to several pipes, each drained by a thread of its own,
+// with Deliver refusing some messages. A pipe only takes a chunk within
+// the window, as a sender keeping to it would send them; a refused chunk
+// is sent again.
+//
+#define PIPES               4
+#define PIPE_MESSAGES       TEST_ROUNDS(20000)
+
+typedef struct _PIPES_CONTEXT
+{
+    STRIPE_REASSEMBLER Reassembler;
+    TEST_SINK          Sink;
+    PTEST_CHUNK        Chunks;
+    ULONG              Count;
+    volatile LONG64    Resent;
+} PIPES_CONTEXT, *PPIPES_CONTEXT;
+
+static
+VOID
+PipeThread(
+    _In_ ULONG Index,
+    _In_opt_ PVOID Context
+)
+{
+    PPIPES_CONTEXT pipes = (PPIPES_CONTEXT)Context;
+
+    for (ULONG i = Index; i < pipes->Count; i += PIPES) {
+        const TEST_CHUNK *chunk = &(pipes->Chunks[i]);
+        NTSTATUS status;
+
+        while (chunk->Message >= (ULONG)ReadAcquire(&(pipes->Sink.Delivered)) + STRIPE_WINDOW) {
+            // what holds the window back may be a message refused earlier
+            StripeRetry(&(pipes->Reassembler));
+            TestYield();
+        }
+
+        while ((status = Accept(&(pipes->Reassembler), chunk)) == STATUS_INSUFFICIENT_RESOURCES) {
+            InterlockedIncrement64(&(pipes->Resent));
+            TestYield();
+        }
+        TEST_CHECK(NT_SUCCESS(status));
+    }
+}
+
+static
+VOID
+CasePipes(
+    VOID
+)
+{
+    static PIPES_CONTEXT pipes;
+    STRIPE_SPLITTER splitter;
+
+    memset(&pipes, 0, sizeof(pipes));
+    SinkInit(&(pipes.Sink));
+    pipes.Sink.RefuseEvery = 7;
+    TEST_CHECK(NT_SUCCESS(StripeSplitterInit(&splitter, TEST_CHUNK_SIZE)));
+    TEST_CHECK(NT_SUCCESS(StripeReassemblerInit(&(pipes.Reassembler), TEST_MAX_MESSAGE, SinkDeliver, &(pipes.Sink))));
+    pipes.Count = CutMessages(&splitter, PIPE_MESSAGES, &(pipes.Chunks));
+
+    TestRunThreads(PIPES, PipeThread, &pipes);
+
+    while (pipes.Sink.Delivered < PIPE_MESSAGES) {
+        StripeRetry(&(pipes.Reassembler));
+    }
+    TEST_CHECK(pipes.Reassembler.Stats.Rejected == 0);
+    TEST_CHECK(pipes.Reassembler.Stats.Refused == (ULONG64)pipes.Sink.Refusals);
+    printf("    %u chunks, %ld refusals, %lld chunks sent again\n",
+           pipes.Count, (long)pipes.Sink.Refusals, (long long)pipes.Resent);
+
+    StripeReassemblerCleanup(&(pipes.Reassembler));
+    OsFree(pipes.Chunks);
+}
+
+
+static const TEST_CASE Cases[] =
+{
+    TEST_CASE_ENTRY(CaseChunkLayout),
+    TEST_CASE_ENTRY(CaseOutOfOrder),
+    TEST_CASE_ENTRY(CaseWindow),
+    TEST_CASE_ENTRY(CaseMalformed),
+    TEST_CASE_ENTRY(CaseUnsequenced),
+    TEST_CASE_ENTRY(CaseRefused),
+    TEST_CASE_ENTRY(CasePipes),
+};
+
+TEST_MAIN(Cases)
@@ -0,0 +1,176 @@
+/*++
+
+Module Name:
+
+Test.h
+
+Abstract:
+
+    What the user-mode tests of the portable modules share: checks that
+    stop the test at the first failure, thread helpers, and a main that
+    runs the cases of a test by name.
+
+    A test is one executable per module (see the Makefile), made of cases:
+
+        static VOID CaseFoo(VOID) { TEST_CHECK(...); }
+
+        static const TEST_CASE Cases[] = { TEST_CASE_ENTRY(CaseFoo), ... };
+        TEST_MAIN(Cases)
+
+    Run with no arguments, it runs every case; otherwise the ones named.
+
+    Iteration counts go through TEST_ROUNDS, which the ThreadSanitizer
+    build scales down (TEST_SCALE), as it runs ten or more times slower.
+
+Environment:
+
+    C11 user-mode POSIX environment, with pthreads
+
+--*/
+
+#pragma once
+
+#include "OsShim.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+
+#ifndef TEST_SCALE
+#define TEST_SCALE      1
+#endif
+
+#define TEST_ROUNDS(__n)    (((__n) / TEST_SCALE) > 0 ? ((__n) / TEST_SCALE) : 1)
+
+#define TEST_MAX_THREADS    16
+
+
+static inline
+VOID
+TestFail(
+    _In_ const char *File,
+    _In_ int Line,
+    _In_ const char *Expression
+)
+{
+    fprintf(stderr, "%s(%d): check failed: %s\n", File, Line, Expression);
+    fflush(stderr);
+    abort();
+}
+
+#define TEST_CHECK(__e)     ((__e) ? (void)0 : TestFail(__FILE__, __LINE__, #__e))
+
+
+//
+// Spin-waits in tests yield instead of pausing: the threads they wait on
+// may well share one CPU with them.
+//
+#define TestYield()         sched_yield()
+
+
+typedef VOID (*PFN_TEST_THREAD)(
+    _In_ ULONG Index,
+    _In_opt_ PVOID Context
+);
+
+typedef struct _TEST_THREAD
+{
+    pthread_t       Thread;
+    ULONG           Index;
+    PFN_TEST_THREAD Routine;
+    PVOID           Context;
+} TEST_THREAD, *PTEST_THREAD;
+
+static inline
+void *
+_TestThreadStart(
+    _In_ void *Parameter
+)
+{
+    PTEST_THREAD thread = (PTEST_THREAD)Parameter;
+
+    thread->Routine(thread->Index, thread->Context);
+    return NULL;
+}
+
+//
+// Runs Routine(0 .. Count - 1, Context) on Count threads, and waits for
+// all of them.
+//
+static inline
+VOID
+TestRunThreads(
+    _In_ ULONG Count,
+    _In_ PFN_TEST_THREAD Routine,
+    _In_opt_ PVOID Context
+)
+{
+    TEST_THREAD threads[TEST_MAX_THREADS];
+    ULONG i;
+
+    TEST_CHECK(Count <= TEST_MAX_THREADS);
+
+    for (i = 0; i < Count; ++i) {
+        threads[i].Index = i;
+        threads[i].Routine = Routine;
+        threads[i].Context = Context;
+        TEST_CHECK(pthread_create(&(threads[i].Thread), NULL, _TestThreadStart, &(threads[i])) == 0);
+    }
+    for (i = 0; i < Count; ++i) {
+        TEST_CHECK(pthread_join(threads[i].Thread, NULL) == 0);
+    }
+}
+
+
+typedef struct _TEST_CASE
+{
+    const char *Name;
+    VOID      (*Run)(VOID);
+} TEST_CASE, *PTEST_CASE;
+
+#define TEST_CASE_ENTRY(__case)     { #__case, __case }
+
+static inline
+int
+TestMain(
+    _In_ int argc,
+    _In_ char **argv,
+    _In_reads_(Count) const TEST_CASE *Cases,
+    _In_ ULONG Count
+)
+{
+    ULONG run = 0;
+
+    for (ULONG i = 0; i < Count; ++i) {
+        ULONG64 start;
+        int a;
+
+        for (a = 1; a < argc; ++a) {
+            if (strcmp(argv[a], Cases[i].Name) == 0) {
+                break;
+            }
+        }
+        if ((argc > 1) && (a == argc)) {
+            continue;
+        }
+
+        start = OsTimestamp();
+        Cases[i].Run();
+        printf("%-32s ok  %8.1f ms\n", Cases[i].Name,
+               (double)(OsTimestamp() - start) * 1000.0 / (double)OsTimestampFrequency());
+        fflush(stdout);
+        ++run;
+    }
+
+    if (run == 0) {
+        fprintf(stderr, "no such case\n");
+        return 1;
+    }
+    return 0;
+}
+
+#define TEST_MAIN(__cases)                                                  \
+    int main(int argc, char **argv)                                         \
+    {                                                                       \
+        return TestMain(argc, argv, (__cases), sizeof(__cases) / sizeof((__cases)[0])); \
+    }
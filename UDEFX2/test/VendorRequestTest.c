@@ -0,0 +1,258 @@
+/*++
+
+Module Name:
+
+VendorRequestTest.c
+
+Abstract:
+
+    Tests of the vendor request dispatcher: each request in the table
+    reaching its handler with its arguments decoded, every other
+    bmRequestType and bRequest refused without a handler running, and data
+    stages of the wrong length refused.
+
+Environment:
+
+    User mode; see Test.h
+
+--*/
+
+#include "VendorRequest.h"
+#include "Test.h"
+
+
+//
+// Records what the handlers were asked to do.
+//
+typedef struct _TEST_DEVICE
+{
+    ULONG   Calls;
+    ULONG   Block;
+    ULONG   Pattern;
+    ULONG   Mode;
+    ULONG64 Seed;
+    ULONG   Blocks;
+} TEST_DEVICE, *PTEST_DEVICE;
+
+static
+ULONG
+TestReadStats(
+    _In_ PVOID Context,
+    _In_ ULONG Block,
+    _Out_writes_to_(VR_STATS_MAX_COUNTERS, return) PULONG64 Counters
+)
+{
+    PTEST_DEVICE device = (PTEST_DEVICE)Context;
+
+    device->Calls++;
+    device->Block = Block;
+    if (Block >= UDEFX2_VR_STATS_BLOCKS) {
+        return 0;
+    }
+    for (ULONG i = 0; i < 5; ++i) {
+        Counters[i] = 0x1122334455667700ull | ((Block * 16) + i);
+    }
+    return 5;
+}
+
+static
+NTSTATUS
+TestSetBulkInPattern(
+    _In_ PVOID Context,
+    _In_ ULONG Pattern,
+    _In_ ULONG64 Seed
+)
+{
+    PTEST_DEVICE device = (PTEST_DEVICE)Context;
+
+    device->Calls++;
+    device->Pattern = Pattern;
+    device->Seed = Seed;
+    return STATUS_SUCCESS;
+}
+
+static
+NTSTATUS
+TestSetBulkOutSink(
+    _In_ PVOID Context,
+    _In_ ULONG Mode,
+    _In_ ULONG Pattern,
+    _In_ ULONG64 Seed
+)
+{
+    PTEST_DEVICE device = (PTEST_DEVICE)Context;
+
+    device->Calls++;
+    device->Mode = Mode;
+    device->Pattern = Pattern;
+    device->Seed = Seed;
+    return STATUS_SUCCESS;
+}
+
+static
+VOID
+TestResetCounters(
+    _In_ PVOID Context,
+    _In_ ULONG Blocks
+)
+{
+    PTEST_DEVICE device = (PTEST_DEVICE)Context;
+
+    device->Calls++;
+    device->Blocks = Blocks;
+}
+
+static const VENDOR_OPS TestOps =
+{
+    TestReadStats,
+    TestSetBulkInPattern,
+    TestSetBulkOutSink,
+    TestResetCounters
+};
+
+static
+NTSTATUS
+Dispatch(
+    _Inout_ PTEST_DEVICE Device,
+    _In_ UCHAR bmRequestType,
+    _In_ UCHAR bRequest,
+    _In_ USHORT wValue,
+    _In_ USHORT wIndex,
+    _In_ USHORT wLength,
+    _Inout_updates_bytes_opt_(Length) PUCHAR Buffer,
+    _In_ ULONG Length,
+    _Out_ PULONG BytesDone
+)
+{
+    VENDOR_SETUP setup = { bmRequestType, bRequest, wValue, wIndex, wLength };
+
+    return VrDispatch(&TestOps, Device, &setup, Buffer, Length, BytesDone);
+}
+
+
+//
+// Each request in the table, with and without its optional data.
+//
+static
+VOID
+CaseDispatch(
+    VOID
+)
+{
+    static const UCHAR seed[8] = { 0x08, 0x07, 0x06, 0x05, 0x04, 0x03, 0x02, 0x01 };
+    TEST_DEVICE device;
+    UCHAR buffer[64];
+    ULONG done;
+
+    // GET_STATS: the counters, little-endian, as many bytes as asked for
+    memset(&device, 0, sizeof(device));
+    TEST_CHECK(NT_SUCCESS(Dispatch(&device, 0xC0, UDEFX2_VR_GET_STATS, 0, UDEFX2_VR_STATS_INTERRUPT,
+                                   sizeof(buffer), buffer, sizeof(buffer), &done)));
+    TEST_CHECK((device.Calls == 1) && (device.Block == UDEFX2_VR_STATS_INTERRUPT));
+    TEST_CHECK(done == 5 * 8);
+    TEST_CHECK((buffer[0] == 0x10) && (buffer[1] == 0x77) && (buffer[7] == 0x11));
+    TEST_CHECK((buffer[32] == 0x14) && (buffer[39] == 0x11));
+
+    TEST_CHECK(NT_SUCCESS(Dispatch(&device, 0xC0, UDEFX2_VR_GET_STATS, 0, UDEFX2_VR_STATS_SINK,
+                                   12, buffer, sizeof(buffer), &done)));
+    TEST_CHECK((done == 12) && (buffer[8] == 0x01) && (buffer[11] == 0x55));
+
+    TEST_CHECK(Dispatch(&device, 0xC0, UDEFX2_VR_GET_STATS, 0, UDEFX2_VR_STATS_BLOCKS,
+                        sizeof(buffer), buffer, sizeof(buffer), &done) == STATUS_INVALID_PARAMETER);
+    TEST_CHECK(done == 0);
+
+    // SET_PATTERN: the seed is optional
+    memset(&device, 0, sizeof(device));
+    TEST_CHECK(NT_SUCCESS(Dispatch(&device, 0x40, UDEFX2_VR_SET_PATTERN, 3, 0, 0, NULL, 0, &done)));
+    TEST_CHECK((device.Calls == 1) && (device.Pattern == 3) && (device.Seed == 0) && (done == 0));
+    memcpy(buffer, seed, sizeof(seed));
+    TEST_CHECK(NT_SUCCESS(Dispatch(&device, 0x40, UDEFX2_VR_SET_PATTERN, 4, 0, 8, buffer, 8, &done)));
+    TEST_CHECK((device.Pattern == 4) && (device.Seed == 0x0102030405060708ull));
+
+    // SET_SINK: mode in the low byte, pattern in the high one
+    memset(&device, 0, sizeof(device));
+    TEST_CHECK(NT_SUCCESS(Dispatch(&device, 0x40, UDEFX2_VR_SET_SINK, 0x0302, 0, 8, buffer, 8, &done)));
+    TEST_CHECK((device.Calls == 1) && (device.Mode == 2) && (device.Pattern == 3));
+    TEST_CHECK(device.Seed == 0x0102030405060708ull);
+
+    // RESET_COUNTERS: the mask as is
+    memset(&device, 0, sizeof(device));
+    TEST_CHECK(NT_SUCCESS(Dispatch(&device, 0x40, UDEFX2_VR_RESET_COUNTERS, 0x8003, 0, 0, NULL, 0, &done)));
+    TEST_CHECK((device.Calls == 1) && (device.Blocks == 0x8003));
+}
+
+//
+// Every bmRequestType and bRequest there is: only the four in the table
+// get past the lookup, and nothing else runs a handler.
+//
+static
+VOID
+CaseUnknownRequests(
+    VOID
+)
+{
+    TEST_DEVICE device;
+    UCHAR buffer[8] = { 0 };
+    ULONG done;
+    ULONG found = 0;
+
+    memset(&device, 0, sizeof(device));
+
+    for (ULONG type = 0; type < 256; ++type) {
+        for (ULONG request = 0; request < 256; ++request) {
+            BOOLEAN known =
+                ((type == 0xC0) && (request == UDEFX2_VR_GET_STATS)) ||
+                ((type == 0x40) && ((request == UDEFX2_VR_SET_PATTERN) ||
+                                    (request == UDEFX2_VR_SET_SINK) ||
+                                    (request == UDEFX2_VR_RESET_COUNTERS)));
+            ULONG calls = device.Calls;
+            NTSTATUS status;
+
+            done = 0xDEAD;
+            status = Dispatch(&device, (UCHAR)type, (UCHAR)request, 0, 0, sizeof(buffer),
+                              buffer, sizeof(buffer), &done);
+            if (known) {
+                TEST_CHECK(status != STATUS_NOT_SUPPORTED);
+                found++;
+            } else {
+                TEST_CHECK(status == STATUS_NOT_SUPPORTED);
+                TEST_CHECK((device.Calls == calls) && (done == 0));
+            }
+        }
+    }
+    TEST_CHECK(found == 4);
+}
+
+//
+// Data stages a request does not take, or that are not all there.
+//
+static
+VOID
+CaseDataStage(
+    VOID
+)
+{
+    TEST_DEVICE device;
+    UCHAR buffer[16] = { 0 };
+    ULONG done;
+
+    memset(&device, 0, sizeof(device));
+
+    TEST_CHECK(Dispatch(&device, 0x40, UDEFX2_VR_SET_PATTERN, 1, 0, 4, buffer, 4, &done) == STATUS_INVALID_PARAMETER);
+    TEST_CHECK(Dispatch(&device, 0x40, UDEFX2_VR_SET_PATTERN, 1, 0, 9, buffer, 9, &done) == STATUS_INVALID_PARAMETER);
+    TEST_CHECK(Dispatch(&device, 0x40, UDEFX2_VR_SET_SINK, 1, 0, 8, buffer, 7, &done) == STATUS_INVALID_PARAMETER);
+    TEST_CHECK(Dispatch(&device, 0x40, UDEFX2_VR_SET_SINK, 1, 0, 8, NULL, 8, &done) == STATUS_INVALID_PARAMETER);
+    TEST_CHECK(Dispatch(&device, 0x40, UDEFX2_VR_RESET_COUNTERS, 1, 0, 1, buffer, 1, &done) == STATUS_INVALID_PARAMETER);
+    TEST_CHECK(Dispatch(&device, 0xC0, UDEFX2_VR_GET_STATS, 0, 0, 0, buffer, 0, &done) == STATUS_INVALID_PARAMETER);
+    TEST_CHECK(device.Calls == 0);
+}
+
+
+static const TEST_CASE Cases[] =
+{
+    TEST_CASE_ENTRY(CaseDispatch),
+    TEST_CASE_ENTRY(CaseUnknownRequests),
+    TEST_CASE_ENTRY(CaseDataStage),
+};
+
+TEST_MAIN(Cases)
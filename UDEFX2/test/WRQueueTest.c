@@ -0,0 +1,1036 @@
+/*++
+
+Module Name:
+
+WRQueueTest.c
+
+Abstract:
+
+    Tests of the write-to-read queue core, a case for each behavior of
+    the queue, and writers racing readers that park and get canceled.
+
+    Requests are TEST_READ and TEST_WRITE structures; the ops below play
+    the part Misc.c plays in the driver, with a state word standing in for
+    WDF's cancelable-request bookkeeping.
+
+Environment:
+
+    User mode; see Test.h
+
+--*/
+
+#include "WRQueueCore.h"
+#include "Test.h"
+
+
+#define READ_IDLE       0
+#define READ_ARMED      1
+#define READ_DISARMED   2
+#define READ_CANCELED   3
+
+typedef struct _TEST_READ
+{
+    UCHAR          Buffer[64];
+    SIZE_T         Length;          // of Buffer offered to the queue
+    PVOID          Parked;          // from ArmRead
+    volatile LONG  State;           // READ_xxx
+    volatile LONG  Completions;
+    NTSTATUS       Status;
+    SIZE_T         Bytes;
+} TEST_READ, *PTEST_READ;
+
+typedef struct _TEST_WRITE
+{
+    volatile LONG  Completions;
+    NTSTATUS       Status;
+    SIZE_T         Bytes;
+} TEST_WRITE, *PTEST_WRITE;
+
+
+static
+NTSTATUS
+TestArmRead(
+    _In_ PVOID Context,
+    _In_ OS_REQUEST Read,
+    _In_ PVOID ParkedRead
+)
+{
+    PTEST_READ read = (PTEST_READ)Read;
+
+    UNREFERENCED_PARAMETER(Context);
+
+    read->Parked = ParkedRead;
+    WriteRelease(&(read->State), READ_ARMED);
+    return STATUS_SUCCESS;
+}
+
+static
+BOOLEAN
+TestDisarmRead(
+    _In_ PVOID Context,
+    _In_ OS_REQUEST Read
+)
+{
+    PTEST_READ read = (PTEST_READ)Read;
+
+    UNREFERENCED_PARAMETER(Context);
+
+    return (InterlockedCompareExchange(&(read->State), READ_DISARMED, READ_ARMED) == READ_ARMED);
+}
+
+static
+NTSTATUS
+TestGetReadBuffer(
+    _In_  PVOID Context,
+    _In_  OS_REQUEST Read,
+    _Out_ PUCHAR *Buffer,
+    _Out_ PSIZE_T Length
+)
+{
+    PTEST_READ read = (PTEST_READ)Read;
+
+    UNREFERENCED_PARAMETER(Context);
+
+    *Buffer = read->Buffer;
+    *Length = read->Length;
+    return STATUS_SUCCESS;
+}
+
+static
+VOID
+TestCompleteRead(
+    _In_ PVOID Context,
+    _In_ OS_REQUEST Read,
+    _In_ NTSTATUS Status,
+    _In_ SIZE_T Bytes
+)
+{
+    PTEST_READ read = (PTEST_READ)Read;
+
+    UNREFERENCED_PARAMETER(Context);
+
+    read->Status = Status;
+    read->Bytes = Bytes;
+    TEST_CHECK(InterlockedIncrement(&(read->Completions)) == 1);
+}
+
+static
+NTSTATUS
+TestParkWrite(
+    _In_ PVOID Context,
+    _In_ OS_REQUEST Write
+)
+{
+    UNREFERENCED_PARAMETER(Context);
+    UNREFERENCED_PARAMETER(Write);
+
+    return STATUS_SUCCESS;
+}
+
+static
+BOOLEAN
+TestTakeWrite(
+    _In_ PVOID Context,
+    _In_ OS_REQUEST Write
+)
+{
+    UNREFERENCED_PARAMETER(Context);
+    UNREFERENCED_PARAMETER(Write);
+
+    return TRUE;
+}
+
+static
+VOID
+TestCompleteWrite(
+    _In_ PVOID Context,
+    _In_ OS_REQUEST Write,
+    _In_ NTSTATUS Status,
+    _In_ SIZE_T Bytes
+)
+{
+    PTEST_WRITE write = (PTEST_WRITE)Write;
+
+    UNREFERENCED_PARAMETER(Context);
+
+    write->Status = Status;
+    write->Bytes = Bytes;
+    TEST_CHECK(InterlockedIncrement(&(write->Completions)) == 1);
+}
+
+static const WRQUEUE_OPS TestOps =
+{
+    TestArmRead,
+    TestDisarmRead,
+    TestGetReadBuffer,
+    TestCompleteRead,
+    TestParkWrite,
+    TestTakeWrite,
+    TestCompleteWrite
+};
+
+
+static
+VOID
+Push(
+    _Inout_ PWRQUEUE Q,
+    _In_ ULONG Lane,
+    _In_reads_bytes_(Length) const VOID *Data,
+    _In_ SIZE_T Length
+)
+{
+    ULONG completed;
+    BOOLEAN bTaken;
+
+    TEST_CHECK(NT_SUCCESS(WrqPushWrite(Q, Lane, NULL, (PVOID)Data, Length, &completed, &bTaken)));
+}
+
+//
+// A read served from what is queued; returns its length, or -1 if it had
+// to park (it is then canceled, and nothing was queued).
+//
+static
+LONG
+Pull(
+    _Inout_ PWRQUEUE Q,
+    _Out_writes_bytes_(Length) PUCHAR Buffer,
+    _In_ SIZE_T Length
+)
+{
+    static TEST_READ read;
+    BOOLEAN bReady;
+    SIZE_T bytes;
+    NTSTATUS status;
+
+    memset(&read, 0, sizeof(read));
+    read.Length = sizeof(read.Buffer);
+    status = WrqPullRead(Q, &read, Buffer, Length, &bReady, &bytes);
+    if (!bReady) {
+        TEST_CHECK(InterlockedCompareExchange(&(read.State), READ_CANCELED, READ_ARMED) == READ_ARMED);
+        WrqCancelRead(read.Parked);
+        TEST_CHECK((read.Completions == 1) && (read.Status == STATUS_CANCELLED));
+        return -1;
+    }
+    TEST_CHECK(NT_SUCCESS(status));
+    return (LONG)bytes;
+}
+
+
+static
+VOID
+CaseMessages(
+    VOID
+)
+{
+    WRQUEUE q;
+    UCHAR data[100];
+    UCHAR buffer[64];
+
+    for (ULONG i = 0; i < sizeof(data); ++i) {
+        data[i] = (UCHAR)i;
+    }
+
+    // a write is never mixed with the next, a long one spans reads
+    TEST_CHECK(NT_SUCCESS(WrqInit(&q, WRQueueModeMessage, NULL, &TestOps, NULL)));
+    Push(&q, WRQUEUE_LANE_NORMAL, data, 100);
+    Push(&q, WRQUEUE_LANE_NORMAL, data, 10);
+    TEST_CHECK(Pull(&q, buffer, 40) == 40);
+    TEST_CHECK(memcmp(buffer, data, 40) == 0);
+    TEST_CHECK(Pull(&q, buffer, 40) == 40);
+    TEST_CHECK(memcmp(buffer, data + 40, 40) == 0);
+    TEST_CHECK(Pull(&q, buffer, 40) == 20);
+    TEST_CHECK(memcmp(buffer, data + 80, 20) == 0);
+    TEST_CHECK(Pull(&q, buffer, 40) == 10);
+    TEST_CHECK(Pull(&q, buffer, 40) == -1);
+    TEST_CHECK((q.QueuedBytes == 0) && (q.QueuedEntries == 0));
+    WrqDestroy(&q);
+}
+
+
+//
+// A read that finds nothing parks, and the next write fills it directly;
+// one canceled while parked is completed once, and the write after it
+// is queued rather than handed to it.
+//
+static
+VOID
+CaseParkedReads(
+    VOID
+)
+{
+    WRQUEUE q;
+    static TEST_READ reads[2];
+    UCHAR data[16] = { 1, 2, 3 };
+    UCHAR buffer[64];
+    ULONG completed;
+    BOOLEAN bTaken;
+    BOOLEAN bReady;
+    SIZE_T bytes;
+
+    memset(reads, 0, sizeof(reads));
+    TEST_CHECK(NT_SUCCESS(WrqInit(&q, WRQueueModeMessage, NULL, &TestOps, NULL)));
+
+    for (ULONG i = 0; i < 2; ++i) {
+        reads[i].Length = sizeof(reads[i].Buffer);
+        TEST_CHECK(NT_SUCCESS(WrqPullRead(&q, &reads[i], reads[i].Buffer, reads[i].Length, &bReady, &bytes)));
+        TEST_CHECK(!bReady && (reads[i].State == READ_ARMED));
+    }
+    TEST_CHECK(q.PeakParkedReads == 2);
+
+    // the first parked read gets the write
+    TEST_CHECK(NT_SUCCESS(WrqPushWrite(&q, WRQUEUE_LANE_NORMAL, NULL, data, sizeof(data), &completed, &bTaken)));
+    TEST_CHECK(completed == 1);
+    TEST_CHECK((reads[0].Completions == 1) && NT_SUCCESS(reads[0].Status) && (reads[0].Bytes == sizeof(data)));
+    TEST_CHECK(memcmp(reads[0].Buffer, data, sizeof(data)) == 0);
+
+    // the second is canceled, and the next write waits for a read of its own
+    TEST_CHECK(InterlockedCompareExchange(&(reads[1].State), READ_CANCELED, READ_ARMED) == READ_ARMED);
+    WrqCancelRead(reads[1].Parked);
+    TEST_CHECK((reads[1].Completions == 1) && (reads[1].Status == STATUS_CANCELLED));
+
+    TEST_CHECK(NT_SUCCESS(WrqPushWrite(&q, WRQUEUE_LANE_NORMAL, NULL, data, 3, &completed, &bTaken)));
+    TEST_CHECK(completed == 0);
+    TEST_CHECK((q.QueuedEntries == 1) && (q.QueuedBytes == 3));
+    TEST_CHECK(Pull(&q, buffer, sizeof(buffer)) == 3);
+    TEST_CHECK(memcmp(buffer, data, 3) == 0);
+    TEST_CHECK(reads[1].Completions == 1);
+    WrqDestroy(&q);
+}
+
+
+//
+// Stream mode packs a read with as many writes as fit, in order, and what
+// does not fit starts the next read; written in pieces and read in others,
+// the bytes come out as one stream.
+//
+#define STREAM_BYTES    TEST_ROUNDS(1000000)
+
+static
+VOID
+CaseStream(
+    VOID
+)
+{
+    WRQUEUE q;
+    UCHAR data[256];
+    UCHAR buffer[64];
+    ULONG written = 0;
+    ULONG read = 0;
+    unsigned seed = 1;
+
+    for (ULONG i = 0; i < sizeof(data); ++i) {
+        data[i] = (UCHAR)i;
+    }
+
+    TEST_CHECK(NT_SUCCESS(WrqInit(&q, WRQueueModeStream, NULL, &TestOps, NULL)));
+    Push(&q, WRQUEUE_LANE_NORMAL, data, 10);
+    Push(&q, WRQUEUE_LANE_NORMAL, data + 10, 10);
+    Push(&q, WRQUEUE_LANE_NORMAL, data + 20, 10);
+    TEST_CHECK(Pull(&q, buffer, 25) == 25);
+    TEST_CHECK(memcmp(buffer, data, 25) == 0);
+    TEST_CHECK(Pull(&q, buffer, 25) == 5);
+    TEST_CHECK(memcmp(buffer, data + 25, 5) == 0);
+    TEST_CHECK(Pull(&q, buffer, 25) == -1);
+
+    // a write longer than the read, then the rest of it packed with the next
+    Push(&q, WRQUEUE_LANE_NORMAL, data, 100);
+    Push(&q, WRQUEUE_LANE_NORMAL, data + 100, 10);
+    TEST_CHECK(Pull(&q, buffer, 64) == 64);
+    TEST_CHECK(memcmp(buffer, data, 64) == 0);
+    TEST_CHECK(Pull(&q, buffer, 64) == 46);
+    TEST_CHECK(memcmp(buffer, data + 64, 46) == 0);
+    TEST_CHECK((q.QueuedBytes == 0) && (q.QueuedEntries == 0));
+
+    // pieces of any length in, reads of any length out, by the one reader
+    while ((written < STREAM_BYTES) || (read < written)) {
+        seed = (seed * 1103515245) + 12345;
+        if ((written < STREAM_BYTES) && (q.QueuedEntries < 256) && (((seed >> 16) % 3) != 0)) {
+            ULONG length = 1 + ((seed >> 8) % 200);
+            UCHAR piece[200];
+
+            for (ULONG i = 0; i < length; ++i) {
+                piece[i] = (UCHAR)(written + i);
+            }
+            Push(&q, WRQUEUE_LANE_NORMAL, piece, length);
+            written += length;
+        } else {
+            LONG bytes = Pull(&q, buffer, 1 + ((seed >> 8) % sizeof(buffer)));
+
+            for (LONG i = 0; i < bytes; ++i) {
+                TEST_CHECK(buffer[i] == (UCHAR)(read + i));
+            }
+            read += (bytes > 0) ? (ULONG)bytes : 0;
+        }
+    }
+    TEST_CHECK((read == written) && (q.QueuedBytes == 0));
+    WrqDestroy(&q);
+}
+
+
+//
+// Higher lanes first, order kept within a lane, and a lane passed over
+// WRQUEUE_LANE_STARVATION_LIMIT times gets the next turn.
+//
+static
+VOID
+CaseLanes(
+    VOID
+)
+{
+    WRQUEUE q;
+    UCHAR buffer[8];
+    ULONG position;
+
+    TEST_CHECK(NT_SUCCESS(WrqInit(&q, WRQueueModeMessage, NULL, &TestOps, NULL)));
+
+    Push(&q, WRQUEUE_LANE_BULK, "b", 1);
+    Push(&q, WRQUEUE_LANE_NORMAL, "n", 1);
+    Push(&q, WRQUEUE_LANE_URGENT, "u", 1);
+    Push(&q, WRQUEUE_LANE_HIGH, "h", 1);
+    TEST_CHECK((Pull(&q, buffer, 1) == 1) && (buffer[0] == 'u'));
+    TEST_CHECK((Pull(&q, buffer, 1) == 1) && (buffer[0] == 'h'));
+    TEST_CHECK((Pull(&q, buffer, 1) == 1) && (buffer[0] == 'n'));
+    TEST_CHECK((Pull(&q, buffer, 1) == 1) && (buffer[0] == 'b'));
+
+    for (UCHAR i = 0; i < 4; ++i) {
+        Push(&q, WRQUEUE_LANE_HIGH, &i, 1);
+    }
+    for (UCHAR i = 0; i < 4; ++i) {
+        TEST_CHECK((Pull(&q, buffer, 1) == 1) && (buffer[0] == i));
+    }
+
+    Push(&q, WRQUEUE_LANE_BULK, "b", 1);
+    for (ULONG i = 0; i < 2 * WRQUEUE_LANE_STARVATION_LIMIT; ++i) {
+        Push(&q, WRQUEUE_LANE_URGENT, "u", 1);
+    }
+    for (position = 1; ; ++position) {
+        TEST_CHECK(Pull(&q, buffer, 1) == 1);
+        if (buffer[0] == 'b') {
+            break;
+        }
+    }
+    TEST_CHECK(position == WRQUEUE_LANE_STARVATION_LIMIT + 1);
+    TEST_CHECK(position == 9); // the limit the lanes are documented with
+
+    // the count starts over once the lane had its turn
+    Push(&q, WRQUEUE_LANE_BULK, "b", 1);
+    for (position = 1; ; ++position) {
+        TEST_CHECK(Pull(&q, buffer, 1) == 1);
+        if (buffer[0] == 'b') {
+            break;
+        }
+    }
+    TEST_CHECK(position == WRQUEUE_LANE_STARVATION_LIMIT + 1);
+    TEST_CHECK(Pull(&q, buffer, 1) == -1);
+
+    WrqDestroy(&q);
+}
+
+
+//
+// A write longer than the reads is drained across them, parked ones
+// first, and the rest queued. One whose rest (after the first read) the
+// queue cannot take goes nowhere: the read it would have started on fails with it, and nothing
+// of it is left to be duplicated when it is sent again.
+//
+static
+VOID
+ParkReads(
+    _Inout_ PWRQUEUE Q,
+    _Out_writes_(Count) PTEST_READ Reads,
+    _In_ ULONG Count
+)
+{
+    BOOLEAN bReady;
+    SIZE_T bytes;
+
+    memset(Reads, 0, Count * sizeof(TEST_READ));
+    for (ULONG i = 0; i < Count; ++i) {
+        Reads[i].Length = sizeof(Reads[i].Buffer);
+        TEST_CHECK(NT_SUCCESS(WrqPullRead(Q, &Reads[i], Reads[i].Buffer, Reads[i].Length, &bReady, &bytes)));
+        TEST_CHECK(!bReady);
+    }
+}
+
+static
+VOID
+CaseOversizedWrites(
+    VOID
+)
+{
+    WRQUEUE q;
+    WRQUEUE_LIMITS limits;
+    static TEST_READ reads[2];
+    UCHAR data[200];
+    UCHAR buffer[64];
+    WRQUEUE_BUFFER writes[1];
+    WRQUEUE_COMPLETION completions[4];
+    ULONG count;
+    ULONG completed;
+    BOOLEAN bTaken;
+
+    for (ULONG i = 0; i < sizeof(data); ++i) {
+        data[i] = (UCHAR)i;
+    }
+    WRQUEUE_LIMITS_INIT(&limits);
+    limits.MaxBytes = 100;
+    limits.HighWaterBytes = 90;
+    limits.LowWaterBytes = 10;
+    TEST_CHECK(NT_SUCCESS(WrqInit(&q, WRQueueModeMessage, &limits, &TestOps, NULL)));
+
+    // two parked reads take 128 bytes, the other 22 are queued
+    ParkReads(&q, reads, 2);
+    TEST_CHECK(NT_SUCCESS(WrqPushWrite(&q, WRQUEUE_LANE_NORMAL, NULL, data, 150, &completed, &bTaken)));
+    TEST_CHECK(completed == 2);
+    TEST_CHECK((reads[0].Bytes == 64) && (memcmp(reads[0].Buffer, data, 64) == 0));
+    TEST_CHECK((reads[1].Bytes == 64) && (memcmp(reads[1].Buffer, data + 64, 64) == 0));
+    TEST_CHECK(q.QueuedBytes == 22);
+    TEST_CHECK((Pull(&q, buffer, 64) == 22) && (memcmp(buffer, data + 128, 22) == 0));
+
+    // one parked read would leave 136 bytes, more than the queue holds
+    ParkReads(&q, reads, 2);
+    TEST_CHECK(!NT_SUCCESS(WrqPushWrite(&q, WRQUEUE_LANE_NORMAL, NULL, data, 200, &completed, &bTaken)));
+    TEST_CHECK((reads[0].Completions == 1) && !NT_SUCCESS(reads[0].Status) && (reads[0].Bytes == 0));
+    TEST_CHECK((reads[1].Completions == 0) && (q.QueuedBytes == 0) && (q.Refused == 1));
+
+    // sent again, smaller, it goes to the read still parked
+    TEST_CHECK(NT_SUCCESS(WrqPushWrite(&q, WRQUEUE_LANE_NORMAL, NULL, data, 100, &completed, &bTaken)));
+    TEST_CHECK((completed == 1) && (reads[1].Bytes == 64) && (memcmp(reads[1].Buffer, data, 64) == 0));
+    TEST_CHECK((Pull(&q, buffer, 64) == 36) && (memcmp(buffer, data + 64, 36) == 0));
+
+    // batched, the reads holding the start of a refused write are failed too
+    ParkReads(&q, reads, 1);
+    writes[0].Buffer = data;
+    writes[0].Length = 200;
+    writes[0].Lane = WRQUEUE_LANE_NORMAL;
+    TEST_CHECK(!NT_SUCCESS(WrqPushWriteBatch(&q, writes, 1, completions, 4, &count)));
+    TEST_CHECK(count == 1);
+    TEST_CHECK(!NT_SUCCESS(completions[0].Status) && (completions[0].Information == 0));
+    TEST_CHECK((reads[0].Completions == 0) && (q.QueuedBytes == 0));
+    TestCompleteRead(NULL, completions[0].Request, completions[0].Status, completions[0].Information);
+    WrqDestroy(&q);
+}
+
+
+//
+// A message of several writes, with room reserved for all of them first:
+// writes from others cannot take that room meanwhile, the ones pushed
+// against it fit, and what a read took directly is given back after.
+//
+static
+VOID
+CaseReservation(
+    VOID
+)
+{
+    WRQUEUE q;
+    WRQUEUE_LIMITS limits;
+    WRQUEUE_RESERVATION reservation;
+    WRQUEUE_RESERVATION other;
+    static TEST_READ reads[1];
+    UCHAR data[40];
+    UCHAR buffer[64];
+    ULONG completed;
+    BOOLEAN bTaken;
+
+    for (ULONG i = 0; i < sizeof(data); ++i) {
+        data[i] = (UCHAR)i;
+    }
+    WRQUEUE_LIMITS_INIT(&limits);
+    limits.MaxBytes = 100;
+    limits.HighWaterBytes = 100;
+    limits.LowWaterBytes = 10;
+    limits.MaxEntries = 8;
+    limits.HighWaterEntries = 8;
+    limits.LowWaterEntries = 1;
+    TEST_CHECK(NT_SUCCESS(WrqInit(&q, WRQueueModeMessage, &limits, &TestOps, NULL)));
+
+    TEST_CHECK(!NT_SUCCESS(WrqReserve(&q, 101, 1, &reservation)));
+    TEST_CHECK(!NT_SUCCESS(WrqReserve(&q, 10, 9, &reservation)));
+    TEST_CHECK(!NT_SUCCESS(WrqReserve(&q, 10, 0, &reservation)));
+    TEST_CHECK((q.QueuedBytes == 0) && (q.QueuedEntries == 0));
+
+    TEST_CHECK(NT_SUCCESS(WrqReserve(&q, 80, 3, &reservation)));
+    TEST_CHECK((q.QueuedBytes == 80) && (q.QueuedEntries == 3));
+
+    // the first piece goes straight to a parked read, leaving the room as it was
+    ParkReads(&q, reads, 1);
+    TEST_CHECK(NT_SUCCESS(WrqPushWriteReserved(&q, WRQUEUE_LANE_NORMAL, &reservation, data, 30, &completed)));
+    TEST_CHECK((completed == 1) && (reads[0].Bytes == 30) && (memcmp(reads[0].Buffer, data, 30) == 0));
+    TEST_CHECK((reservation.Bytes == 80) && (reservation.Entries == 3));
+
+    // someone else's write finds only the room left
+    TEST_CHECK(!NT_SUCCESS(WrqPushWrite(&q, WRQUEUE_LANE_NORMAL, NULL, data, 30, &completed, &bTaken)));
+    TEST_CHECK(NT_SUCCESS(WrqPushWrite(&q, WRQUEUE_LANE_NORMAL, NULL, data, 20, &completed, &bTaken)));
+    TEST_CHECK(!NT_SUCCESS(WrqReserve(&q, 1, 1, &other)));
+
+    // the other two pieces are queued in the reserved room
+    TEST_CHECK(NT_SUCCESS(WrqPushWriteReserved(&q, WRQUEUE_LANE_NORMAL, &reservation, data, 40, &completed)));
+    TEST_CHECK(NT_SUCCESS(WrqPushWriteReserved(&q, WRQUEUE_LANE_NORMAL, &reservation, data, 40, &completed)));
+    TEST_CHECK((reservation.Bytes == 0) && (reservation.Entries == 1));
+    TEST_CHECK((q.QueuedBytes == 100) && (q.QueuedEntries == 4));
+
+    // what it did not use goes back
+    WrqReleaseReservation(&q, &reservation);
+    TEST_CHECK((reservation.Bytes == 0) && (reservation.Entries == 0));
+    TEST_CHECK((q.QueuedBytes == 100) && (q.QueuedEntries == 3));
+
+    TEST_CHECK(Pull(&q, buffer, 64) == 20);
+    TEST_CHECK((Pull(&q, buffer, 64) == 40) && (memcmp(buffer, data, 40) == 0));
+    TEST_CHECK((Pull(&q, buffer, 64) == 40) && (memcmp(buffer, data, 40) == 0));
+    TEST_CHECK((q.QueuedBytes == 0) && (q.QueuedEntries == 0));
+    WrqDestroy(&q);
+}
+
+
+//
+// A batch pairs its writes with parked reads, in order, and leaves those
+// reads to the caller; what they do not take, and what is beyond
+// MaxCompletions, goes the way of WrqPushWrite.
+//
+static
+VOID
+CaseBatch(
+    VOID
+)
+{
+    WRQUEUE q;
+    static TEST_READ reads[4];
+    UCHAR data[8][16];
+    UCHAR buffer[64];
+    WRQUEUE_BUFFER writes[8];
+    WRQUEUE_COMPLETION completions[3];
+    ULONG count;
+
+    for (ULONG i = 0; i < 8; ++i) {
+        memset(data[i], (int)i, sizeof(data[i]));
+        writes[i].Buffer = data[i];
+        writes[i].Length = sizeof(data[i]);
+        writes[i].Lane = WRQUEUE_LANE_NORMAL;
+    }
+
+    TEST_CHECK(NT_SUCCESS(WrqInit(&q, WRQueueModeMessage, NULL, &TestOps, NULL)));
+
+    // four parked reads, room for three completions: the fourth read is completed by the push
+    ParkReads(&q, reads, 4);
+    TEST_CHECK(NT_SUCCESS(WrqPushWriteBatch(&q, writes, 8, completions, 3, &count)));
+    TEST_CHECK(count == 3);
+    for (ULONG i = 0; i < 3; ++i) {
+        TEST_CHECK(completions[i].Request == &reads[i]);
+        TEST_CHECK(NT_SUCCESS(completions[i].Status) && (completions[i].Information == sizeof(data[i])));
+        TEST_CHECK((reads[i].Completions == 0) && (memcmp(reads[i].Buffer, data[i], sizeof(data[i])) == 0));
+        TestCompleteRead(NULL, completions[i].Request, completions[i].Status, completions[i].Information);
+    }
+    TEST_CHECK((reads[3].Completions == 1) && (reads[3].Bytes == sizeof(data[3])));
+    TEST_CHECK(memcmp(reads[3].Buffer, data[3], sizeof(data[3])) == 0);
+
+    // the rest queued, in order
+    TEST_CHECK(q.QueuedEntries == 4);
+    for (ULONG i = 4; i < 8; ++i) {
+        TEST_CHECK(Pull(&q, buffer, sizeof(buffer)) == sizeof(data[i]));
+        TEST_CHECK(buffer[0] == (UCHAR)i);
+    }
+
+    // no reads parked: all of it queued
+    TEST_CHECK(NT_SUCCESS(WrqPushWriteBatch(&q, writes, 8, completions, 3, &count)));
+    TEST_CHECK((count == 0) && (q.QueuedEntries == 8));
+    WrqDestroy(&q);
+}
+
+
+//
+// A deferred write is read straight out of its own buffer, and completed
+// with the last byte taken.
+//
+static
+VOID
+CaseDeferredWrite(
+    VOID
+)
+{
+    WRQUEUE q;
+    TEST_WRITE write = { 0 };
+    UCHAR data[100];
+    UCHAR buffer[64];
+    ULONG completed;
+    BOOLEAN bTaken;
+
+    for (ULONG i = 0; i < sizeof(data); ++i) {
+        data[i] = (UCHAR)(i * 3);
+    }
+
+    TEST_CHECK(NT_SUCCESS(WrqInit(&q, WRQueueModeMessage, NULL, &TestOps, NULL)));
+    TEST_CHECK(NT_SUCCESS(WrqPushWrite(&q, WRQUEUE_LANE_NORMAL, &write, data, sizeof(data), &completed, &bTaken)));
+    TEST_CHECK(bTaken && (completed == 0));
+
+    TEST_CHECK(Pull(&q, buffer, 64) == 64);
+    TEST_CHECK(write.Completions == 0);
+    TEST_CHECK(memcmp(buffer, data, 64) == 0);
+    TEST_CHECK(Pull(&q, buffer, 64) == 36);
+    TEST_CHECK(memcmp(buffer, data + 64, 36) == 0);
+    TEST_CHECK((write.Completions == 1) && NT_SUCCESS(write.Status) && (write.Bytes == sizeof(data)));
+
+    // still queued at teardown: canceled
+    memset(&write, 0, sizeof(write));
+    TEST_CHECK(NT_SUCCESS(WrqPushWrite(&q, WRQUEUE_LANE_NORMAL, &write, data, sizeof(data), &completed, &bTaken)));
+    TEST_CHECK(bTaken);
+    WrqDestroy(&q);
+    TEST_CHECK((write.Completions == 1) && (write.Status == STATUS_CANCELLED));
+}
+
+
+
+//
+// The throttle: on at a high watermark, off at or below both low ones,
+// and writes beyond the hard limits refused.
+//
+typedef struct _FLOW_RECORD
+{
+    volatile LONG  Calls;
+    volatile LONG  Inside;
+    volatile LONG  bLast;
+    PWRQUEUE       Queue;
+    LONG           Pending;         // writes the producer holds while throttled
+} FLOW_RECORD, *PFLOW_RECORD;
+
+static
+VOID
+RecordFlow(
+    _In_ PVOID Context,
+    _In_ BOOLEAN bThrottle
+)
+{
+    PFLOW_RECORD record = (PFLOW_RECORD)Context;
+
+    TEST_CHECK(InterlockedIncrement(&(record->Inside)) == 1);
+
+    // a change undone before it got here is dropped, so calls alternate
+    TEST_CHECK((bThrottle ? 1 : 0) != ReadNoFence(&(record->bLast)));
+    WriteNoFence(&(record->bLast), bThrottle ? 1 : 0);
+    InterlockedIncrement(&(record->Calls));
+
+    InterlockedDecrement(&(record->Inside));
+}
+
+static
+VOID
+CaseWatermarks(
+    VOID
+)
+{
+    WRQUEUE q;
+    WRQUEUE_LIMITS limits;
+    FLOW_RECORD record = { 0 };
+    UCHAR buffer[256] = { 0 };
+    ULONG completed;
+    BOOLEAN bTaken;
+
+    WRQUEUE_LIMITS_INIT(&limits);
+    limits.MaxEntries = 16;
+    limits.HighWaterEntries = 8;
+    limits.LowWaterEntries = 2;
+    limits.MaxBytes = 1024;
+    limits.HighWaterBytes = 512;
+    limits.LowWaterBytes = 128;
+
+    TEST_CHECK(NT_SUCCESS(WrqInit(&q, WRQueueModeMessage, &limits, &TestOps, NULL)));
+    WrqSetFlowControl(&q, RecordFlow, &record);
+
+    // by entries
+    for (ULONG i = 0; i < 7; ++i) {
+        Push(&q, WRQUEUE_LANE_NORMAL, buffer, 1);
+    }
+    TEST_CHECK(!q.bThrottled && (record.Calls == 0));
+    Push(&q, WRQUEUE_LANE_NORMAL, buffer, 1);
+    TEST_CHECK(q.bThrottled && (record.Calls == 1) && record.bLast);
+
+    for (ULONG i = 8; i < 16; ++i) {
+        Push(&q, WRQUEUE_LANE_NORMAL, buffer, 1);
+    }
+    TEST_CHECK(!NT_SUCCESS(WrqPushWrite(&q, WRQUEUE_LANE_NORMAL, NULL, buffer, 1, &completed, &bTaken)));
+    TEST_CHECK((q.Refused == 1) && (q.QueuedEntries == 16) && (q.PeakEntries == 16));
+
+    for (ULONG i = 16; i > 3; --i) {
+        TEST_CHECK(Pull(&q, buffer, 64) == 1);
+    }
+    TEST_CHECK(q.bThrottled && (record.Calls == 1));
+    TEST_CHECK(Pull(&q, buffer, 64) == 1);
+    TEST_CHECK(!q.bThrottled && (record.Calls == 2) && !record.bLast);
+    TEST_CHECK(q.Throttles == 1);
+    TEST_CHECK(Pull(&q, buffer, 64) == 1);
+    TEST_CHECK(Pull(&q, buffer, 64) == 1);
+    TEST_CHECK(q.QueuedEntries == 0);
+
+    // by bytes, and off only once the entries are low too
+    Push(&q, WRQUEUE_LANE_NORMAL, buffer, 255);
+    Push(&q, WRQUEUE_LANE_NORMAL, buffer, 254);
+    Push(&q, WRQUEUE_LANE_NORMAL, buffer, 1);
+    Push(&q, WRQUEUE_LANE_NORMAL, buffer, 1);
+    TEST_CHECK(!q.bThrottled);
+    Push(&q, WRQUEUE_LANE_NORMAL, buffer, 1);
+    TEST_CHECK(q.bThrottled && (record.Calls == 3));
+    TEST_CHECK(Pull(&q, buffer, sizeof(buffer)) == 255);
+    TEST_CHECK(Pull(&q, buffer, sizeof(buffer)) == 254);
+    TEST_CHECK((q.QueuedBytes == 3) && (q.QueuedEntries == 3));
+    TEST_CHECK(q.bThrottled && (record.Calls == 3));
+    TEST_CHECK(Pull(&q, buffer, sizeof(buffer)) == 1);
+    TEST_CHECK(!q.bThrottled && (record.Calls == 4));
+    TEST_CHECK(Pull(&q, buffer, sizeof(buffer)) == 1);
+    TEST_CHECK(Pull(&q, buffer, sizeof(buffer)) == 1);
+
+    // a callback installed while throttled is told right away, the old one released
+    for (ULONG i = 0; i < 8; ++i) {
+        Push(&q, WRQUEUE_LANE_NORMAL, buffer, 1);
+    }
+    TEST_CHECK(record.bLast && (record.Calls == 5));
+    {
+        FLOW_RECORD other = { 0 };
+
+        WrqSetFlowControl(&q, RecordFlow, &other);
+        TEST_CHECK(!record.bLast && (record.Calls == 6));
+        TEST_CHECK(other.bLast && (other.Calls == 1));
+        WrqSetFlowControl(&q, NULL, NULL);
+        TEST_CHECK(!other.bLast && (other.Calls == 2));
+    }
+
+    WrqDestroy(&q);
+}
+
+//
+// A callback that, once released, pushes the writes its producer held,
+// as a restarted queue dispatching inline does; those may throttle it
+// again from within the call.
+//
+static
+VOID
+RestartFlow(
+    _In_ PVOID Context,
+    _In_ BOOLEAN bThrottle
+)
+{
+    PFLOW_RECORD record = (PFLOW_RECORD)Context;
+    UCHAR data[8] = { 0 };
+
+    RecordFlow(Context, bThrottle);
+
+    TEST_CHECK(InterlockedIncrement(&(record->Inside)) == 1);
+    while (!bThrottle && (record->Pending > 0) && !ReadAcquire(&(record->Queue->bThrottled))) {
+        --(record->Pending);
+        Push(record->Queue, WRQUEUE_LANE_NORMAL, data, sizeof(data));
+    }
+    InterlockedDecrement(&(record->Inside));
+}
+
+static
+VOID
+CaseFlowControlReentrant(
+    VOID
+)
+{
+    WRQUEUE q;
+    WRQUEUE_LIMITS limits;
+    FLOW_RECORD record = { 0 };
+    UCHAR buffer[8] = { 0 };
+    ULONG reads = 0;
+
+    WRQUEUE_LIMITS_INIT(&limits);
+    limits.MaxEntries = 16;
+    limits.HighWaterEntries = 8;
+    limits.LowWaterEntries = 2;
+
+    TEST_CHECK(NT_SUCCESS(WrqInit(&q, WRQueueModeMessage, &limits, &TestOps, NULL)));
+    record.Queue = &q;
+    WrqSetFlowControl(&q, RestartFlow, &record);
+
+    for (ULONG i = 0; i < 8; ++i) {
+        Push(&q, WRQUEUE_LANE_NORMAL, buffer, sizeof(buffer));
+    }
+    TEST_CHECK(q.bThrottled && record.bLast);
+    record.Pending = 20;
+
+    while (Pull(&q, buffer, sizeof(buffer)) > 0) {
+        ++reads;
+    }
+
+    TEST_CHECK((record.Pending == 0) && (reads == 28));
+    TEST_CHECK(!q.bThrottled && !record.bLast && (q.Refused == 0));
+    WrqDestroy(&q);
+}
+
+
+
+//
+// Writers and readers on several threads. Readers that find nothing park,
+// and cancel a share of their parked reads; writers back off while the
+// queue is throttled. Every write is read exactly once, every read
+// completed exactly once, and the throttle calls alternate, one at a time.
+//
+#define STRESS_WRITERS      4
+#define STRESS_READERS      4
+#define STRESS_WRITES       TEST_ROUNDS(50000)
+
+typedef struct _STRESS_MESSAGE
+{
+    ULONG   Writer;
+    ULONG   Sequence;
+    UCHAR   Fill[8];
+} STRESS_MESSAGE, *PSTRESS_MESSAGE;
+
+typedef struct _STRESS_CONTEXT
+{
+    WRQUEUE        Queue;
+    FLOW_RECORD    Flow;
+    volatile LONG *Seen;            // by writer and sequence
+    volatile LONG  Received;
+    volatile LONG  WritersLeft;
+    volatile LONG64 Canceled;
+} STRESS_CONTEXT, *PSTRESS_CONTEXT;
+
+static
+VOID
+StressReceive(
+    _Inout_ PSTRESS_CONTEXT Stress,
+    _In_reads_bytes_(Length) const UCHAR *Data,
+    _In_ SIZE_T Length
+)
+{
+    STRESS_MESSAGE message;
+
+    TEST_CHECK(Length == sizeof(message));
+    memcpy(&message, Data, sizeof(message));
+    TEST_CHECK((message.Writer < STRESS_WRITERS) && (message.Sequence < (ULONG)STRESS_WRITES));
+    TEST_CHECK(message.Fill[7] == (UCHAR)(message.Writer + message.Sequence));
+    TEST_CHECK(InterlockedIncrement(&(Stress->Seen[(message.Writer * STRESS_WRITES) + message.Sequence])) == 1);
+    InterlockedIncrement(&(Stress->Received));
+}
+
+static
+VOID
+StressThread(
+    _In_ ULONG Index,
+    _In_opt_ PVOID Context
+)
+{
+    PSTRESS_CONTEXT stress = (PSTRESS_CONTEXT)Context;
+    LONG total = STRESS_WRITERS * STRESS_WRITES;
+    unsigned seed = Index + 1;
+
+    if (Index < STRESS_WRITERS) {
+        for (LONG i = 0; i < STRESS_WRITES; ++i) {
+            STRESS_MESSAGE message = { Index, (ULONG)i, { 0 } };
+            ULONG completed;
+            BOOLEAN bTaken;
+
+            message.Fill[7] = (UCHAR)(Index + i);
+            while (ReadAcquire(&(stress->Flow.bLast))) {
+                TestYield();
+            }
+            while (!NT_SUCCESS(WrqPushWrite(&(stress->Queue), (ULONG)i % WRQUEUE_NUM_LANES, NULL,
+                                            &message, sizeof(message), &completed, &bTaken))) {
+                TestYield();
+            }
+        }
+        InterlockedDecrement(&(stress->WritersLeft));
+        return;
+    }
+
+    while (ReadAcquire(&(stress->Received)) < total) {
+        PTEST_READ read = (PTEST_READ)OsAllocate(sizeof(TEST_READ));
+        BOOLEAN bReady;
+        SIZE_T bytes;
+        NTSTATUS status;
+
+        TEST_CHECK(read != NULL);
+        read->Length = sizeof(read->Buffer);
+        seed = (seed * 1103515245) + 12345;
+
+        status = WrqPullRead(&(stress->Queue), read, read->Buffer, read->Length, &bReady, &bytes);
+        if (bReady) {
+            TEST_CHECK(NT_SUCCESS(status));
+            StressReceive(stress, read->Buffer, bytes);
+            OsFree(read);
+            continue;
+        }
+
+        // parked: cancel some right away, and the rest once there is nothing left to wait for
+        if (((seed >> 16) % 4) != 0) {
+            while (ReadAcquire(&(read->Completions)) == 0) {
+                if ((ReadAcquire(&(stress->WritersLeft)) == 0) &&
+                    (ReadAcquire(&(stress->Received)) == total)) {
+                    break;
+                }
+                TestYield();
+            }
+        }
+        if (InterlockedCompareExchange(&(read->State), READ_CANCELED, READ_ARMED) == READ_ARMED) {
+            WrqCancelRead(read->Parked);
+        }
+        while (ReadAcquire(&(read->Completions)) == 0) {
+            TestYield();
+        }
+
+        if (read->Status == STATUS_CANCELLED) {
+            InterlockedIncrement64(&(stress->Canceled));
+        } else {
+            TEST_CHECK(NT_SUCCESS(read->Status));
+            StressReceive(stress, read->Buffer, read->Bytes);
+        }
+        OsFree(read);
+    }
+}
+
+static
+VOID
+CaseWritersReadersCancel(
+    VOID
+)
+{
+    static STRESS_CONTEXT stress;
+    WRQUEUE_LIMITS limits;
+    LONG total = STRESS_WRITERS * STRESS_WRITES;
+
+    memset(&stress, 0, sizeof(stress));
+    WRQUEUE_LIMITS_INIT(&limits);
+    limits.MaxEntries = 64;
+    limits.HighWaterEntries = 32;
+    limits.LowWaterEntries = 8;
+
+    TEST_CHECK(NT_SUCCESS(WrqInit(&(stress.Queue), WRQueueModeMessage, &limits, &TestOps, NULL)));
+    stress.Seen = (volatile LONG *)OsAllocate(total * sizeof(LONG));
+    TEST_CHECK(stress.Seen != NULL);
+    stress.WritersLeft = STRESS_WRITERS;
+
+    WrqSetFlowControl(&(stress.Queue), RecordFlow, &(stress.Flow));
+    TestRunThreads(STRESS_WRITERS + STRESS_READERS, StressThread, &stress);
+
+    for (LONG i = 0; i < total; ++i) {
+        TEST_CHECK(stress.Seen[i] == 1);
+    }
+    TEST_CHECK((stress.Queue.QueuedBytes == 0) && (stress.Queue.QueuedEntries == 0));
+    TEST_CHECK(!stress.Queue.bThrottled && !stress.Flow.bLast);
+    printf("    %ld throttle calls, %lld reads canceled, %lld writes refused, %d reads parked at most\n",
+           (long)stress.Flow.Calls, (long long)stress.Canceled, (long long)stress.Queue.Refused,
+           (int)stress.Queue.PeakParkedReads);
+
+    WrqSetFlowControl(&(stress.Queue), NULL, NULL);
+    WrqDestroy(&(stress.Queue));
+    OsFree((PVOID)stress.Seen);
+}
+
+
+static const TEST_CASE Cases[] =
+{
+    TEST_CASE_ENTRY(CaseMessages),
+    TEST_CASE_ENTRY(CaseParkedReads),
+    TEST_CASE_ENTRY(CaseStream),
+    TEST_CASE_ENTRY(CaseLanes),
+    TEST_CASE_ENTRY(CaseOversizedWrites),
+    TEST_CASE_ENTRY(CaseReservation),
+    TEST_CASE_ENTRY(CaseBatch),
+    TEST_CASE_ENTRY(CaseDeferredWrite),
+    TEST_CASE_ENTRY(CaseWatermarks),
+    TEST_CASE_ENTRY(CaseFlowControlReentrant),
+    TEST_CASE_ENTRY(CaseWritersReadersCancel),
+};
+
+TEST_MAIN(Cases)
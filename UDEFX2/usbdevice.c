@@ -15,12 +15,12 @@ Abstract:
 #include "Device.h"
 #include "usbdevice.h"
 #include "USBCom.h"
+#include "UsbDescriptor.h"
 #include "ucx/1.4/ucxobjects.h"
 #include "usbdevice.tmh"
 
 
 
-#define UDECXMBIM_POOL_TAG 'UDEI'
 
 
 
@@ -40,11 +40,19 @@ const UCHAR g_LanguageDescriptor[] = { 4,3,9,4 };
 const USB_DEVICE_DESCRIPTOR g_UsbDeviceDescriptor = {
     sizeof(USB_DEVICE_DESCRIPTOR),   // Descriptor size
     USB_DEVICE_DESCRIPTOR_TYPE,      // Device descriptor type
+#if UDEFX2_SUPERSPEED
+    0x0320,                          // USB 3.2
+#else
     0x0200,                          // USB 2.0
+#endif
     0x00,                            // Device class (interface-class defined)
     0x00,                            // Device subclass
     0x00,                            // Device protocol
+#if UDEFX2_SUPERSPEED
+    0x09,                            // Maxpacket size for EP0: 2^9 at SuperSpeed
+#else
     0x40,                            // Maxpacket size for EP0
+#endif
     UDEFX2_DEVICE_VENDOR_ID,         // Vendor ID
     UDEFX2_DEVICE_PROD_ID,           // Product ID
     0x0100,                          // firmware revision
@@ -54,54 +62,66 @@ const USB_DEVICE_DESCRIPTOR g_UsbDeviceDescriptor = {
     0x01                             // Number of configurations
 };
 
+//
+// The endpoints, described once; the configuration descriptor set for the
+// speed profile is written out from this at compile time (UsbDescriptorSet.h).
+// Bulk pair 1 and up come after the interrupt endpoint. The isochronous pair
+// is only in alternate setting 1, so the default setting takes no isochronous
+// bandwidth.
+//
+#define UDEFX2_BULK_PAIR_ENDPOINTS(EP, __pair)                                                      \
+    EP(g_BulkOutEndpointAddressOf(__pair), UD_ENDPOINT_BULK, 0, 0, UDEFX2_BULK_MAX_BURST)          \
+    EP(g_BulkInEndpointAddressOf(__pair),  UD_ENDPOINT_BULK, 0, 0, UDEFX2_BULK_MAX_BURST)
+
+#if UDEFX2_BULK_PAIRS > 1
+#define UDEFX2_BULK_PAIR_1(EP) UDEFX2_BULK_PAIR_ENDPOINTS(EP, 1)
+#else
+#define UDEFX2_BULK_PAIR_1(EP)
+#endif
+#if UDEFX2_BULK_PAIRS > 2
+#define UDEFX2_BULK_PAIR_2(EP) UDEFX2_BULK_PAIR_ENDPOINTS(EP, 2)
+#else
+#define UDEFX2_BULK_PAIR_2(EP)
+#endif
+#if UDEFX2_BULK_PAIRS > 3
+#define UDEFX2_BULK_PAIR_3(EP) UDEFX2_BULK_PAIR_ENDPOINTS(EP, 3)
+#else
+#define UDEFX2_BULK_PAIR_3(EP)
+#endif
+
+#define UDEFX2_ENDPOINTS(EP)                                                                        \
+    UDEFX2_BULK_PAIR_ENDPOINTS(EP, 0)                                                               \
+    EP(g_InterruptEndpointAddress, UD_ENDPOINT_INTERRUPT, 64, 1, 0)   /* 1 microframe */            \
+    UDEFX2_BULK_PAIR_1(EP)                                                                          \
+    UDEFX2_BULK_PAIR_2(EP)                                                                          \
+    UDEFX2_BULK_PAIR_3(EP)
+
+#define UDEFX2_ISOCH_ENDPOINTS(EP)                                                                  \
+    EP(g_IsochOutEndpointAddress, UD_ENDPOINT_ISOCHRONOUS, g_IsochMaxPacketSize, 1, 0)              \
+    EP(g_IsochInEndpointAddress,  UD_ENDPOINT_ISOCHRONOUS, g_IsochMaxPacketSize, 1, 0)
+
+#if UDEFX2_SUPERSPEED
+#define UDEFX2_SPEED SS
+#else
+#define UDEFX2_SPEED HS
+#endif
+
 const UCHAR g_UsbConfigDescriptorSet[] =
 {
-    // Configuration Descriptor Type
-    0x9,                              // Descriptor Size
-    USB_CONFIGURATION_DESCRIPTOR_TYPE, // Configuration Descriptor Type
-    0x27, 0x00,                        // Length of this descriptor and all sub descriptors
-    0x1,                               // Number of interfaces
-    0x01,                              // Configuration number
-    0x00,                              // Configuration string index
-    0xA0,                              // Config characteristics - bus powered
-    0x32,                              // Max power consumption of device (in 2mA unit) : 0 ma
-
-        // Interface  descriptor
-        0x9,                                      // Descriptor size
-        USB_INTERFACE_DESCRIPTOR_TYPE,             // Interface Association Descriptor Type
-        0,                                        // bInterfaceNumber
-        0,                                        // bAlternateSetting
-        3,                                        // bNumEndpoints
-        0xFF,                                     // bInterfaceClass
-        0x00,                                     // bInterfaceSubClass
-        0x00,                                     // bInterfaceProtocol
-        0x00,                                     // iInterface
-
-        // Bulk Out Endpoint descriptor
-        0x07,                           // Descriptor size
-        USB_ENDPOINT_DESCRIPTOR_TYPE,   // bDescriptorType
-        g_BulkOutEndpointAddress,       // bEndpointAddress
-        USB_ENDPOINT_TYPE_BULK,         // bmAttributes - bulk
-        0x00, 0x2,                      // wMaxPacketSize
-        0x00,                           // bInterval
-
-        // Bulk IN endpoint descriptor
-        0x07,                           // Descriptor size 
-        USB_ENDPOINT_DESCRIPTOR_TYPE,   // Descriptor type
-        g_BulkInEndpointAddress,        // Endpoint address and description
-        USB_ENDPOINT_TYPE_BULK,         // bmAttributes - bulk
-        0x00, 0x02,                     // Max packet size
-        0x00,                           // Servicing interval for data transfers : NA for bulk
-
-        // Interrupt IN endpoint descriptor
-        0x07,                           // Descriptor size 
-        USB_ENDPOINT_DESCRIPTOR_TYPE,   // Descriptor type
-        g_InterruptEndpointAddress,     // Endpoint address and description
-        USB_ENDPOINT_TYPE_INTERRUPT,    // bmAttributes - interrupt
-        0x40, 0x0,                      // Max packet size = 64
-        0x01                            // Servicing interval for interrupt (1ms/1 frame)
+    UD_ALTERNATE_CONFIGURATION_SET(UDEFX2_SPEED, UDEFX2_ENDPOINTS, UDEFX2_ISOCH_ENDPOINTS,
+        0xA0,                               // bus powered, remote wakeup
+        100,                                // mA
+        0xFF, 0x00, 0x00)                   // vendor-specific interface
 };
 
+UD_CHECK_ALTERNATE_CONFIGURATION_SET(UDEFX2_SPEED, UDEFX2_ENDPOINTS, UDEFX2_ISOCH_ENDPOINTS, g_UsbConfigDescriptorSet);
+C_ASSERT(UD_ENDPOINT_COUNT(UDEFX2_ENDPOINTS) == 1 + (2 * UDEFX2_BULK_PAIRS));
+C_ASSERT(UD_ENDPOINT_COUNT(UDEFX2_ISOCH_ENDPOINTS) == 2);
+
+const UCHAR g_UsbBosDescriptorSet[] = { UD_BOS_SET() };
+
+C_ASSERT(sizeof(g_UsbBosDescriptorSet) == UD_BOS_LENGTH);
+
 
 
 //
@@ -119,13 +139,9 @@ UsbValidateConstants(
     NT_ASSERT(((PUSB_STRING_DESCRIPTOR)g_LanguageDescriptor)->bString[0] == AMERICAN_ENGLISH);
     //NT_ASSERT(((PUSB_STRING_DESCRIPTOR)g_LanguageDescriptor)->bString[1] == PRC_CHINESE);
 
-    NT_ASSERT(((PUSB_CONFIGURATION_DESCRIPTOR)g_UsbConfigDescriptorSet)->wTotalLength ==
-        sizeof(g_UsbConfigDescriptorSet));
     NT_ASSERT(((PUSB_STRING_DESCRIPTOR)g_LanguageDescriptor)->bLength ==
         sizeof(g_LanguageDescriptor));
 
-    NT_ASSERT(((PUSB_CONFIGURATION_DESCRIPTOR)g_UsbConfigDescriptorSet)->bDescriptorType ==
-        USB_CONFIGURATION_DESCRIPTOR_TYPE);
     NT_ASSERT(((PUSB_STRING_DESCRIPTOR)g_LanguageDescriptor)->bDescriptorType ==
         USB_STRING_DESCRIPTOR_TYPE);
 }
@@ -176,7 +192,8 @@ Usb_Initialize(
     //
     // Set required attributes.
     //
-    UdecxUsbDeviceInitSetSpeed(controllerContext->ChildDeviceInit, UdecxUsbHighSpeed);
+    UdecxUsbDeviceInitSetSpeed(controllerContext->ChildDeviceInit,
+        UDEFX2_SUPERSPEED ? UdecxUsbSuperSpeed : UdecxUsbHighSpeed);
 
     UdecxUsbDeviceInitSetEndpointsType(controllerContext->ChildDeviceInit, UdecxEndpointTypeSimple);
 
@@ -251,26 +268,18 @@ Usb_ReadDescriptorsAndPlugIn(
     NTSTATUS                          status;
     PUDECX_USBCONTROLLER_CONTEXT controllerContext = GetUsbControllerContext(WdfControllerDevice);
 
-    //
-    // Compute configuration descriptor dynamically.
-    //
-    PUSB_CONFIGURATION_DESCRIPTOR pComputedConfigDescSet = (PUSB_CONFIGURATION_DESCRIPTOR)
-        ExAllocatePool2(POOL_FLAG_NON_PAGED, sizeof(g_UsbConfigDescriptorSet), UDECXMBIM_POOL_TAG);
-
-    if (pComputedConfigDescSet == NULL) {
+    ULONG badOffset = 0;
 
-        status = STATUS_INSUFFICIENT_RESOURCES;
-        LogError(TRACE_DEVICE, "Failed to allocate %d bytes for temporary config descriptor %!STATUS!",
-            sizeof(g_UsbConfigDescriptorSet), status);
+    // built and size-checked at compile time; parsed once more here as a host would
+    status = UdValidateConfiguration(UDEFX2_SUPERSPEED ? UdSpeedSuper : UdSpeedHigh,
+        g_UsbConfigDescriptorSet, sizeof(g_UsbConfigDescriptorSet), &badOffset);
+    if (!NT_SUCCESS(status)) {
+        LogError(TRACE_DEVICE, "Configuration descriptor set invalid at offset %d %!STATUS!", badOffset, status);
         goto exit;
     }
 
-    RtlCopyMemory(pComputedConfigDescSet,
-        g_UsbConfigDescriptorSet,
-        sizeof(g_UsbConfigDescriptorSet));
-
     status = UdecxUsbDeviceInitAddDescriptor(controllerContext->ChildDeviceInit,
-        (PUCHAR)pComputedConfigDescSet,
+        (PUCHAR)g_UsbConfigDescriptorSet,
         sizeof(g_UsbConfigDescriptorSet));
 
     if (!NT_SUCCESS(status)) {
@@ -278,6 +287,23 @@ Usb_ReadDescriptorsAndPlugIn(
         goto exit;
     }
 
+    if (UDEFX2_SUPERSPEED) {
+        status = UdValidateBos(g_UsbBosDescriptorSet, sizeof(g_UsbBosDescriptorSet), &badOffset);
+        if (!NT_SUCCESS(status)) {
+            LogError(TRACE_DEVICE, "BOS descriptor set invalid at offset %d %!STATUS!", badOffset, status);
+            goto exit;
+        }
+
+        status = UdecxUsbDeviceInitAddDescriptor(controllerContext->ChildDeviceInit,
+            (PUCHAR)g_UsbBosDescriptorSet,
+            sizeof(g_UsbBosDescriptorSet));
+
+        if (!NT_SUCCESS(status)) {
+
+            goto exit;
+        }
+    }
+
 
     //
     // Create emulated USB device
@@ -301,6 +327,16 @@ Usb_ReadDescriptorsAndPlugIn(
         goto exit;
     }
 
+    // EP0's max packet size is a power of two at SuperSpeed
+    status = Io_RegisterEndpoints(controllerContext->ChildDevice,
+        UDEFX2_SUPERSPEED ? (USHORT)(1 << g_UsbDeviceDescriptor.bMaxPacketSize0) : g_UsbDeviceDescriptor.bMaxPacketSize0,
+        g_UsbConfigDescriptorSet,
+        sizeof(g_UsbConfigDescriptorSet));
+    if (!NT_SUCCESS(status)) {
+
+        goto exit;
+    }
+
 
     PUSB_CONTEXT deviceContext = GetUsbDeviceContext(controllerContext->ChildDevice);
 
@@ -314,42 +350,25 @@ Usb_ReadDescriptorsAndPlugIn(
     deviceContext->IsAwake = TRUE;  // for some strange reason, it starts out awake!
 
     //
-    // Create static endpoints.
+    // Create static endpoints, the ones of the configuration descriptor.
     //
-    status = UsbCreateEndpointObj(controllerContext->ChildDevice,
-        USB_DEFAULT_ENDPOINT_ADDRESS,
-        &(deviceContext->UDEFX2ControlEndpoint) );
+    PEP_REGISTRY pRegistry = &(WdfDeviceGetIoContext(controllerContext->ChildDevice)->Endpoints);
 
-    if (!NT_SUCCESS(status)) {
+    for (ULONG i = 0; i < EP_SLOTS; ++i) {
+        PEP_SLOT slot = EpAt(pRegistry, i);
 
-        goto exit;
-    }
+        if (slot == NULL) {
+            continue;
+        }
 
-    status = UsbCreateEndpointObj(controllerContext->ChildDevice,
-        g_BulkOutEndpointAddress, 
-        &(deviceContext->UDEFX2BulkOutEndpoint) );
+        status = UsbCreateEndpointObj(controllerContext->ChildDevice,
+            slot->Address,
+            &(deviceContext->UDEFX2Endpoint[i]) );
 
-    if (!NT_SUCCESS(status)) {
+        if (!NT_SUCCESS(status)) {
 
-        goto exit;
-    }
-
-    status = UsbCreateEndpointObj(controllerContext->ChildDevice,
-        g_BulkInEndpointAddress,
-        &(deviceContext->UDEFX2BulkInEndpoint));
-
-    if (!NT_SUCCESS(status)) {
-
-        goto exit;
-    }
-
-    status = UsbCreateEndpointObj(controllerContext->ChildDevice,
-        g_InterruptEndpointAddress,
-        &(deviceContext->UDEFX2InterruptInEndpoint));
-
-    if (!NT_SUCCESS(status)) {
-
-        goto exit;
+            goto exit;
+        }
     }
 
     //
@@ -357,7 +376,11 @@ Usb_ReadDescriptorsAndPlugIn(
     //
     UDECX_USB_DEVICE_PLUG_IN_OPTIONS pluginOptions;
     UDECX_USB_DEVICE_PLUG_IN_OPTIONS_INIT(&pluginOptions);
-    pluginOptions.Usb20PortNumber = 1;
+    if (UDEFX2_SUPERSPEED) {
+        pluginOptions.Usb30PortNumber = UDEFX2_USB30_PORT;
+    } else {
+        pluginOptions.Usb20PortNumber = UDEFX2_USB20_PORT;
+    }
     status = UdecxUsbDevicePlugIn(controllerContext->ChildDevice, &pluginOptions);
 
 
@@ -365,15 +388,6 @@ Usb_ReadDescriptorsAndPlugIn(
 
 exit:
 
-    //
-    // Free temporary allocation always.
-    //
-    if (pComputedConfigDescSet != NULL) {
-
-        ExFreePoolWithTag(pComputedConfigDescSet, UDECXMBIM_POOL_TAG);
-        pComputedConfigDescSet = NULL;
-    }
-
     return status;
 }
 
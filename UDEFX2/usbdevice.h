@@ -25,13 +25,23 @@ Abstract:
 
 
 
+//
+// Bulk OUT/IN endpoint pairs, set at build time (the descriptors are static).
+// With more than one, messages are striped across all pairs (Stripe.h);
+// pair 0 is the original one, and the only one with sink and pattern modes.
+//
+#ifndef UDEFX2_BULK_PAIRS
+#define UDEFX2_BULK_PAIRS 1
+#endif
+#define UDEFX2_MAX_BULK_PAIRS 4
+
+C_ASSERT((UDEFX2_BULK_PAIRS >= 1) && (UDEFX2_BULK_PAIRS <= UDEFX2_MAX_BULK_PAIRS));
+
+
 // device context
 typedef struct _USB_CONTEXT {
     WDFDEVICE             ControllerDevice;
-    UDECXUSBENDPOINT      UDEFX2ControlEndpoint;
-	UDECXUSBENDPOINT      UDEFX2BulkOutEndpoint;
-    UDECXUSBENDPOINT      UDEFX2BulkInEndpoint;
-    UDECXUSBENDPOINT      UDEFX2InterruptInEndpoint;
+    UDECXUSBENDPOINT      UDEFX2Endpoint[UDEFX2_MAX_ENDPOINTS];   // by endpoint registry slot
     BOOLEAN               IsAwake;
 } USB_CONTEXT, *PUSB_CONTEXT;
 
@@ -52,13 +62,53 @@ WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(USB_CONTEXT, GetUsbDeviceContext);
 #define g_BulkOutEndpointAddress 2
 #define g_BulkInEndpointAddress    0x84
 #define g_InterruptEndpointAddress 0x86
+// pair 1 and up come after the interrupt endpoint: OUT 7, 9, 11 and IN 0x88, 0x8A, 0x8C
+#define g_BulkOutEndpointAddressOf(__pair) ((UCHAR)(((__pair) == 0) ? g_BulkOutEndpointAddress : 5 + 2 * (__pair)))
+#define g_BulkInEndpointAddressOf(__pair)  ((UCHAR)(((__pair) == 0) ? g_BulkInEndpointAddress : g_InterruptEndpointAddress + 2 * (__pair)))
+
+// isochronous pair: one packet of up to g_IsochMaxPacketSize every microframe
+#define g_IsochOutEndpointAddress  3
+#define g_IsochInEndpointAddress   0x83
+#define g_IsochMaxPacketSize       1024
+#define g_IsochIntervalsPerSecond  8000
+
+//
+// Speed profile, set at build time. SuperSpeed adds a BOS descriptor and
+// endpoint companions, with bulk bursts of UDEFX2_BULK_MAX_BURST + 1
+// packets of 1024 bytes; high speed has 512-byte bulk packets.
+//
+#ifndef UDEFX2_SUPERSPEED
+#define UDEFX2_SUPERSPEED 0
+#endif
+#ifndef UDEFX2_BULK_MAX_BURST
+#define UDEFX2_BULK_MAX_BURST 15
+#endif
+
+C_ASSERT(UDEFX2_BULK_MAX_BURST <= 15);
+
+#if UDEFX2_SUPERSPEED
+#define g_BulkMaxPacketSize        1024
+#else
+#define g_BulkMaxPacketSize        512
+#endif
+
+
+//
+// Root ports of the emulated controller, given to UdeCx in its
+// UDECX_WDF_DEVICE_CONFIG. UdeCx numbers the USB 2.0 ones first, from 1,
+// then the USB 3.x ones; the device plugs into the first of its speed.
+//
+#define UDEFX2_USB20_PORTS       1
+#define UDEFX2_USB30_PORTS       1
+#define UDEFX2_USB20_PORT        1
+#define UDEFX2_USB30_PORT        (UDEFX2_USB20_PORTS + 1)
+
+C_ASSERT((UDEFX2_USB20_PORTS >= 1) && (UDEFX2_USB30_PORTS >= 1));
 
 
 #define UDEFX2_DEVICE_VENDOR_ID  0x1209
 #define UDEFX2_DEVICE_PROD_ID    0x0887
 
-extern const UCHAR g_UsbConfigDescriptorSet[];
-
 // ------------------------------------------------
 
 
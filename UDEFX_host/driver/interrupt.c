@@ -23,6 +23,7 @@ Environment:
 --*/
 
 #include <hostude.h>
+#include "IntrPacket.h"
 
 #include "interrupt.tmh"
 
@@ -54,7 +55,7 @@ Return Value:
     WDF_USB_CONTINUOUS_READER_CONFIG_INIT(&contReaderConfig,
                                           OsrFxEvtUsbInterruptPipeReadComplete,
                                           DeviceContext,    // Context
-                                          sizeof(DEVICE_INTR_FLAGS) );   // TransferLength
+                                          INTR_PACKET_MAX_SIZE );   // TransferLength
 
     contReaderConfig.EvtUsbTargetPipeReadersFailed = OsrFxEvtUsbInterruptReadersFailed;
 
@@ -108,8 +109,10 @@ Return Value:
 
 --*/
 {
-    PDEVICE_INTR_FLAGS  intrFlags = NULL;
+    PUCHAR              packet = NULL;
     DEVICE_INTR_FLAGS   newFlags;
+    INTR_PACKET_HEADER  header;
+    INTR_PACKET_RECORD  records[INTR_PACKET_MAX_EVENTS];
     WDFDEVICE           device;
     PDEVICE_CONTEXT     pDeviceContext = Context;
 
@@ -132,21 +135,38 @@ Return Value:
     }
 
 
-    NT_ASSERT(NumBytesTransferred == sizeof(DEVICE_INTR_FLAGS));
+    packet = WdfMemoryGetBuffer(Buffer, NULL);
 
-    intrFlags = WdfMemoryGetBuffer(Buffer, NULL);
+    if (NumBytesTransferred == sizeof(DEVICE_INTR_FLAGS)) {
+        // original format, one event; deal with possible memory alignment issues
+        memcpy(&newFlags, packet, sizeof(newFlags));
 
-    // deal with possible memory alignment issues
-    memcpy(&newFlags, intrFlags, sizeof(newFlags));
+        TraceEvents(TRACE_LEVEL_INFORMATION, DBG_INIT,
+                    "OsrFxEvtUsbInterruptPipeReadComplete flags %x\n",
+                    newFlags);
 
-    TraceEvents(TRACE_LEVEL_INFORMATION, DBG_INIT,
-                "OsrFxEvtUsbInterruptPipeReadComplete flags %x\n",
-                newFlags);
+        OsrUsbIoctlGetInterruptMessage(device, STATUS_SUCCESS, newFlags);
+        return;
+    }
+
+    if (!NT_SUCCESS(IntrPacketDecode(packet, NumBytesTransferred, &header, records))) {
+        TraceEvents(TRACE_LEVEL_ERROR, DBG_INIT,
+                    "OsrFxEvtUsbInterruptPipeReadComplete malformed packet, %d bytes\n",
+                    (int)NumBytesTransferred);
+        return;
+    }
 
     //
-    // Handle any pending Interrupt Message IOCTLs. 
+    // Handle any pending Interrupt Message IOCTLs, one event at a time,
+    // oldest first.
     //
-    OsrUsbIoctlGetInterruptMessage(device, STATUS_SUCCESS, newFlags);
+    for (ULONG i = 0; i < header.Count; ++i) {
+        TraceEvents(TRACE_LEVEL_INFORMATION, DBG_INIT,
+                    "OsrFxEvtUsbInterruptPipeReadComplete flags %x seq %d (device overflows %d)\n",
+                    records[i].Flags, records[i].Sequence, header.Overflows);
+
+        OsrUsbIoctlGetInterruptMessage(device, STATUS_SUCCESS, records[i].Flags);
+    }
 
 }
 
@@ -77,6 +77,7 @@ char *G_WriteText = "DefaultWrite";
 
 BOOL G_fAutoBot = FALSE;
 BOOL G_fCommandTrip = FALSE;
+BOOL G_fDumpFlightRecorder = FALSE;
 
 DEVICE_INTR_FLAGS G_IntrValue = 0;
 
@@ -253,6 +254,7 @@ Return Value:
 
     printf("-a  -- autonomous back-channel agent(continuously wait for mission and complete)\n");
     printf("-c [text] -- send one command to autonomous agent (-a)\n");
+    printf("-f  -- dump the virtual device's URB flight recorder\n");
     return;
 }
 
@@ -352,6 +354,11 @@ Return Value:
                 G_fGenerateVirtualDeviceIntr = TRUE;
                 break;
 
+            case 'f':
+            case 'F':
+                G_fDumpFlightRecorder = TRUE;
+                break;
+
 
             default:
                 Usage();
@@ -482,6 +489,93 @@ GenerateDeviceInterrupt(DEVICE_INTR_FLAGS value)
 
 
 
+static int __cdecl
+CompareFlightRecords(const void *a, const void *b)
+{
+    ULONG64 ta = ((const UDEFX2_FLIGHT_RECORD *)a)->Timestamp;
+    ULONG64 tb = ((const UDEFX2_FLIGHT_RECORD *)b)->Timestamp;
+
+    return (ta < tb) ? -1 : ((ta > tb) ? 1 : 0);
+}
+
+
+/*++
+Routine Description:
+
+    Fetches the URB flight recorder from the virtual device over the
+    back-channel, and prints it as one timeline, oldest first, with
+    times relative to the oldest record.
+
+--*/
+BOOL
+DumpFlightRecorder()
+{
+    HANDLE  deviceHandle;
+    DWORD   size = 1024 * 1024;     // enough for 64 rings of 256 records
+    DWORD   returned = 0;
+    ULONG   i;
+    PUDEFX2_FLIGHT_DUMP pDump;
+
+    deviceHandle = OpenDevice((LPGUID)&GUID_DEVINTERFACE_UDE_BACKCHANNEL);
+    if (deviceHandle == INVALID_HANDLE_VALUE) {
+        printf("Unable to find virtual controller device!\n");
+        return FALSE;
+    }
+
+    pDump = (PUDEFX2_FLIGHT_DUMP)malloc(size);
+    if (pDump == NULL) {
+        printf("Unable to allocate %d bytes\n", size);
+        CloseHandle(deviceHandle);
+        return FALSE;
+    }
+
+    if (!DeviceIoControl(deviceHandle,
+        IOCTL_UDEFX2_DUMP_FLIGHT_RECORDER,
+        NULL, 0,
+        pDump, size,
+        &returned,
+        0)) {
+        printf("DeviceIoControl failed with error 0x%x\n", GetLastError());
+        goto exit;
+    }
+
+    if ((pDump->Version != UDEFX2_FLIGHT_DUMP_VERSION) ||
+        (pDump->RecordSize != sizeof(UDEFX2_FLIGHT_RECORD))) {
+        printf("Unknown flight recorder dump version %d, record size %d\n", pDump->Version, pDump->RecordSize);
+        goto exit;
+    }
+
+    printf("%d records from %d rings, %I64u recorded in all\n", pDump->Count, pDump->Rings, pDump->Recorded);
+    if (pDump->Count == 0) {
+        goto exit;
+    }
+
+    qsort(pDump->Records, pDump->Count, sizeof(UDEFX2_FLIGHT_RECORD), CompareFlightRecords);
+
+    printf("%14s %4s %4s %-8s %8s %10s %s\n", "us", "ring", "ep", "event", "length", "status", "request");
+    for (i = 0; i < pDump->Count; ++i) {
+        PUDEFX2_FLIGHT_RECORD r = &(pDump->Records[i]);
+        ULONG64 us = ((r->Timestamp - pDump->Records[0].Timestamp) * 1000000) / pDump->TimestampFrequency;
+
+        printf("%14I64u %4d %4x %-8s %8d %10x %I64x\n",
+            us,
+            r->Ring,
+            r->Endpoint,
+            (r->Event == UDEFX2_FLIGHT_EVENT_COMPLETE) ? "complete" :
+                ((r->Event == UDEFX2_FLIGHT_EVENT_PEND) ? "pend" : "?"),
+            r->Length,
+            r->Status,
+            r->RequestId);
+    }
+
+exit:
+    free(pDump);
+    CloseHandle(deviceHandle);
+    return TRUE;
+}
+
+
+
 
 
 BOOL
@@ -739,6 +833,9 @@ Return Value:
     }
     else if (G_fCommandTrip) {
         CommandTrip(&GUID_DEVINTERFACE_HOSTUDE, G_WriteText);
+    }
+    else if (G_fDumpFlightRecorder) {
+        DumpFlightRecorder();
     } else  {
         retValue = 1;
         Usage();
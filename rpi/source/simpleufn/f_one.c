@@ -21,6 +21,7 @@
 
 #include "u_f.h" // from gaget utilities, part of Linux
 #include "f_one.h" // defines the interface of this function, usable by gadgets that need this function.
+#include "UsbDescriptorSet.h" // from the UDEFX2 driver: descriptors written out at compile time
 
 /*
  * LOOPBACK FUNCTION ... a testing vehicle for USB peripherals,
@@ -46,105 +47,69 @@ static inline struct f_loopback *func_to_loop(struct usb_function *f)
 
 /*-------------------------------------------------------------------------*/
 
+/*
+ * The function's endpoints, described once, in the UDEFX2 driver's format
+ * (see UsbDescriptorSet.h); the full, high and super speed descriptors are
+ * all written out from this at compile time. Endpoint numbers are only
+ * placeholders: usb_ep_autoconfig() picks the real ones at bind time.
+ */
+#define F_ONE_ENDPOINTS(EP)						\
+	EP(USB_DIR_OUT | 1, UD_ENDPOINT_BULK, 0, 0, 0)	/* sink */	\
+	EP(USB_DIR_IN | 1, UD_ENDPOINT_BULK, 0, 0, 0)	/* source */
+
+#define F_ONE_SINK	0
+#define F_ONE_SOURCE	1
+
+UD_CHECK_ENDPOINTS(F_ONE_ENDPOINTS);
+
 static struct usb_interface_descriptor loopback_intf = {
 	.bLength =		sizeof(loopback_intf),
 	.bDescriptorType =	USB_DT_INTERFACE,
 
-	.bNumEndpoints =	2,
+	.bNumEndpoints =	UD_ENDPOINT_COUNT(F_ONE_ENDPOINTS),
 	.bInterfaceClass =	USB_CLASS_VENDOR_SPEC,
 	/* .iInterface = DYNAMIC */
 };
 
-/* full speed support: */
-
-static struct usb_endpoint_descriptor fs_loop_source_desc = {
-	.bLength =		USB_DT_ENDPOINT_SIZE,
-	.bDescriptorType =	USB_DT_ENDPOINT,
-
-	.bEndpointAddress =	USB_DIR_IN,
-	.bmAttributes =		USB_ENDPOINT_XFER_BULK,
-};
-
-static struct usb_endpoint_descriptor fs_loop_sink_desc = {
-	.bLength =		USB_DT_ENDPOINT_SIZE,
-	.bDescriptorType =	USB_DT_ENDPOINT,
-
-	.bEndpointAddress =	USB_DIR_OUT,
-	.bmAttributes =		USB_ENDPOINT_XFER_BULK,
-};
+static u8 fs_loopback_eps[] = { UD_ENDPOINT_SET(FS, F_ONE_ENDPOINTS) };
+static u8 hs_loopback_eps[] = { UD_ENDPOINT_SET(HS, F_ONE_ENDPOINTS) };
+static u8 ss_loopback_eps[] = { UD_ENDPOINT_SET(SS, F_ONE_ENDPOINTS) };
+
+UD_STATIC_ASSERT(sizeof(fs_loopback_eps) == UD_ENDPOINT_SET_LENGTH(FS, F_ONE_ENDPOINTS));
+UD_STATIC_ASSERT(sizeof(hs_loopback_eps) == UD_ENDPOINT_SET_LENGTH(HS, F_ONE_ENDPOINTS));
+UD_STATIC_ASSERT(sizeof(ss_loopback_eps) == UD_ENDPOINT_SET_LENGTH(SS, F_ONE_ENDPOINTS));
+
+/* endpoint descriptor __index of a set, and its companion at super speed */
+#define F_ONE_EP(__set, __speed, __index) \
+	((struct usb_endpoint_descriptor *) \
+	 &(__set)[UD_ENDPOINT_OFFSET(__speed, __index)])
+#define F_ONE_HDR(__set, __speed, __index) \
+	((struct usb_descriptor_header *) \
+	 &(__set)[UD_ENDPOINT_OFFSET(__speed, __index)])
+#define F_ONE_COMP_HDR(__index) \
+	((struct usb_descriptor_header *) \
+	 &ss_loopback_eps[UD_ENDPOINT_OFFSET(SS, __index) + UD_ENDPOINT_LENGTH])
 
 static struct usb_descriptor_header *fs_loopback_descs[] = {
 	(struct usb_descriptor_header *) &loopback_intf,
-	(struct usb_descriptor_header *) &fs_loop_sink_desc,
-	(struct usb_descriptor_header *) &fs_loop_source_desc,
+	F_ONE_HDR(fs_loopback_eps, FS, F_ONE_SINK),
+	F_ONE_HDR(fs_loopback_eps, FS, F_ONE_SOURCE),
 	NULL,
 };
 
-/* high speed support: */
-
-static struct usb_endpoint_descriptor hs_loop_source_desc = {
-	.bLength =		USB_DT_ENDPOINT_SIZE,
-	.bDescriptorType =	USB_DT_ENDPOINT,
-
-	.bmAttributes =		USB_ENDPOINT_XFER_BULK,
-	.wMaxPacketSize =	cpu_to_le16(512),
-};
-
-static struct usb_endpoint_descriptor hs_loop_sink_desc = {
-	.bLength =		USB_DT_ENDPOINT_SIZE,
-	.bDescriptorType =	USB_DT_ENDPOINT,
-
-	.bmAttributes =		USB_ENDPOINT_XFER_BULK,
-	.wMaxPacketSize =	cpu_to_le16(512),
-};
-
 static struct usb_descriptor_header *hs_loopback_descs[] = {
 	(struct usb_descriptor_header *) &loopback_intf,
-	(struct usb_descriptor_header *) &hs_loop_source_desc,
-	(struct usb_descriptor_header *) &hs_loop_sink_desc,
+	F_ONE_HDR(hs_loopback_eps, HS, F_ONE_SINK),
+	F_ONE_HDR(hs_loopback_eps, HS, F_ONE_SOURCE),
 	NULL,
 };
 
-/* super speed support: */
-
-static struct usb_endpoint_descriptor ss_loop_source_desc = {
-	.bLength =		USB_DT_ENDPOINT_SIZE,
-	.bDescriptorType =	USB_DT_ENDPOINT,
-
-	.bmAttributes =		USB_ENDPOINT_XFER_BULK,
-	.wMaxPacketSize =	cpu_to_le16(1024),
-};
-
-static struct usb_ss_ep_comp_descriptor ss_loop_source_comp_desc = {
-	.bLength =		USB_DT_SS_EP_COMP_SIZE,
-	.bDescriptorType =	USB_DT_SS_ENDPOINT_COMP,
-	.bMaxBurst =		0,
-	.bmAttributes =		0,
-	.wBytesPerInterval =	0,
-};
-
-static struct usb_endpoint_descriptor ss_loop_sink_desc = {
-	.bLength =		USB_DT_ENDPOINT_SIZE,
-	.bDescriptorType =	USB_DT_ENDPOINT,
-
-	.bmAttributes =		USB_ENDPOINT_XFER_BULK,
-	.wMaxPacketSize =	cpu_to_le16(1024),
-};
-
-static struct usb_ss_ep_comp_descriptor ss_loop_sink_comp_desc = {
-	.bLength =		USB_DT_SS_EP_COMP_SIZE,
-	.bDescriptorType =	USB_DT_SS_ENDPOINT_COMP,
-	.bMaxBurst =		0,
-	.bmAttributes =		0,
-	.wBytesPerInterval =	0,
-};
-
 static struct usb_descriptor_header *ss_loopback_descs[] = {
 	(struct usb_descriptor_header *) &loopback_intf,
-	(struct usb_descriptor_header *) &ss_loop_source_desc,
-	(struct usb_descriptor_header *) &ss_loop_source_comp_desc,
-	(struct usb_descriptor_header *) &ss_loop_sink_desc,
-	(struct usb_descriptor_header *) &ss_loop_sink_comp_desc,
+	F_ONE_HDR(ss_loopback_eps, SS, F_ONE_SINK),
+	F_ONE_COMP_HDR(F_ONE_SINK),
+	F_ONE_HDR(ss_loopback_eps, SS, F_ONE_SOURCE),
+	F_ONE_COMP_HDR(F_ONE_SOURCE),
 	NULL,
 };
 
@@ -173,6 +138,7 @@ static int loopback_bind(struct usb_configuration *c, struct usb_function *f)
 	struct f_loopback	*loop = func_to_loop(f);
 	int			id;
 	int ret;
+	int i;
 
 	/* allocate interface ID(s) */
 	id = usb_interface_id(c, f);
@@ -188,7 +154,8 @@ static int loopback_bind(struct usb_configuration *c, struct usb_function *f)
 
 	/* allocate endpoints */
 
-	loop->in_ep = usb_ep_autoconfig(cdev->gadget, &fs_loop_source_desc);
+	loop->in_ep = usb_ep_autoconfig(cdev->gadget,
+			F_ONE_EP(fs_loopback_eps, FS, F_ONE_SOURCE));
 	if (!loop->in_ep) {
 autoconf_fail:
 		ERROR(cdev, "%s: can't autoconfigure on %s\n",
@@ -196,19 +163,18 @@ autoconf_fail:
 		return -ENODEV;
 	}
 
-	loop->out_ep = usb_ep_autoconfig(cdev->gadget, &fs_loop_sink_desc);
+	loop->out_ep = usb_ep_autoconfig(cdev->gadget,
+			F_ONE_EP(fs_loopback_eps, FS, F_ONE_SINK));
 	if (!loop->out_ep)
 		goto autoconf_fail;
 
-	/* support high speed hardware */
-	hs_loop_source_desc.bEndpointAddress =
-		fs_loop_source_desc.bEndpointAddress;
-	hs_loop_sink_desc.bEndpointAddress = fs_loop_sink_desc.bEndpointAddress;
+	/* support high and super speed hardware */
+	for (i = 0; i < UD_ENDPOINT_COUNT(F_ONE_ENDPOINTS); i++) {
+		u8 address = F_ONE_EP(fs_loopback_eps, FS, i)->bEndpointAddress;
 
-	/* support super speed hardware */
-	ss_loop_source_desc.bEndpointAddress =
-		fs_loop_source_desc.bEndpointAddress;
-	ss_loop_sink_desc.bEndpointAddress = fs_loop_sink_desc.bEndpointAddress;
+		F_ONE_EP(hs_loopback_eps, HS, i)->bEndpointAddress = address;
+		F_ONE_EP(ss_loopback_eps, SS, i)->bEndpointAddress = address;
+	}
 
 	ret = usb_assign_descriptors(f, fs_loopback_descs, hs_loopback_descs,
 			ss_loopback_descs, NULL);